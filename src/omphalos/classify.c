@@ -0,0 +1,479 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <omphalos/tcp.h>
+#include <omphalos/diag.h>
+#include <omphalos/udp.h>
+#include <omphalos/dns.h>
+#include <omphalos/ssh.h>
+#include <omphalos/dhcp.h>
+#include <omphalos/mdns.h>
+#include <omphalos/ssdp.h>
+#include <omphalos/http.h>
+#include <linux/if_ether.h>
+#include <omphalos/netbios.h>
+#include <omphalos/service.h>
+#include <omphalos/classify.h>
+#include <omphalos/omphalos.h>
+#include <omphalos/tcpstream.h>
+
+#define L4_SRC		0x1u
+#define L4_DST		0x2u
+#define L4_EITHER	(L4_SRC | L4_DST)
+
+typedef struct l4rule {
+	int proto;		// IPPROTO_UDP or IPPROTO_TCP
+	unsigned dir;		// which port(s) lo..hi is matched against
+	uint16_t lo,hi;		// port range, host byte order, inclusive
+	uint16_t peerlo,peerhi;	// the other port's range (peerhi 0: any)
+	unsigned l3proto;	// ETH_P_IP or ETH_P_IPV6 (0: either)
+	const char *sig;	// payload prefix (NULL: any payload)
+	int (*handler)(struct omphalos_packet *,const void *,size_t);
+	// If non-NULL, the service is observed of the sender, at the matched
+	// port, when the handler returns 1.
+	const wchar_t *srvname;
+	// TCP only: the handler wants the first 'want' bytes of the stream in
+	// the matched direction, rather than segments (see tcpstream.h).
+	unsigned want;
+} l4rule;
+
+static int
+natpmp_rule(omphalos_packet *op,const void *frame,size_t len){
+	handle_natpmp_packet(op,frame,len);
+	return 0;
+}
+
+static int
+mdns_rule(omphalos_packet *op,const void *frame,size_t len){
+	handle_mdns_packet(op,frame,len); // observes mDNS itself
+	return 0;
+}
+
+// Order matters: rules naming both ports must precede those naming one of
+// them. Most dissectors look for responses, and thus match source ports.
+static const l4rule l4rules[] = {
+	{
+		.proto = IPPROTO_UDP, .dir = L4_SRC,
+		.lo = MDNS_NATPMP1_UDP_PORT, .hi = MDNS_NATPMP1_UDP_PORT,
+		.peerlo = MDNS_NATPMP1_UDP_PORT, .peerhi = MDNS_NATPMP1_UDP_PORT,
+		.handler = natpmp_rule,
+	},{
+		.proto = IPPROTO_UDP, .dir = L4_SRC,
+		.lo = MDNS_NATPMP2_UDP_PORT, .hi = MDNS_NATPMP2_UDP_PORT,
+		.peerlo = MDNS_NATPMP2_UDP_PORT, .peerhi = MDNS_NATPMP2_UDP_PORT,
+		.handler = natpmp_rule,
+	},{
+		.proto = IPPROTO_UDP, .dir = L4_SRC,
+		.lo = DNS_UDP_PORT, .hi = DNS_UDP_PORT,
+		.handler = handle_dns_packet, .srvname = L"DNS",
+	},{
+		.proto = IPPROTO_UDP, .dir = L4_SRC,
+		.lo = SSDP_UDP_PORT, .hi = SSDP_UDP_PORT,
+		.handler = handle_ssdp_packet, .srvname = L"UPnP",
+	},{
+		.proto = IPPROTO_UDP, .dir = L4_SRC,
+		.lo = MDNS_UDP_PORT, .hi = MDNS_UDP_PORT,
+		.peerlo = MDNS_NATPMP1_UDP_PORT, .peerhi = MDNS_NATPMP2_UDP_PORT,
+		.handler = natpmp_rule,
+	},{
+		.proto = IPPROTO_UDP, .dir = L4_SRC,
+		.lo = MDNS_UDP_PORT, .hi = MDNS_UDP_PORT,
+		.handler = mdns_rule,
+	},{
+		.proto = IPPROTO_UDP, .dir = L4_SRC,
+		.lo = NETBIOS_NS_UDP_PORT, .hi = NETBIOS_NS_UDP_PORT,
+		.peerlo = NETBIOS_NS_UDP_PORT, .peerhi = NETBIOS_NS_UDP_PORT,
+		.handler = handle_netbios_ns_packet,
+	},{
+		.proto = IPPROTO_UDP, .dir = L4_SRC,
+		.lo = DHCP_UDP_PORT, .hi = DHCP_UDP_PORT,
+		.peerlo = BOOTP_UDP_PORT, .peerhi = BOOTP_UDP_PORT,
+		.l3proto = ETH_P_IP,
+		.handler = handle_dhcp_packet, .srvname = L"DHCP",
+	},{
+		.proto = IPPROTO_UDP, .dir = L4_SRC,
+		.lo = DHCP6SRV_UDP_PORT, .hi = DHCP6SRV_UDP_PORT,
+		.peerlo = DHCP6CLI_UDP_PORT, .peerhi = DHCP6CLI_UDP_PORT,
+		.l3proto = ETH_P_IPV6,
+		.handler = handle_dhcp6_packet, .srvname = L"DHCPv6",
+	},{ // advertisements needn't come from the SSDP port
+		.proto = IPPROTO_UDP, .dir = L4_DST,
+		.lo = SSDP_UDP_PORT, .hi = SSDP_UDP_PORT,
+		.sig = "NOTIFY ",
+		.handler = handle_ssdp_packet, .srvname = L"UPnP",
+	},{
+		.proto = IPPROTO_TCP, .dir = L4_SRC,
+		.lo = DNS_TCP_PORT, .hi = DNS_TCP_PORT,
+		.handler = handle_dns_tcp_packet, .srvname = L"DNS",
+		.want = TCPSTREAM_MAXWANT,
+	},{
+		.proto = IPPROTO_TCP, .dir = L4_SRC,
+		.lo = SSH_TCP_PORT, .hi = SSH_TCP_PORT,
+		.sig = "SSH-",
+		.handler = handle_ssh_stream, // observes SSH itself
+		.want = 256,
+	},{
+		.proto = IPPROTO_TCP, .dir = L4_SRC,
+		.lo = HTTP_TCP_PORT, .hi = HTTP_TCP_PORT,
+		.sig = "HTTP/",
+		.handler = handle_http_stream, // observes HTTP itself
+		.want = 1024,
+	},{
+		.proto = IPPROTO_TCP, .dir = L4_SRC,
+		.lo = HTTPALT_TCP_PORT, .hi = HTTPALT_TCP_PORT,
+		.sig = "HTTP/",
+		.handler = handle_http_stream,
+		.want = 1024,
+	},
+};
+
+#define L4_RULES (sizeof(l4rules) / sizeof(*l4rules))
+#define L4_CHAINEND UINT16_MAX	// terminates chains; sorts after all rules
+#define L4_MAXCLASSES 256	// class 0 is the empty chain
+#define L4_BLOCKBITS 6u		// 64 ports per block, one per bit of a word
+#define L4_BLOCKS ((1u << 16u) >> L4_BLOCKBITS)
+
+// A block holding at least one port named by some rule.
+typedef struct l4portblock {
+	uint64_t ports;		// bit p set iff port (block * 64 + p) is named
+	unsigned base;		// chains[] index of its lowest named port
+} l4portblock;
+
+// Maps ports to their chains. Few ports are named by any rule, so rather than
+// a table of all 64Ki ports, two levels of bitmaps are kept, indexed by
+// popcount as in lpm.c. Bit b of blockmap is set iff block b (ports b * 64
+// through b * 64 + 63) holds a named port, in which case it has an entry in
+// blocks[]; its bits, in turn, index the chains of its named ports. Unnamed
+// ports, and thus most traffic, are dismissed by the first bitmap.
+typedef struct l4portmap {
+	uint64_t blockmap[L4_BLOCKS / 64];
+	uint16_t blockbase[L4_BLOCKS / 64];	// blockmap bits set in earlier words
+	l4portblock *blocks;
+	uint32_t *chains;	// offsets into chainv
+	unsigned nblocks,nports;
+} l4portmap;
+
+// Ports map to classes, each a chain of candidate rule indices in ascending
+// order. Ports with identical chains share a class, and the maps hold the
+// offset of its chain. Source and destination maps share the classes of their
+// protocol. Class 0, the empty chain, is at offset 0.
+typedef struct l4classifier {
+	l4portmap srcmap,dstmap;
+	uint32_t chainoff[L4_MAXCLASSES];	// into chainv
+	uint16_t *chainv;
+	size_t chainlen;
+	unsigned classes;
+} l4classifier;
+
+static l4classifier udp_classifier,tcp_classifier;
+
+static inline l4classifier *
+get_classifier(int proto){
+	return proto == IPPROTO_TCP ? &tcp_classifier : &udp_classifier;
+}
+
+// Returns the class of the chain of n indices (plus its terminator), adding
+// it if new, or -1 on error.
+static int
+lookup_class(l4classifier *c,const uint16_t *chain,unsigned n){
+	uint16_t *tmp;
+	unsigned z;
+
+	for(z = 0 ; z < c->classes ; ++z){
+		const uint16_t *cz = c->chainv + c->chainoff[z];
+		unsigned i;
+
+		for(i = 0 ; i < n && cz[i] == chain[i] ; ++i){
+			;
+		}
+		if(i == n && cz[i] == L4_CHAINEND){
+			return z;
+		}
+	}
+	if(c->classes == L4_MAXCLASSES){
+		errno = ENOSPC;
+		return -1;
+	}
+	if((tmp = realloc(c->chainv,sizeof(*tmp) * (c->chainlen + n + 1))) == NULL){
+		return -1;
+	}
+	c->chainv = tmp;
+	memcpy(c->chainv + c->chainlen,chain,sizeof(*chain) * (n + 1));
+	c->chainoff[c->classes] = c->chainlen;
+	c->chainlen += n + 1;
+	return c->classes++;
+}
+
+// Ports must be added in ascending order.
+static int
+map_port(l4portmap *m,unsigned port,uint32_t chainoff){
+	unsigned block = port >> L4_BLOCKBITS;
+	uint32_t *chains;
+
+	if(!((m->blockmap[block / 64] >> (block % 64)) & 1)){
+		l4portblock *pb;
+
+		if((pb = realloc(m->blocks,sizeof(*pb) * (m->nblocks + 1))) == NULL){
+			return -1;
+		}
+		m->blocks = pb;
+		pb += m->nblocks++;
+		pb->ports = 0;
+		pb->base = m->nports;
+		m->blockmap[block / 64] |= 1ull << (block % 64);
+	}
+	if((chains = realloc(m->chains,sizeof(*chains) * (m->nports + 1))) == NULL){
+		return -1;
+	}
+	m->chains = chains;
+	m->chains[m->nports++] = chainoff;
+	m->blocks[m->nblocks - 1].ports |= 1ull << (port % 64);
+	return 0;
+}
+
+static int
+compile_map(l4classifier *c,int proto,unsigned dir,l4portmap *m){
+	uint16_t chain[L4_RULES + 1],prev[L4_RULES + 1];
+	unsigned port,n,prevn = 0;
+	int class = 0;
+
+	prev[0] = L4_CHAINEND;
+	for(port = 0 ; port < (1u << 16u) ; ++port){
+		unsigned z;
+
+		for(n = 0, z = 0 ; z < L4_RULES ; ++z){
+			const l4rule *r = &l4rules[z];
+
+			if(r->proto == proto && (r->dir & dir) && port >= r->lo && port <= r->hi){
+				chain[n++] = z;
+			}
+		}
+		chain[n] = L4_CHAINEND;
+		// Ranges make runs of ports with the same chain common
+		if(n != prevn || memcmp(chain,prev,sizeof(*chain) * n)){
+			if((class = lookup_class(c,chain,n)) < 0){
+				return -1;
+			}
+			memcpy(prev,chain,sizeof(*chain) * (n + 1));
+			prevn = n;
+		}
+		if(class && map_port(m,port,c->chainoff[class])){
+			return -1;
+		}
+	}
+	for(n = 1 ; n < L4_BLOCKS / 64 ; ++n){
+		m->blockbase[n] = m->blockbase[n - 1] + __builtin_popcountll(m->blockmap[n - 1]);
+	}
+	return 0;
+}
+
+// Returns the offset of the port's chain, 0 (the empty chain) if no rule
+// names it.
+static inline uint32_t
+port_chain(const l4portmap *m,unsigned port){
+	unsigned block = port >> L4_BLOCKBITS,bit = port % 64;
+	uint64_t bm = m->blockmap[block / 64];
+	const l4portblock *pb;
+
+	if(!((bm >> (block % 64)) & 1)){
+		return 0;
+	}
+	pb = &m->blocks[m->blockbase[block / 64] +
+		__builtin_popcountll(bm & ((1ull << (block % 64)) - 1))];
+	if(!((pb->ports >> bit) & 1)){
+		return 0;
+	}
+	return m->chains[pb->base + __builtin_popcountll(pb->ports & ((1ull << bit) - 1))];
+}
+
+static int
+compile_classifier(l4classifier *c,int proto){
+	const uint16_t empty = L4_CHAINEND;
+
+	memset(c,0,sizeof(*c));
+	if(lookup_class(c,&empty,0) < 0){
+		return -1;
+	}
+	if(compile_map(c,proto,L4_SRC,&c->srcmap) || compile_map(c,proto,L4_DST,&c->dstmap)){
+		return -1;
+	}
+	return 0;
+}
+
+int init_classifier(void){
+	unsigned z;
+
+	_Static_assert(L4_RULES < L4_CHAINEND,"too many l4 rules");
+	for(z = 0 ; z < L4_RULES ; ++z){
+		if(l4rules[z].want > TCPSTREAM_MAXWANT){
+			diagnostic("Rule %u wants too much (%u > %u)",z,l4rules[z].want,TCPSTREAM_MAXWANT);
+			return -1;
+		}
+	}
+	if(compile_classifier(&udp_classifier,IPPROTO_UDP)){
+		cleanup_classifier();
+		return -1;
+	}
+	if(compile_classifier(&tcp_classifier,IPPROTO_TCP)){
+		cleanup_classifier();
+		return -1;
+	}
+	return 0;
+}
+
+static void
+free_classifier(l4classifier *c){
+	free(c->srcmap.blocks);
+	free(c->srcmap.chains);
+	free(c->dstmap.blocks);
+	free(c->dstmap.chains);
+	free(c->chainv);
+}
+
+void cleanup_classifier(void){
+	free_classifier(&udp_classifier);
+	free_classifier(&tcp_classifier);
+	memset(&udp_classifier,0,sizeof(udp_classifier));
+	memset(&tcp_classifier,0,sizeof(tcp_classifier));
+}
+
+// The rule's port range has matched; check its other constraints. The peer
+// port is in host byte order.
+static inline int
+rule_matches(const l4rule *r,const omphalos_packet *op,unsigned peer,
+				const void *payload,size_t len){
+	if(r->l3proto && r->l3proto != op->l3proto){
+		return 0;
+	}
+	if(r->peerhi && (peer < r->peerlo || peer > r->peerhi)){
+		return 0;
+	}
+	if(r->sig){
+		size_t slen = strlen(r->sig);
+
+		if(len < slen || memcmp(payload,r->sig,slen)){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// port is that matched, in network byte order.
+static int
+dispatch_rule(const l4rule *r,omphalos_packet *op,unsigned port,
+				const void *payload,size_t len){
+	if(r->handler(op,payload,len) == 1 && r->srvname){
+		observe_service(op->i,op->l2s,op->l3s,op->l3proto,port,r->srvname,NULL);
+	}
+	return 1;
+}
+
+// Returns the index of the first rule matching the packet, or -1, setting
+// *port to the matched port (network byte order).
+static inline int
+match_l4(const omphalos_packet *op,int proto,const void *payload,size_t len,
+				unsigned *port){
+	const l4classifier *c = get_classifier(proto);
+	unsigned sport = ntohs(op->l4src),dport = ntohs(op->l4dst);
+	const uint16_t *sc,*dc;
+	uint32_t s,d;
+
+	s = port_chain(&c->srcmap,sport);
+	d = port_chain(&c->dstmap,dport);
+	if((s | d) == 0){
+		return -1;
+	}
+	// Usually only one of the ports is named, and its chain is walked alone
+	if(s == 0 || d == 0){
+		const uint16_t *ch = c->chainv + (s | d);
+		unsigned peer = s ? dport : sport;
+
+		for( ; *ch != L4_CHAINEND ; ++ch){
+			if(rule_matches(&l4rules[*ch],op,peer,payload,len)){
+				*port = s ? op->l4src : op->l4dst;
+				return *ch;
+			}
+		}
+		return -1;
+	}
+	// Walk the two chains in rule order, as in a merge
+	sc = c->chainv + s;
+	dc = c->chainv + d;
+	for(;;){
+		unsigned idx = *sc < *dc ? *sc : *dc;
+		const l4rule *r;
+
+		if(idx == L4_CHAINEND){
+			return -1;
+		}
+		r = &l4rules[idx];
+		if(*sc == idx){
+			++sc;
+			if(rule_matches(r,op,dport,payload,len)){
+				*port = op->l4src;
+				return idx;
+			}
+		}
+		if(*dc == idx){
+			++dc;
+			if(rule_matches(r,op,sport,payload,len)){
+				*port = op->l4dst;
+				return idx;
+			}
+		}
+	}
+}
+
+int classify_l4(omphalos_packet *op,int proto,const void *payload,size_t len){
+	unsigned port;
+	int idx;
+
+	if((idx = match_l4(op,proto,payload,len,&port)) < 0){
+		return 0;
+	}
+	return dispatch_rule(&l4rules[idx],op,port,payload,len);
+}
+
+int classify_l4_rule(const omphalos_packet *op,int proto,const void *payload,size_t len){
+	unsigned port;
+
+	return match_l4(op,proto,payload,len,&port);
+}
+
+// As classify_l4()'s port walk, but without a payload to check signatures
+// against: any rule which might match a segment from sport to dport counts.
+size_t classify_stream_want(unsigned l3proto,unsigned sport,unsigned dport){
+	const l4classifier *c = &tcp_classifier;
+	const uint16_t *sc,*dc;
+	unsigned want = 0;
+
+	sport = ntohs(sport);
+	dport = ntohs(dport);
+	sc = c->chainv + port_chain(&c->srcmap,sport);
+	dc = c->chainv + port_chain(&c->dstmap,dport);
+	while(*sc != L4_CHAINEND || *dc != L4_CHAINEND){
+		unsigned idx = *sc < *dc ? *sc : *dc;
+		const l4rule *r = &l4rules[idx];
+		unsigned peer;
+
+		if(*sc == idx){
+			++sc;
+			peer = dport;
+		}else{
+			++dc;
+			peer = sport;
+		}
+		if(r->l3proto && r->l3proto != l3proto){
+			continue;
+		}
+		if(r->peerhi && (peer < r->peerlo || peer > r->peerhi)){
+			continue;
+		}
+		if(r->want > want){
+			want = r->want;
+		}
+	}
+	return want;
+}
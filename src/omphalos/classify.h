@@ -0,0 +1,45 @@
+#ifndef OMPHALOS_CLASSIFY
+#define OMPHALOS_CLASSIFY
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+struct omphalos_packet;
+
+// Dispatch of UDP and TCP payloads to their dissectors. Dissectors are
+// described by rules (see classify.c): a port range, the end of the flow it's
+// matched against (source, destination, or either), an optional range for the
+// other port, the L3 family, and an optional payload prefix. The first rule
+// matching a packet, in table order, claims it.
+//
+// init_classifier() expands the rules of each transport protocol into chains
+// of candidate rules, mapped to by the ports they name via small bitmaps.
+// Traffic no rule names costs two bit tests; otherwise, only the chains of the
+// packet's two ports are walked. Adding a dissector is a matter of adding a
+// rule.
+int init_classifier(void);
+void cleanup_classifier(void);
+
+// op->l3proto, op->l4src and op->l4dst must be set. proto is IPPROTO_UDP or
+// IPPROTO_TCP; the payload follows the transport header, or is a reassembled
+// stream prefix (see tcpstream.h). Returns 1 if a rule claimed the packet, 0
+// otherwise.
+int classify_l4(struct omphalos_packet *,int,const void *,size_t);
+
+// As classify_l4(), but only identifies the rule which would claim the
+// packet, returning its index in table order, or -1 if none would. Nothing
+// is dispatched (see tools/classifybench.c).
+int classify_l4_rule(const struct omphalos_packet *,int,const void *,size_t);
+
+// The largest prefix any TCP rule wants of the stream from sport to dport
+// (network byte order), over the L3 protocol; 0 if none would take it.
+size_t classify_stream_want(unsigned,unsigned,unsigned);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -479,7 +479,7 @@ int handle_dns_packet(omphalos_packet *op,const void *frame,size_t len){
 						// FIXME perform routing lookup on ss to get
 						// the desired interface and see whether we care
 						// about this address
-						offer_wresolution(fam,ss,L"address unknown",
+						offer_wresolution(op->i,fam,ss,L"address unknown",
 							NAMING_LEVEL_NXDOMAIN,nsfam,nsaddr);
 					}
 				}
@@ -523,7 +523,7 @@ int handle_dns_packet(omphalos_packet *op,const void *frame,size_t len){
 				if(cname && strcmp(cname,buf) == 0){
 					free(cname);
 					cname = NULL;
-					offer_resolution(cnamefam,cnamess,data,
+					offer_resolution(op->i,cnamefam,cnamess,data,
 						NAMING_LEVEL_REVDNS,nsfam,nsaddr);
 				}else if(process_reverse_lookup(buf,&fam,ss) == 0){
 				// A failure here doesn't mean the response is
@@ -532,7 +532,7 @@ int handle_dns_packet(omphalos_packet *op,const void *frame,size_t len){
 				// FIXME perform routing lookup on ss to get
 				// the desired interface and see whether we care
 				// about this address
-					offer_resolution(fam,ss,data,
+					offer_resolution(op->i,fam,ss,data,
 						NAMING_LEVEL_REVDNS,nsfam,nsaddr);
 				}else if( (srv = process_srv_lookup(buf,&proto,&port,&add)) ){;
 					// If it was actual DNS (not mDNS),
@@ -548,10 +548,10 @@ int handle_dns_packet(omphalos_packet *op,const void *frame,size_t len){
 					// Probably name-as-PTR (see bug #542)
 				}
 			}else if(type == DNS_TYPE_A){
-				offer_resolution(AF_INET,data,buf,
+				offer_resolution(op->i,AF_INET,data,buf,
 						NAMING_LEVEL_DNS,nsfam,nsaddr);
 			}else if(type == DNS_TYPE_AAAA){
-				offer_resolution(AF_INET6,data,buf,
+				offer_resolution(op->i,AF_INET6,data,buf,
 						NAMING_LEVEL_DNS,nsfam,nsaddr);
 			}else if(type == DNS_TYPE_CNAME){
 			// In the case of the "CNAME hack" for reverse DNS
@@ -625,6 +625,22 @@ malformed:
 	return -1;
 }
 
+// Each message is preceded by its 16-bit length (RFC 1035 4.2.2). Lacking
+// reassembly, we can only handle messages contained by a single segment.
+int handle_dns_tcp_packet(omphalos_packet *op,const void *frame,size_t len){
+	uint16_t mlen;
+
+	if(len < sizeof(mlen)){ // bare ACKs and the like
+		return 0;
+	}
+	memcpy(&mlen,frame,sizeof(mlen));
+	mlen = ntohs(mlen);
+	if(mlen > len - sizeof(mlen)){ // FIXME spans segments
+		return 0;
+	}
+	return handle_dns_packet(op,(const char *)frame + sizeof(mlen),mlen);
+}
+
 int tx_dns_ptr(int fam,const void *addr,const char *question){
 	struct routepath rp;
 	void *frame;
@@ -35,6 +35,10 @@ struct dnshdr {
 int handle_dns_packet(struct omphalos_packet *,const void *,size_t)
 			__attribute__ ((nonnull (1,2)));
 
+// Takes the TCP payload, wherein each message is prefixed by its length.
+int handle_dns_tcp_packet(struct omphalos_packet *,const void *,size_t)
+			__attribute__ ((nonnull (1,2)));
+
 int tx_dns_ptr(int,const void *,const char *) __attribute__ ((nonnull (2,3)));
 
 int setup_dns_ptr(const struct routepath *,int,const void *,unsigned,size_t,
@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pcap/pcap.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <omphalos/diag.h>
+#include <omphalos/filter.h>
+#include <omphalos/interface.h>
+
+#define SNAP_WHOLE 0x40000u	// exceeds any frame we'll see, even with GRO
+
+// Header-only snapping for Ethernet framing. A frame too short for one of the
+// absolute loads is dropped by the kernel, just as the dissectors would have
+// flagged it malformed.
+static const struct sock_filter ethsnap[] = {
+	/*  0 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS,12),			// ethertype
+	/*  1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,ETH_P_IP,0,11),
+	/*  2 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS,ETH_HLEN + 9),	// protocol
+	/*  3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,IPPROTO_TCP,0,17),
+	/*  4 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS,ETH_HLEN + 6),	// frag_off
+	/*  5 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,0x3fff,15,0),	// MF|offset
+	/*  6 */ BPF_STMT(BPF_LDX | BPF_B | BPF_MSH,ETH_HLEN),		// X <- ihl * 4
+	/*  7 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND,ETH_HLEN + 12),	// doff
+	/*  8 */ BPF_STMT(BPF_ALU | BPF_AND | BPF_K,0xf0),
+	/*  9 */ BPF_STMT(BPF_ALU | BPF_RSH | BPF_K,2),			// A <- doff * 4
+	/* 10 */ BPF_STMT(BPF_ALU | BPF_ADD | BPF_X,0),
+	/* 11 */ BPF_STMT(BPF_ALU | BPF_ADD | BPF_K,ETH_HLEN),
+	/* 12 */ BPF_STMT(BPF_RET | BPF_A,0),
+	/* 13 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,ETH_P_IPV6,0,7),
+	/* 14 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS,ETH_HLEN + 6),	// next header
+	/* 15 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,IPPROTO_TCP,0,5),
+	/* 16 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS,ETH_HLEN + 40 + 12),	// doff
+	/* 17 */ BPF_STMT(BPF_ALU | BPF_AND | BPF_K,0xf0),
+	/* 18 */ BPF_STMT(BPF_ALU | BPF_RSH | BPF_K,2),
+	/* 19 */ BPF_STMT(BPF_ALU | BPF_ADD | BPF_K,ETH_HLEN + 40),
+	/* 20 */ BPF_STMT(BPF_RET | BPF_A,0),
+	/* 21 */ BPF_STMT(BPF_RET | BPF_K,SNAP_WHOLE),
+};
+
+// The DLT against which expressions are compiled for an ARPHRD_* type. Only
+// types where the packet socket presents the same framing are handled.
+static int
+arptype_dlt(unsigned arptype){
+	switch(arptype){
+		case ARPHRD_ETHER: case ARPHRD_LOOPBACK:
+			return DLT_EN10MB;
+		case ARPHRD_IEEE80211_RADIOTAP:
+			return DLT_IEEE802_11_RADIO;
+		case ARPHRD_NONE:
+			return DLT_RAW;
+	}
+	return -1;
+}
+
+static int
+compile_filter(int dlt,const char *expr,struct bpf_program *bp){
+	pcap_t *p;
+
+	if((p = pcap_open_dead(dlt,SNAP_WHOLE)) == NULL){
+		return -1;
+	}
+	if(pcap_compile(p,bp,expr,1,PCAP_NETMASK_UNKNOWN)){
+		diagnostic("Couldn't compile filter '%s' (%s?)",expr,pcap_geterr(p));
+		pcap_close(p);
+		return -1;
+	}
+	pcap_close(p);
+	return 0;
+}
+
+int filter_psocket(int fd,const interface *i,const char *expr,int headers){
+	struct sock_filter *insns;
+	struct bpf_program bp;
+	struct sock_fprog fp;
+	unsigned ulen,z;
+	int dlt;
+
+	if(expr == NULL && !headers){
+		return 0;
+	}
+	if((dlt = arptype_dlt(i->arptype)) < 0){
+		diagnostic("[%s] No capture filtering for ARPHRD %u",i->name,i->arptype);
+		return 0;
+	}
+	if(dlt != DLT_EN10MB){
+		headers = 0;
+		if(expr == NULL){
+			return 0;
+		}
+	}
+	memset(&bp,0,sizeof(bp));
+	if(expr && compile_filter(dlt,expr,&bp)){
+		return -1;
+	}
+	ulen = bp.bf_len;
+	fp.len = ulen + (headers ? sizeof(ethsnap) / sizeof(*ethsnap) : 0);
+	if((insns = malloc(sizeof(*insns) * fp.len)) == NULL){
+		pcap_freecode(&bp);
+		return -1;
+	}
+	// struct bpf_insn and struct sock_filter share a layout. When snapping,
+	// accepting returns in the expression's program instead continue into
+	// the snap program (classic BPF only jumps forward, so it follows).
+	for(z = 0 ; z < ulen ; ++z){
+		insns[z].code = bp.bf_insns[z].code;
+		insns[z].jt = bp.bf_insns[z].jt;
+		insns[z].jf = bp.bf_insns[z].jf;
+		insns[z].k = bp.bf_insns[z].k;
+		if(headers && insns[z].code == (BPF_RET | BPF_K) && insns[z].k){
+			insns[z].code = BPF_JMP | BPF_JA;
+			insns[z].k = ulen - (z + 1);
+		}
+	}
+	pcap_freecode(&bp);
+	if(headers){
+		memcpy(insns + ulen,ethsnap,sizeof(ethsnap));
+	}
+	fp.filter = insns;
+	if(setsockopt(fd,SOL_SOCKET,SO_ATTACH_FILTER,&fp,sizeof(fp))){
+		diagnostic("[%s] Couldn't attach %u-insn filter (%s?)",
+				i->name,fp.len,strerror(errno));
+		free(insns);
+		return -1;
+	}
+	free(insns);
+	return headers;
+}
+
+int filter_savefile(int dlt,const char *expr,struct bpf_program *bp){
+	return compile_filter(dlt,expr,bp);
+}
+
+int filter_pcap(pcap_t *p,const char *expr){
+	struct bpf_program bp;
+
+	if(expr == NULL){
+		return 0;
+	}
+	if(pcap_compile(p,&bp,expr,1,PCAP_NETMASK_UNKNOWN)){
+		diagnostic("Couldn't compile filter '%s' (%s?)",expr,pcap_geterr(p));
+		return -1;
+	}
+	if(pcap_setfilter(p,&bp)){
+		diagnostic("Couldn't set filter '%s' (%s?)",expr,pcap_geterr(p));
+		pcap_freecode(&bp);
+		return -1;
+	}
+	pcap_freecode(&bp);
+	return 0;
+}
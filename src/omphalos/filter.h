@@ -0,0 +1,38 @@
+#ifndef OMPHALOS_FILTER
+#define OMPHALOS_FILTER
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// In-kernel classic BPF filtering of RX packet sockets. Frames rejected by
+// the filter never reach the ring, and frames accepted can be truncated to a
+// per-protocol snap length before being copied into it (the kernel still
+// reports the frame's full length as tp_len).
+//
+// In header-only mode, TCP over IPv4 and IPv6 is truncated following the TCP
+// header (including options): we never analyze TCP payloads. Everything else
+// (UDP-borne DNS, mDNS, DHCP, SSDP..., ARP, ICMP, fragments) is kept whole.
+
+struct pcap;
+struct bpf_program;
+struct interface;
+
+// Attach a program to the bound packet socket, composed of the pcap-filter(7)
+// expression 'expr' (may be NULL) compiled for the interface's link type, and
+// if 'headers' is non-zero, the header-only snap program. Returns -1 on error,
+// 0 if frames will be delivered whole, and 1 if they might be truncated.
+int filter_psocket(int,const struct interface *,const char *,int);
+
+// Apply the expression to a pcap savefile being read.
+int filter_pcap(struct pcap *,const char *);
+
+// Compile the expression for a savefile link type, to be matched against its
+// frames via pcap_offline_filter(). Returns -1 on error.
+int filter_savefile(int,const char *,struct bpf_program *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
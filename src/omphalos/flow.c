@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+#include <omphalos/flow.h>
+#include <omphalos/timing.h>
+#include <omphalos/omphalos.h>
+#include <omphalos/interface.h>
+
+static uintmax_t flow_created;	// all of these are updated atomically
+static uintmax_t flow_active;
+static uintmax_t flow_expired;
+static uintmax_t flow_evicted;
+
+static inline void
+stat_add(uintmax_t *stat,uintmax_t n){
+	__atomic_add_fetch(stat,n,__ATOMIC_RELAXED);
+}
+
+static inline void
+stat_sub(uintmax_t *stat,uintmax_t n){
+	__atomic_sub_fetch(stat,n,__ATOMIC_RELAXED);
+}
+
+// Symmetric in its two endpoints, so that either direction finds the flow.
+// Never 0, which marks an empty slot.
+static inline uint32_t
+flow_hash(const flowrec *key){
+	uint32_t h0 = key->port[0],h1 = key->port[1];
+	unsigned z;
+
+	for(z = 0 ; z < 4 ; ++z){
+		h0 = (h0 ^ key->addr[0][z]) * 0x9e3779b1u;
+		h1 = (h1 ^ key->addr[1][z]) * 0x9e3779b1u;
+	}
+	h0 ^= h1 ^ ((uint32_t)key->l3proto << 8u) ^ key->l4proto;
+	h0 = (h0 ^ (h0 >> 16u)) * 0x85ebca6bu;
+	h0 ^= h0 >> 13u;
+	return h0 ? h0 : 1;
+}
+
+// Returns 0 and the slot holding key's flow, with in *dir the endpoint of the
+// flow which is key's endpoint 0. Otherwise, returns -1 and the empty slot
+// which ended the probe.
+static int
+find_flow(const flowtable *ft,const flowrec *key,uint32_t tag,unsigned *slot,
+						unsigned *dir){
+	const unsigned mask = ft->size - 1;
+	unsigned s;
+
+	for(s = tag & mask ; ft->tags[s] ; s = (s + 1) & mask){
+		const flowrec *r = &ft->recs[s];
+
+		if(ft->tags[s] != tag || r->l3proto != key->l3proto ||
+				r->l4proto != key->l4proto){
+			continue;
+		}
+		if(r->port[0] == key->port[0] && r->port[1] == key->port[1] &&
+				equal128(r->addr[0],key->addr[0]) && equal128(r->addr[1],key->addr[1])){
+			*dir = 0;
+			*slot = s;
+			return 0;
+		}
+		if(r->port[1] == key->port[0] && r->port[0] == key->port[1] &&
+				equal128(r->addr[1],key->addr[0]) && equal128(r->addr[0],key->addr[1])){
+			*dir = 1;
+			*slot = s;
+			return 0;
+		}
+	}
+	*slot = s;
+	return -1;
+}
+
+// Empty the slot, shifting back any later members of its cluster which would
+// otherwise be cut off from their home slots.
+static void
+remove_slot(flowtable *ft,unsigned s){
+	const unsigned mask = ft->size - 1;
+	unsigned n;
+
+	for(n = (s + 1) & mask ; ft->tags[n] ; n = (n + 1) & mask){
+		const unsigned home = ft->tags[n] & mask;
+
+		// n's flow can fill the hole if its home doesn't lie in (s, n]
+		if(((n - home) & mask) >= ((n - s) & mask)){
+			ft->tags[s] = ft->tags[n];
+			ft->recs[s] = ft->recs[n];
+			s = n;
+		}
+	}
+	ft->tags[s] = 0;
+	--ft->count;
+	stat_sub(&flow_active,1);
+}
+
+static void
+export_flow(const interface *i,const flowrec *r){
+	const omphalos_ctx *octx = get_octx();
+
+	if(octx->iface.flow_event){
+		octx->iface.flow_event(i,r);
+	}
+}
+
+// Idleness is measured in wheel time, which needn't be that of the frames'
+// timestamps (see count_pcap_frame()). The first sweep after arming only
+// establishes a baseline, as the wheel might not have been advanced recently.
+static int
+sweep_flows(const struct timeval *now,struct timeval *resched,void *arg){
+	interface *i = arg;
+	flowtable *ft = &i->flows;
+	long elapsed = 0;
+	unsigned s;
+
+	if(ft->swept.tv_sec){
+		elapsed = now->tv_sec - ft->swept.tv_sec;
+		if(elapsed < 0){
+			elapsed = 0;
+		}else if(elapsed > FLOW_IDLE_SECS){
+			elapsed = FLOW_IDLE_SECS;
+		}
+	}
+	ft->swept = *now;
+	for(s = 0 ; s < ft->size ; ++s){
+		if(ft->tags[s]){
+			ft->recs[s].idle += elapsed;
+		}
+	}
+	// A removal shifts a later flow into s, so s is checked again
+	s = 0;
+	while(s < ft->size){
+		if(ft->tags[s] && ft->recs[s].idle >= FLOW_IDLE_SECS){
+			export_flow(i,&ft->recs[s]);
+			remove_slot(ft,s);
+			stat_add(&flow_expired,1);
+			continue;
+		}
+		++s;
+	}
+	if(ft->count == 0){
+		ft->swept.tv_sec = 0;
+		return 0;
+	}
+	resched->tv_sec = now->tv_sec + FLOW_SWEEP_SECS;
+	resched->tv_usec = now->tv_usec;
+	return 1;
+}
+
+// Evict the least recently seen of the next few flows past the clock hand.
+static void
+evict_flow(interface *i){
+	flowtable *ft = &i->flows;
+	unsigned s,victim,sampled;
+
+	victim = ft->size;
+	sampled = 0;
+	for(s = ft->hand ; sampled < FLOW_EVICT_SAMPLES && sampled < ft->count ;
+					s = (s + 1) & (ft->size - 1)){
+		if(ft->tags[s]){
+			if(victim == ft->size || timercmp(&ft->recs[s].last,&ft->recs[victim].last,<)){
+				victim = s;
+			}
+			++sampled;
+		}
+	}
+	ft->hand = s;
+	export_flow(i,&ft->recs[victim]);
+	remove_slot(ft,victim);
+	stat_add(&flow_evicted,1);
+}
+
+// Size the table such that it's never more than three-quarters full.
+static int
+create_table(flowtable *ft,unsigned max){
+	unsigned size = 16;
+
+	while(size / 4 * 3 < max){
+		size <<= 1;
+	}
+	if((ft->tags = calloc(size,sizeof(*ft->tags))) == NULL){
+		return -1;
+	}
+	if((ft->recs = malloc(sizeof(*ft->recs) * size)) == NULL){
+		free(ft->tags);
+		ft->tags = NULL;
+		return -1;
+	}
+	ft->size = size;
+	ft->max = max;
+	return 0;
+}
+
+// Find key's flow, creating it (as of tv) if necessary. *dir is set as by
+// find_flow(). Returns NULL if flows aren't being tracked.
+static flowrec *
+lookup_flow(interface *i,const flowrec *key,const struct timeval *tv,unsigned *dir){
+	flowtable *ft = &i->flows;
+	struct timeval sweep;
+	uint32_t tag;
+	flowrec *r;
+	unsigned s;
+
+	if(ft->tags == NULL){
+		const unsigned max = get_octx()->flowcap;
+
+		if(max == 0 || create_table(ft,max)){
+			return NULL;
+		}
+	}
+	tag = flow_hash(key);
+	if(find_flow(ft,key,tag,&s,dir) == 0){
+		return &ft->recs[s];
+	}
+	if(ft->count >= ft->max){
+		evict_flow(i);
+		for(s = tag & (ft->size - 1) ; ft->tags[s] ; s = (s + 1) & (ft->size - 1)){
+			;
+		}
+	}
+	ft->tags[s] = tag;
+	r = &ft->recs[s];
+	memset(r,0,sizeof(*r));
+	assign128(r->addr[0],key->addr[0]);
+	assign128(r->addr[1],key->addr[1]);
+	r->port[0] = key->port[0];
+	r->port[1] = key->port[1];
+	r->l3proto = key->l3proto;
+	r->l4proto = key->l4proto;
+	r->first = r->last = *tv;
+	++ft->count;
+	stat_add(&flow_active,1);
+	if(!timer_scheduled(&ft->timer)){
+		twheel_now(&i->timers,&sweep);
+		sweep.tv_sec += FLOW_SWEEP_SECS;
+		schedule_timer(&i->timers,&ft->timer,&sweep,sweep_flows,i);
+	}
+	*dir = 0;
+	return r;
+}
+
+void observe_flow(const omphalos_packet *op,size_t len){
+	unsigned dir;
+	flowrec key;
+	flowrec *r;
+
+	if(op->l4proto == 0){
+		return;
+	}
+	assign128(key.addr[0],op->l3saddr);
+	assign128(key.addr[1],op->l3daddr);
+	key.port[0] = op->l4src;
+	key.port[1] = op->l4dst;
+	key.l3proto = op->l3proto;
+	key.l4proto = op->l4proto;
+	if((r = lookup_flow(op->i,&key,&op->tv,&dir)) == NULL){
+		return;
+	}
+	// Flows merged from elsewhere were already counted there
+	if(r->frames[0] == 0 && r->frames[1] == 0){
+		stat_add(&flow_created,1);
+	}
+	++r->frames[dir];
+	r->bytes[dir] += len;
+	r->idle = 0;
+	if(timercmp(&op->tv,&r->last,>)){
+		r->last = op->tv;
+	}
+}
+
+unsigned top_flows(const interface *i,flowrec *top,unsigned n){
+	const flowtable *ft = &i->flows;
+	unsigned s,count = 0;
+
+	for(s = 0 ; s < ft->size ; ++s){
+		const flowrec *r = &ft->recs[s];
+		uintmax_t bytes;
+		unsigned z;
+
+		if(ft->tags[s] == 0){
+			continue;
+		}
+		bytes = r->bytes[0] + r->bytes[1];
+		// Insertion sort, dropping off the end once full
+		for(z = count ; z && top[z - 1].bytes[0] + top[z - 1].bytes[1] < bytes ; --z){
+			if(z < n){
+				top[z] = top[z - 1];
+			}
+		}
+		if(z < n){
+			top[z] = *r;
+			if(count < n){
+				++count;
+			}
+		}
+	}
+	return count;
+}
+
+void merge_flows(interface *dst,const interface *src){
+	const flowtable *ft = &src->flows;
+	unsigned s;
+
+	for(s = 0 ; s < ft->size ; ++s){
+		const flowrec *sr = &ft->recs[s];
+		unsigned dir;
+		flowrec *r;
+
+		if(ft->tags[s] == 0){
+			continue;
+		}
+		if((r = lookup_flow(dst,sr,&sr->first,&dir)) == NULL){
+			return;
+		}
+		r->frames[dir] += sr->frames[0];
+		r->frames[!dir] += sr->frames[1];
+		r->bytes[dir] += sr->bytes[0];
+		r->bytes[!dir] += sr->bytes[1];
+		if(timercmp(&sr->first,&r->first,<)){
+			r->first = sr->first;
+		}
+		if(timercmp(&sr->last,&r->last,>)){
+			r->last = sr->last;
+		}
+	}
+}
+
+char *flow_ntop(const flowrec *r,unsigned e,char *buf){
+	char addr[INET6_ADDRSTRLEN];
+	const int v6 = r->l3proto == ETH_P_IPV6;
+
+	if(inet_ntop(v6 ? AF_INET6 : AF_INET,r->addr[e],addr,sizeof(addr)) == NULL){
+		strcpy(addr,"?");
+	}
+	if(r->port[e] == 0){
+		snprintf(buf,FLOW_NTOPLEN,"%s",addr);
+	}else{
+		snprintf(buf,FLOW_NTOPLEN,v6 ? "[%s]:%u" : "%s:%u",addr,ntohs(r->port[e]));
+	}
+	return buf;
+}
+
+const char *flow_protostr(const flowrec *r,char *buf){
+	switch(r->l4proto){
+		case IPPROTO_TCP: return "tcp";
+		case IPPROTO_UDP: return "udp";
+		case IPPROTO_SCTP: return "sctp";
+		case IPPROTO_ICMP: return "icmp";
+		case IPPROTO_ICMPV6: return "icmp6";
+		case IPPROTO_IGMP: return "igmp";
+		case IPPROTO_GRE: return "gre";
+		case IPPROTO_ESP: return "esp";
+		case IPPROTO_AH: return "ah";
+		case IPPROTO_PIM: return "pim";
+	}
+	snprintf(buf,FLOW_PROTOSTRLEN,"%u",r->l4proto);
+	return buf;
+}
+
+void cleanup_flows(interface *i){
+	flowtable *ft = &i->flows;
+
+	cancel_timer(&i->timers,&ft->timer);
+	stat_sub(&flow_active,ft->count);
+	free(ft->tags);
+	free(ft->recs);
+	memset(ft,0,sizeof(*ft));
+}
+
+void flow_stats(flowstats *fs){
+	fs->created = __atomic_load_n(&flow_created,__ATOMIC_RELAXED);
+	fs->active = __atomic_load_n(&flow_active,__ATOMIC_RELAXED);
+	fs->expired = __atomic_load_n(&flow_expired,__ATOMIC_RELAXED);
+	fs->evicted = __atomic_load_n(&flow_evicted,__ATOMIC_RELAXED);
+}
+
+#define STAT(fp,st,x) if((st)->x) { if(fprintf((fp),"<"#x">%ju</"#x">",(uintmax_t)(st)->x) < 0){ return -1; } }
+int print_flow_stats(FILE *fp){
+	flowstats fs;
+
+	flow_stats(&fs);
+	if(fs.created == 0){
+		return 0;
+	}
+	if(fprintf(fp,"<flows>") < 0){
+		return -1;
+	}
+	STAT(fp,&fs,created);
+	STAT(fp,&fs,active);
+	STAT(fp,&fs,expired);
+	STAT(fp,&fs,evicted);
+	if(fprintf(fp,"</flows>") < 0){
+		return -1;
+	}
+	return 0;
+}
+#undef STAT
@@ -0,0 +1,100 @@
+#ifndef OMPHALOS_FLOW
+#define OMPHALOS_FLOW
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <omphalos/128.h>
+#include <omphalos/timing.h>
+
+struct interface;
+struct omphalos_packet;
+
+// Per-interface accounting of who's talking to whom. Each frame carrying an
+// IP payload is charged to its flow: the (protocol, address, port, address,
+// port) tuple of its innermost IP header, in either direction. Portless
+// protocols have ports of 0. Fragments which don't complete a datagram aren't
+// charged, as they don't carry a transport header.
+//
+// The table is open-addressed (linear probing over a dense array of 32-bit
+// hash tags, with the flows themselves in a parallel array), allocated upon
+// the first flow, and never resized. It holds at most omphalos_ctx's flowcap
+// flows; beyond that, the stalest of a few flows sampled by a clock hand is
+// evicted to make room. A sweep every FLOW_SWEEP_SECS of the interface's
+// timing wheel expires flows which have gone FLOW_IDLE_SECS without a frame.
+// Evicted and expired flows are handed to the flow_event callback. Everything
+// is protected by the interface lock.
+
+#define FLOW_IDLE_SECS		60
+#define FLOW_SWEEP_SECS		5
+#define FLOW_EVICT_SAMPLES	8	// flows considered for each eviction
+#define FLOW_NTOPLEN		(INET6_ADDRSTRLEN + 8) // "[addr]:port"
+#define FLOW_PROTOSTRLEN	6
+
+// Endpoint 0 is that which sent the first frame seen. Counters are indexed by
+// the sending endpoint.
+typedef struct flowrec {
+	uint128_t addr[2];
+	uint16_t port[2];	// network byte order
+	uint16_t l3proto;	// ETH_P_IP or ETH_P_IPV6
+	uint8_t l4proto;	// IP protocol number
+	uintmax_t frames[2];
+	uintmax_t bytes[2];	// on the wire, L2 headers included
+	struct timeval first,last; // frame timestamps (omphalos_packet's tv)
+	unsigned idle;		// seconds without a frame, as of the last sweep
+} flowrec;
+
+typedef struct flowtable {
+	uint32_t *tags;		// hash of each slot's flow (0: empty)
+	flowrec *recs;		// parallel to tags
+	unsigned size,count;	// slots (a power of 2), flows
+	unsigned max;		// flows held before eviction
+	unsigned hand;		// next slot sampled for eviction
+	twtimer timer;		// idle sweep, armed while count is nonzero
+	struct timeval swept;	// wheel time of the last sweep (0: none yet)
+} flowtable;
+
+typedef struct flowstats {
+	uintmax_t created;	// flows tracked
+	uintmax_t active;	// ...of which are currently tracked
+	uintmax_t expired;	// flows removed on idleness
+	uintmax_t evicted;	// ...to make room for new ones
+} flowstats;
+
+// Charge the frame to its flow. len is the frame's length on the wire. Call
+// with the interface lock held, once dissection is complete.
+void observe_flow(const struct omphalos_packet *,size_t);
+
+// Copy up to n of the interface's flows, those having moved the most bytes,
+// into the array (most first). Returns the number copied. Call with the
+// interface lock held.
+unsigned top_flows(const struct interface *,flowrec *,unsigned);
+
+// Add the flows of src into those of dst, as if dst had seen src's frames.
+void merge_flows(struct interface *,const struct interface *);
+
+// "addr:port" ("[addr]:port" for IPv6) for endpoint 0 or 1 of the flow, the
+// port omitted if 0, into a buffer of FLOW_NTOPLEN bytes. Returns the buffer.
+char *flow_ntop(const flowrec *,unsigned,char *);
+
+// The flow's transport protocol as a short lowercase name, or failing that its
+// number, written into the buffer of FLOW_PROTOSTRLEN bytes.
+const char *flow_protostr(const flowrec *,char *);
+
+// Free all of an interface's flows, without calling back. Must precede
+// destruction of its wheel.
+void cleanup_flows(struct interface *);
+
+void flow_stats(flowstats *);
+int print_flow_stats(FILE *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
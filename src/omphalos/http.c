@@ -0,0 +1,70 @@
+#include <string.h>
+#include <strings.h>
+#include <omphalos/diag.h>
+#include <omphalos/http.h>
+#include <omphalos/util.h>
+#include <omphalos/service.h>
+#include <omphalos/omphalos.h>
+#include <omphalos/interface.h>
+
+#define HTTP_VERSION "HTTP/1."
+#define HTTP_SERVER "Server:"
+#define HTTP_MAXSERVER 128
+
+// Returns the value of the Server header, trimmed, and its length in *vlen.
+// Only complete lines, up to the end of the headers, are considered.
+static const char *
+http_server(const char *s,size_t len,size_t *vlen){
+	const char *eol;
+
+	while( (eol = memchr(s,'\n',len)) ){
+		size_t llen = eol - s;
+
+		if(llen == 0 || (llen == 1 && *s == '\r')){ // end of headers
+			break;
+		}
+		if(llen > __builtin_strlen(HTTP_SERVER) &&
+				strncasecmp(s,HTTP_SERVER,__builtin_strlen(HTTP_SERVER)) == 0){
+			const char *v = s + __builtin_strlen(HTTP_SERVER);
+
+			while(v < eol && (*v == ' ' || *v == '\t')){
+				++v;
+			}
+			*vlen = eol - v;
+			while(*vlen && (v[*vlen - 1] == '\r' || v[*vlen - 1] == ' ')){
+				--*vlen;
+			}
+			return v;
+		}
+		len -= llen + 1;
+		s = eol + 1;
+	}
+	return NULL;
+}
+
+// "HTTP/1.x SP 3DIGIT SP reason CR LF", followed by headers.
+int handle_http_stream(omphalos_packet *op,const void *frame,size_t len){
+	const char *s = frame,*eol,*srv;
+	wchar_t ver[HTTP_MAXSERVER];
+	size_t vlen;
+
+	if(len < __builtin_strlen(HTTP_VERSION) + 6 || memcmp(s,HTTP_VERSION,__builtin_strlen(HTTP_VERSION))){
+		return 0;
+	}
+	if((eol = memchr(s,'\n',len)) == NULL){
+		return 0;
+	}
+	if(s[8] != ' ' || s[9] < '1' || s[9] > '5'){
+		diagnostic("[%s] malformed HTTP status line",op->i->name);
+		op->malformed = 1;
+		return 0;
+	}
+	++eol;
+	if( (srv = http_server(eol,len - (eol - s),&vlen)) ){
+		btowcpy(ver,sizeof(ver) / sizeof(*ver),srv,vlen);
+	}else{
+		ver[0] = L'\0';
+	}
+	observe_service(op->i,op->l2s,op->l3s,op->l3proto,op->l4src,L"HTTP",ver[0] ? ver : NULL);
+	return 1;
+}
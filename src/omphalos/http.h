@@ -0,0 +1,25 @@
+#ifndef OMPHALOS_HTTP
+#define OMPHALOS_HTTP
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+struct omphalos_packet;
+
+#define HTTP_TCP_PORT 80
+#define HTTPALT_TCP_PORT 8080
+
+// Handed the start of a server's stream, which ought be an HTTP/1.x response.
+// Observes HTTP of the sender, along with its Server header if it's within
+// what we were handed. Returns 1 for a valid status line, 0 otherwise.
+int handle_http_stream(struct omphalos_packet *,const void *,size_t)
+			__attribute__ ((nonnull (1,2)));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
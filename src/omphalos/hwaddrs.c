@@ -5,8 +5,10 @@
 #include <arpa/inet.h>
 #include <net/if_arp.h>
 #include <omphalos/iana.h>
+#include <omphalos/pool.h>
 #include <linux/rtnetlink.h>
 #include <omphalos/hwaddrs.h>
+#include <omphalos/netaddrs.h>
 #include <omphalos/ethernet.h>
 #include <omphalos/omphalos.h>
 #include <omphalos/interface.h>
@@ -16,22 +18,24 @@
 typedef struct l2host {
 	hwaddrint hwaddr;		// hardware address
 	const wchar_t *devname;		// text description based off lladdress
-	struct l2host *next;
+	// LRU list, most recently used first. The head's prev is the tail.
+	struct l2host *next,*prev;
 	uintmax_t srcpkts,dstpkts;	// stats
 	interface *i;
 	void *opaque;
+	struct l3host *l3s;		// l3hosts last seen via this l2host
 } l2host;
 
 static inline l2host *
 create_l2host(interface *,const void *) __attribute__ ((malloc));
 
-// FIXME replace internals with LRU acquisition...
-// FIXME caller must set ->next
+// FIXME caller must link it into the LRU list and index
 static inline l2host *
 create_l2host(interface *i,const void *hwaddr){
 	l2host *l2;
 
-	if( (l2 = malloc(sizeof(*l2))) ){
+	if( (l2 = hostpool_get(&i->l2pool,sizeof(*l2))) ){
+		l2->l3s = NULL;
 		l2->dstpkts = l2->srcpkts = 0;
 		l2->hwaddr = 0;
 		memcpy(&l2->hwaddr,hwaddr,i->addrlen);
@@ -50,29 +54,162 @@ create_l2host(interface *i,const void *hwaddr){
 	return l2;
 }
 
-// FIXME strictly proof-of-concept. we'll want a trie- or hash-based
-// lookup, backed by an arena-allocated LRU, etc...
+#define L2INDEX_MINSIZE 64
+
+// Fibonacci hashing. Vendor OUIs make the low bits of a MAC fairly uniform
+// and the high bits nearly constant, so mix everything into the top.
+static inline unsigned
+l2index_slot(const l2index *idx,hwaddrint hw){
+	return (unsigned)((hw * 0x9e3779b97f4a7c15ull) >> 32u) & (idx->size - 1);
+}
+
+// The table must have a free slot.
+static void
+l2index_insert(l2index *idx,l2host *l2){
+	unsigned s;
+
+	s = l2index_slot(idx,l2->hwaddr);
+	while(idx->slots[s]){
+		s = (s + 1) & (idx->size - 1);
+	}
+	idx->slots[s] = l2;
+	++idx->count;
+}
+
+static int
+l2index_grow(l2index *idx){
+	l2host **old = idx->slots;
+	unsigned oldsize = idx->size,s;
+
+	idx->size = oldsize ? oldsize * 2 : L2INDEX_MINSIZE;
+	if((idx->slots = calloc(idx->size,sizeof(*idx->slots))) == NULL){
+		idx->slots = old;
+		idx->size = oldsize;
+		return -1;
+	}
+	idx->count = 0;
+	for(s = 0 ; s < oldsize ; ++s){
+		if(old[s]){
+			l2index_insert(idx,old[s]);
+		}
+	}
+	free(old);
+	return 0;
+}
+
+static inline l2host *
+l2index_find(const l2index *idx,hwaddrint hw){
+	l2host *l2;
+	unsigned s;
+
+	if(idx->size == 0){
+		return NULL;
+	}
+	s = l2index_slot(idx,hw);
+	while( (l2 = idx->slots[s]) ){
+		if(l2->hwaddr == hw){
+			return l2;
+		}
+		s = (s + 1) & (idx->size - 1);
+	}
+	return NULL;
+}
+
+// Backward-shift deletion, so that no tombstones are needed.
+static void
+l2index_remove(l2index *idx,const l2host *l2){
+	const unsigned mask = idx->size - 1;
+	unsigned s,j,home;
+
+	s = l2index_slot(idx,l2->hwaddr);
+	while(idx->slots[s] != l2){
+		if(idx->slots[s] == NULL){
+			return;
+		}
+		s = (s + 1) & mask;
+	}
+	for(j = (s + 1) & mask ; idx->slots[j] ; j = (j + 1) & mask){
+		home = l2index_slot(idx,idx->slots[j]->hwaddr);
+		// Move it into the hole unless its home lies cyclically in (s, j]
+		if(((j - home) & mask) >= ((j - s) & mask)){
+			idx->slots[s] = idx->slots[j];
+			s = j;
+		}
+	}
+	idx->slots[s] = NULL;
+	--idx->count;
+}
+
+static inline void
+l2_lru_push(interface *i,l2host *l2){
+	if( (l2->next = i->l2hosts) ){
+		l2->prev = i->l2hosts->prev;
+		i->l2hosts->prev = l2;
+	}else{
+		l2->prev = l2;
+	}
+	i->l2hosts = l2;
+}
+
+static inline void
+l2_lru_unlink(interface *i,l2host *l2){
+	if(l2 == i->l2hosts){
+		if( (i->l2hosts = l2->next) ){
+			i->l2hosts->prev = l2->prev;
+		}
+	}else{
+		l2->prev->next = l2->next;
+		if(l2->next){
+			l2->next->prev = l2->prev;
+		}else{
+			i->l2hosts->prev = l2->prev;
+		}
+	}
+}
+
+// Evict the least recently used l2host, along with any l3hosts last seen via
+// it. The UI is notified of each eviction, l3hosts first.
+static void
+evict_l2host(interface *i){
+	const omphalos_ctx *octx = get_octx();
+	l2host *l2 = i->l2hosts->prev;
+
+	evict_l3hosts_via(i,l2,&l2->l3s);
+	if(octx->iface.evict_event){
+		octx->iface.evict_event(i,l2,NULL);
+	}
+	l2index_remove(&i->l2idx,l2);
+	l2_lru_unlink(i,l2);
+	hostpool_put(&i->l2pool,l2);
+}
+
 l2host *lookup_l2host(interface *i,const void *hwaddr){
 	const omphalos_ctx *octx = get_octx();
-	l2host *l2,**prev;
 	hwaddrint hwcmp;
+	l2host *l2;
 
 	hwcmp = 0;
 	memcpy(&hwcmp,hwaddr,i->addrlen);
-	for(prev = &i->l2hosts ; (l2 = *prev) ; prev = &l2->next){
-		if(l2->hwaddr == hwcmp){
-			// Move it to the front of the list, splicing it out
-			*prev = l2->next;
-			l2->next = i->l2hosts;
-			i->l2hosts = l2;
-			return l2;
+	if( (l2 = l2index_find(&i->l2idx,hwcmp)) ){
+		if(l2 != i->l2hosts){
+			l2_lru_unlink(i,l2);
+			l2_lru_push(i,l2);
+		}
+		return l2;
+	}
+	if(octx->hostcap && i->l2idx.count >= octx->hostcap){
+		evict_l2host(i);
+	}
+	if((i->l2idx.count + 1) * 2 > i->l2idx.size){
+		if(l2index_grow(&i->l2idx)){
+			return NULL;
 		}
 	}
 	l2 = create_l2host(i,hwaddr);
 	assert(l2);
 	if(l2){
-		l2->next = i->l2hosts;
-		i->l2hosts = l2;
+		l2_lru_push(i,l2);
+		l2index_insert(&i->l2idx,l2);
 		if(octx->iface.neigh_event){
 			l2->opaque = octx->iface.neigh_event(i,l2);
 		}
@@ -80,14 +217,35 @@ l2host *lookup_l2host(interface *i,const void *hwaddr){
 	return l2;
 }
 
-void cleanup_l2hosts(l2host **list){
-	l2host *l2,*tmp;
+// Walk src from its least recently used l2host, so that the merged hosts
+// take on src's recency order in dst.
+void merge_l2hosts(interface *dst,const interface *src){
+	const l2host *l2;
+
+	if(src->l2hosts == NULL){
+		return;
+	}
+	l2 = src->l2hosts->prev;
+	for(;;){
+		l2host *d2;
 
-	for(l2 = *list ; l2 ; l2 = tmp){
-		tmp = l2->next;
-		free(l2);
+		if( (d2 = lookup_l2host(dst,&l2->hwaddr)) ){
+			d2->srcpkts += l2->srcpkts;
+			d2->dstpkts += l2->dstpkts;
+		}
+		if(l2 == src->l2hosts){
+			break;
+		}
+		l2 = l2->prev;
 	}
-	*list = NULL;
+}
+
+void cleanup_l2hosts(interface *i){
+	i->l2hosts = NULL;
+	free(i->l2idx.slots);
+	i->l2idx.slots = NULL;
+	i->l2idx.size = i->l2idx.count = 0;
+	hostpool_destroy(&i->l2pool);
 }
 
 void hwntop(const void *hwaddr,size_t len,char *buf){
@@ -181,3 +339,7 @@ uintmax_t get_dstpkts(const l2host *l2){
 interface *l2_getiface(l2host *l2){
 	return l2->i;
 }
+
+struct l3host **l2_l3hosts(l2host *l2){
+	return &l2->l3s;
+}
@@ -14,10 +14,28 @@ struct interface;
 // We don't handle any hardware addresses longer than 64 bits...yet...
 typedef uint64_t hwaddrint;
 
+// Open-addressed (linear probing) index over an interface's l2hosts, keyed on
+// the hwaddrint. Only pointers live in the table, so l2host handles (and
+// anything the UI hangs off them) remain valid across resizes.
+typedef struct l2index {
+	struct l2host **slots;
+	unsigned size;		// power of 2, or 0 prior to the first insertion
+	unsigned count;		// occupied slots, kept under size / 2
+} l2index;
+
+// Look up an l2host, creating it if necessary. If the interface is at the
+// configured host cap, the least recently used l2host is first evicted (see
+// the omphalos_iface evict_event callback).
 struct l2host *lookup_l2host(struct interface *,const void *)
 		__attribute__ ((nonnull (1,2)));
 
-void cleanup_l2hosts(struct l2host **) __attribute__ ((nonnull (1)));
+// Look up each of the second interface's l2hosts on the first (creating them
+// as necessary, subject to its host cap), adding their packet counts.
+void merge_l2hosts(struct interface *,const struct interface *)
+		__attribute__ ((nonnull (1,2)));
+
+// Free all of the interface's l2hosts. Its l3hosts must already be gone.
+void cleanup_l2hosts(struct interface *) __attribute__ ((nonnull (1)));
 
 // Each byte becomes two ASCII characters + separator or nul
 #define HWADDRSTRLEN(len) ((len) == 0 ? 1 : (len == 1) ? 2 : (len) * 3)
@@ -34,6 +52,10 @@ const wchar_t *get_devname(const struct l2host *) __attribute__ ((nonnull (1)));
 // Problematic accessors -- return unlocked, unsafe objects FIXME
 struct interface *l2_getiface(struct l2host *) __attribute__ ((nonnull (1)));
 
+// Head of the list of l3hosts last seen via this l2host. Maintained by
+// netaddrs.c, so that l3hosts can be evicted along with their l2host.
+struct l3host **l2_l3hosts(struct l2host *) __attribute__ ((nonnull (1)));
+
 // Predicates and comparators
 int l2hostcmp(const struct l2host *,const struct l2host *,size_t)
 				__attribute__ ((nonnull (1,2)));
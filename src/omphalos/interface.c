@@ -12,6 +12,7 @@
 #include <omphalos/irda.h>
 #include <omphalos/hdlc.h>
 #include <omphalos/ietf.h>
+#include <omphalos/probe.h>
 #include <omphalos/service.h>
 #include <omphalos/hwaddrs.h>
 #include <omphalos/netlink.h>
@@ -46,7 +47,9 @@ handle_void_packet(omphalos_packet *op,const void *frame __attribute__ ((unused)
 
 static int
 init_iface(interface *iface){
+	const omphalos_ctx *octx = get_octx();
 	pthread_mutexattr_t attr;
+	struct timeval tv;
 
 	if(pthread_mutexattr_init(&attr)){
 		return -1;
@@ -59,18 +62,24 @@ init_iface(interface *iface){
 		pthread_mutexattr_destroy(&attr);
 		return -1;
 	}
-	if(timestat_prep(&iface->fps,IFACE_TIMESTAT_USECS,IFACE_TIMESTAT_SLOTS)){
+	// One shard per fanout ring, each with its own RX thread
+	if(prep_rxshards(iface,octx->fanout ? octx->fanout : 1)){
 		pthread_mutex_destroy(&iface->lock);
 		pthread_mutexattr_destroy(&attr);
 		return -1;
 	}
-	if(timestat_prep(&iface->bps,IFACE_TIMESTAT_USECS,IFACE_TIMESTAT_SLOTS)){
-		timestat_destroy(&iface->fps);
+	gettimeofday(&tv,NULL);
+	if(twheel_init(&iface->timers,IFACE_TIMER_USECS,&tv)){
+		free_rxshards(iface->rxs,iface->rxshards);
+		iface->rxs = NULL;
+		iface->rxshards = 0;
 		pthread_mutex_destroy(&iface->lock);
 		pthread_mutexattr_destroy(&attr);
 		return -1;
 	}
 	iface->fd4 = iface->fd6udp = iface->fd6icmp = iface->rfd =iface->fd = -1;
+	iface->numanode = -1;
+	iface->rxcpusirq = -1;
 	assert(pthread_mutexattr_destroy(&attr) == 0);
 	return 0;
 }
@@ -79,33 +88,121 @@ int init_interfaces(void){
 	return 0;
 }
 
-#define STAT(fp,i,x) if((i)->x) { if(fprintf((fp),"<"#x">%ju</"#x">",(i)->x) < 0){ return -1; } }
-int print_iface_stats(FILE *fp,const interface *i,interface *agg,const char *decorator){
-	if(i->name == NULL){
+// The count is loaded first: grow_rxshards() publishes the array before it,
+// and arrays only grow, so whichever array we then see has that many shards.
+void interface_stats(const interface *i,ifstats *st){
+	const rxshard *rs;
+	unsigned z,n;
+
+	memset(st,0,sizeof(*st));
+	n = __atomic_load_n(&i->rxshards,__ATOMIC_ACQUIRE);
+	rs = __atomic_load_n(&i->rxs,__ATOMIC_ACQUIRE);
+	for(z = 0 ; z < n ; ++z){
+		rxshard_read(&rs[z],st);
+	}
+	st->txframes = i->txframes;
+	st->txbytes = i->txbytes;
+	st->txaborts = i->txaborts;
+	st->txerrors = i->txerrors;
+}
+
+int prep_rxshards(interface *i,unsigned count){
+	rxshard *rs;
+
+	if((rs = create_rxshards(count,IFACE_TIMESTAT_USECS,IFACE_TIMESTAT_SLOTS)) == NULL){
+		return -1;
+	}
+	free_rxshards(i->rxs,i->rxshards);
+	i->rxs = rs;
+	i->rxshards = count;
+	return 0;
+}
+
+// An array outgrown by grow_rxshards(). Its shards were moved to the new
+// array, which now owns their timestats and plog queues.
+typedef struct oldrxshards {
+	struct oldrxshards *next;
+	rxshard *rs;
+} oldrxshards;
+
+int grow_rxshards(interface *i,unsigned count){
+	oldrxshards *old;
+	rxshard *rs;
+	unsigned z;
+
+	if(count <= i->rxshards){
+		return 0;
+	}
+	if((old = malloc(sizeof(*old))) == NULL){
+		return -1;
+	}
+	if((rs = create_rxshards(count,IFACE_TIMESTAT_USECS,IFACE_TIMESTAT_SLOTS)) == NULL){
+		free(old);
+		return -1;
+	}
+	for(z = 0 ; z < i->rxshards ; ++z){
+		timestat_destroy(&rs[z].fps);
+		timestat_destroy(&rs[z].bps);
+		memcpy(&rs[z],&i->rxs[z],sizeof(*rs));
+	}
+	old->rs = i->rxs;
+	old->next = i->oldrxs;
+	i->oldrxs = old;
+	__atomic_store_n(&i->rxs,rs,__ATOMIC_RELEASE);
+	__atomic_store_n(&i->rxshards,count,__ATOMIC_RELEASE);
+	return 0;
+}
+
+static void
+free_oldrxshards(interface *i){
+	oldrxshards *old;
+
+	while( (old = i->oldrxs) ){
+		i->oldrxs = old->next;
+		free(old->rs);
+		free(old);
+	}
+}
+
+#define STAT(fp,st,x) if((st)->x) { if(fprintf((fp),"<"#x">%ju</"#x">",(st)->x) < 0){ return -1; } }
+int print_ifstats(FILE *fp,const ifstats *st,const char *name,const char *decorator){
+	if(name == NULL){
 		if(fprintf(fp,"<%s>",decorator) < 0){
 			return -1;
 		}
 	}else{
-		if(fprintf(fp,"<%s name=\"%s\">",decorator,i->name) < 0){
+		if(fprintf(fp,"<%s name=\"%s\">",decorator,name) < 0){
 			return -1;
 		}
 	}
-	STAT(fp,i,frames);
-	STAT(fp,i,truncated);
-	STAT(fp,i,noprotocol);
-	STAT(fp,i,malformed);
+	STAT(fp,st,frames);
+	STAT(fp,st,truncated);
+	STAT(fp,st,noprotocol);
+	STAT(fp,st,malformed);
+	STAT(fp,st,plogdrops);
 	if(fprintf(fp,"</%s>",decorator) < 0){
 		return -1;
 	}
+	return 0;
+}
+#undef STAT
+
+int print_iface_stats(FILE *fp,const interface *i,ifstats *agg,const char *decorator){
+	ifstats st;
+
+	interface_stats(i,&st);
+	if(print_ifstats(fp,&st,i->name,decorator) < 0){
+		return -1;
+	}
 	if(agg){
-		agg->frames += i->frames;
-		agg->truncated += i->truncated;
-		agg->noprotocol += i->noprotocol;
-		agg->malformed += i->malformed;
+		agg->frames += st.frames;
+		agg->truncated += st.truncated;
+		agg->noprotocol += st.noprotocol;
+		agg->malformed += st.malformed;
+		agg->plogdrops += st.plogdrops;
 	}
 	return 0;
 }
-#undef STAT
 
 // not valid unless the interface came from the interfaces[] array!
 static unsigned
@@ -196,6 +293,15 @@ void free_iface(interface *i){
 		}
 		i->fd6icmp = -1;
 	}
+	cancel_probes(i);
+	cleanup_tcpstreams(i);
+	cleanup_ipfrags(i);
+	cleanup_flows(i);
+	twheel_destroy(&i->timers);
+	lpm_destroy(&i->ip6trie);
+	lpm_destroy(&i->ip4trie);
+	i->ip6srcr = NULL;
+	i->ip4srcr = NULL;
 	while(i->ip6r){
 		struct ip6route *r6 = i->ip6r->next;
 
@@ -208,8 +314,10 @@ void free_iface(interface *i){
 		free(i->ip4r);
 		i->ip4r = r4;
 	}
-	timestat_destroy(&i->fps);
-	timestat_destroy(&i->bps);
+	free_rxshards(i->rxs,i->rxshards);
+	i->rxs = NULL;
+	i->rxshards = 0;
+	free_oldrxshards(i);
 	free(i->topinfo.devname);
 	i->topinfo.devname = NULL;
 	free(i->truncbuf);
@@ -220,10 +328,8 @@ void free_iface(interface *i){
 	i->addr = NULL;
 	free(i->bcast);
 	i->bcast = NULL;
-	cleanup_l3hosts(&i->cells);
-	cleanup_l3hosts(&i->ip6hosts);
-	cleanup_l3hosts(&i->ip4hosts);
-	cleanup_l2hosts(&i->l2hosts);
+	cleanup_l3hosts(i);
+	cleanup_l2hosts(i);
 	Pthread_mutex_unlock(&i->lock);
 
 	// Mark it unused
@@ -244,13 +350,15 @@ void cleanup_interfaces(void){
 	}
 }
 
-int print_all_iface_stats(FILE *fp,interface *agg){
+int print_all_iface_stats(FILE *fp,ifstats *agg){
 	unsigned i;
 
 	for(i = 0 ; i < sizeof(interfaces) / sizeof(*interfaces) ; ++i){
 		const interface *iface = &interfaces[i];
+		ifstats st;
 
-		if(iface->frames){
+		interface_stats(iface,&st);
+		if(st.frames){
 			if(print_iface_stats(fp,iface,agg,"iface") < 0){
 				return -1;
 			}
@@ -259,34 +367,29 @@ int print_all_iface_stats(FILE *fp,interface *agg){
 	return 0;
 }
 
-// Interface lock must be held upon entry
+// Interface lock must be held upon entry. Routes are looked up via the tries
+// while holding the interface lock, so we needn't defer freeing them.
 // FIXME need to check and ensure they don't overlap with existing routes
 int add_route4(interface *i,const uint32_t *dst,const uint32_t *via,
 				const uint32_t *src,unsigned blen){
-	ip4route *r,**prev;
+	ip4route *r,*lr;
+	interface *owner;
 	struct l3host *l3;
 	struct l2host *l2;
 
-	if((r = malloc(sizeof(*r))) == NULL){
-		return -1;
-	}
-	memcpy(&r->dst,dst,sizeof(*dst));
-	r->maskbits = blen;
-	prev = &i->ip4r;
-	// Order most-specific (largest maskbits) to least-specific (0 maskbits)
-	while(*prev){
-		if(r->maskbits >= (*prev)->maskbits){
-			break;
+	if((r = lpm_find(&i->ip4trie,dst,blen)) == NULL){
+		if((r = malloc(sizeof(*r))) == NULL){
+			return -1;
 		}
-		prev = &(*prev)->next;
-	}
-	if(*prev && r->maskbits == (*prev)->maskbits && r->dst == (*prev)->dst){
-		free(r);
-		r = *prev;
-	}else{
-		r->addrs = 0;
-		r->next = *prev;
-		*prev = r;
+		memset(r,0,sizeof(*r));
+		memcpy(&r->dst,dst,sizeof(*dst));
+		r->maskbits = blen;
+		if(lpm_insert(&i->ip4trie,dst,blen,r) != r){
+			free(r);
+			return -1;
+		}
+		r->next = i->ip4r;
+		i->ip4r = r;
 	}
 	if(via){
 		memcpy(&r->via,via,sizeof(*via));
@@ -298,20 +401,23 @@ int add_route4(interface *i,const uint32_t *dst,const uint32_t *via,
 		r->addrs |= ROUTE_HAS_SRC;
 		// Set the src for any less-specific routes we contain
 		// FIXME this will only work once...it won't update :/
-		while( *(prev = &(*prev)->next) ){
-			assert((*prev)->maskbits <= r->maskbits);
-			if(!((*prev)->addrs & ROUTE_HAS_SRC)){
-				(*prev)->addrs |= ROUTE_HAS_SRC;
-				memcpy(&(*prev)->src,src,sizeof(*src));
+		for(lr = i->ip4r ; lr ; lr = lr->next){
+			if(lr->maskbits <= r->maskbits && !(lr->addrs & ROUTE_HAS_SRC)){
+				lr->addrs |= ROUTE_HAS_SRC;
+				memcpy(&lr->src,src,sizeof(*src));
 			}
 		}
+		if(i->ip4srcr == NULL || i->ip4srcr->maskbits < r->maskbits){
+			i->ip4srcr = r;
+		}
 		assert(lookup_local_l3host(NULL,i,l2,AF_INET,src));
 	}
 	if(r->addrs & ROUTE_HAS_VIA && r->maskbits < 32){
-		if( (l3 = lookup_global_l3host(AF_INET,via)) ){
+		if( (l3 = lookup_global_l3host(i,AF_INET,via,&owner)) ){
 			if( (l2 = l3_getlastl2(l3)) ){
 				observe_service(i,l2,l3,IPPROTO_IP,4,L"Router",NULL);
 			}
+			release_global_l3host(i,owner);
 		}
 	}
 	return 0;
@@ -320,30 +426,24 @@ int add_route4(interface *i,const uint32_t *dst,const uint32_t *via,
 // Interface lock must be held upon entry
 int add_route6(interface *i,const uint128_t dst,const uint128_t via,
 				const uint128_t src,unsigned blen){
-	ip6route *r,**prev;
+	ip6route *r,*lr;
+	interface *owner;
 	struct l3host *l3;
 	struct l2host *l2;
 
-	if((r = malloc(sizeof(*r))) == NULL){
-		return -1;
-	}
-	assign128(r->dst,dst);
-	r->maskbits = blen;
-	prev = &i->ip6r;
-	// Order most-specific (largest maskbits) to least-specific (0 maskbits)
-	while(*prev){
-		if(r->maskbits >= (*prev)->maskbits){
-			break;
+	if((r = lpm_find(&i->ip6trie,dst,blen)) == NULL){
+		if((r = malloc(sizeof(*r))) == NULL){
+			return -1;
 		}
-		prev = &(*prev)->next;
-	}
-	if(*prev && r->maskbits == (*prev)->maskbits && equal128(r->dst,(*prev)->dst)){
-		free(r);
-		r = *prev;
-	}else{
-		r->addrs = 0;
-		r->next = *prev;
-		*prev = r;
+		memset(r,0,sizeof(*r));
+		assign128(r->dst,dst);
+		r->maskbits = blen;
+		if(lpm_insert(&i->ip6trie,dst,blen,r) != r){
+			free(r);
+			return -1;
+		}
+		r->next = i->ip6r;
+		i->ip6r = r;
 	}
 	if(via){
 		assign128(r->via,via);
@@ -354,115 +454,102 @@ int add_route6(interface *i,const uint128_t dst,const uint128_t via,
 		assign128(r->src,src);
 		r->addrs |= ROUTE_HAS_SRC;
 		// Set the src for any less-specific routes we contain
-		while( *(prev = &(*prev)->next) ){
-			assert((*prev)->maskbits <= r->maskbits);
-			if(!((*prev)->addrs & ROUTE_HAS_SRC)){
-				(*prev)->addrs |= ROUTE_HAS_SRC;
-				assign128((*prev)->src,src);
+		for(lr = i->ip6r ; lr ; lr = lr->next){
+			if(lr->maskbits <= r->maskbits && !(lr->addrs & ROUTE_HAS_SRC)){
+				lr->addrs |= ROUTE_HAS_SRC;
+				assign128(lr->src,src);
 			}
 		}
+		if(i->ip6srcr == NULL || i->ip6srcr->maskbits < r->maskbits){
+			i->ip6srcr = r;
+		}
 		assert(lookup_local_l3host(NULL,i,l2,AF_INET6,src));
 	}
 	if(r->addrs & ROUTE_HAS_VIA && r->maskbits < 128){
-		if( (l3 = lookup_global_l3host(AF_INET6,via)) ){
+		if( (l3 = lookup_global_l3host(i,AF_INET6,via,&owner)) ){
 			if( (l2 = l3_getlastl2(l3)) ){
 				observe_service(i,l2,l3,IPPROTO_IP,6,L"Router",NULL);
 			}
+			release_global_l3host(i,owner);
 		}
 	}
 	return 0;
 }
 
-// FIXME need to check for overlaps and intersections etc
-int del_route4(interface *i,const struct in_addr *a,unsigned blen){
-	ip4route *r,**prev;
+static const ip4route *
+most_specific_src4(const interface *i){
+	const ip4route *r,*best = NULL;
 
-	for(prev = &i->ip4r ; (r = *prev) ; prev = &r->next){
-		if(r->dst == a->s_addr && r->maskbits == blen){
-			*prev = r->next;
-			free(r);
-			return 0;
+	for(r = i->ip4r ; r ; r = r->next){
+		if(r->addrs & ROUTE_HAS_SRC){
+			if(best == NULL || r->maskbits > best->maskbits){
+				best = r;
+			}
 		}
 	}
-	return -1;
+	return best;
 }
 
-// FIXME need to implement
-int del_route6(interface *i,const struct in6_addr *a,unsigned blen){
-	ip6route *r,**prev;
+static const ip6route *
+most_specific_src6(const interface *i){
+	const ip6route *r,*best = NULL;
 
-	for(prev = &i->ip6r ; (r = *prev) ; prev = &r->next){
-		if(!memcmp(&r->dst,&a->s6_addr,sizeof(a->s6_addr)) && r->maskbits == blen){
-			*prev = r->next;
-			free(r);
-			return 0;
+	for(r = i->ip6r ; r ; r = r->next){
+		if(r->addrs & ROUTE_HAS_SRC){
+			if(best == NULL || r->maskbits > best->maskbits){
+				best = r;
+			}
 		}
 	}
-	return -1;
+	return best;
 }
 
-static inline int
-ip4_in_route(const ip4route *r,uint32_t i){
-	uint64_t mask = ~0llu;
+// FIXME need to check for overlaps and intersections etc
+int del_route4(interface *i,const struct in_addr *a,unsigned blen){
+	ip4route *r,**prev;
 
-	mask <<= 32 - r->maskbits;
-	return (ntohl(r->dst) & mask) == (ntohl(i) & mask);
+	if((r = lpm_remove(&i->ip4trie,&a->s_addr,blen)) == NULL){
+		return -1;
+	}
+	for(prev = &i->ip4r ; *prev != r ; prev = &(*prev)->next){
+		assert(*prev);
+	}
+	*prev = r->next;
+	if(i->ip4srcr == r){
+		i->ip4srcr = most_specific_src4(i);
+	}
+	free(r);
+	return 0;
 }
 
-int is_local4(const interface *i,uint32_t ip){
-	const ip4route *r;
+int del_route6(interface *i,const struct in6_addr *a,unsigned blen){
+	ip6route *r,**prev;
 
-	for(r = i->ip4r ; r ; r = r->next){
-		if(ip4_in_route(r,ip)){
-			return (r->via == 0);
-		}
+	if((r = lpm_remove(&i->ip6trie,a->s6_addr,blen)) == NULL){
+		return -1;
+	}
+	for(prev = &i->ip6r ; *prev != r ; prev = &(*prev)->next){
+		assert(*prev);
 	}
+	*prev = r->next;
+	if(i->ip6srcr == r){
+		i->ip6srcr = most_specific_src6(i);
+	}
+	free(r);
 	return 0;
 }
 
-static inline int
-ip6_in_route(const ip6route *r,const uint128_t i){
-	uint128_t dst,mask,itmp;
+int is_local4(const interface *i,uint32_t ip){
+	const ip4route *r;
 
-	assign128(dst,r->dst);
-	set128(mask,0xff);
-	assign128(itmp,i);
-	switch(r->maskbits / 32){
-		case 0:
-			mask[0] = ~0lu << (32 - r->maskbits);
-			mask[1] = 0lu;
-			mask[2] = 0lu;
-			mask[3] = 0lu;
-			break;
-		case 1:
-			mask[1] = ~0lu << (64 - r->maskbits);
-			mask[2] = 0lu;
-			mask[3] = 0lu;
-			break;
-		case 2:
-			mask[2] = ~0lu << (96 - r->maskbits);
-			mask[3] = 0lu;
-			break;
-		case 3:
-			mask[3] = ~0lu << (128 - r->maskbits);
-			break;
-		case 4:
-			break;
+	if( (r = lpm_lookup(&i->ip4trie,&ip)) ){
+		return (r->via == 0);
 	}
-	andequals128(dst,mask);
-	andequals128(itmp,mask);
-	return equal128(dst,itmp);
+	return 0;
 }
 
 int is_local6(const interface *i,const struct in6_addr *a){
-	const ip6route *r;
-
-	for(r = i->ip6r ; r ; r = r->next){
-		if(ip6_in_route(r,*(const uint128_t *)a->s6_addr32)){
-			return 1;
-		}
-	}
-	return 0;
+	return lpm_lookup(&i->ip6trie,a->s6_addr) != NULL;
 }
 
 typedef struct arptype {
@@ -639,38 +726,21 @@ int disable_promiscuity(const interface *i){
 
 // FIXME these need to take into account priority (table number)
 // FIXME how to handle policy routing (rules)?
-static const ip4route *
+static inline const ip4route *
 get_route4(const interface *i,const uint32_t *ip){
-	const ip4route *i4r;
-
-	for(i4r = i->ip4r ; i4r ; i4r = i4r->next){
-		if(ip4_in_route(i4r,*ip)){
-			break;
-		}
-	}
-	return i4r;
+	return lpm_lookup(&i->ip4trie,ip);
 }
 
-static const ip6route *
+static inline const ip6route *
 get_route6(const interface *i,const void *ip){
-	const ip6route *i6r;
-
-	for(i6r = i->ip6r ; i6r ; i6r = i6r->next){
-		uint128_t i;
-
-		assign128(i,ip);
-		if(ip6_in_route(i6r,i)){
-			return i6r;
-		}
-	}
-	return NULL;
+	return lpm_lookup(&i->ip6trie,ip);
 }
 
 const void *
 get_source_address(interface *i,int fam,const void *addr,void *s){
 	switch(fam){
 		case AF_INET:{
-			const ip4route *i4r = addr ? get_route4(i,addr) : i->ip4r;
+			const ip4route *i4r = addr ? get_route4(i,addr) : i->ip4srcr;
 
 			if(i4r && (i4r->addrs & ROUTE_HAS_SRC)){
 				memcpy(s,&i4r->src,sizeof(uint32_t));
@@ -679,7 +749,7 @@ get_source_address(interface *i,int fam,const void *addr,void *s){
 			}
 			break;
 		}case AF_INET6:{
-			const ip6route *i6r = addr ? get_route6(i,addr) : i->ip6r;
+			const ip6route *i6r = addr ? get_route6(i,addr) : i->ip6srcr;
 
 			// FIXME ipv6 routes very rarely set their src :/
 			if(i6r && (i6r->addrs & ROUTE_HAS_SRC)){
@@ -9,6 +9,7 @@ extern "C" {
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 #include <stdint.h>
 #include <net/if.h>
 #include <pthread.h>
@@ -19,7 +20,15 @@ extern "C" {
 #include <linux/if_packet.h>
 #include <omphalos/timing.h>
 #include <omphalos/nl80211.h>
+#include <omphalos/lpm.h>
+#include <omphalos/stats.h>
+#include <omphalos/pool.h>
+#include <omphalos/flow.h>
+#include <omphalos/ipfrag.h>
+#include <omphalos/tcpstream.h>
+#include <omphalos/probe.h>
 #include <omphalos/hwaddrs.h>
+#include <omphalos/netaddrs.h>
 
 // Taken from linux/if.h as of 3.1-rc6
 #define IFF_LOWER_UP	0x10000		// driver signals L1 up
@@ -71,6 +80,7 @@ typedef void (*analyzefxn)(struct omphalos_packet *,const void *,size_t);
 
 #define IFACE_TIMESTAT_USECS 250000	// 10Hz sampling
 #define IFACE_TIMESTAT_SLOTS 12		// x12 samples == 3s history
+#define IFACE_TIMER_USECS 1000		// timing wheel resolution
 
 typedef struct interface {
 	// Packet analysis entry point
@@ -79,23 +89,25 @@ typedef struct interface {
 	// Lock (packet thread vs netlink layer vs UI)
 	pthread_mutex_t lock;
 
-	// Lifetime stats
-	uintmax_t frames;		// Frames received on the interface
-	uintmax_t malformed;		// Packet had malformed L2 -- L4 headers
-	uintmax_t truncated;		// Packet didn't fit in ringbuffer frame
-	uintmax_t truncated_recovered;	// We were able to recvfrom() the packet
-	uintmax_t noprotocol;		// Packets without protocol handler
-	uintmax_t bytes;		// Total bytes sniffed
-	uintmax_t drops;		// PACKET_STATISTICS @ TP_STATUS_LOSING
+	// Lifetime and finite time domain RX stats, one shard per RX thread.
+	// These don't require the lock; use interface_stats() to read them.
+	rxshard *rxs;
+	unsigned rxshards;
+	struct oldrxshards *oldrxs;	// outgrown by grow_rxshards()
+
+	// Lifetime TX stats, protected by the lock
 	uintmax_t txframes;		// Frames generated by omphalos
 	uintmax_t txbytes;		// Total bytes generated by omphalos
 	uintmax_t txaborts;		// TX frames handed out but aborted
 	uintmax_t txerrors;		// TX frames we failed to send
 
-	// Finite time domain stats
-	timestat fps,bps;		// frames and bits per second
-
-	struct psocket_marsh *pmarsh;	// State for packet socket thread
+	struct psocket_marsh *pmarsh;	// State for packet socket thread(s)
+	unsigned rxrings;		// RX rings (and threads) in pmarsh
+	unsigned rxsnap;		// RX filter truncates frames to headers
+	struct xdpif *xdp;		// AF_XDP program and map, or NULL
+	int numanode;			// NUMA node local to the device, or -1
+	cpu_set_t rxcpus;		// processors for RX threads (maybe empty)
+	int rxcpusirq;			// lookup_placement() result for rxcpus
 
 	// For recvfrom()ing truncated packets (see PACKET_COPY_THRESH sockopt)
 	void *truncbuf;
@@ -105,6 +117,7 @@ typedef struct interface {
 	unsigned flags;		// from rtnetlink(7) ifi_flags
 	size_t l2hlen;		// static l2 header length
 	int mtu;		// to match netdevice(7)'s ifr_mtu...
+	unsigned gsomax,gromax;	// largest offloaded frames, if reported
 	char *name;
 	void *addr;		// multiple hwaddrs are multiple ifaces...
 	void *bcast;		// l2 broadcast address (not valid unless
@@ -113,7 +126,11 @@ typedef struct interface {
 	int rfd;		// RX packet socket
 	void *rxm;		// RX packet ring buffer
 	size_t rs;		// RX packet ring size in bytes
-	struct tpacket_req rtpr;// RX packet ring descriptor
+	unsigned rtpver;	// RX TPACKET version (TPACKET_V1 or _V3)
+	union {
+		struct tpacket_req rtpr;	// RX packet ring descriptor
+		struct tpacket_req3 rtpr3;	// ...extended for TPACKET_V3
+	};
 	int fd;			// TX PF_PACKET socket
 	void *txm;		// TX packet ring buffer
 	int fd4,fd6udp,fd6icmp;	// Fallback IPv4 and IPv6 TX raw sockets
@@ -121,6 +138,13 @@ typedef struct interface {
 	struct tpacket_req ttpr;// TX packet ring descriptor
 	unsigned txidx;		// Index of next frame for TX
 	void *curtxm;		// Location of next frame for TX
+	void *lasttxm;		// Most recent frame handed out, if unsent
+	unsigned lasttxidx;	// ...and its index
+	unsigned txring;	// txm is a PACKET_TX_RING (else we copy out)
+	unsigned txpending;	// frames marked for TX, but not yet flushed
+	unsigned txbatch;	// begin_tx_batch() nesting depth
+	probesched probes;	// rate-limited active probes (see probe.h)
+	twheel timers;		// advanced by the RX threads, under the lock
 	struct ethtool_drvinfo drv;	// ethtool driver info
 	unsigned offload;	// offloading settings
 	unsigned offloadmask;	// which offloading settings are valid
@@ -139,13 +163,25 @@ typedef struct interface {
 	topdev_info topinfo;
 	// Other interfaces might also offer routes to these same
 	// destinations -- they must not be considered unique!
-	struct ip4route *ip4r;	// list of IPv4 routes
-	struct ip6route *ip6r;	// list of IPv6 routes
+	struct ip4route *ip4r;	// list of IPv4 routes, newest first
+	struct ip6route *ip6r;	// list of IPv6 routes, newest first
+	lpmtrie ip4trie,ip6trie; // longest-prefix-match indices over the above
+	// most specific routes having a source address
+	const struct ip4route *ip4srcr;
+	const struct ip6route *ip6srcr;
 
 	uint128_t ip6defsrc;	// default ipv6 source FIXME
 
-	struct l2host *l2hosts;
-	struct l3host *ip4hosts,*ip6hosts,*cells;
+	struct l2host *l2hosts;	// all l2hosts, most recently used first
+	l2index l2idx;		// hash index over l2hosts
+	struct l3host *ip4hosts,*ip6hosts,*cells; // ...also LRU-ordered
+	l3index ip4idx,ip6idx,cellidx;	// hash indices over the above
+	hostpool l2pool,l3pool;	// backing store for l2hosts and l3hosts
+	unsigned isolated;	// l3hosts are kept out of the global map, and
+				//  names resolved only against our own
+	tcpstreams tcp;		// reassembling TCP flows (see tcpstream.h)
+	ipfrags frags;		// reassembling IP datagrams (see ipfrag.h)
+	flowtable flows;	// 5-tuple flow accounting (see flow.h)
 
 	void *opaque;		// opaque callback state
 } interface;
@@ -153,7 +189,21 @@ typedef struct interface {
 int init_interfaces(void);
 interface *iface_by_idx(int);
 int idx_of_iface(const interface *);
-int print_iface_stats(FILE *,const interface *,interface *,const char *);
+// Sum the interface's stats shards (and TX counters) into a snapshot, without
+// taking the interface lock.
+void interface_stats(const interface *,ifstats *);
+
+// (Re)allocate the RX stats shards. Must not be called while RX threads or
+// stats readers might be active on the interface.
+int prep_rxshards(interface *,unsigned);
+
+// Ensure at least this many RX stats shards, keeping the existing shards'
+// counts. Must not be called while RX threads are active, but stats readers
+// are fine: the outgrown array is retained until free_iface().
+int grow_rxshards(interface *,unsigned);
+
+int print_ifstats(FILE *,const ifstats *,const char *,const char *);
+int print_iface_stats(FILE *,const interface *,ifstats *,const char *);
 
 static inline char *
 hwaddrstr(const interface *i){
@@ -168,7 +218,7 @@ hwaddrstr(const interface *i){
 void free_iface(interface *);
 void cleanup_interfaces(void);
 
-int print_all_iface_stats(FILE *,interface *);
+int print_all_iface_stats(FILE *,ifstats *);
 int add_route4(interface *,const uint32_t *,const uint32_t *,
 				const uint32_t *,unsigned);
 int add_route6(interface *,const uint128_t,const uint128_t,const uint128_t,
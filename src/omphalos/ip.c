@@ -15,6 +15,7 @@
 #include <omphalos/ospf.h>
 #include <omphalos/vrrp.h>
 #include <omphalos/util.h>
+#include <omphalos/ipfrag.h>
 #include <omphalos/cisco.h>
 #include <omphalos/ipsec.h>
 #include <omphalos/hwaddrs.h>
@@ -83,38 +84,16 @@ handle_igmp_packet(omphalos_packet *op,const void *frame,size_t len){
 	// FIXME
 }
 
-void handle_ipv6_packet(omphalos_packet *op,const void *frame,size_t len){
-	const struct ip6_hdr *ip = frame;
-	uint16_t plen;
-	unsigned ver;
-	uint8_t next;
-
-	if(len < sizeof(*ip)){
-		op->malformed = 1;
-		diagnostic("%s malformed with %zu on %s",__func__,len,op->i->name);
-		return;
-	}
-	ver = ntohl(ip->ip6_ctlun.ip6_un1.ip6_un1_flow) >> 28u;
-	if(ver != 6){
-		op->noproto = 1;
-		diagnostic("%s noversion for %u on %s",__func__,ver,op->i->name);
-		return;
-	}
-	plen = ntohs(ip->ip6_ctlun.ip6_un1.ip6_un1_plen);
-	if(len < plen + sizeof(*ip)){
-		op->malformed = 1;
-		diagnostic("%s malformed with %zu < %zu on %s",__func__,len,plen + sizeof(*ip),op->i->name);
-		return;
-	}
-	memcpy(op->l3saddr,&ip->ip6_src,16);
-	memcpy(op->l3daddr,&ip->ip6_dst,16);
-	op->l3s = lookup_l3host(&op->tv,op->i,op->l2s,AF_INET6,&ip->ip6_src);
-	op->l3d = lookup_l3host(&op->tv,op->i,op->l2d,AF_INET6,&ip->ip6_dst);
-	// Don't just subtract payload length from frame length, since the
-	// frame might have been padded up to a minimum size.
-	const void *nhdr = (const char *)ip + sizeof(*ip);
-	next = ip->ip6_ctlun.ip6_un1.ip6_un1_nxt;
+// Dissect the chain of headers following the fixed IPv6 header. reassembled
+// is set if this is the payload of a reassembled datagram.
+static void
+handle_ipv6_payload(omphalos_packet *op,uint8_t next,const void *nhdr,uint16_t plen,
+				int reassembled){
 	while(nhdr){
+	if(next != IPPROTO_HOPOPTS && next != IPPROTO_FRAGMENT){
+		op->l4proto = next; // the chain ends here, barring error
+		op->l4src = op->l4dst = 0;
+	}
 	switch(next){ // "upper-level" protocols end the packet
 		case IPPROTO_TCP:{
 			handle_tcp_packet(op,nhdr,plen);
@@ -168,16 +147,37 @@ void handle_ipv6_packet(omphalos_packet *op,const void *frame,size_t len){
 			next = opt->ip6e_nxt;
 		break; }case IPPROTO_FRAGMENT:{
 			const struct ip6_frag *opt = nhdr;
+			unsigned off,more;
+			void *dgram;
+			size_t dlen;
 
 			if(plen < sizeof(*opt)){
 				op->malformed = 1;
 				diagnostic("%s malformed with len %d on %s",__func__,plen,op->i->name);
 				return;
 			}
+			if(reassembled){ // no fragments within fragments
+				op->malformed = 1;
+				diagnostic("%s nested fragment on %s",__func__,op->i->name);
+				return;
+			}
 			plen -= sizeof(*opt);
 			nhdr = (const char *)nhdr + sizeof(*opt);
 			next = opt->ip6f_nxt;
-			return; // FIXME reassemble fragments!
+			off = ntohs(opt->ip6f_offlg & IP6F_OFF_MASK);
+			more = !!(opt->ip6f_offlg & IP6F_MORE_FRAG);
+			if(off == 0 && !more){ // atomic fragment (RFC 6946)
+				break;
+			}
+			if(op->snapped){ // can't reassemble what wasn't captured
+				return;
+			}
+			dgram = ipfrag_add(op,next,ntohl(opt->ip6f_ident),off,more,nhdr,plen,&dlen);
+			if(dgram){
+				handle_ipv6_payload(op,next,dgram,dlen,1);
+				free(dgram);
+			}
+			return;
 		break; }default:{
 			op->noproto = 1;
 			diagnostic("%s %s noproto for %u",__func__,
@@ -187,57 +187,46 @@ void handle_ipv6_packet(omphalos_packet *op,const void *frame,size_t len){
 	}
 }
 
-void handle_ipv4_packet(omphalos_packet *op,const void *frame,size_t len){
-	const struct iphdr *ip = frame;
-	unsigned hlen;
+void handle_ipv6_packet(omphalos_packet *op,const void *frame,size_t len){
+	const struct ip6_hdr *ip = frame;
+	uint16_t plen;
+	unsigned ver;
+	uint8_t next;
 
 	if(len < sizeof(*ip)){
 		op->malformed = 1;
-		diagnostic("[%s] IPv4 malformed with %zu",op->i->name,len);
-		return;
-	}
-	hlen = ip->ihl << 2u;
-	if(len < hlen){
-		op->malformed = 1;
-		diagnostic("[%s] IPv4 malformed with %zu vs %u",op->i->name,len,hlen);
-		return;
-	}
-	if(!hlen){
-		op->malformed = 1;
-		diagnostic("[%s] IPv4 malformed with 0 hdrlen",op->i->name);
-		return;
-	}
-	if(ipv4_csum(frame)){
-		op->malformed = 1;
-		diagnostic("[%s] bad IPv4 checksum (%04hx)",op->i->name,ipv4_csum(frame));
+		diagnostic("%s malformed with %zu on %s",__func__,len,op->i->name);
 		return;
 	}
-	if(ip->version != 4){
+	ver = ntohl(ip->ip6_ctlun.ip6_un1.ip6_un1_flow) >> 28u;
+	if(ver != 6){
 		op->noproto = 1;
-		diagnostic("[%s] IPv4 noversion for %u",op->i->name,ip->version);
+		diagnostic("%s noversion for %u on %s",__func__,ver,op->i->name);
 		return;
 	}
-	// len can be greater than tot_len due to layer 2 padding requirements
-	if(len < ntohs(ip->tot_len)){
+	plen = ntohs(ip->ip6_ctlun.ip6_un1.ip6_un1_plen);
+	if(len < plen + sizeof(*ip) && op->snapped){
+		plen = len - sizeof(*ip); // analyze only what we captured
+	}else if(len < plen + sizeof(*ip)){
 		op->malformed = 1;
-		diagnostic("[%s] IPv4 tot_len malformed frame: %zu TLspec: %hu",
-				op->i->name,len,ntohs(ip->tot_len));
-		return;
-	}
-	memcpy(op->l3saddr,&ip->saddr,4);
-	memcpy(op->l3daddr,&ip->daddr,4);
-	op->l3s = lookup_l3host(&op->tv,op->i,op->l2s,AF_INET,&ip->saddr);
-	op->l3d = lookup_l3host(&op->tv,op->i,op->l2d,AF_INET,&ip->daddr);
-
-	// FIXME need reassemble fragments
-	if((ip->frag_off & __constant_ntohs(0x1f)) || (ip->frag_off & __constant_ntohs(0x20))){
+		diagnostic("%s malformed with %zu < %zu on %s",__func__,len,plen + sizeof(*ip),op->i->name);
 		return;
 	}
+	memcpy(op->l3saddr,&ip->ip6_src,16);
+	memcpy(op->l3daddr,&ip->ip6_dst,16);
+	op->l3s = lookup_l3host(&op->tv,op->i,op->l2s,AF_INET6,&ip->ip6_src);
+	op->l3d = lookup_l3host(&op->tv,op->i,op->l2d,AF_INET6,&ip->ip6_dst);
+	// Don't just subtract payload length from frame length, since the
+	// frame might have been padded up to a minimum size.
+	next = ip->ip6_ctlun.ip6_un1.ip6_un1_nxt;
+	handle_ipv6_payload(op,next,(const char *)ip + sizeof(*ip),plen,0);
+}
 
-	const void *nhdr = (const unsigned char *)frame + hlen;
-	const size_t nlen = ntohs(ip->tot_len) - hlen;
-
-	switch(ip->protocol){
+static void
+handle_ipv4_payload(omphalos_packet *op,unsigned proto,const void *nhdr,size_t nlen){
+	op->l4proto = proto;
+	op->l4src = op->l4dst = 0; // not those of any encapsulating packet
+	switch(proto){
 	case IPPROTO_TCP:{
 		handle_tcp_packet(op,nhdr,nlen);
 	break; }case IPPROTO_UDP:{
@@ -270,10 +259,80 @@ void handle_ipv4_packet(omphalos_packet *op,const void *frame,size_t len){
 		handle_ipv6_packet(op,nhdr,nlen);
 	break; }default:{
 		op->noproto = 1;
-		diagnostic("[%s] ipv4 noproto for %u",op->i->name,ip->protocol);
+		diagnostic("[%s] ipv4 noproto for %u",op->i->name,proto);
 	break; } }
 }
 
+static void
+handle_ipv4_fragment(omphalos_packet *op,const struct iphdr *ip,const void *frag,size_t len){
+	const unsigned fo = ntohs(ip->frag_off);
+	size_t dlen;
+	void *dgram;
+
+	if(op->snapped){ // can't reassemble what wasn't captured
+		return;
+	}
+	dgram = ipfrag_add(op,ip->protocol,ntohs(ip->id),(fo & IP_OFFMASK) * 8u,
+				!!(fo & IP_MF),frag,len,&dlen);
+	if(dgram){
+		handle_ipv4_payload(op,ip->protocol,dgram,dlen);
+		free(dgram);
+	}
+}
+
+void handle_ipv4_packet(omphalos_packet *op,const void *frame,size_t len){
+	const struct iphdr *ip = frame;
+	unsigned hlen;
+
+	if(len < sizeof(*ip)){
+		op->malformed = 1;
+		diagnostic("[%s] IPv4 malformed with %zu",op->i->name,len);
+		return;
+	}
+	hlen = ip->ihl << 2u;
+	if(len < hlen){
+		op->malformed = 1;
+		diagnostic("[%s] IPv4 malformed with %zu vs %u",op->i->name,len,hlen);
+		return;
+	}
+	if(!hlen){
+		op->malformed = 1;
+		diagnostic("[%s] IPv4 malformed with 0 hdrlen",op->i->name);
+		return;
+	}
+	if(ipv4_csum(frame)){
+		op->malformed = 1;
+		diagnostic("[%s] bad IPv4 checksum (%04hx)",op->i->name,ipv4_csum(frame));
+		return;
+	}
+	if(ip->version != 4){
+		op->noproto = 1;
+		diagnostic("[%s] IPv4 noversion for %u",op->i->name,ip->version);
+		return;
+	}
+	// len can be greater than tot_len due to layer 2 padding requirements,
+	// and less if we snapped the frame following the L4 header.
+	if(len < ntohs(ip->tot_len) && !op->snapped){
+		op->malformed = 1;
+		diagnostic("[%s] IPv4 tot_len malformed frame: %zu TLspec: %hu",
+				op->i->name,len,ntohs(ip->tot_len));
+		return;
+	}
+	memcpy(op->l3saddr,&ip->saddr,4);
+	memcpy(op->l3daddr,&ip->daddr,4);
+	op->l3s = lookup_l3host(&op->tv,op->i,op->l2s,AF_INET,&ip->saddr);
+	op->l3d = lookup_l3host(&op->tv,op->i,op->l2d,AF_INET,&ip->daddr);
+
+	const void *nhdr = (const unsigned char *)frame + hlen;
+	const size_t nlen = (len < ntohs(ip->tot_len) ? len : ntohs(ip->tot_len)) - hlen;
+
+	if(ip->frag_off & __constant_htons(IP_MF | IP_OFFMASK)){
+		handle_ipv4_fragment(op,ip,nhdr,nlen);
+		return;
+	}
+	handle_ipv4_payload(op,ip->protocol,nhdr,nlen);
+}
+
 // Doesn't set ->tot_len; that must be done by the caller. Prepare ->check for
 // checksum evaluation, but we cannot yet actually evaluate it (FIXME though we
 // could calculate differential).
@@ -0,0 +1,373 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <omphalos/diag.h>
+#include <omphalos/util.h>
+#include <omphalos/timing.h>
+#include <omphalos/ipfrag.h>
+#include <omphalos/omphalos.h>
+#include <omphalos/interface.h>
+
+#define IPFRAG_MAXDGRAM 65535	// largest payload the offset field can reach
+
+typedef struct fragpiece {
+	struct fragpiece *next;	// sorted by offset
+	unsigned off,len;
+	unsigned char data[];
+} fragpiece;
+
+typedef struct fragsrc {
+	struct fragsrc *next;	// hash chain
+	unsigned l3proto;
+	uint128_t addr;
+	size_t bytes;		// charged to this source's queues
+	unsigned queues;
+} fragsrc;
+
+typedef struct ipfragq {
+	struct ipfragq *next;	// hash chain
+	struct interface *i;	// owner, for the timer
+	fragsrc *src;
+	twtimer timer;		// expiry
+	unsigned l3proto,proto;
+	uint32_t id;
+	uint128_t saddr,daddr;
+	int sized;		// the final fragment has been seen...
+	unsigned total;		// ...making the payload this long
+	unsigned have;		// payload bytes held
+	unsigned pieces;
+	size_t bytes;		// charged to the interface and source
+	fragpiece *frags;
+} ipfragq;
+
+static uintmax_t frag_fragments;	// all of these are updated atomically
+static uintmax_t frag_reassembled;
+static uintmax_t frag_timeouts;
+static uintmax_t frag_overlaps;
+static uintmax_t frag_memdrops;
+
+static inline void
+stat_inc(uintmax_t *stat){
+	__atomic_add_fetch(stat,1,__ATOMIC_RELAXED);
+}
+
+static inline unsigned
+addr_hash(uint32_t h,const uint128_t a){
+	unsigned z;
+
+	for(z = 0 ; z < 4 ; ++z){
+		h = (h ^ a[z]) * 0x9e3779b1u;
+	}
+	return h;
+}
+
+static inline unsigned
+queue_bucket(unsigned l3proto,const uint128_t s,const uint128_t d,uint32_t id,unsigned proto){
+	uint32_t h = addr_hash(addr_hash(id ^ (proto << 16u) ^ l3proto,s),d);
+
+	return (h ^ (h >> 16u)) % IPFRAG_BUCKETS;
+}
+
+static inline unsigned
+src_bucket(unsigned l3proto,const uint128_t s){
+	uint32_t h = addr_hash(l3proto,s);
+
+	return (h ^ (h >> 16u)) % IPFRAG_BUCKETS;
+}
+
+static fragsrc *
+get_src(ipfrags *fc,unsigned l3proto,const uint128_t addr){
+	fragsrc **pfs = &fc->srcs[src_bucket(l3proto,addr)],*fs;
+
+	for(fs = *pfs ; fs ; fs = fs->next){
+		if(fs->l3proto == l3proto && equal128(fs->addr,addr)){
+			return fs;
+		}
+	}
+	if((fs = hostpool_get(&fc->srcpool,sizeof(*fs))) == NULL){
+		return NULL;
+	}
+	memset(fs,0,sizeof(*fs));
+	fs->l3proto = l3proto;
+	memcpy(fs->addr,addr,sizeof(fs->addr));
+	fs->next = *pfs;
+	*pfs = fs;
+	return fs;
+}
+
+static void
+put_src(ipfrags *fc,fragsrc *fs){
+	fragsrc **pfs;
+
+	if(fs->queues){
+		return;
+	}
+	pfs = &fc->srcs[src_bucket(fs->l3proto,fs->addr)];
+	while(*pfs != fs){
+		pfs = &(*pfs)->next;
+	}
+	*pfs = fs->next;
+	hostpool_put(&fc->srcpool,fs);
+}
+
+// Can n more bytes be charged to the queue's source?
+static inline int
+can_charge(const ipfrags *fc,const fragsrc *fs,size_t n){
+	return fc->bytes + n <= IPFRAG_MAXBYTES && fs->bytes + n <= IPFRAG_SRCBYTES;
+}
+
+static inline void
+charge(ipfrags *fc,ipfragq *q,size_t n){
+	fc->bytes += n;
+	q->src->bytes += n;
+	q->bytes += n;
+}
+
+// Unlink and free the queue. Its timer must already be unscheduled.
+static void
+free_queue(ipfrags *fc,ipfragq *q){
+	ipfragq **pq = &fc->queues[queue_bucket(q->l3proto,q->saddr,q->daddr,q->id,q->proto)];
+	fragpiece *fp;
+
+	while(*pq != q){
+		pq = &(*pq)->next;
+	}
+	*pq = q->next;
+	while( (fp = q->frags) ){
+		q->frags = fp->next;
+		free(fp);
+	}
+	fc->bytes -= q->bytes;
+	q->src->bytes -= q->bytes;
+	--q->src->queues;
+	put_src(fc,q->src);
+	hostpool_put(&fc->qpool,q);
+}
+
+static void
+drop_queue(ipfrags *fc,ipfragq *q){
+	cancel_timer(&q->i->timers,&q->timer);
+	free_queue(fc,q);
+}
+
+static int
+expire_queue(const struct timeval *now,struct timeval *resched,void *arg){
+	ipfragq *q = arg;
+
+	(void)now;
+	(void)resched;
+	stat_inc(&frag_timeouts);
+	free_queue(&q->i->frags,q);
+	return 0;
+}
+
+static ipfragq *
+lookup_queue(ipfrags *fc,const omphalos_packet *op,uint32_t id,unsigned proto){
+	ipfragq *q;
+
+	q = fc->queues[queue_bucket(op->l3proto,op->l3saddr,op->l3daddr,id,proto)];
+	while(q){
+		if(q->id == id && q->proto == proto && q->l3proto == op->l3proto &&
+				equal128(q->saddr,op->l3saddr) && equal128(q->daddr,op->l3daddr)){
+			return q;
+		}
+		q = q->next;
+	}
+	return NULL;
+}
+
+static ipfragq *
+create_queue(ipfrags *fc,omphalos_packet *op,uint32_t id,unsigned proto){
+	struct timeval tv;
+	ipfragq **pq;
+	fragsrc *fs;
+	ipfragq *q;
+
+	if((fs = get_src(fc,op->l3proto,op->l3saddr)) == NULL){
+		return NULL;
+	}
+	if(!can_charge(fc,fs,sizeof(*q))){
+		stat_inc(&frag_memdrops);
+		put_src(fc,fs);
+		return NULL;
+	}
+	if((q = hostpool_get(&fc->qpool,sizeof(*q))) == NULL){
+		put_src(fc,fs);
+		return NULL;
+	}
+	memset(q,0,sizeof(*q));
+	q->i = op->i;
+	q->src = fs;
+	++fs->queues;
+	q->l3proto = op->l3proto;
+	q->proto = proto;
+	q->id = id;
+	memcpy(q->saddr,op->l3saddr,sizeof(q->saddr));
+	memcpy(q->daddr,op->l3daddr,sizeof(q->daddr));
+	charge(fc,q,sizeof(*q));
+	pq = &fc->queues[queue_bucket(q->l3proto,q->saddr,q->daddr,id,proto)];
+	q->next = *pq;
+	*pq = q;
+	twheel_now(&op->i->timers,&tv);
+	tv.tv_sec += IPFRAG_TIMEOUT_SECS;
+	schedule_timer(&op->i->timers,&q->timer,&tv,expire_queue,q);
+	return q;
+}
+
+// Copy the complete datagram out, and free its queue.
+static void *
+assemble_queue(ipfrags *fc,ipfragq *q,size_t *dlen){
+	const fragpiece *fp;
+	unsigned char *buf;
+
+	// A final fragment with no payload at offset 0 makes for an empty
+	// datagram; keep Malloc() from seeing 0.
+	if( (buf = Malloc(q->total ? q->total : 1)) ){
+		for(fp = q->frags ; fp ; fp = fp->next){
+			memcpy(buf + fp->off,fp->data,fp->len);
+		}
+		*dlen = q->total;
+		stat_inc(&frag_reassembled);
+	}
+	drop_queue(fc,q);
+	return buf;
+}
+
+void *ipfrag_add(omphalos_packet *op,unsigned proto,uint32_t id,unsigned off,
+			int more,const void *frag,size_t len,size_t *dlen){
+	ipfrags *fc = &op->i->frags;
+	fragpiece **pfp,*fp;
+	ipfragq *q;
+
+	stat_inc(&frag_fragments);
+	// Only the final fragment may be of a length other than a multiple
+	// of 8, and only it may be empty.
+	if(off + len > IPFRAG_MAXDGRAM || (more && (len == 0 || len % 8))){
+		diagnostic("[%s] invalid %zub fragment at %u",op->i->name,len,off);
+		op->malformed = 1;
+		return NULL;
+	}
+	if(fc->queues == NULL){
+		if((fc->queues = Malloc(sizeof(*fc->queues) * IPFRAG_BUCKETS)) == NULL){
+			return NULL;
+		}
+		if((fc->srcs = Malloc(sizeof(*fc->srcs) * IPFRAG_BUCKETS)) == NULL){
+			free(fc->queues);
+			fc->queues = NULL;
+			return NULL;
+		}
+		memset(fc->queues,0,sizeof(*fc->queues) * IPFRAG_BUCKETS);
+		memset(fc->srcs,0,sizeof(*fc->srcs) * IPFRAG_BUCKETS);
+	}
+	if((q = lookup_queue(fc,op,id,proto)) == NULL){
+		if((q = create_queue(fc,op,id,proto)) == NULL){
+			return NULL;
+		}
+	}
+	// Nothing may extend past the final fragment, nor may it move
+	if((q->sized && off + len > q->total) || (!more && q->sized && off + len != q->total)){
+		goto inconsistent;
+	}
+	for(pfp = &q->frags ; (fp = *pfp) && fp->off < off ; pfp = &fp->next){
+		if(fp->off + fp->len > off){
+			goto inconsistent;
+		}
+	}
+	if(fp && fp->off == off && fp->len == len){
+		return NULL; // a duplicate, presumably retransmitted
+	}
+	if(fp && off + len > fp->off){
+		goto inconsistent;
+	}
+	if(!more){
+		const fragpiece *last;
+
+		for(last = fp ; last && last->next ; last = last->next){
+			;
+		}
+		if(last && last->off + last->len > off + len){
+			goto inconsistent;
+		}
+	}
+	if(q->pieces == IPFRAG_MAXPIECES || !can_charge(fc,q->src,sizeof(*fp) + len)){
+		stat_inc(&frag_memdrops);
+		drop_queue(fc,q);
+		return NULL;
+	}
+	if((fp = Malloc(sizeof(*fp) + len)) == NULL){
+		return NULL;
+	}
+	fp->off = off;
+	fp->len = len;
+	memcpy(fp->data,frag,len);
+	fp->next = *pfp;
+	*pfp = fp;
+	charge(fc,q,sizeof(*fp) + len);
+	++q->pieces;
+	q->have += len;
+	if(!more){
+		q->sized = 1;
+		q->total = off + len;
+	}
+	// Pieces are disjoint and within total, so this means no holes remain
+	if(q->sized && q->have == q->total){
+		return assemble_queue(fc,q,dlen);
+	}
+	return NULL;
+
+inconsistent:
+	diagnostic("[%s] overlapping fragment (%zub at %u)",op->i->name,len,off);
+	stat_inc(&frag_overlaps);
+	op->malformed = 1;
+	drop_queue(fc,q);
+	return NULL;
+}
+
+void cleanup_ipfrags(interface *i){
+	ipfrags *fc = &i->frags;
+	unsigned z;
+
+	if(fc->queues){
+		for(z = 0 ; z < IPFRAG_BUCKETS ; ++z){
+			while(fc->queues[z]){
+				drop_queue(fc,fc->queues[z]);
+			}
+		}
+	}
+	free(fc->queues);
+	free(fc->srcs);
+	hostpool_destroy(&fc->qpool);
+	hostpool_destroy(&fc->srcpool);
+	memset(fc,0,sizeof(*fc));
+}
+
+void ipfrag_stats(ipfragstats *fs){
+	fs->fragments = __atomic_load_n(&frag_fragments,__ATOMIC_RELAXED);
+	fs->reassembled = __atomic_load_n(&frag_reassembled,__ATOMIC_RELAXED);
+	fs->timeouts = __atomic_load_n(&frag_timeouts,__ATOMIC_RELAXED);
+	fs->overlaps = __atomic_load_n(&frag_overlaps,__ATOMIC_RELAXED);
+	fs->memdrops = __atomic_load_n(&frag_memdrops,__ATOMIC_RELAXED);
+}
+
+#define STAT(fp,st,x) if((st)->x) { if(fprintf((fp),"<"#x">%ju</"#x">",(uintmax_t)(st)->x) < 0){ return -1; } }
+int print_ipfrag_stats(FILE *fp){
+	ipfragstats fs;
+
+	ipfrag_stats(&fs);
+	if(fs.fragments == 0){
+		return 0;
+	}
+	if(fprintf(fp,"<ipfrags>") < 0){
+		return -1;
+	}
+	STAT(fp,&fs,fragments);
+	STAT(fp,&fs,reassembled);
+	STAT(fp,&fs,timeouts);
+	STAT(fp,&fs,overlaps);
+	STAT(fp,&fs,memdrops);
+	if(fprintf(fp,"</ipfrags>") < 0){
+		return -1;
+	}
+	return 0;
+}
+#undef STAT
@@ -0,0 +1,71 @@
+#ifndef OMPHALOS_IPFRAG
+#define OMPHALOS_IPFRAG
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <omphalos/pool.h>
+
+struct interface;
+struct omphalos_packet;
+
+// IPv4 and IPv6 fragment reassembly. Unfragmented datagrams never reach this
+// code, and are dissected in place. Fragments are copied into a queue keyed
+// by (source, destination, identification, protocol); once a queue holds the
+// entire datagram, it's assembled into a single buffer and handed back for
+// dissection. Queues are discarded IPFRAG_TIMEOUT_SECS after their first
+// fragment, via the interface's timing wheel.
+//
+// Memory is bounded per interface (IPFRAG_MAXBYTES) and per source address
+// (IPFRAG_SRCBYTES), so that no one host can monopolize the cache. Fragments
+// which would exceed either are dropped, along with their queue. Fragments
+// overlapping another of their datagram (other than exact duplicates) are
+// likewise taken to be hostile (RFC 5722), and cost the entire datagram.
+// Everything is protected by the interface lock.
+
+#define IPFRAG_MAXBYTES		(4u << 20u)	// per interface
+#define IPFRAG_SRCBYTES		(256u << 10u)	// per source address
+#define IPFRAG_MAXPIECES	64		// fragments per datagram
+#define IPFRAG_TIMEOUT_SECS	30
+#define IPFRAG_BUCKETS		256		// hash chains of each table
+
+struct ipfragq;
+struct fragsrc;
+
+typedef struct ipfrags {
+	struct ipfragq **queues;	// allocated upon the first fragment
+	struct fragsrc **srcs;		// per-source accounting
+	size_t bytes;			// charged across all queues
+	hostpool qpool,srcpool;
+} ipfrags;
+
+typedef struct ipfragstats {
+	uintmax_t fragments;	// fragments seen
+	uintmax_t reassembled;	// datagrams completed
+	uintmax_t timeouts;	// queues discarded on expiry
+	uintmax_t overlaps;	// ...on overlapping or inconsistent fragments
+	uintmax_t memdrops;	// ...on exceeding a memory limit
+} ipfragstats;
+
+// Add a fragment of the datagram, from the packet's source to its
+// destination. off is in bytes; more is the More Fragments flag. Returns the
+// reassembled payload (to be free()d by the caller) and its length if this
+// completed the datagram, or NULL. The packet is marked malformed if the
+// fragment is. Call with the interface lock held, and op's L3 fields set.
+void *ipfrag_add(struct omphalos_packet *,unsigned,uint32_t,unsigned,int,
+			const void *,size_t,size_t *);
+
+// Free all of an interface's queues. Must precede destruction of its wheel.
+void cleanup_ipfrags(struct interface *);
+
+void ipfrag_stats(ipfragstats *);
+int print_ipfrag_stats(FILE *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
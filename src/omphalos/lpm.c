@@ -0,0 +1,425 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <omphalos/lpm.h>
+#include <omphalos/util.h>
+
+#define LPM_STRIDE 8
+#define LPM_FANOUT (1u << LPM_STRIDE)
+#define LPM_WORDS (LPM_FANOUT / 64)
+#define LPM_MAXDEPTH (LPM_MAXBITS / LPM_STRIDE)
+#define LPM_RETIRE_BATCH 64	// retired nodes which trigger lpm_synchronize()
+
+// A prefix rooted within a node: its final 'len' (1..LPM_STRIDE) bits are the
+// high bits 'bits' of this node's key byte.
+typedef struct lpmprefix {
+	struct lpmprefix *next;
+	void *val;
+	unsigned char bits,len;
+} lpmprefix;
+
+// Entry e has a child iff bit e of kidmap is set; that child is slots[] at
+// the number of kidmap bits below e. Entry e's value (the longest prefix
+// rooted here covering it, possibly NULL) belongs to the run containing e,
+// whose value is slots[nkids + number of runmap bits at or below e - 1].
+// Entry 0 always begins a run. The bases hold the bits set in all earlier
+// words, so a rank is one popcount. Only the maps, bases, nkids and slots
+// are read by lookups; the rest is writer state. Once published, a node's
+// lookup state is never modified.
+typedef struct lpmnode {
+	uint64_t kidmap[LPM_WORDS];
+	uint64_t runmap[LPM_WORDS];
+	uint16_t kidbase[LPM_WORDS];
+	uint16_t runbase[LPM_WORDS];
+	uint16_t nkids,nruns;
+	unsigned slotcap;		// slots allocated
+	union {
+		lpmprefix *prefixes;	// all prefixes rooted here, shortest first
+		struct lpmnode *retired;// next retired node, once replaced
+	};
+	union {
+		struct lpmnode *kid;
+		void *val;
+	} slots[];			// nkids children, then nruns values
+} lpmnode;
+
+// Bits of the map set at or below bit e
+static inline unsigned
+lpm_rank(const uint64_t *map,const uint16_t *base,unsigned e){
+	return base[e / 64] + __builtin_popcountll(map[e / 64] & ((2ull << (e % 64)) - 1));
+}
+
+static inline int
+lpm_haskid(const lpmnode *n,unsigned e){
+	return (n->kidmap[e / 64] >> (e % 64)) & 1;
+}
+
+static inline lpmnode **
+lpm_kidloc(lpmnode *n,unsigned e){
+	return &n->slots[lpm_rank(n->kidmap,n->kidbase,e) - 1].kid;
+}
+
+static inline void *
+lpm_val(const lpmnode *n,unsigned e){
+	return n->slots[n->nkids + lpm_rank(n->runmap,n->runbase,e) - 1].val;
+}
+
+static inline size_t
+lpm_node_size(const lpmnode *n){
+	return sizeof(*n) + sizeof(*n->slots) * n->slotcap;
+}
+
+static void
+lpm_pack(lpmnode *n,lpmnode * const *kids,void * const *vals,unsigned nkids){
+	unsigned e,k,r;
+
+	memset(n->kidmap,0,sizeof(n->kidmap));
+	memset(n->runmap,0,sizeof(n->runmap));
+	for(k = 0, r = nkids, e = 0 ; e < LPM_FANOUT ; ++e){
+		if(e % 64 == 0){
+			n->kidbase[e / 64] = k;
+			n->runbase[e / 64] = r - nkids;
+		}
+		if(kids[e]){
+			n->kidmap[e / 64] |= 1ull << (e % 64);
+			n->slots[k++].kid = kids[e];
+		}
+		if(e == 0 || vals[e] != vals[e - 1]){
+			n->runmap[e / 64] |= 1ull << (e % 64);
+			n->slots[r++].val = vals[e];
+		}
+	}
+	n->nkids = k;
+	n->nruns = r - nkids;
+}
+
+// Retire a node which is no longer reachable by new lookups. Its prefixes (if
+// any) must have passed to its replacement.
+static void
+lpm_retire(lpmtrie *t,lpmnode *n){
+	n->retired = t->retired;
+	t->retired = n;
+	++t->nretired;
+}
+
+// Replace the node at *np (creating an empty one if *np is NULL) with one
+// built from its prefix list, setting the child at entry e to 'kid' (possibly
+// NULL) if e is less than LPM_FANOUT. The replacement is fully initialized
+// before it's published with a release store, and the old node is retired.
+// Returns -1 on allocation failure, leaving the node in place.
+static int
+lpm_rebuild(lpmtrie *t,lpmnode **np,unsigned e,lpmnode *kid){
+	lpmnode *kids[LPM_FANOUT];
+	void *vals[LPM_FANOUT];
+	unsigned z,nkids,nruns;
+	const lpmprefix *p;
+	lpmnode *o,*n;
+	size_t s;
+
+	memset(kids,0,sizeof(kids));
+	memset(vals,0,sizeof(vals));
+	if( (o = *np) ){
+		for(nkids = z = 0 ; z < LPM_FANOUT ; ++z){
+			if(lpm_haskid(o,z)){
+				kids[z] = o->slots[nkids++].kid;
+			}
+		}
+		// Shorter prefixes come first, and are painted over by longer ones.
+		for(p = o->prefixes ; p ; p = p->next){
+			unsigned first = p->bits << (LPM_STRIDE - p->len);
+
+			for(z = first ; z < first + (1u << (LPM_STRIDE - p->len)) ; ++z){
+				vals[z] = p->val;
+			}
+		}
+	}
+	if(e < LPM_FANOUT){
+		kids[e] = kid;
+	}
+	for(nkids = nruns = z = 0 ; z < LPM_FANOUT ; ++z){
+		if(kids[z]){
+			++nkids;
+		}
+		if(z == 0 || vals[z] != vals[z - 1]){
+			++nruns;
+		}
+	}
+	s = sizeof(*n) + sizeof(*n->slots) * (nkids + nruns);
+	if((n = Malloc(s)) == NULL){
+		return -1;
+	}
+	t->bytes += s;
+	n->slotcap = nkids + nruns;
+	n->prefixes = o ? o->prefixes : NULL;
+	lpm_pack(n,kids,vals,nkids);
+	__atomic_store_n(np,n,__ATOMIC_RELEASE);
+	if(o){
+		lpm_retire(t,o);
+	}
+	return 0;
+}
+
+static void
+lpm_maybe_synchronize(lpmtrie *t){
+	if(t->nretired >= LPM_RETIRE_BATCH){
+		lpm_synchronize(t);
+	}
+}
+
+// Find the node in which the nonzero-length prefix is rooted, optionally
+// creating it and any missing ancestors, and return the location of the
+// pointer to it. On return, *k points to the key byte within the node, and
+// *plen is the prefix length remaining within it.
+static lpmnode **
+lpm_node_for(lpmtrie *t,const unsigned char **k,unsigned *plen,int create){
+	lpmnode **np = &t->root;
+	lpmnode *kid;
+	unsigned e;
+
+	for( ; ; ){
+		if(*np == NULL){
+			if(!create || lpm_rebuild(t,np,LPM_FANOUT,NULL)){
+				return NULL;
+			}
+		}
+		if(*plen <= LPM_STRIDE){
+			return np;
+		}
+		e = **k;
+		if(!lpm_haskid(*np,e)){
+			if(!create){
+				return NULL;
+			}
+			kid = NULL;
+			if(lpm_rebuild(t,&kid,LPM_FANOUT,NULL)){
+				return NULL;
+			}
+			if(lpm_rebuild(t,np,e,kid)){
+				t->bytes -= lpm_node_size(kid);
+				free(kid);
+				return NULL;
+			}
+		}
+		*plen -= LPM_STRIDE;
+		++*k;
+		np = lpm_kidloc(*np,e);
+	}
+}
+
+void *lpm_insert(lpmtrie *t,const void *key,unsigned plen,void *val){
+	const unsigned char *k = key;
+	lpmprefix *p,**pp;
+	lpmnode **np;
+	unsigned bits;
+
+	if(plen == 0){
+		if(t->defval == NULL){
+			__atomic_store_n(&t->defval,val,__ATOMIC_RELEASE);
+		}
+		return t->defval;
+	}
+	if(plen > LPM_MAXBITS){
+		return NULL;
+	}
+	if((np = lpm_node_for(t,&k,&plen,1)) == NULL){
+		return NULL;
+	}
+	bits = *k >> (LPM_STRIDE - plen);
+	for(pp = &(*np)->prefixes ; (p = *pp) && p->len <= plen ; pp = &p->next){
+		if(p->len == plen && p->bits == bits){
+			return p->val;
+		}
+	}
+	if((p = Malloc(sizeof(*p))) == NULL){
+		return NULL;
+	}
+	p->val = val;
+	p->bits = bits;
+	p->len = plen;
+	p->next = *pp;
+	*pp = p;
+	if(lpm_rebuild(t,np,LPM_FANOUT,NULL)){
+		*pp = p->next;
+		free(p);
+		return NULL;
+	}
+	t->bytes += sizeof(*p);
+	lpm_maybe_synchronize(t);
+	return val;
+}
+
+void *lpm_remove(lpmtrie *t,const void *key,unsigned plen){
+	lpmnode **path[LPM_MAXDEPTH];
+	const unsigned char *k = key;
+	unsigned bits,depth;
+	lpmprefix *p,**pp;
+	lpmnode **np,*n;
+	void *val;
+
+	if(plen == 0){
+		val = t->defval;
+		__atomic_store_n(&t->defval,NULL,__ATOMIC_RELEASE);
+		return val;
+	}
+	if(plen > LPM_MAXBITS){
+		return NULL;
+	}
+	np = &t->root;
+	for(depth = 0 ; ; ++depth){
+		if(*np == NULL){
+			return NULL;
+		}
+		path[depth] = np;
+		if(plen <= LPM_STRIDE){
+			break;
+		}
+		if(!lpm_haskid(*np,k[depth])){
+			return NULL;
+		}
+		np = lpm_kidloc(*np,k[depth]);
+		plen -= LPM_STRIDE;
+	}
+	bits = k[depth] >> (LPM_STRIDE - plen);
+	for(pp = &(*np)->prefixes ; (p = *pp) ; pp = &p->next){
+		if(p->len == plen && p->bits == bits){
+			break;
+		}
+	}
+	if(p == NULL){
+		return NULL;
+	}
+	*pp = p->next;
+	if(lpm_rebuild(t,np,LPM_FANOUT,NULL)){
+		*pp = p;
+		return NULL;
+	}
+	val = p->val;
+	free(p);
+	t->bytes -= sizeof(*p);
+	// Prune nodes left with neither prefixes nor children. The locations
+	// in path[] remain valid, since each is within a node we've yet to
+	// replace. Should we fail to allocate a parent's replacement, the empty
+	// node is merely left in place.
+	while((n = *path[depth])->prefixes == NULL && n->nkids == 0){
+		if(depth == 0){
+			__atomic_store_n(&t->root,NULL,__ATOMIC_RELEASE);
+		}else if(lpm_rebuild(t,path[depth - 1],k[depth - 1],NULL)){
+			break;
+		}
+		lpm_retire(t,n);
+		if(depth-- == 0){
+			break;
+		}
+	}
+	lpm_maybe_synchronize(t);
+	return val;
+}
+
+void *lpm_find(const lpmtrie *t,const void *key,unsigned plen){
+	const unsigned char *k = key;
+	const lpmprefix *p;
+	lpmnode **np;
+	unsigned bits;
+
+	if(plen == 0){
+		return t->defval;
+	}
+	if(plen > LPM_MAXBITS){
+		return NULL;
+	}
+	if((np = lpm_node_for((lpmtrie *)t,&k,&plen,0)) == NULL){
+		return NULL;
+	}
+	bits = *k >> (LPM_STRIDE - plen);
+	for(p = (*np)->prefixes ; p ; p = p->next){
+		if(p->len == plen && p->bits == bits){
+			return p->val;
+		}
+	}
+	return NULL;
+}
+
+unsigned lpm_read_begin(lpmtrie *t){
+	unsigned e;
+
+	// Should lpm_synchronize() advance the epoch between our load and our
+	// increment, it might not have seen us; back out and try the new epoch.
+	for( ; ; ){
+		e = __atomic_load_n(&t->epoch,__ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&t->readers[e % 2],1,__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&t->epoch,__ATOMIC_SEQ_CST) == e){
+			return e;
+		}
+		__atomic_sub_fetch(&t->readers[e % 2],1,__ATOMIC_SEQ_CST);
+	}
+}
+
+void lpm_read_end(lpmtrie *t,unsigned e){
+	__atomic_sub_fetch(&t->readers[e % 2],1,__ATOMIC_RELEASE);
+}
+
+// Lookups begun after the epoch advances can't reach nodes retired before it
+// did, so once those counted against the old epoch have ended, the retired
+// nodes are unreachable. Lookups are short, so we just yield until then.
+void lpm_synchronize(lpmtrie *t){
+	unsigned e = t->epoch;
+	lpmnode *n;
+
+	__atomic_store_n(&t->epoch,e + 1,__ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&t->readers[e % 2],__ATOMIC_SEQ_CST)){
+		sched_yield();
+	}
+	while( (n = t->retired) ){
+		t->retired = n->retired;
+		t->bytes -= lpm_node_size(n);
+		free(n);
+	}
+	t->nretired = 0;
+}
+
+// Children only exist beneath prefixes no longer than the key, so we can't
+// run off the end of it.
+void *lpm_lookup(const lpmtrie *t,const void *key){
+	const unsigned char *k = key;
+	const lpmnode *n;
+	void *best,*v;
+
+	best = __atomic_load_n(&t->defval,__ATOMIC_ACQUIRE);
+	for(n = __atomic_load_n(&t->root,__ATOMIC_ACQUIRE) ; n ; ++k){
+		if( (v = lpm_val(n,*k)) ){
+			best = v;
+		}
+		if(!lpm_haskid(n,*k)){
+			break;
+		}
+		n = __atomic_load_n(&n->slots[lpm_rank(n->kidmap,n->kidbase,*k) - 1].kid,
+					__ATOMIC_ACQUIRE);
+	}
+	return best;
+}
+
+static void
+free_lpmnode(lpmnode *n){
+	lpmprefix *p;
+	unsigned z;
+
+	for(z = 0 ; z < n->nkids ; ++z){
+		free_lpmnode(n->slots[z].kid);
+	}
+	while( (p = n->prefixes) ){
+		n->prefixes = p->next;
+		free(p);
+	}
+	free(n);
+}
+
+void lpm_destroy(lpmtrie *t){
+	lpm_synchronize(t);
+	if(t->root){
+		free_lpmnode(t->root);
+		t->root = NULL;
+	}
+	t->defval = NULL;
+	t->bytes = 0;
+}
@@ -0,0 +1,82 @@
+#ifndef OMPHALOS_LPM
+#define OMPHALOS_LPM
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+// Longest-prefix-match over network byte-order keys (IPv4 and IPv6 routes),
+// via a multibit trie of 8-bit strides (see Varghese's "Network Algorithmics"
+// sec 11.8). Each node expands the prefixes rooted within it across its 256
+// entries, so a lookup touches at most one node per key byte.
+//
+// Nodes are stored compressed, after Asai and Ohara's Poptrie: a bitmap
+// marks which entries have children, and another which entries begin a run
+// of entries sharing a value. Children and per-run values are packed into a
+// single array, indexed by the popcount of the bitmap below the entry. A
+// node thus costs a few words per child and per distinct run, rather than
+// three 256-entry arrays.
+//
+// Lookups may run concurrently with a single writer. Writers must be
+// serialized by the caller. A writer never modifies a reachable node;
+// it builds a replacement and publishes it with a release store. Replaced
+// nodes are retired rather than freed. Lookups which don't otherwise exclude
+// writers must be bracketed by lpm_read_begin() and lpm_read_end(), which
+// take no locks. Retired nodes are freed once every lookup begun before their
+// retirement has ended (lpm_synchronize()), which writers do every so often.
+// Values removed via lpm_remove() might still be returned to a concurrent
+// lookup, and must not be freed until such lookups are known to have ended.
+//
+// A zero-initialized lpmtrie is valid and empty. A given trie must only
+// ever be used with keys of a single length, of at most LPM_MAXBITS bits.
+#define LPM_MAXBITS 128
+
+struct lpmnode;
+
+typedef struct lpmtrie {
+	void *defval;		// value of the zero-length prefix
+	struct lpmnode *root;
+	struct lpmnode *retired;	// replaced, awaiting lpm_synchronize()
+	unsigned nretired;
+	unsigned epoch;		// advanced by lpm_synchronize()
+	unsigned readers[2];	// lookups in progress, by epoch parity
+	size_t bytes;		// heap held by nodes (retired too) and prefixes
+} lpmtrie;
+
+// Associate 'val' with the prefix of 'plen' bits of 'key'. If the prefix is
+// already present, it is unchanged, and its existing value is returned.
+// Returns NULL on allocation failure, or if the prefix is too long.
+void *lpm_insert(lpmtrie *,const void *,unsigned,void *)
+			__attribute__ ((nonnull (1,2,4)));
+
+// Remove the prefix, returning its value. Returns NULL if it was not present,
+// or on allocation failure, in which case the prefix remains.
+void *lpm_remove(lpmtrie *,const void *,unsigned) __attribute__ ((nonnull (1,2)));
+
+// Value of exactly this prefix, or NULL. For use by the writer.
+void *lpm_find(const lpmtrie *,const void *,unsigned) __attribute__ ((nonnull (1,2)));
+
+// Value of the longest prefix matching the key, or NULL.
+void *lpm_lookup(const lpmtrie *,const void *) __attribute__ ((nonnull (1,2)));
+
+// Begin a lock-free lookup, returning a token for lpm_read_end().
+unsigned lpm_read_begin(lpmtrie *) __attribute__ ((nonnull (1)));
+
+// End the lock-free lookup begun with the token.
+void lpm_read_end(lpmtrie *,unsigned) __attribute__ ((nonnull (1)));
+
+// Wait for lookups begun before the call to end, and free retired nodes. For
+// use by the writer.
+void lpm_synchronize(lpmtrie *) __attribute__ ((nonnull (1)));
+
+// Free all nodes, including retired ones. No lookups may be in progress.
+// Values are not freed.
+void lpm_destroy(lpmtrie *) __attribute__ ((nonnull (1)));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,6 +7,8 @@
 #include <omphalos/util.h>
 #include <omphalos/diag.h>
 #include <omphalos/ietf.h>
+#include <omphalos/pool.h>
+#include <omphalos/probe.h>
 #include <omphalos/route.h>
 #include <omphalos/resolv.h>
 #include <omphalos/service.h>
@@ -19,6 +21,8 @@
 // Don't want to backoff name resolution attempts to more than 2^9s or so.
 #define MAX_BACKOFF_EXP		9
 
+#define L3INDEX_MINSIZE		64
+
 typedef struct l3host {
 	wchar_t *name;
 	int fam;	// FIXME kill determine from addr relative to arenas
@@ -34,13 +38,16 @@ typedef struct l3host {
 	time_t nextnametry;	// next time we can attempt name resolution
 	unsigned nametries;	// number of times we've tried name resolution
 	struct l4srv *services;	// services observed providing
-	struct l3host *next;	// next within the interface
+	// LRU list within the interface, most recently used first. The head's
+	// prev is the tail.
+	struct l3host *next,*prev;
 	struct l2host *l2;	// FIXME we only keep the most recent l2host
 				// seen with this address. ought keep all, or
 				// at the very least one per interface...
+	struct l3host *l2next,**l2pprev; // list of l3hosts sharing our l2
 	void *opaque;		// UI state
-	struct l3host *gnext;	// next globally
 	pthread_mutex_t nlock;	// naming lock
+	interface *iface;	// owner, whose lock protects us
 } l3host;
 
 static l3host external_l3 = {
@@ -49,19 +56,30 @@ static l3host external_l3 = {
 	.nosrvs = 1,
 }; // FIXME augh
 
+// The global map is striped, each stripe being an independently-locked
+// l3index. The stripe is chosen from the low bits of the hash, and the slot
+// within it from the high bits, so threads working different addresses
+// rarely contend.
+#define GLOBAL_STRIPES 64
+
 static struct globalhosts {
-	struct l3host *head;
-	pthread_mutex_t lock;
-	size_t addrlen;
-} ipv4hosts = {
-	.head = NULL,
-	.lock = PTHREAD_MUTEX_INITIALIZER,
-	.addrlen = 4,
-},ipv6hosts = {
-	.head = NULL,
-	.lock = PTHREAD_MUTEX_INITIALIZER,
-	.addrlen = 16,
-};
+	struct globalstripe {
+		l3index idx;
+		pthread_mutex_t lock;
+	} stripes[GLOBAL_STRIPES];
+} ipv4hosts,ipv6hosts;
+
+static pthread_once_t globalhosts_once = PTHREAD_ONCE_INIT;
+
+static void
+init_globalhosts(void){
+	unsigned z;
+
+	for(z = 0 ; z < GLOBAL_STRIPES ; ++z){
+		pthread_mutex_init(&ipv4hosts.stripes[z].lock,NULL);
+		pthread_mutex_init(&ipv6hosts.stripes[z].lock,NULL);
+	}
+}
 
 // RFC 3513 notes :: (all zeros) to be the "unspecified" address. It ought
 // never appear as a destination address.
@@ -77,48 +95,175 @@ static l3host unspecified_ipv4 = {
 	.nosrvs = 1,
 };
 
-static inline struct globalhosts *
-get_global_hosts(int fam){
-	struct globalhosts *ret;
+static inline size_t
+l3addrlen(int fam){
+	switch(fam){
+		case AF_INET: return 4;
+		case AF_INET6: return 16;
+		case AF_BSSID: return ETH_ALEN;
+	}
+	return 0;
+}
+
+// Fold the address into 64 bits, and mix thoroughly: the interesting bits of
+// an IPv4 address are at the bottom, while IPv6 varies mostly in the IID.
+static inline uint64_t
+l3hash(const void *addr,size_t len){
+	uint64_t h = 0,w;
+	size_t z;
+
+	for(z = 0 ; z < len ; z += sizeof(w)){
+		w = 0;
+		memcpy(&w,(const char *)addr + z,len - z < sizeof(w) ? len - z : sizeof(w));
+		h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+	}
+	return h ^ (h >> 29u);
+}
+
+static inline unsigned
+l3index_slot(const l3index *idx,uint64_t hash){
+	return (unsigned)(hash >> 32u) & (idx->size - 1);
+}
+
+// The table must have a free slot.
+static void
+l3index_insert(l3index *idx,l3host *l3,uint64_t hash){
+	unsigned s;
+
+	s = l3index_slot(idx,hash);
+	while(idx->slots[s]){
+		s = (s + 1) & (idx->size - 1);
+	}
+	idx->slots[s] = l3;
+	++idx->count;
+}
+
+// Ensure there's room for one more entry, keeping the load under 1/2.
+static int
+l3index_reserve(l3index *idx){
+	l3host **old = idx->slots;
+	unsigned oldsize = idx->size,s;
+
+	if((idx->count + 1) * 2 <= idx->size){
+		return 0;
+	}
+	idx->size = oldsize ? oldsize * 2 : L3INDEX_MINSIZE;
+	if((idx->slots = calloc(idx->size,sizeof(*idx->slots))) == NULL){
+		idx->slots = old;
+		idx->size = oldsize;
+		return -1;
+	}
+	idx->count = 0;
+	for(s = 0 ; s < oldsize ; ++s){
+		if(old[s]){
+			const l3host *l3 = old[s];
+
+			l3index_insert(idx,old[s],l3hash(&l3->addr,l3addrlen(l3->fam)));
+		}
+	}
+	free(old);
+	return 0;
+}
+
+static l3host *
+l3index_find(const l3index *idx,const void *addr,size_t len,uint64_t hash){
+	l3host *l3;
+	unsigned s;
+
+	if(idx->size == 0){
+		return NULL;
+	}
+	s = l3index_slot(idx,hash);
+	while( (l3 = idx->slots[s]) ){
+		if(memcmp(&l3->addr,addr,len) == 0){
+			return l3;
+		}
+		s = (s + 1) & (idx->size - 1);
+	}
+	return NULL;
+}
+
+// Backward-shift deletion, so that no tombstones are needed.
+static void
+l3index_remove(l3index *idx,const l3host *l3,uint64_t hash){
+	const unsigned mask = idx->size - 1;
+	unsigned s,j,home;
+
+	if(idx->size == 0){
+		return;
+	}
+	s = l3index_slot(idx,hash);
+	while(idx->slots[s] != l3){
+		if(idx->slots[s] == NULL){
+			return;
+		}
+		s = (s + 1) & mask;
+	}
+	for(j = (s + 1) & mask ; idx->slots[j] ; j = (j + 1) & mask){
+		const l3host *m = idx->slots[j];
+
+		home = l3index_slot(idx,l3hash(&m->addr,l3addrlen(m->fam)));
+		// Move m into the hole unless its home lies cyclically in (s, j]
+		if(((j - home) & mask) >= ((j - s) & mask)){
+			idx->slots[s] = idx->slots[j];
+			s = j;
+		}
+	}
+	idx->slots[s] = NULL;
+	--idx->count;
+}
+
+static void
+l3index_free(l3index *idx){
+	free(idx->slots);
+	idx->slots = NULL;
+	idx->size = idx->count = 0;
+}
+
+// Returns the stripe of the global map responsible for this hash, locked.
+static inline struct globalstripe *
+get_global_stripe(int fam,uint64_t hash){
+	struct globalstripe *ret;
+	struct globalhosts *gh;
 
 	switch(fam){
 		case AF_INET:
-			ret = &ipv4hosts;
+			gh = &ipv4hosts;
 			break;
 		case AF_INET6:
-			ret = &ipv6hosts;
+			gh = &ipv6hosts;
 			break;
 		default:
-			ret = NULL;
-			break;
+			return NULL;
 	}
-	if(ret){
-		if(pthread_mutex_lock(&ret->lock)){
-			ret = NULL;
-		}
+	pthread_once(&globalhosts_once,init_globalhosts);
+	ret = &gh->stripes[hash & (GLOBAL_STRIPES - 1)];
+	if(pthread_mutex_lock(&ret->lock)){
+		ret = NULL;
 	}
 	return ret;
 }
 
-// FIXME like the l2addrs, need do this in constant space via LRU or something
+// The caller must link the new l3host into its lists and index.
 static l3host *
-create_l3host(int fam,const void *addr,size_t len){
+create_l3host(interface *i,int fam,const void *addr,size_t len){
 	l3host *r;
 
 	assert(len <= sizeof(r->addr));
-	if( (r = Malloc(sizeof(*r))) ){
-		struct globalhosts *gh;
+	if( (r = hostpool_get(&i->l3pool,sizeof(*r))) ){
+		struct globalstripe *gs;
 		int ret;
 
 		if( (ret = pthread_mutex_init(&r->nlock,NULL)) ){
 			diagnostic("%s couldn't initialize mutex (%s?)",
 					__func__,strerror(ret));
-			free(r);
+			hostpool_put(&i->l3pool,r);
 			return NULL;
 		}
 		r->opaque = NULL;
 		r->name = NULL;
 		r->l2 = NULL;
+		r->iface = i;
 		r->fam = fam;
 		r->srcpkts = r->dstpkts = 0;
 		r->nlevel = 0;
@@ -126,18 +271,128 @@ create_l3host(int fam,const void *addr,size_t len){
 		r->nosrvs = 0;
 		r->nextnametry = 0;
 		r->nametries = 0;
+		memset(&r->addr,0,sizeof(r->addr));
 		memcpy(&r->addr,addr,len);
-		if( (gh = get_global_hosts(fam)) ){
-			r->gnext = gh->head;
-			gh->head = r;
-			pthread_mutex_unlock(&gh->lock);
-		}else{
-			r->gnext = NULL;
+		if(!i->isolated && (gs = get_global_stripe(fam,l3hash(addr,len)))){
+			if(l3index_reserve(&gs->idx) == 0){
+				l3index_insert(&gs->idx,r,l3hash(addr,len));
+			}
+			pthread_mutex_unlock(&gs->lock);
 		}
 	}
 	return r;
 }
 
+// Remove the l3host from the global map and release it to the pool. It must
+// already have been unlinked from the interface.
+static void
+destroy_l3host(interface *i,l3host *l3){
+	const size_t len = l3addrlen(l3->fam);
+	struct globalstripe *gs;
+	uint64_t hash;
+
+	hash = l3hash(&l3->addr,len);
+	if(!i->isolated && (gs = get_global_stripe(l3->fam,hash))){
+		l3index_remove(&gs->idx,l3,hash);
+		pthread_mutex_unlock(&gs->lock);
+	}
+	pthread_mutex_destroy(&l3->nlock);
+	free_services(l3->services);
+	free(l3->name);
+	hostpool_put(&i->l3pool,l3);
+}
+
+static inline void
+l3_lru_push(l3host **head,l3host *l3){
+	if( (l3->next = *head) ){
+		l3->prev = (*head)->prev;
+		(*head)->prev = l3;
+	}else{
+		l3->prev = l3;
+	}
+	*head = l3;
+}
+
+static inline void
+l3_lru_unlink(l3host **head,l3host *l3){
+	if(l3 == *head){
+		if( (*head = l3->next) ){
+			(*head)->prev = l3->prev;
+		}
+	}else{
+		l3->prev->next = l3->next;
+		if(l3->next){
+			l3->next->prev = l3->prev;
+		}else{
+			(*head)->prev = l3->prev;
+		}
+	}
+}
+
+// Move the l3host onto the list of l3hosts last seen via this l2host.
+static void
+l3_setl2(l3host *l3,struct l2host *l2){
+	if(l3->l2 == l2){
+		return;
+	}
+	if(l3->l2){
+		if( (*l3->l2pprev = l3->l2next) ){
+			l3->l2next->l2pprev = l3->l2pprev;
+		}
+	}
+	l3->l2 = l2;
+	l3->l2pprev = l2_l3hosts(l2);
+	if( (l3->l2next = *l3->l2pprev) ){
+		l3->l2next->l2pprev = &l3->l2next;
+	}
+	*l3->l2pprev = l3;
+}
+
+static int
+l3_family_lists(interface *i,int fam,l3host ***list,l3index **idx){
+	switch(fam){
+		case AF_INET:
+			*list = &i->ip4hosts;
+			*idx = &i->ip4idx;
+			return 0;
+		case AF_INET6:
+			*list = &i->ip6hosts;
+			*idx = &i->ip6idx;
+			return 0;
+		case AF_BSSID:
+			*list = &i->cells;
+			*idx = &i->cellidx;
+			return 0;
+	}
+	return -1;
+}
+
+static void
+evict_l3host(interface *i,l3host *l3){
+	const omphalos_ctx *octx = get_octx();
+	l3index *idx;
+	l3host **list;
+
+	if(octx->iface.evict_event){
+		octx->iface.evict_event(i,l3->l2,l3);
+	}
+	if( (*l3->l2pprev = l3->l2next) ){
+		l3->l2next->l2pprev = l3->l2pprev;
+	}
+	if(l3_family_lists(i,l3->fam,&list,&idx) == 0){
+		l3index_remove(idx,l3,l3hash(&l3->addr,l3addrlen(l3->fam)));
+		l3_lru_unlink(list,l3);
+	}
+	destroy_l3host(i,l3);
+}
+
+void evict_l3hosts_via(interface *i,struct l2host *l2 __attribute__ ((unused)),
+			l3host **l3s){
+	while(*l3s){
+		evict_l3host(i,*l3s);
+	}
+}
+
 void name_l3host_absolute(const interface *i,struct l2host *l2,l3host *l3,
 				const char *name,namelevel nlevel){
 	wchar_t *wname;
@@ -184,38 +439,53 @@ void wname_l3host_absolute(const interface *i,struct l2host *l2,l3host *l3,
 // An interface-scoped lookup without lower-level information. It doesn't
 // create a new entry if none exists. No support for BSSID lookup.
 struct l3host *find_l3host(interface *i,int fam,const void *addr){
-        l3host *l3;
-	typeof(l3->addr) cmp;
+	const l3index *idx;
 	size_t len;
 
 	switch(fam){
 		case AF_INET:
-			len = 4;
-			l3 = i->ip4hosts;
+			idx = &i->ip4idx;
 			break;
 		case AF_INET6:
-			len = 16;
-			l3 = i->ip6hosts;
+			idx = &i->ip6idx;
 			break;
 		default:
 			return NULL; // FIXME
 	}
-	assert(len <= sizeof(cmp));
-	memcpy(&cmp,addr,sizeof(cmp));
-	while(l3){
-		if(memcmp(&l3->addr,&cmp,len) == 0){
-			return l3;
-		}
-		l3 = l3->next;
+	len = l3addrlen(fam);
+	return l3index_find(idx,addr,len,l3hash(addr,len));
+}
+
+// Reverse lookups are active probes, and go through the scheduler. By the time
+// a deferred lookup is emitted, the l3host might have been evicted.
+static int
+name_probe(interface *i,int fam,const void *addr){
+	l3host *l3;
+	char *rev;
+	int r;
+
+	if((l3 = find_l3host(i,fam,addr)) == NULL){
+		return 0;
 	}
-	return NULL;
+	if((rev = (fam == AF_INET ? rev_dns_a : rev_dns_aaaa)(addr)) == NULL){
+		return -1;
+	}
+	r = queue_for_naming(i,l3,tx_dns_ptr,rev,fam,addr);
+	free(rev);
+	return r;
+}
+
+static int
+arp_probe(interface *i,int fam __attribute__ ((unused)),const void *addr){
+	send_arp_probe(i,addr);
+	return 0;
 }
 
 static inline void
 update_l3name(const struct timeval *tv,struct l2host *l2,l3host *l3,
 		dnstxfxn dnsfxn,char *(*revstrfxn)(const void *),int cat,
 		const void *addr,interface *i,int fam){
-	char *rev;
+	unsigned backoff;
 
 	// Multicast and broadcast addresses are statically named only
 	if(cat != RTN_UNICAST && cat != RTN_LOCAL){
@@ -231,17 +501,15 @@ update_l3name(const struct timeval *tv,struct l2host *l2,l3host *l3,
 	if(dnsfxn == NULL || revstrfxn == NULL){
 		return;
 	}
-	if((rev = revstrfxn(addr)) == NULL){
-		return;
-	}
 	++l3->nametries;
-	// FIXME add a random factor to avoid thundering herds!
-	l3->nextnametry = tv->tv_sec + (1u << (l3->nametries > MAX_BACKOFF_EXP ?
-					MAX_BACKOFF_EXP : l3->nametries));
-	if(queue_for_naming(i,l3,dnsfxn,rev,fam,addr)){
+	backoff = 1u << (l3->nametries > MAX_BACKOFF_EXP ?
+				MAX_BACKOFF_EXP : l3->nametries);
+	// Stretch each backoff by up to half again, so that hosts discovered
+	// together (say, by a sweep) don't retry together.
+	l3->nextnametry = tv->tv_sec + backoff + random() % (backoff / 2 + 1);
+	if(schedule_probe(i,PROBE_UNICAST,name_probe,fam,addr)){
 		wname_l3host_absolute(i,l2,l3,L"Resolution failed",NAMING_LEVEL_FAIL);
 	}
-	free(rev);
 }
 
 // Interface lock needs be held upon entry
@@ -249,9 +517,10 @@ static l3host *
 lookup_l3host_common(const struct timeval *tv,interface *i,struct l2host *l2,
 			int fam,const void *addr,int knownlocal){
 	char *(*revstrfxn)(const void *);
-        l3host *l3,**prev,**orig;
-	typeof(l3->addr) cmp;
+        l3host *l3,**orig;
 	dnstxfxn dnsfxn;
+	l3index *idx;
+	uint64_t hash;
 	size_t len;
 	int cat;
 
@@ -261,6 +530,7 @@ lookup_l3host_common(const struct timeval *tv,interface *i,struct l2host *l2,
 
 			len = 4;
 			orig = &i->ip4hosts;
+			idx = &i->ip4idx;
 			dnsfxn = tx_dns_ptr;
 			revstrfxn = rev_dns_a;
 			if(memcmp(addr,&zaddr,len) == 0){
@@ -272,6 +542,7 @@ lookup_l3host_common(const struct timeval *tv,interface *i,struct l2host *l2,
 
 			len = 16;
 			orig = &i->ip6hosts;
+			idx = &i->ip6idx;
 			dnsfxn = tx_dns_ptr;
 			revstrfxn = rev_dns_aaaa;
 			if(memcmp(addr,&zaddr,len) == 0){
@@ -281,6 +552,7 @@ lookup_l3host_common(const struct timeval *tv,interface *i,struct l2host *l2,
 		}case AF_BSSID:{
 			len = ETH_ALEN;
 			orig = &i->cells;
+			idx = &i->cellidx;
 			dnsfxn = NULL;
 			revstrfxn = NULL;
 			break;
@@ -290,19 +562,15 @@ lookup_l3host_common(const struct timeval *tv,interface *i,struct l2host *l2,
 		}
 	}
 	cat = l2categorize(i,l2);
-	// FIXME probably want to make this per-node
-	assert(len <= sizeof(cmp));
-	memcpy(&cmp,addr,len);
-	for(prev = orig ; (l3 = *prev) ; prev = &l3->next){
-		if(memcmp(&l3->addr,&cmp,len) == 0){
-			// Move it to the front of the list, splicing it out
-			*prev = l3->next;
-			l3->next = *orig;
-			*orig = l3;
-			l3->l2 = l2; // FIXME ought indicate a change!
-			update_l3name(tv,l2,l3,dnsfxn,revstrfxn,cat,addr,i,fam);
-			return l3;
+	hash = l3hash(addr,len);
+	if( (l3 = l3index_find(idx,addr,len,hash)) ){
+		if(l3 != *orig){
+			l3_lru_unlink(orig,l3);
+			l3_lru_push(orig,l3);
 		}
+		l3_setl2(l3,l2); // FIXME ought indicate a change!
+		update_l3name(tv,l2,l3,dnsfxn,revstrfxn,cat,addr,i,fam);
+		return l3;
 	}
 	if(!(i->flags & IFF_NOARP) && !knownlocal){
 		if(cat == RTN_UNICAST || cat == RTN_LOCAL){
@@ -312,8 +580,7 @@ lookup_l3host_common(const struct timeval *tv,interface *i,struct l2host *l2,
 			if(get_unicast_address(i,fam,addr,&ss) == NULL){
 				if(fam == AF_INET){
 					// Issue a non-destructive ARP probe
-					// FIXME need rate-limiting!
-					//send_arp_probe(i,addr);
+					schedule_probe(i,PROBE_BROADCAST,arp_probe,fam,addr);
 				}
 				return &external_l3;
 			}
@@ -323,12 +590,16 @@ lookup_l3host_common(const struct timeval *tv,interface *i,struct l2host *l2,
 			}
 		}
 	}
-        if( (l3 = create_l3host(fam,addr,len)) ){
-		char *rev;
-
-                l3->next = *orig;
-                *orig = l3;
-		l3->l2 = l2;
+	if(get_octx()->hostcap && idx->count >= get_octx()->hostcap){
+		evict_l3host(i,(*orig)->prev);
+	}
+	if(l3index_reserve(idx)){
+		return NULL;
+	}
+        if( (l3 = create_l3host(i,fam,addr,len)) ){
+		l3_lru_push(orig,l3);
+		l3index_insert(idx,l3,hash);
+		l3_setl2(l3,l2);
 		// handle 127.0.0.1 and ::1 as special cases, but look up local
 		// addresses otherwise. multicast and broadcast are only named
 		// via special case static lookups.
@@ -355,15 +626,14 @@ lookup_l3host_common(const struct timeval *tv,interface *i,struct l2host *l2,
 				}
 			} // fallthrough: look locals up if they're not special cases
 		       	uname = ietf_unicast_lookup(fam,addr);
-			if(dnsfxn && revstrfxn && (rev = revstrfxn(addr))){
+			if(dnsfxn && revstrfxn){
 				// Calls the host event if necessary
 				wname_l3host_absolute(i,l2,l3,L"Resolving...",NAMING_LEVEL_RESOLVING);
 				++l3->nextnametry;
 				l3->nextnametry = tv->tv_sec + 1;
-				if(queue_for_naming(i,l3,dnsfxn,rev,fam,addr)){
+				if(schedule_probe(i,PROBE_UNICAST,name_probe,fam,addr)){
 					wname_l3host_absolute(i,l2,l3,L"Resolution failed",NAMING_LEVEL_FAIL);
 				}
-				free(rev);
 			}
 			if(is_router(fam,addr)){
 				observe_service(i,l2,l3,IPPROTO_IP,4,L"Router",NULL);
@@ -373,29 +643,46 @@ lookup_l3host_common(const struct timeval *tv,interface *i,struct l2host *l2,
         return l3;
 }
 
-// Browse the global list. Don't create the host if it doesn't exist. Since
-// references are handed out without a lock held, we cannot destroy an l3host
-// which is on the global list! This is fundamentally unsafe, really FIXME.
-struct l3host *lookup_global_l3host(int fam,const void *addr){
-	struct globalhosts *gh;
+// Browse the global map. Don't create the host if it doesn't exist. Hosts are
+// destroyed (evicted, or their interface torn down) under their owner's lock,
+// having first been removed from the global map under the stripe's. While we
+// hold the stripe's lock, then, a host we find there is live, and once we
+// hold its owner's lock, it stays so. We already hold i's lock, and the owner
+// might be waiting on our stripe while holding its own, so we only try it. An
+// isolated interface sees only its own hosts (and they're in no global map).
+struct l3host *lookup_global_l3host(interface *i,int fam,const void *addr,
+					interface **owner){
+	struct globalstripe *gs;
+	uint64_t hash;
 	l3host *l3;
-	typeof(l3->addr) cmp;
+	size_t len;
 
-	// locks the globalhosts entry on success
-	if((gh = get_global_hosts(fam)) == NULL){
+	if(i->isolated){
+		*owner = i;
+		return find_l3host(i,fam,addr);
+	}
+	len = l3addrlen(fam);
+	hash = l3hash(addr,len);
+	// locks the stripe on success
+	if((gs = get_global_stripe(fam,hash)) == NULL){
 		return NULL;
 	}
-	assert(gh->addrlen <= sizeof(cmp));
-	memcpy(&cmp,addr,gh->addrlen);
-	for(l3 = gh->head ; l3 ; l3 = l3->gnext){
-		if(memcmp(&l3->addr,&cmp,gh->addrlen) == 0){
-			break;
+	if( (l3 = l3index_find(&gs->idx,addr,len,hash)) ){
+		*owner = l3->iface;
+		if(*owner != i && pthread_mutex_trylock(&(*owner)->lock)){
+			l3 = NULL;
 		}
 	}
-	pthread_mutex_unlock(&gh->lock);
+	pthread_mutex_unlock(&gs->lock);
 	return l3;
 }
 
+void release_global_l3host(const interface *i,interface *owner){
+	if(owner != i){
+		unlock_interface(owner);
+	}
+}
+
 // This is for raw network addresses as seen on the wire, which may be from
 // outside the local network. We want only the local network address(es) of the
 // link (in a rare case, it might not have any). For unicast link addresses, a
@@ -490,6 +777,10 @@ void *l3host_get_opaque(l3host *l3){
 	return l3->opaque;
 }
 
+void l3host_set_opaque(l3host *l3,void *opaque){
+	l3->opaque = opaque;
+}
+
 int l3ntop(const l3host *l3,char *buf,size_t buflen){
 	if(l3->fam > AF_MAX){
 		if(buflen < HWADDRSTRLEN(ETH_ALEN)){
@@ -502,18 +793,62 @@ int l3ntop(const l3host *l3,char *buf,size_t buflen){
 	return inet_ntop(l3->fam,&l3->addr,buf,buflen) != buf;
 }
 
-void cleanup_l3hosts(l3host **list){
-	l3host *l3,*tmp;
+void cleanup_l3hosts(interface *i){
+	l3host **lists[] = { &i->ip4hosts, &i->ip6hosts, &i->cells, };
+	l3index *idxs[] = { &i->ip4idx, &i->ip6idx, &i->cellidx, };
+	unsigned z;
+
+	for(z = 0 ; z < sizeof(lists) / sizeof(*lists) ; ++z){
+		l3host *l3,*tmp;
+
+		for(l3 = *lists[z] ; l3 ; l3 = tmp){
+			tmp = l3->next;
+			destroy_l3host(i,l3);
+		}
+		*lists[z] = NULL;
+		l3index_free(idxs[z]);
+	}
+	hostpool_destroy(&i->l3pool);
+}
+
+// Walk each of src's lists from its least recently used l3host, so that the
+// merged hosts take on src's recency order in dst. Names and services carry
+// over; UI callbacks fire as they're introduced to dst.
+void merge_l3hosts(const struct timeval *tv,interface *dst,const interface *src){
+	l3host * const *lists[] = { &src->ip4hosts, &src->ip6hosts, &src->cells, };
+	unsigned z;
 
-	for(l3 = *list ; l3 ; l3 = tmp){
-		tmp = l3->next;
-		pthread_mutex_destroy(&l3->nlock);
-		free_services(l3->services);
-		free(l3->name);
-		free(l3);
+	for(z = 0 ; z < sizeof(lists) / sizeof(*lists) ; ++z){
+		const l3host *l3;
+
+		if((l3 = *lists[z]) == NULL){
+			continue;
+		}
+		l3 = l3->prev;
+		for(;;){
+			struct l2host *d2;
+			hwaddrint hw;
+			l3host *d3;
+
+			if(l3->l2){
+				hw = get_hwaddr(l3->l2);
+				if( (d2 = lookup_l2host(dst,&hw)) ){
+					if( (d3 = lookup_local_l3host(tv,dst,d2,l3->fam,&l3->addr)) ){
+						if(l3->name){
+							wname_l3host_absolute(dst,d2,d3,l3->name,l3->nlevel);
+						}
+						observe_services(dst,d2,d3,l3->services);
+						d3->srcpkts += l3->srcpkts;
+						d3->dstpkts += l3->dstpkts;
+					}
+				}
+			}
+			if(l3 == *lists[z]){
+				break;
+			}
+			l3 = l3->prev;
+		}
 	}
-	*list = NULL;
-	// FIXME ensure all globall3host lists are empty
 }
 
 void l3_srcpkt(l3host *l3){
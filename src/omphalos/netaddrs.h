@@ -16,6 +16,15 @@ struct interface;
 
 #define AF_BSSID (AF_MAX + 1)
 
+// Open-addressed (linear probing) index of l3hosts, keyed on their address.
+// One per address family on each interface, and one per stripe of the global
+// map. Only pointers are stored, so l3host handles are stable.
+typedef struct l3index {
+	struct l3host **slots;
+	unsigned size;		// power of 2, or 0 prior to the first insertion
+	unsigned count;		// occupied slots, kept under size / 2
+} l3index;
+
 // Reasoning:
 //  - _DNS is below _GLOBAL because a crap entry (say, mapping to 127.0.0.1)
 //     could then override a correct, if generic, entry.
@@ -40,7 +49,9 @@ typedef enum {
 
 // Look up an l3 address, creating an l3host if the address isn't known on
 // this l2host. A route check will be performed; if no local route to this host
-// exists, an ARP request will be issued rather than adding the host.
+// exists, an ARP request will be issued rather than adding the host. If the
+// interface is at its host cap for this family, the least recently used
+// l3host is first evicted.
 struct l3host *lookup_l3host(const struct timeval *tv,struct interface *,
 				struct l2host *,int,const void *);
 
@@ -55,8 +66,19 @@ struct l3host *find_l3host(struct interface *,int,const void *)
 	__attribute__ ((nonnull (1,3)));
 
 // Doesn't create the l3host if it isn't found (what interface would it bind it
-// to?), but scans all interfaces' nodes for such a host.
-struct l3host *lookup_global_l3host(int,const void *) __attribute__ ((nonnull (2)));
+// to?), but scans all (non-isolated) interfaces' nodes for such a host, or
+// only the provided interface's own, should it be isolated. The caller must hold
+// the lock of the interface provided. A host found on some other interface is
+// returned with that interface's lock held, to be released (once the caller is
+// done with the host) via release_global_l3host(); its interface is written
+// to the final argument. If that lock isn't immediately available, NULL is
+// returned, as if the host weren't known.
+struct l3host *lookup_global_l3host(struct interface *,int,const void *,
+					struct interface **)
+	__attribute__ ((nonnull (1,3,4)));
+
+void release_global_l3host(const struct interface *,struct interface *)
+	__attribute__ ((nonnull (1,2)));
 
 void name_l3host_local(const struct interface *,struct l2host *,struct l3host *,int,const void *,namelevel)
 				__attribute__ ((nonnull (1,2,3,5)));
@@ -73,12 +95,28 @@ char *netaddrstr(int,const void *) __attribute__ ((nonnull (2)));
 // Get a string representation of the l3host's network address
 int l3ntop(const struct l3host *,char *,size_t) __attribute__ ((nonnull (1,2)));
 
-void cleanup_l3hosts(struct l3host **list) __attribute__ ((nonnull (1)));
+// Look up each of the second interface's l3hosts (names, services and all) on
+// the first, as local hosts, adding their packet counts. Their l2hosts are
+// looked up on the first interface as needed.
+void merge_l3hosts(const struct timeval *,struct interface *,const struct interface *)
+		__attribute__ ((nonnull (1,2,3)));
+
+// Free all of the interface's l3hosts, removing them from the global map. No
+// eviction callbacks are invoked.
+void cleanup_l3hosts(struct interface *) __attribute__ ((nonnull (1)));
+
+// Evict each l3host on the list (see l2_l3hosts()), invoking the eviction
+// callback for each. Called when their l2host is itself being evicted.
+void evict_l3hosts_via(struct interface *,struct l2host *,struct l3host **)
+				__attribute__ ((nonnull (1,2,3)));
 
 // Accessors
 const wchar_t *get_l3name(const struct l3host *) __attribute__ ((nonnull (1)));
 namelevel get_l3nlevel(const struct l3host *) __attribute__ ((nonnull (1)));
 void *l3host_get_opaque(struct l3host *) __attribute__ ((nonnull (1)));
+// For UIs dropping their state for an l3host without its eviction, generally
+// because the l2host beneath which they displayed it was evicted.
+void l3host_set_opaque(struct l3host *,void *) __attribute__ ((nonnull (1)));
 uintmax_t l3_get_srcpkt(const struct l3host *) __attribute__ ((nonnull (1)));
 uintmax_t l3_get_dstpkt(const struct l3host *) __attribute__ ((nonnull (1)));
 uint32_t get_l3addr_in(const struct l3host *) __attribute__ ((nonnull (1)));
@@ -114,7 +114,7 @@ int handle_netbios_ns_packet(omphalos_packet *op,const void *frame,size_t len){
 				return -1;
 			}
 			// FIXME can other families be used?
-			offer_resolution(AF_INET,op->l3saddr,name,NAMING_LEVEL_REVDNS,0,NULL);
+			offer_resolution(op->i,AF_INET,op->l3saddr,name,NAMING_LEVEL_REVDNS,0,NULL);
 			free(name);
 			break;
 		}
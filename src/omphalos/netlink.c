@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <stdio.h>
+#include <sched.h>
 #include <limits.h>
 #include <string.h>
 #include <signal.h>
@@ -9,6 +10,7 @@
 #include <pthread.h>
 #include <sys/uio.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -18,8 +20,12 @@
 #include <linux/if_addr.h>
 #include <linux/netlink.h>
 #include <linux/version.h>
+#include <omphalos/xdp.h>
+#include <omphalos/numa.h>
 #include <omphalos/diag.h>
+#include <omphalos/filter.h>
 #include <omphalos/route.h>
+#include <omphalos/reactor.h>
 #include <omphalos/sysfs.h>
 #include <linux/rtnetlink.h>
 #include <omphalos/signals.h>
@@ -35,7 +41,9 @@
 #include <omphalos/bluetooth.h>
 #include <omphalos/interface.h>
 
-#define OFFLOAD_MTU (32678 - (int)TPACKET2_HDRLEN)
+// GSO_MAX_SIZE, for kernels which report neither IFLA_GSO_MAX_SIZE (4.6+)
+// nor IFLA_GRO_MAX_SIZE (5.19+). We see GSO (TX) and GRO (RX) frames whole.
+#define OFFLOAD_MTU 65536
 
 // External cancellation, tested in input-handling loops. This only works
 // without a mutex lock (memory barrier, more precisely) because we
@@ -408,6 +416,9 @@ handle_rtm_dellink(const struct nlmsghdr *nl){
 	return 0;
 }
 
+// One per RX ring. Without fanout, there's a single ring, described by the
+// interface's rfd/rxm/rs. With PACKET_FANOUT, rings 1..n-1 are additional
+// sockets joined to the same group, owned by their marshals.
 typedef struct psocket_marsh {
 	const omphalos_ctx *ctx;
 	interface *i;
@@ -415,15 +426,155 @@ typedef struct psocket_marsh {
 	pthread_cond_t cond;
 	pthread_mutex_t lock;
 	pthread_t tid;
+	int fd;			// RX packet socket for this ring
+	void *rxm;		// RX packet ring buffer
+	size_t rs;		// RX packet ring size in bytes
+	cpu_set_t cpus;		// processors to which we're pinned, if any
+	int node;		// NUMA node we prefer for allocations, or -1
+	rxshard *rxs;		// our stats shard, written only by us
+	xsk *xsk;		// AF_XDP socket state, or NULL for PACKET_MMAP
+	void *cur;		// next frame (V1) or block (V3) to analyze
+	unsigned ridx;		// ...and its index
+	uint64_t rhandle;	// reactor handle, or 0 if we have a thread
+	struct timeval lastrx;	// last analysis or idle update (reactor)
+	unsigned rtpver;	// RX TPACKET version, and this ring's geometry
+	union {
+		struct tpacket_req rtpr;
+		struct tpacket_req3 rtpr3;
+	};
+	unsigned maxframe;	// largest frame the ring was laid out for
+	struct timeval lastadapt;	// start of the drop-rate window...
+	uintmax_t adaptframes,adaptdrops;	// ...and the shard's counts then
 } psocket_marsh;
 
+// Rings losing more than 1/RING_GROW_DROPRATE of their frames over a window of
+// at least RING_GROW_USECS are doubled in size.
+#define RING_GROW_USECS 1000000
+#define RING_GROW_DROPRATE 1000
+
+static inline int
+ring_frame_ready(const void *frame){
+	const volatile struct tpacket_hdr *thdr = frame;
+
+	return thdr->tp_status != TP_STATUS_KERNEL;
+}
+
+// Is the ring's next frame (V1), block (V3), or descriptor (AF_XDP) ready?
+static inline int
+ring_ready(const psocket_marsh *pm){
+	if(pm->xsk){
+		return xsk_rx_ready(pm->xsk);
+	}else if(pm->rtpver == TPACKET_V3){
+		const struct tpacket_block_desc *bd = pm->cur;
+
+		return __atomic_load_n(&bd->hdr.bh1.block_status,__ATOMIC_ACQUIRE) & TP_STATUS_USER;
+	}
+	return ring_frame_ready(pm->cur);
+}
+
+// Analyze the next batch of frames (V1, see RING_BATCH), block (V3), or batch
+// (AF_XDP), waiting for it if it's not yet ready, and advance. The interface
+// lock must be held.
 static int
-ring_packet_loop(psocket_marsh *pm){
-	// FIXME either send pm and nothing or everything else this aliases
-	unsigned idx = 0;
-	void *rxm;
+ring_step(psocket_marsh *pm){
+	int r;
 
-	rxm = pm->i->rxm;
+	if(pm->xsk){
+		return handle_xsk_batch(pm->i,pm->fd,pm->xsk,pm->rxs);
+	}else if(pm->rtpver == TPACKET_V3){
+		// Blocks are contiguous, and consumed in order
+		if((r = handle_ring_block(pm->i,pm->fd,pm->cur,pm->rxs)) == 0){
+			if(++pm->ridx == pm->rtpr3.tp_block_nr){
+				pm->ridx = 0;
+			}
+			pm->cur = (char *)pm->rxm + pm->ridx * pm->rtpr3.tp_block_size;
+		}
+		return r;
+	}
+	return handle_ring_batch(pm->i,pm->fd,&pm->cur,&pm->ridx,&pm->rtpr,pm->rxs);
+}
+
+// If the ring has been dropping frames, drain it and double its size (see
+// resize_rx_psocket()). A dropping ring is refilled about as fast as we can
+// drain it, so we drain at most one ring's worth; if it's still not empty,
+// the resize waits for a later interval. The shard's counters are our own,
+// so we can read them without the seqlock. The interface lock must be held.
+// Returns -1 if the ring was lost.
+static int
+ring_adapt(psocket_marsh *pm){
+	unsigned nr,left,adv,prev;
+	uintmax_t frames,drops;
+	struct timeval tv,d;
+	size_t rs,want;
+
+	if(pm->xsk || pm->rxs->drops == pm->adaptdrops){
+		return 0;
+	}
+	gettimeofday(&tv,NULL);
+	timersub(&tv,&pm->lastadapt,&d);
+	if(d.tv_sec * 1000000 + d.tv_usec < RING_GROW_USECS){
+		return 0;
+	}
+	frames = pm->rxs->frames - pm->adaptframes;
+	drops = pm->rxs->drops - pm->adaptdrops;
+	pm->adaptframes = pm->rxs->frames;
+	pm->adaptdrops = pm->rxs->drops;
+	pm->lastadapt = tv;
+	if(drops * RING_GROW_DROPRATE <= frames + drops){
+		return 0;
+	}
+	if((want = pm->rs * 2) > RX_RING_MAX){
+		return 0;
+	}
+	// Count the frames (V1) or blocks (V3) stepped over. A step might lap
+	// a small ring entirely, leaving the index where it was.
+	nr = pm->rtpver == TPACKET_V3 ? pm->rtpr3.tp_block_nr : pm->rtpr.tp_frame_nr;
+	for(left = nr ; left && ring_ready(pm) ; left -= adv < left ? adv : left){
+		prev = pm->ridx;
+		if(ring_step(pm) < 0){
+			return -1;
+		}
+		if((adv = (pm->ridx + nr - prev) % nr) == 0){
+			adv = nr;
+		}
+	}
+	if(ring_ready(pm)){
+		return 0;
+	}
+	if((rs = resize_rx_psocket(pm->fd,pm->maxframe,want,&pm->rxm,pm->rs,
+					&pm->rtpr3,pm->rtpver)) == 0){
+		pm->rs = 0;
+		return -1;
+	}
+	diagnostic("[%s] %ju/%ju drops, RX ring %zu -> %zub",pm->i->name,
+			drops,frames + drops,pm->rs,rs);
+	pm->rs = rs;
+	pm->cur = pm->rxm;
+	pm->ridx = 0;
+	if(pm == pm->i->pmarsh){ // the interface describes ring 0
+		pm->i->rxm = pm->rxm;
+		pm->i->rs = pm->rs;
+		pm->i->rtpr3 = pm->rtpr3;
+	}
+	return 0;
+}
+
+// Expire timers in a batch, while we hold the lock anyway
+static inline void
+ring_timers(psocket_marsh *pm){
+	if(pm->i->timers.pending){
+		struct timeval tv;
+
+		gettimeofday(&tv,NULL);
+		twheel_advance(&pm->i->timers,&tv);
+	}
+}
+
+// Fanout rings are drained concurrently, but analysis is serialized by the
+// interface lock: dissection and the host tables aren't safe to share. Each
+// ring's thread holds the lock for a whole batch (see handle_ring_batch()).
+static int
+ring_packet_loop(psocket_marsh *pm){
 	while(!pm->cancelled){
 		int r;
 
@@ -431,12 +582,12 @@ ring_packet_loop(psocket_marsh *pm){
 			diagnostic("Couldn't lock %s (%s?)",pm->i->name,strerror(r));
 			return -1;
 		}
-		if((r = handle_ring_packet(pm->i,pm->i->rfd,rxm)) == 0){
-			rxm += inclen(&idx,&pm->i->rtpr);
-		}else if(r < 0){
+		// Each step is a batch, analyzed under one acquisition of the lock
+		if(ring_step(pm) < 0 || ring_adapt(pm)){
 			pthread_mutex_unlock(&pm->i->lock);
 			return -1;
 		}
+		ring_timers(pm);
 		if( (r = pthread_mutex_unlock(&pm->i->lock)) ){
 			diagnostic("Couldn't unlock %s (%s?)",pm->i->name,strerror(r));
 			return -1;
@@ -445,6 +596,51 @@ ring_packet_loop(psocket_marsh *pm){
 	return 0;
 }
 
+// Reactor service callback. Never blocks: we only step a ready ring. An error
+// on the socket (e.g. the device went away) with nothing ready disarms us.
+static int
+ring_service(void *arg,unsigned events){
+	psocket_marsh *pm = arg;
+	int r = 0;
+
+	lock_interface(pm->i);
+	if(ring_ready(pm)){
+		if((r = ring_step(pm)) >= 0){
+			gettimeofday(&pm->lastrx,NULL);
+		}
+	}else if(events & EPOLLERR){
+		r = -1;
+	}
+	if(r >= 0){
+		r = ring_adapt(pm);
+	}
+	ring_timers(pm);
+	unlock_interface(pm->i);
+	return r < 0 ? -1 : 0;
+}
+
+// Reactor tick callback: run the timers, and update the timestats if we've
+// been idle for a sampling period, as wait_ring_packet() does for threads.
+static int
+ring_tick(void *arg,unsigned events __attribute__ ((unused))){
+	psocket_marsh *pm = arg;
+	omphalos_packet packet;
+	struct timeval tv,d;
+
+	lock_interface(pm->i);
+	ring_timers(pm);
+	gettimeofday(&tv,NULL);
+	timersub(&tv,&pm->lastrx,&d);
+	if(d.tv_sec || d.tv_usec >= IFACE_TIMESTAT_USECS){
+		memset(&packet,0,sizeof(packet));
+		packet.i = pm->i;
+		idle_ring(&packet,pm->rxs);
+		pm->lastrx = tv;
+	}
+	unlock_interface(pm->i);
+	return 0;
+}
+
 static void *
 psocket_thread(void *unsafe){
 	psocket_marsh *pm = unsafe;
@@ -453,6 +649,16 @@ psocket_thread(void *unsafe){
 	if(pthread_setspecific(omphalos_ctx_key,pm->ctx)){
 		return "couldn't set TSD";
 	}
+	if(CPU_COUNT(&pm->cpus)){
+		if( (r = pthread_setaffinity_np(pthread_self(),sizeof(pm->cpus),&pm->cpus)) ){
+			char buf[BUFSIZ];
+
+			diagnostic("Couldn't pin %s thread to CPUs %s (%s?)",pm->i->name,
+					format_cpulist(&pm->cpus,buf,sizeof(buf)),strerror(r));
+		}
+	}
+	// Host tables (and grown rings) are allocated from this thread
+	prefer_numa_node(pm->node);
 	// We control thread exit via the global cancelled value, set in the
 	// signal handler. We don't want actual pthread cancellation, as it's
 	// unsafe for the user callback's duration, and thus we'd need switch
@@ -470,17 +676,51 @@ psocket_thread(void *unsafe){
 }
 
 static void
-pmarsh_destroy(psocket_marsh *pm){
-	if( (errno = pthread_cond_destroy(&pm->cond)) ){
-		diagnostic("Error cleaning condvar: %s",strerror(errno));
-	}
-	if( (errno = pthread_mutex_destroy(&pm->lock)) ){
-		diagnostic("Error cleaning mutex: %s",strerror(errno));
+pmarsh_destroy(psocket_marsh *pm,unsigned count){
+	unsigned z;
+
+	for(z = 0 ; z < count ; ++z){
+		if( (errno = pthread_cond_destroy(&pm[z].cond)) ){
+			diagnostic("Error cleaning condvar: %s",strerror(errno));
+		}
+		if( (errno = pthread_mutex_destroy(&pm[z].lock)) ){
+			diagnostic("Error cleaning mutex: %s",strerror(errno));
+		}
 	}
 	free(pm);
 }
 
+// Unmap and close the fanout rings [first..count). Ring 0 belongs to the
+// interface, and is closed along with it.
+static void
+close_fanout_rings(psocket_marsh *pm,unsigned first,unsigned count){
+	unsigned z;
+
+	for(z = first ? first : 1 ; z < count ; ++z){
+		if(pm[z].rs){
+			unmap_psocket(pm[z].rxm,pm[z].rs);
+		}
+		xsk_close(pm[z].xsk);
+		pm[z].xsk = NULL;
+		close(pm[z].fd);
+		pm[z].fd = -1;
+		pm[z].rs = 0;
+	}
+}
+
+// Ring 0's socket is closed along with the interface.
+static void
+close_rx_rings(interface *i){
+	close_fanout_rings(i->pmarsh,1,i->rxrings);
+	xsk_close(i->pmarsh[0].xsk);
+	xdp_detach(i);
+	pmarsh_destroy(i->pmarsh,i->rxrings);
+	i->pmarsh = NULL;
+	i->rxrings = 0;
+}
+
 void reap_thread(interface *i){
+	unsigned z;
 	void *ret;
 
 	// See psocket_thread(); we disable pthread cancellation. Send a
@@ -496,65 +736,325 @@ void reap_thread(interface *i){
 	//  - we use a condvar signal (safe) to wake it up following
 	//  - the thread wakes, dies, and is joined
 	//  - we safely close the fd and free the pmarsh
-	pthread_mutex_lock(&i->pmarsh->lock);
-		if(!i->pmarsh->cancelled){
-			if( (errno = pthread_kill(i->pmarsh->tid,SIGCHLD)) ){
-				diagnostic("Couldn't signal thread (%s?)",strerror(errno));
-			} // FIXME check return codes here
-			i->pmarsh->cancelled = 1;
+	//
+	// With fanout, every ring's thread is signalled before any are joined.
+	//
+	// Rings serviced by the reactor are simply removed from it, once any
+	// reactor thread within their callbacks (which take the lock) is done.
+	if(i->rxrings && i->pmarsh[0].rhandle){
+		pthread_mutex_unlock(&i->lock);
+		for(z = 0 ; z < i->rxrings ; ++z){
+			reactor_del(i->pmarsh[z].rhandle);
 		}
-	pthread_cond_signal(&i->pmarsh->cond);
-	pthread_mutex_unlock(&i->pmarsh->lock);
+		pthread_mutex_lock(&i->lock);
+		close_rx_rings(i);
+		return;
+	}
+	for(z = 0 ; z < i->rxrings ; ++z){
+		psocket_marsh *pm = &i->pmarsh[z];
+
+		pthread_mutex_lock(&pm->lock);
+			if(!pm->cancelled){
+				if( (errno = pthread_kill(pm->tid,SIGCHLD)) ){
+					diagnostic("Couldn't signal thread (%s?)",strerror(errno));
+				} // FIXME check return codes here
+				pm->cancelled = 1;
+			}
+		pthread_cond_signal(&pm->cond);
+		pthread_mutex_unlock(&pm->lock);
+	}
 	pthread_mutex_unlock(&i->lock);
-	if( (errno = pthread_join(i->pmarsh->tid,&ret)) ){
-		diagnostic("Couldn't join thread (%s?)",strerror(errno));
-	/*}else if(ret != PTHREAD_CANCELED){
-		diagnostic("%s thread returned error on exit (%s)",
-				i->name,(char *)ret);*/
+	for(z = 0 ; z < i->rxrings ; ++z){
+		if( (errno = pthread_join(i->pmarsh[z].tid,&ret)) ){
+			diagnostic("Couldn't join thread (%s?)",strerror(errno));
+		/*}else if(ret != PTHREAD_CANCELED){
+			diagnostic("%s thread returned error on exit (%s)",
+					i->name,(char *)ret);*/
+		}
 	}
 	pthread_mutex_lock(&i->lock);
-	pmarsh_destroy(i->pmarsh);
-	i->pmarsh = NULL;
+	close_rx_rings(i);
 }
 
 static psocket_marsh *
-pmarsh_create(void){
+pmarsh_create(unsigned count){
 	psocket_marsh *ret;
+	unsigned z;
 
-	if( (ret = malloc(sizeof(*ret))) ){
-		if(pthread_mutex_init(&ret->lock,NULL) == 0){
-			if(pthread_cond_init(&ret->cond,NULL) == 0){
-				ret->cancelled = 0;
-				return ret;
+	if( (ret = malloc(sizeof(*ret) * count)) ){
+		for(z = 0 ; z < count ; ++z){
+			if(pthread_mutex_init(&ret[z].lock,NULL)){
+				break;
+			}
+			if(pthread_cond_init(&ret[z].cond,NULL)){
+				pthread_mutex_destroy(&ret[z].lock);
+				break;
 			}
-			pthread_mutex_destroy(&ret->lock);
+			ret[z].cancelled = 0;
+			ret[z].fd = -1;
+			ret[z].rxm = NULL;
+			ret[z].rs = 0;
+			CPU_ZERO(&ret[z].cpus);
+			ret[z].node = -1;
+			ret[z].xsk = NULL;
+			ret[z].rhandle = 0;
+		}
+		if(z == count){
+			return ret;
 		}
-		free(ret);
+		pmarsh_destroy(ret,z);
 	}
 	return NULL;
 }
 
+// Choose processors for the nth of count RX rings. Of those on which we're
+// allowed to run, we prefer those local to the device. A single ring may run
+// on any of them; fanout rings are each pinned to one, round-robin, starting
+// from an offset particular to the interface, so that the rings of several
+// interfaces don't all stack up on the first few processors. Leaves the set
+// empty if nothing's known (the thread then floats).
+static void
+rx_ring_cpus(const interface *i,unsigned n,unsigned count,cpu_set_t *cs){
+	cpu_set_t local;
+	int cpus,z;
+
+	if(sched_getaffinity(0,sizeof(*cs),cs)){
+		CPU_ZERO(cs);
+		return;
+	}
+	CPU_AND(&local,cs,&i->rxcpus);
+	if(CPU_COUNT(&local)){
+		*cs = local;
+	}else if(count == 1){
+		CPU_ZERO(cs);
+		return;
+	}
+	if(count == 1 || (cpus = CPU_COUNT(cs)) == 0){
+		return;
+	}
+	n = (n + (unsigned)idx_of_iface(i) * count) % cpus;
+	for(z = 0 ; z < CPU_SETSIZE ; ++z){
+		if(CPU_ISSET(z,cs) && n-- == 0){
+			break;
+		}
+	}
+	CPU_ZERO(cs);
+	if(z < CPU_SETSIZE){
+		CPU_SET(z,cs);
+	}
+}
+
+// Open rings 1..count-1 for a fanout group, using the geometry and TPACKET
+// version of ring 0. Returns the number of rings available (at least 1).
+static unsigned
+prepare_fanout_rings(interface *iface,psocket_marsh *pm,int idx,unsigned mtu,
+				size_t bytes,unsigned group,unsigned count){
+	const omphalos_ctx *ctx = get_octx();
+	unsigned z;
+
+	for(z = 1 ; z < count ; ++z){
+		if((pm[z].fd = packet_socket(ETH_P_ALL)) < 0){
+			break;
+		}
+		pm[z].rtpver = iface->rtpver;
+		pm[z].maxframe = mtu;
+		if((pm[z].rs = mmap_rx_psocket(pm[z].fd,idx,mtu,bytes,&pm[z].rxm,
+						&pm[z].rtpr3,&pm[z].rtpver)) == 0){
+			close(pm[z].fd);
+			pm[z].fd = -1;
+			break;
+		}
+		if(filter_psocket(pm[z].fd,iface,ctx->filter,ctx->headers) < 0){
+			close_fanout_rings(pm,z,z + 1);
+			break;
+		}
+		// All rings share the interface's TPACKET version
+		if(pm[z].rtpver != iface->rtpver
+				|| fanout_psocket(pm[z].fd,group,ctx->fanoutmode)){
+			close_fanout_rings(pm,z,z + 1);
+			break;
+		}
+	}
+	if(z < count){
+		diagnostic("[%s] Using %u/%u fanout rings",iface->name,z,count);
+	}
+	return z;
+}
+
+// Launch a thread for each of the count rings in iface->pmarsh, or hand them
+// to the reactor if it's running. Each ring gets a stats shard of its own,
+// so the interface must have at least count. Rings which couldn't be serviced
+// are closed. Returns -1 if none could be.
+static int
+start_rx_threads(interface *iface,unsigned count){
+	const omphalos_ctx *ctx = get_octx();
+	psocket_marsh *pm = iface->pmarsh;
+	unsigned z;
+
+	assert(count <= iface->rxshards);
+	iface->rxrings = count;
+	iface->curtxm = iface->txm;
+	iface->lasttxm = NULL;
+	iface->txidx = 0;
+	iface->txpending = 0;
+	for(z = 0 ; z < count ; ++z){
+		pm[z].ctx = ctx;
+		pm[z].i = iface;
+		rx_ring_cpus(iface,z,count,&pm[z].cpus);
+		pm[z].node = iface->numanode;
+		pm[z].rxs = &iface->rxs[z];
+		pm[z].cur = pm[z].rxm;
+		pm[z].ridx = 0;
+		gettimeofday(&pm[z].lastrx,NULL);
+		pm[z].lastadapt = pm[z].lastrx;
+		pm[z].adaptframes = pm[z].rxs->frames;
+		pm[z].adaptdrops = pm[z].rxs->drops;
+		if(ctx->reactor){
+			if((pm[z].rhandle = reactor_add(pm[z].fd,ring_service,
+							ring_tick,&pm[z])) == 0){
+				break;
+			}
+		}else if(pthread_create(&pm[z].tid,NULL,psocket_thread,&pm[z])){
+			break;
+		}
+	}
+	if(z == count){
+		return 0;
+	}
+	if(z){ // keep the threads we got; drop the rest
+		diagnostic("[%s] Only launched %u/%u RX threads",
+				iface->name,z,count);
+		close_fanout_rings(pm,z,count);
+		iface->rxrings = z;
+		return 0;
+	}
+	close_fanout_rings(pm,1,count);
+	iface->rxrings = 0;
+	return -1;
+}
+
+// Capture via AF_XDP, with a socket (and thread) per RX queue.
+static int
+prepare_xdp_rings(interface *iface,int idx){
+	const omphalos_ctx *ctx = get_octx();
+	unsigned count,z;
+	psocket_marsh *pm;
+
+	if(ctx->filter || ctx->headers){
+		diagnostic("[%s] Filters don't apply to AF_XDP capture",iface->name);
+	}
+	if((count = xdp_attach(iface,idx)) == 0){
+		return -1;
+	}
+	if((pm = pmarsh_create(count)) == NULL){
+		xdp_detach(iface);
+		return -1;
+	}
+	for(z = 0 ; z < count ; ++z){
+		if((pm[z].fd = xsk_open(iface,idx,z,&pm[z].xsk)) < 0){
+			break;
+		}
+	}
+	if(z){
+		if(z < count){ // remaining queues pass frames to the stack
+			diagnostic("[%s] Capturing only %u/%u RX queues",iface->name,z,count);
+		}
+		iface->pmarsh = pm;
+		iface->rfd = pm[0].fd;
+		iface->rxsnap = 0;
+		// Each queue's thread needs a shard (and plog queue) of its own
+		if(grow_rxshards(iface,z) == 0 && start_rx_threads(iface,z) == 0){
+			diagnostic("[%s] Capturing via AF_XDP (%s mode)",iface->name,
+					iface->xdp->skbmode ? "generic" : "native");
+			return 0;
+		}
+		iface->pmarsh = NULL;
+		iface->rfd = -1;
+		close(pm[0].fd);
+		xsk_close(pm[0].xsk);
+	}
+	pmarsh_destroy(pm,count);
+	xdp_detach(iface);
+	return -1;
+}
+
+// Link speed in Mb/s, if ethtool knows it, or 0.
+static unsigned
+link_mbps(const interface *i){
+	uint32_t speed;
+
+	if(i->settings_valid != SETTINGS_VALID_ETHTOOL){
+		return 0;
+	}
+	speed = ethtool_cmd_speed(&i->settings.ethtool);
+	return speed == (uint32_t)-1 ? 0 : speed; // SPEED_UNKNOWN
+}
+
+// Lay out RX slots for the largest frame we'll be handed. With offloading,
+// that's a GSO or GRO super-frame, which would otherwise be truncated in the
+// ring and copied out via recover_truncated_packet(). TPACKET_V3 packs frames
+// into its blocks by length, so only V1 pays for the larger slots.
+static unsigned
+rx_frame_size(const interface *iface,int offload){
+	unsigned mtu = iface->mtu;
+
+	if(offload){
+		if(iface->gsomax == 0 && iface->gromax == 0){
+			mtu = mtu < OFFLOAD_MTU ? OFFLOAD_MTU : mtu;
+		}else{
+			mtu = mtu < iface->gsomax ? iface->gsomax : mtu;
+			mtu = mtu < iface->gromax ? iface->gromax : mtu;
+		}
+	}
+	return mtu + iface->l2hlen;
+}
+
 static int
 prepare_rx_socket(interface *iface,int idx,int offload){
-	int mtu;
+	const omphalos_ctx *ctx = get_octx();
+	unsigned count,mtu;
+	size_t bytes;
+	int snap;
 
-	if((iface->rfd = packet_socket(ETH_P_ALL)) >= 0){
-		mtu = iface->mtu;
-		if(offload && mtu < OFFLOAD_MTU){
-			mtu = OFFLOAD_MTU;
+	if(xdp_requested(ctx->xdp,iface->name)){
+		if(prepare_xdp_rings(iface,idx) == 0){
+			return 0;
 		}
-		if((iface->rs = mmap_rx_psocket(iface->rfd,idx,mtu,&iface->rxm,
-						&iface->rtpr)) > 0){
-			if( (iface->pmarsh = pmarsh_create()) ){
-				iface->pmarsh->ctx = get_octx();
-				iface->pmarsh->i = iface;
-				iface->curtxm = iface->txm;
-				iface->txidx = 0;
-				if(pthread_create(&iface->pmarsh->tid,NULL,
-						psocket_thread,iface->pmarsh) == 0){
+		diagnostic("[%s] Falling back to packet socket capture",iface->name);
+	}
+	count = ctx->fanout > 1 ? ctx->fanout : 1;
+	if((iface->rfd = packet_socket(ETH_P_ALL)) >= 0){
+		mtu = rx_frame_size(iface,offload);
+		bytes = rx_ring_budget(link_mbps(iface),count);
+		iface->rtpver = ctx->rxringver;
+		if((iface->rs = mmap_rx_psocket(iface->rfd,idx,mtu,bytes,&iface->rxm,
+					&iface->rtpr3,&iface->rtpver)) > 0 &&
+				(snap = filter_psocket(iface->rfd,iface,ctx->filter,ctx->headers)) >= 0){
+			iface->rxsnap = snap;
+			if( (iface->pmarsh = pmarsh_create(count)) ){
+				psocket_marsh *pm = iface->pmarsh;
+
+				pm[0].fd = iface->rfd;
+				pm[0].rxm = iface->rxm;
+				pm[0].rs = iface->rs;
+				pm[0].rtpver = iface->rtpver;
+				pm[0].rtpr3 = iface->rtpr3;
+				pm[0].maxframe = mtu;
+				if(count > 1){
+					// Group IDs are global, so mix in our PID
+					unsigned group = (getpid() + idx) & 0xffffu;
+
+					if(fanout_psocket(iface->rfd,group,ctx->fanoutmode) == 0){
+						count = prepare_fanout_rings(iface,pm,idx,mtu,bytes,
+								group,count);
+					}else{
+						count = 1;
+					}
+				}
+				if(start_rx_threads(iface,count) == 0){
 					return 0;
 				}
-				pmarsh_destroy(iface->pmarsh);
+				pmarsh_destroy(iface->pmarsh,count);
 				iface->pmarsh = NULL;
 			}
 		}
@@ -639,7 +1139,11 @@ prepare_packet_sockets(interface *iface,int idx,int offload){
 			if((iface->fd4 = raw_socket(iface,AF_INET,0)) >= 0){
 				if((iface->fd = packet_socket(ETH_P_ALL)) >= 0){
 					if((iface->ts = mmap_tx_psocket(iface->fd,idx,
-							iface->mtu,&iface->txm,&iface->ttpr)) > 0){
+							iface->mtu,&iface->txm,&iface->ttpr,
+							&iface->txring)) > 0){
+						if(get_octx()->qdiscbypass){
+							qdisc_bypass_psocket(iface->fd);
+						}
 						if(prepare_rx_socket(iface,idx,offload) == 0){
 							return 0;
 						}
@@ -841,6 +1345,9 @@ handle_newlink_locked(interface *iface,const struct ifinfomsg *ii,const struct n
 #endif
 			break;}case IFLA_GSO_MAX_SEGS:{
 			break;}case IFLA_GSO_MAX_SIZE:{
+				if(RTA_PAYLOAD(ra) == sizeof(uint32_t)){
+					iface->gsomax = *(uint32_t *)RTA_DATA(ra);
+				}
 #ifndef IFLA_PAD
 #define IFLA_PAD 42
 #endif
@@ -849,6 +1356,13 @@ handle_newlink_locked(interface *iface,const struct ifinfomsg *ii,const struct n
 #define IFLA_XDP 43
 #endif
 			break;}case IFLA_XDP:{
+#ifndef IFLA_GRO_MAX_SIZE
+#define IFLA_GRO_MAX_SIZE 58
+#endif
+			break;}case IFLA_GRO_MAX_SIZE:{
+				if(RTA_PAYLOAD(ra) == sizeof(uint32_t)){
+					iface->gromax = *(uint32_t *)RTA_DATA(ra);
+				}
 			break;}default:{
 				diagnostic("Unknown iflatype %u on %s",
 						ra->rta_type,iface->name);
@@ -874,6 +1388,7 @@ handle_newlink_locked(interface *iface,const struct ifinfomsg *ii,const struct n
 	}
 	open_nl80211();	// protected by mutex; only opens once
 	iface->flags = ii->ifi_flags;
+	iface->rxcpusirq = lookup_placement(iface->name,&iface->numanode,&iface->rxcpus);
 	iface->settings_valid = SETTINGS_INVALID;
 	// Ethtool can fail for any given command depending on the device's
 	// level of support. All but loopback seem to provide driver info...
@@ -917,13 +1432,23 @@ handle_newlink_locked(interface *iface,const struct ifinfomsg *ii,const struct n
 		if(iface->bcast && (iface->flags & IFF_BROADCAST)){
 			lookup_l2host(iface,iface->bcast);
 		}
+		// The kernel allocates rings on behalf of the calling thread, so
+		// they follow our memory policy.
+		if(iface->numanode >= 0){
+			prefer_numa_node(iface->numanode);
+		}
 		r = prepare_packet_sockets(iface,ii->ifi_index,iface_uses_offloading(iface));
+		if(iface->numanode >= 0){
+			prefer_numa_node(-1);
+		}
 		if(r){
 			// Everything needs already be closed/freed by here
 			iface->txidx = iface->rfd = iface->fd = -1;
-			memset(&iface->rtpr,0,sizeof(iface->rtpr));
+			memset(&iface->rtpr3,0,sizeof(iface->rtpr3));
 			memset(&iface->ttpr,0,sizeof(iface->ttpr));
 			iface->curtxm = iface->rxm = iface->txm = NULL;
+			iface->lasttxm = NULL;
+			iface->txring = 0;
 			iface->ts = iface->rs = 0;
 		}
 	}else{
@@ -935,7 +1460,7 @@ handle_newlink_locked(interface *iface,const struct ifinfomsg *ii,const struct n
 			close(iface->rfd);
 			close(iface->fd);
 			memset(&iface->ttpr,0,sizeof(iface->ttpr));
-			memset(&iface->rtpr,0,sizeof(iface->rtpr));
+			memset(&iface->rtpr3,0,sizeof(iface->rtpr3));
 			iface->rfd = iface->fd = -1;
 			iface->rs = iface->ts = 0;
 		}
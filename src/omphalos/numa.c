@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <omphalos/numa.h>
+#include <linux/mempolicy.h>
+
+int parse_cpulist(const char *list,cpu_set_t *cs){
+	unsigned long lo,hi;
+	char *e;
+
+	while(*list && *list != '\n'){
+		if(!isdigit(*list)){
+			return -1;
+		}
+		lo = strtoul(list,&e,10);
+		if(*e == '-'){
+			if(!isdigit(*++e)){
+				return -1;
+			}
+			hi = strtoul(e,&e,10);
+		}else{
+			hi = lo;
+		}
+		if(hi < lo || hi >= CPU_SETSIZE){
+			return -1;
+		}
+		while(lo <= hi){
+			CPU_SET(lo++,cs);
+		}
+		if(*e == ','){
+			++e;
+		}else if(*e && *e != '\n'){
+			return -1;
+		}
+		list = e;
+	}
+	return 0;
+}
+
+char *format_cpulist(const cpu_set_t *cs,char *buf,size_t len){
+	size_t off = 0;
+	int z,run;
+
+	if(len == 0){
+		return buf;
+	}
+	buf[0] = '\0';
+	for(z = 0 ; z < CPU_SETSIZE ; ++z){
+		if(!CPU_ISSET(z,cs)){
+			continue;
+		}
+		for(run = z ; run + 1 < CPU_SETSIZE && CPU_ISSET(run + 1,cs) ; ++run){
+			;
+		}
+		off += snprintf(buf + off,off < len ? len - off : 0,run > z ? "%s%d-%d" : "%s%d",
+				off ? "," : "",z,run);
+		z = run;
+	}
+	if(off == 0){
+		snprintf(buf,len,"-");
+	}
+	return buf;
+}
+
+// Raw system call, so as not to require libnuma.
+int prefer_numa_node(int node){
+	unsigned long mask[CPU_SETSIZE / (sizeof(unsigned long) * 8)];
+	int mode = MPOL_DEFAULT;
+
+	memset(mask,0,sizeof(mask));
+	if(node >= 0){
+		if((unsigned)node >= sizeof(mask) * 8){
+			return -1;
+		}
+		mask[node / (sizeof(*mask) * 8)] |= 1ul << (node % (sizeof(*mask) * 8));
+		mode = MPOL_PREFERRED;
+	}
+	if(syscall(__NR_set_mempolicy,mode,node >= 0 ? mask : NULL,
+				node >= 0 ? sizeof(mask) * 8 + 1 : 0)){
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef OMPHALOS_NUMA
+#define OMPHALOS_NUMA
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sched.h>
+#include <stddef.h>
+
+// Capture placement. Work for a device ought run on the processors servicing
+// its interrupts, and its memory ought come from the NUMA node to which it's
+// attached. See lookup_placement() (sysfs.c) for discovery.
+
+// Parse a kernel cpulist ("0-3,8,10-11"), ORing its processors into the set.
+// Returns -1 if the list is malformed.
+int parse_cpulist(const char *,cpu_set_t *);
+
+// Render the set as a cpulist into the buffer, returning it. An empty set is
+// rendered as "-".
+char *format_cpulist(const cpu_set_t *,char *,size_t);
+
+// Prefer the node for the calling thread's future allocations, including those
+// the kernel makes on its behalf (packet rings, AF_XDP UMEMs). -1 restores
+// the default (local) policy. Returns -1 if the policy couldn't be set
+// (e.g. on kernels without NUMA support), which is otherwise harmless.
+int prefer_numa_node(int);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
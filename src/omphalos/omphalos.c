@@ -1,4 +1,6 @@
+#include <math.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
 #include <stdarg.h>
@@ -7,18 +9,25 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <inttypes.h>
 #include <pcap/pcap.h>
 #include <sys/socket.h>
 #include <omphalos/usb.h>
+#include <linux/if_packet.h>
 #include <omphalos/pci.h>
 #include <omphalos/diag.h>
+#include <omphalos/plog.h>
 #include <omphalos/iana.h>
 #include <omphalos/lltd.h>
 #include <omphalos/pcap.h>
 #include <sys/capability.h>
 #include <omphalos/privs.h>
+#include <omphalos/probe.h>
 #include <omphalos/route.h>
 #include <omphalos/resolv.h>
+#include <omphalos/reactor.h>
+#include <omphalos/classify.h>
+#include <omphalos/tcpstream.h>
 #include <omphalos/procfs.h>
 #include <omphalos/signals.h>
 #include <omphalos/hwaddrs.h>
@@ -35,6 +44,18 @@
 // usbutils' 'update-usbids'
 #define DEFAULT_USBIDS_FILENAME OMPHALOS_DATADIR "/" PACKAGE_NAME "/" "usb.ids"
 #define DEFAULT_RESOLVCONF_FILENAME "/etc/resolv.conf"
+#define DEFAULT_RINGSTRING "v3"
+#define DEFAULT_HOSTCAP 65536
+#define MIN_HOSTCAP 16
+#define DEFAULT_PROBEPPS 100
+#define DEFAULT_PROBEBURST 32
+#define MAX_PROBEPPS 1000000
+#define MAX_REPLAY 1000000.0
+#define MAX_PLOGKEEP 100000
+#define DEFAULT_TCPMEM (64u << 20u)
+#define DEFAULT_FLOWCAP 16384
+#define MIN_FLOWCAP 16
+#define MAX_FLOWCAP (1u << 24u)
 
 pthread_key_t omphalos_ctx_key;
 
@@ -66,7 +87,8 @@ usage(const char *arg0,int ret){
 	fprintf(fp,"--version print version info, and exit\n");
 	fprintf(fp,"-u username: user name to take after creating packet socket.\n");
 	fprintf(fp," '%s' by default, empty string to disable.\n",DEFAULT_USERNAME);
-	fprintf(fp,"-f filename: libpcap-format save file for input.\n");
+	fprintf(fp,"-f filename: libpcap-format save file for input. May be provided\n");
+	fprintf(fp," multiple times, and may be a directory or glob(7) pattern.\n");
 	fprintf(fp,"--usbids=filename: USB ID Repository (http://www.linux-usb.org/usb-ids.html).\n");
 	fprintf(fp," '%s' by default, empty string to disable.\n",DEFAULT_USBIDS_FILENAME);
 	fprintf(fp,"--ouis=filename: IANA's OUI mapping in get-oui(1) format.\n");
@@ -74,11 +96,40 @@ usage(const char *arg0,int ret){
 	fprintf(fp,"--resolv=filename: resolv.conf-format nameserver list.\n");
 	fprintf(fp," '%s' by default, empty string to disable.\n",DEFAULT_RESOLVCONF_FILENAME);
 	fprintf(fp,"--plog=filename: Enable malformed packet logging to this file.\n");
+	fprintf(fp,"--plogformat=pcap|pcapng: Packet log format. 'pcap' by default.\n");
+	fprintf(fp,"--plogzip: Compress the packet log with gzip.\n");
+	fprintf(fp,"--plogsize=n[k|M|G]: Rotate the packet log once it reaches n bytes.\n");
+	fprintf(fp,"--plogsecs=n: Rotate the packet log once it's n seconds old.\n");
+	fprintf(fp,"--plogkeep=n: Retain only the n most recently rotated packet logs.\n");
 	fprintf(fp,"--mode=");
 	for(e = 0 ; e < OMPHALOS_MODE_MAX ; ++e){
 		fprintf(fp,"%s%s",omphalos_modes[e].str,e + 1 == OMPHALOS_MODE_MAX ? ": Operating mode.\n" : "|");
 	}
 	fprintf(fp," '%s' by default. See documentation for details.\n",DEFAULT_MODESTRING);
+	fprintf(fp,"--ring=v1|v3: RX ring format (TPACKET version).\n");
+	fprintf(fp," '%s' by default, falling back to v1 where unsupported.\n",DEFAULT_RINGSTRING);
+	fprintf(fp,"--fanout=hash|cpu|lb[:n]: Capture using n RX rings+threads per interface.\n");
+	fprintf(fp," n defaults to the number of online CPUs. Disabled by default.\n");
+	fprintf(fp," Rings are drained in parallel, but analyzed one batch at a time.\n");
+	fprintf(fp,"--hostcap=n: Max hosts of each type tracked per interface (0: no limit).\n");
+	fprintf(fp," %u by default, evicting the least recently seen.\n",DEFAULT_HOSTCAP);
+	fprintf(fp,"--tcpmem=n[k|M|G]: Memory for reassembling TCP streams (0: disabled).\n");
+	fprintf(fp," %uM by default.\n",DEFAULT_TCPMEM >> 20u);
+	fprintf(fp,"--flowcap=n: Max flows tracked per interface (0: disabled).\n");
+	fprintf(fp," %u by default, evicting the least recently seen.\n",DEFAULT_FLOWCAP);
+	fprintf(fp,"--probepps=n[:burst]: Max active probe frames per second per interface.\n");
+	fprintf(fp," %u by default, bursts of %u (0: no limit).\n",DEFAULT_PROBEPPS,DEFAULT_PROBEBURST);
+	fprintf(fp,"--qdiscbypass: Transmit directly to the device, bypassing qdiscs.\n");
+	fprintf(fp,"--filter=expr: Capture only frames matching this pcap-filter(7) expression.\n");
+	fprintf(fp,"--headers: Capture only the headers of TCP segments.\n");
+	fprintf(fp,"--xdp=dev[,dev...]: Capture on these devices via AF_XDP. Frames are\n");
+	fprintf(fp," not passed to the host's network stack; use only on capture devices.\n");
+	fprintf(fp,"--reactor[=n]: Service all RX rings with a pool of n threads, rather than\n");
+	fprintf(fp," a thread per ring. n defaults to the number of online CPUs.\n");
+	fprintf(fp,"--pcapthreads=n: Dissect multiple -f inputs on n threads.\n");
+	fprintf(fp," n defaults to the number of online CPUs.\n");
+	fprintf(fp,"--replay=speed|max: Play -f inputs back in order at capture time,\n");
+	fprintf(fp," scaled by speed (e.g. 1, 10x, 0.5), or as fast as possible (max).\n");
 	exit(ret);
 }
 
@@ -94,6 +145,284 @@ lex_omphalos_mode(const char *str){
 	return OMPHALOS_MODE_MAX;
 }
 
+static int
+lex_ring_version(const char *str,unsigned *ver){
+	if(strcmp(str,"v1") == 0){
+		*ver = TPACKET_V1;
+	}else if(strcmp(str,"v3") == 0){
+		*ver = TPACKET_V3;
+	}else{
+		return -1;
+	}
+	return 0;
+}
+
+// Validate a --filter expression up front, rather than failing as each
+// device comes up. It's compiled anew for each device's link type.
+static int
+check_filter(const char *expr){
+	struct bpf_program bp;
+	pcap_t *p;
+	int r;
+
+	if((p = pcap_open_dead(DLT_EN10MB,65535)) == NULL){
+		return -1;
+	}
+	if((r = pcap_compile(p,&bp,expr,1,PCAP_NETMASK_UNKNOWN)) == 0){
+		pcap_freecode(&bp);
+	}
+	pcap_close(p);
+	return r;
+}
+
+// Parse "mode[:count]" for --fanout. A missing count means one ring per
+// online processor.
+static int
+lex_fanout(const char *str,unsigned *mode,unsigned *count){
+	static const struct {
+		const char *str;
+		unsigned mode;
+	} modes[] = {
+		{ "hash",	PACKET_FANOUT_HASH,	},
+		{ "cpu",	PACKET_FANOUT_CPU,	},
+		{ "lb",		PACKET_FANOUT_LB,	},
+		{ NULL,		0,			}
+	}, *m;
+	const char *delim;
+	size_t len;
+
+	if( (delim = strchr(str,':')) ){
+		len = delim - str;
+	}else{
+		len = strlen(str);
+	}
+	for(m = modes ; m->str ; ++m){
+		if(strlen(m->str) == len && strncmp(str,m->str,len) == 0){
+			break;
+		}
+	}
+	if(m->str == NULL){
+		return -1;
+	}
+	*mode = m->mode;
+	if(delim){
+		unsigned long ul;
+		char *e;
+
+		if(!isdigit(*++delim)){
+			return -1;
+		}
+		errno = 0;
+		ul = strtoul(delim,&e,0);
+		if(*e || errno || ul < 1 || ul > 0xffffu){
+			return -1;
+		}
+		*count = ul;
+	}else{
+		long cpus;
+
+		if((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1){
+			cpus = 1;
+		}
+		*count = cpus;
+	}
+	return 0;
+}
+
+// Parse --hostcap. 0 disables the cap; otherwise, it must be large enough
+// that the hosts of any one packet needn't evict one another.
+static int
+lex_hostcap(const char *str,unsigned *cap){
+	unsigned long ul;
+	char *e;
+
+	if(!isdigit(*str)){
+		return -1;
+	}
+	errno = 0;
+	ul = strtoul(str,&e,0);
+	if(*e || errno || ul > UINT_MAX || (ul && ul < MIN_HOSTCAP)){
+		return -1;
+	}
+	*cap = ul;
+	return 0;
+}
+
+// Parse --flowcap. 0 disables flow tracking.
+static int
+lex_flowcap(const char *str,unsigned *cap){
+	unsigned long ul;
+	char *e;
+
+	if(!isdigit(*str)){
+		return -1;
+	}
+	errno = 0;
+	ul = strtoul(str,&e,0);
+	if(*e || errno || ul > MAX_FLOWCAP || (ul && ul < MIN_FLOWCAP)){
+		return -1;
+	}
+	*cap = ul;
+	return 0;
+}
+
+// Parse "rate[:burst]" for --probepps. A rate of 0 disables limiting.
+static int
+lex_probepps(const char *str,unsigned *rate,unsigned *burst){
+	unsigned long ul;
+	char *e;
+
+	if(!isdigit(*str)){
+		return -1;
+	}
+	errno = 0;
+	ul = strtoul(str,&e,0);
+	if(errno || ul > MAX_PROBEPPS){
+		return -1;
+	}
+	*rate = ul;
+	if(*e == ':'){
+		if(!isdigit(*++e)){
+			return -1;
+		}
+		ul = strtoul(e,&e,0);
+		if(errno || ul < 1 || ul > 0xffffu){
+			return -1;
+		}
+		*burst = ul;
+	}else{
+		*burst = DEFAULT_PROBEBURST;
+	}
+	return *e ? -1 : 0;
+}
+
+// Parse the optional thread count for --reactor, defaulting to the number of
+// online processors.
+static int
+lex_reactor(const char *str,unsigned *threads){
+	unsigned long ul;
+	long cpus;
+	char *e;
+
+	if(str == NULL){
+		if((cpus = sysconf(_SC_NPROCESSORS_ONLN)) <= 0){
+			cpus = 1;
+		}
+		*threads = cpus > REACTOR_MAXTHREADS ? REACTOR_MAXTHREADS : cpus;
+		return 0;
+	}
+	if(!isdigit(*str)){
+		return -1;
+	}
+	errno = 0;
+	ul = strtoul(str,&e,0);
+	if(errno || *e || ul < 1 || ul > REACTOR_MAXTHREADS){
+		return -1;
+	}
+	*threads = ul;
+	return 0;
+}
+
+// Parse the thread count for --pcapthreads.
+static int
+lex_pcapthreads(const char *str,unsigned *threads){
+	unsigned long ul;
+	char *e;
+
+	if(!isdigit(*str)){
+		return -1;
+	}
+	errno = 0;
+	ul = strtoul(str,&e,0);
+	if(errno || *e || ul < 1 || ul > PCAP_MAXTHREADS){
+		return -1;
+	}
+	*threads = ul;
+	return 0;
+}
+
+// Parse the playback speed for --replay: "max", or a positive multiple of
+// capture time, optionally suffixed with 'x'.
+static int
+lex_replay(const char *str,double *speed){
+	double d;
+	char *e;
+
+	if(strcmp(str,"max") == 0){
+		*speed = HUGE_VAL;
+		return 0;
+	}
+	if(!isdigit(*str) && *str != '.'){
+		return -1;
+	}
+	errno = 0;
+	d = strtod(str,&e);
+	if(*e == 'x'){
+		++e;
+	}
+	if(errno || *e || !(d > 0) || d > MAX_REPLAY){
+		return -1;
+	}
+	*speed = d;
+	return 0;
+}
+
+static int
+lex_plogformat(const char *str,int *pcapng){
+	if(strcmp(str,"pcap") == 0){
+		*pcapng = 0;
+	}else if(strcmp(str,"pcapng") == 0){
+		*pcapng = 1;
+	}else{
+		return -1;
+	}
+	return 0;
+}
+
+// Parse --plogsize and --tcpmem: a byte count, optionally suffixed with a
+// binary multiplier (k, M or G). 0 is only accepted if zerook is set.
+static int
+lex_bytes(const char *str,int zerook,uintmax_t *bytes){
+	uintmax_t um;
+	unsigned shift;
+	char *e;
+
+	if(!isdigit(*str)){
+		return -1;
+	}
+	errno = 0;
+	um = strtoumax(str,&e,0);
+	switch(*e){
+		case 'k': case 'K': shift = 10; ++e; break;
+		case 'M': shift = 20; ++e; break;
+		case 'G': shift = 30; ++e; break;
+		default: shift = 0; break;
+	}
+	if(errno || *e || (um == 0 && !zerook) || um > (UINTMAX_MAX >> shift)){
+		return -1;
+	}
+	*bytes = um << shift;
+	return 0;
+}
+
+// Parse a positive count no greater than max, for --plogsecs and --plogkeep.
+static int
+lex_plogcount(const char *str,unsigned max,unsigned *count){
+	unsigned long ul;
+	char *e;
+
+	if(!isdigit(*str)){
+		return -1;
+	}
+	errno = 0;
+	ul = strtoul(str,&e,0);
+	if(errno || *e || ul < 1 || ul > max){
+		return -1;
+	}
+	*count = ul;
+	return 0;
+}
+
 static void
 version(const char *arg0){
 	fprintf(stdout,"%s %s\n",PACKAGE,VERSION);
@@ -114,6 +443,24 @@ enum {
 	OPT_PLOG,
 	OPT_RESOLV,
 	OPT_MODE,
+	OPT_RING,
+	OPT_FANOUT,
+	OPT_HOSTCAP,
+	OPT_QDISCBYPASS,
+	OPT_PROBEPPS,
+	OPT_FILTER,
+	OPT_HEADERS,
+	OPT_XDP,
+	OPT_REACTOR,
+	OPT_PCAPTHREADS,
+	OPT_REPLAY,
+	OPT_PLOGFORMAT,
+	OPT_PLOGZIP,
+	OPT_PLOGSIZE,
+	OPT_PLOGSECS,
+	OPT_PLOGKEEP,
+	OPT_TCPMEM,
+	OPT_FLOWCAP,
 };
 
 int omphalos_setup(int argc,char * const *argv,omphalos_ctx *pctx){
@@ -148,6 +495,96 @@ int omphalos_setup(int argc,char * const *argv,omphalos_ctx *pctx){
 			.has_arg = 2,
 			.flag = NULL,
 			.val = OPT_MODE,
+		},{
+			.name = "ring",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_RING,
+		},{
+			.name = "fanout",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_FANOUT,
+		},{
+			.name = "hostcap",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_HOSTCAP,
+		},{
+			.name = "qdiscbypass",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = OPT_QDISCBYPASS,
+		},{
+			.name = "probepps",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_PROBEPPS,
+		},{
+			.name = "filter",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_FILTER,
+		},{
+			.name = "headers",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = OPT_HEADERS,
+		},{
+			.name = "xdp",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_XDP,
+		},{
+			.name = "reactor",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_REACTOR,
+		},{
+			.name = "pcapthreads",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_PCAPTHREADS,
+		},{
+			.name = "replay",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_REPLAY,
+		},{
+			.name = "plogformat",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_PLOGFORMAT,
+		},{
+			.name = "plogzip",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = OPT_PLOGZIP,
+		},{
+			.name = "plogsize",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_PLOGSIZE,
+		},{
+			.name = "plogsecs",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_PLOGSECS,
+		},{
+			.name = "plogkeep",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_PLOGKEEP,
+		},{
+			.name = "tcpmem",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_TCPMEM,
+		},{
+			.name = "flowcap",
+			.has_arg = 2,
+			.flag = NULL,
+			.val = OPT_FLOWCAP,
 		},
 		{
 			.name = NULL,
@@ -158,7 +595,9 @@ int omphalos_setup(int argc,char * const *argv,omphalos_ctx *pctx){
 	};
 	// FIXME maybe CAP_SETPCAP as well?
 	const cap_value_t caparray[] = { CAP_NET_RAW, };
-	const char *user = NULL,*mode = NULL;
+	const char *user = NULL,*mode = NULL,*ring = NULL,*hostcap = NULL;
+	const char *probepps = NULL,*plogformat = NULL,*tcpmem = NULL;
+	const char *flowcap = NULL;
 	int opt,longidx;
 	
 	memset(pctx,0,sizeof(*pctx));
@@ -215,8 +654,136 @@ int omphalos_setup(int argc,char * const *argv,omphalos_ctx *pctx){
 			}
 			mode = optarg;
 			break;
+		}case OPT_RING:{
+			if(ring){
+				fprintf(stderr,"Provided --ring twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			ring = optarg;
+			break;
+		}case OPT_FANOUT:{
+			if(pctx->fanout){
+				fprintf(stderr,"Provided --fanout twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(lex_fanout(optarg,&pctx->fanoutmode,&pctx->fanout)){
+				fprintf(stderr,"Invalid fanout specification: %s\n",optarg);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			break;
+		}case OPT_HOSTCAP:{
+			if(hostcap){
+				fprintf(stderr,"Provided --hostcap twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			hostcap = optarg;
+			break;
+		}case OPT_QDISCBYPASS:{
+			if(pctx->qdiscbypass){
+				fprintf(stderr,"Provided --qdiscbypass twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			pctx->qdiscbypass = 1;
+			break;
+		}case OPT_PROBEPPS:{
+			if(probepps){
+				fprintf(stderr,"Provided --probepps twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			probepps = optarg;
+			break;
+		}case OPT_FILTER:{
+			if(pctx->filter){
+				fprintf(stderr,"Provided --filter twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(check_filter(optarg)){
+				fprintf(stderr,"Invalid filter expression: %s\n",optarg);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			pctx->filter = optarg;
+			break;
+		}case OPT_HEADERS:{
+			if(pctx->headers){
+				fprintf(stderr,"Provided --headers twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			pctx->headers = 1;
+			break;
+		}case OPT_XDP:{
+			if(pctx->xdp){
+				fprintf(stderr,"Provided --xdp twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			pctx->xdp = optarg;
+			break;
+		}case OPT_REACTOR:{
+			if(pctx->reactor){
+				fprintf(stderr,"Provided --reactor twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(lex_reactor(optarg,&pctx->reactor)){
+				fprintf(stderr,"Invalid reactor thread count (1..%u): %s\n",
+						REACTOR_MAXTHREADS,optarg);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			break;
+		}case OPT_PCAPTHREADS:{
+			if(pctx->pcapthreads){
+				fprintf(stderr,"Provided --pcapthreads twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(lex_pcapthreads(optarg,&pctx->pcapthreads)){
+				fprintf(stderr,"Invalid pcap thread count (1..%u): %s\n",
+						PCAP_MAXTHREADS,optarg);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			break;
+		}case OPT_REPLAY:{
+			if(pctx->replay){
+				fprintf(stderr,"Provided --replay twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(lex_replay(optarg,&pctx->replay)){
+				fprintf(stderr,"Invalid replay speed (max or 0..%g): %s\n",
+						MAX_REPLAY,optarg);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			break;
 		}case OPT_PLOG:{
-			if(pctx->plog){
+			if(pctx->plog.path){
 				fprintf(stderr,"Provided --plog twice\n");
 				usage(argv[0],EXIT_FAILURE);
 			}
@@ -224,11 +791,93 @@ int omphalos_setup(int argc,char * const *argv,omphalos_ctx *pctx){
 				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
 				usage(argv[0],EXIT_FAILURE);
 			}
-			if((pctx->plog = init_pcap_write(&pctx->plogp,optarg)) == NULL){
-				fprintf(stderr,"Couldn't write to %s\n",optarg);
+			pctx->plog.path = optarg;
+			break;
+		}case OPT_PLOGFORMAT:{
+			if(plogformat){
+				fprintf(stderr,"Provided --plogformat twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(lex_plogformat(optarg,&pctx->plog.pcapng)){
+				fprintf(stderr,"Invalid packet log format (pcap or pcapng): %s\n",optarg);
 				usage(argv[0],EXIT_FAILURE);
 			}
-			fprintf(stdout,"Logging malformed packets to %s\n",optarg);
+			plogformat = optarg;
+			break;
+		}case OPT_PLOGZIP:{
+			if(pctx->plog.gzip){
+				fprintf(stderr,"Provided --plogzip twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			pctx->plog.gzip = 1;
+			break;
+		}case OPT_PLOGSIZE:{
+			if(pctx->plog.maxbytes){
+				fprintf(stderr,"Provided --plogsize twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(lex_bytes(optarg,0,&pctx->plog.maxbytes)){
+				fprintf(stderr,"Invalid packet log size: %s\n",optarg);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			break;
+		}case OPT_PLOGSECS:{
+			if(pctx->plog.maxsecs){
+				fprintf(stderr,"Provided --plogsecs twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(lex_plogcount(optarg,UINT_MAX,&pctx->plog.maxsecs)){
+				fprintf(stderr,"Invalid packet log age (1..%u): %s\n",UINT_MAX,optarg);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			break;
+		}case OPT_PLOGKEEP:{
+			if(pctx->plog.keep){
+				fprintf(stderr,"Provided --plogkeep twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(lex_plogcount(optarg,MAX_PLOGKEEP,&pctx->plog.keep)){
+				fprintf(stderr,"Invalid packet log count (1..%u): %s\n",MAX_PLOGKEEP,optarg);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			break;
+		}case OPT_TCPMEM:{
+			if(tcpmem){
+				fprintf(stderr,"Provided --tcpmem twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			tcpmem = optarg;
+			break;
+		}case OPT_FLOWCAP:{
+			if(flowcap){
+				fprintf(stderr,"Provided --flowcap twice\n");
+				usage(argv[0],EXIT_FAILURE);
+			}
+			if(!optarg){
+				fprintf(stderr,"Option requires parameter: '%s'\n",ops[longidx].name);
+				usage(argv[0],EXIT_FAILURE);
+			}
+			flowcap = optarg;
 			break;
 		}case 'p':{
 			if(pctx->nopromiscuous){
@@ -238,11 +887,10 @@ int omphalos_setup(int argc,char * const *argv,omphalos_ctx *pctx){
 			pctx->nopromiscuous = 1;
 			break;
 		}case 'f':{
-			if(pctx->pcapfn){
-				fprintf(stderr,"Provided %c twice\n",opt);
+			if(add_pcap_input(pctx,optarg)){
+				fprintf(stderr,"Invalid pcap input: %s\n",optarg);
 				usage(argv[0],EXIT_FAILURE);
 			}
-			pctx->pcapfn = optarg;
 			break;
 		}case 'u':{
 			if(user){
@@ -272,6 +920,22 @@ int omphalos_setup(int argc,char * const *argv,omphalos_ctx *pctx){
 		usage(argv[0],-1);
 		return -1;
 	}
+	if(pctx->replay && !pctx->pcapcount){
+		fprintf(stderr,"--replay requires -f\n");
+		usage(argv[0],-1);
+		return -1;
+	}
+	if(!pctx->plog.path && (plogformat || pctx->plog.gzip || pctx->plog.maxbytes ||
+				pctx->plog.maxsecs || pctx->plog.keep)){
+		fprintf(stderr,"--plogformat, --plogzip, --plogsize, --plogsecs and --plogkeep require --plog\n");
+		usage(argv[0],-1);
+		return -1;
+	}
+	if(pctx->plog.keep && !pctx->plog.maxbytes && !pctx->plog.maxsecs){
+		fprintf(stderr,"--plogkeep requires --plogsize or --plogsecs\n");
+		usage(argv[0],-1);
+		return -1;
+	}
 	if(user == NULL){
 		user = DEFAULT_USERNAME;
 	}
@@ -293,9 +957,55 @@ int omphalos_setup(int argc,char * const *argv,omphalos_ctx *pctx){
 		return -1;
 	}
 	printf("Operating mode: %s\n",mode);
+	if(ring == NULL){
+		ring = DEFAULT_RINGSTRING;
+	}
+	if(lex_ring_version(ring,&pctx->rxringver)){
+		fprintf(stderr,"Invalid ring format: %s\n",ring);
+		usage(argv[0],-1);
+		return -1;
+	}
+	if(hostcap == NULL){
+		pctx->hostcap = DEFAULT_HOSTCAP;
+	}else if(lex_hostcap(hostcap,&pctx->hostcap)){
+		fprintf(stderr,"Invalid host cap (0 or at least %u): %s\n",MIN_HOSTCAP,hostcap);
+		usage(argv[0],-1);
+		return -1;
+	}
+	if(probepps == NULL){
+		pctx->probepps = DEFAULT_PROBEPPS;
+		pctx->probeburst = DEFAULT_PROBEBURST;
+	}else if(lex_probepps(probepps,&pctx->probepps,&pctx->probeburst)){
+		fprintf(stderr,"Invalid probe rate (0..%u[:burst]): %s\n",MAX_PROBEPPS,probepps);
+		usage(argv[0],-1);
+		return -1;
+	}
+	if(tcpmem == NULL){
+		pctx->tcpmem = DEFAULT_TCPMEM;
+	}else if(lex_bytes(tcpmem,1,&pctx->tcpmem)){
+		fprintf(stderr,"Invalid TCP reassembly memory: %s\n",tcpmem);
+		usage(argv[0],-1);
+		return -1;
+	}
+	if(flowcap == NULL){
+		pctx->flowcap = DEFAULT_FLOWCAP;
+	}else if(lex_flowcap(flowcap,&pctx->flowcap)){
+		fprintf(stderr,"Invalid flow cap (0 or %u..%u): %s\n",MIN_FLOWCAP,MAX_FLOWCAP,flowcap);
+		usage(argv[0],-1);
+		return -1;
+	}
+	// The log is created with our original credentials, but any rotations
+	// will be created with those remaining after the drop.
+	if(pctx->plog.path){
+		if(plog_open(&pctx->plog)){
+			fprintf(stderr,"Couldn't write to %s (%s?)\n",pctx->plog.path,strerror(errno));
+			return -1;
+		}
+		printf("Logging malformed packets to %s\n",pctx->plog.path);
+	}
 	// Drop privileges (possibly requiring a setuid()), and mask
 	// cancellation signals, before creating other threads.
-	if(pctx->pcapfn){
+	if(pctx->pcapcount){
 		if(handle_priv_drop(user,NULL,0)){
 			return -1;
 		}
@@ -310,6 +1020,10 @@ int omphalos_setup(int argc,char * const *argv,omphalos_ctx *pctx){
 	if(init_interfaces()){
 		return -1;
 	}
+	if(init_classifier()){
+		return -1;
+	}
+	init_tcpstreams(pctx->tcpmem);
 	pctx->iface.vdiagnostic = default_vdiagnostic;
 	if(pthread_key_create(&omphalos_ctx_key,NULL)){
 		return -1;
@@ -349,7 +1063,12 @@ int omphalos_init(const omphalos_ctx *pctx){
 	if(init_lltd_service()){
 		return -1;
 	}
-	if(pctx->pcapfn){
+	if(pctx->plog.path){
+		if(plog_start()){
+			return -1;
+		}
+	}
+	if(pctx->pcapcount){
 		if(handle_pcap_file(pctx)){
 			return -1;
 		}
@@ -357,6 +1076,16 @@ int omphalos_init(const omphalos_ctx *pctx){
 		if(init_pci_support()){
 			diagnostic("Warning: no PCI support available");
 		}
+		if(pctx->mode != OMPHALOS_MODE_SILENT){
+			if(init_probes(pctx->probepps,pctx->probeburst)){
+				return -1;
+			}
+		}
+		if(pctx->reactor){
+			if(init_reactor(pctx->reactor)){
+				return -1;
+			}
+		}
 		if(handle_netlink_socket()){
 			return -1;
 		}
@@ -367,8 +1096,11 @@ int omphalos_init(const omphalos_ctx *pctx){
 void omphalos_cleanup(const omphalos_ctx *pctx){
 	cleanup_pcap(pctx);
 	cleanup_naming();
+	stop_probes();
 	free_routes();
 	cleanup_interfaces();
+	cleanup_classifier();
+	stop_reactor();
 	stop_lltd_service();
 	cleanup_iana_naming();
 	stop_pci_support();
@@ -11,9 +11,11 @@ extern "C" {
 #include <sys/time.h>
 #include <pcap/pcap.h>
 #include <omphalos/128.h>
+#include <omphalos/plog.h>
 
 struct l4srv;
 struct l2host;
+struct flowrec;
 struct l3host;
 struct iphost;
 struct ipv6host;
@@ -30,9 +32,13 @@ typedef struct omphalos_packet {
 	uint16_t l3proto;		// Actual L3 protocol number
 	struct l3host *l3s,*l3d;
 	uint128_t l3saddr,l3daddr;
+	uint8_t l4proto;		// IP protocol of the innermost payload
+					//  (0: no transport header seen)
 	uint16_t l4src,l4dst;
 	unsigned malformed;
 	unsigned noproto;
+	unsigned snapped;		// Truncated by the capture filter; L3
+					//  lengths might exceed the frame
 } omphalos_packet;
 
 // UI callback interface. Any number may be NULL, save diagnostic.
@@ -78,6 +84,19 @@ typedef struct omphalos_iface {
 	void *(*srv_event)(const struct interface *,struct l2host *,
 				struct l3host *,struct l4srv *);
 
+	// Host eviction callback, invoked when a host table reaches its cap
+	// (see omphalos_ctx's hostcap). If the l3host is non-NULL, it (and its
+	// services) are about to be freed; drop any state referencing them.
+	// Otherwise, the l2host is about to be freed, following the eviction
+	// of all l3hosts last seen via it.
+	void (*evict_event)(const struct interface *,struct l2host *,struct l3host *);
+
+	// Flow export callback, invoked with a flow's final counters as it
+	// leaves the interface's flow table, having gone idle or been evicted
+	// (see flow.h and omphalos_ctx's flowcap). Called with the interface
+	// lock held; the record is only valid for the duration of the call.
+	void (*flow_event)(const struct interface *,const struct flowrec *);
+
 	// Network metastatus change callback, fed by network analysis. Covers
 	// everything from /proc to DNS to routing.
 	void (*network_event)(void);
@@ -96,15 +115,33 @@ typedef enum {
 // Process-scope settings, generally configured on startup based off
 // command-line options.
 typedef struct omphalos_ctx {
-	const char *pcapfn;	 // PCAP-format filename FIXME support multiple?
+	char **pcapfns;		 // PCAP-format input files, in merge order
+	unsigned pcapcount;
+	unsigned pcapthreads;	 // threads dissecting pcapfns (0: online CPUs)
+	double replay;		 // play pcapfns back at this multiple of capture
+				 //  time (0: unpaced; HUGE_VAL: unpaced, but
+				 //  with capture timestamps)
 	const char *ianafn;	 // IANA's OUI mappings in get-oui(1) format
 	const char *resolvconf;	 // resolver configuration file
 	const char *usbidsfn;	 // USB ID database in update-usbids(8) format
 	omphalos_mode_enum mode; // operating mode
 	int nopromiscuous;	 // do not make newly-discovered devices promiscous
+	unsigned rxringver;	 // requested RX TPACKET version (V1 or V3)
+	unsigned fanout;	 // RX rings+threads per interface (0: no fanout)
+	unsigned fanoutmode;	 // PACKET_FANOUT_{HASH,CPU,LB}
+	unsigned hostcap;	 // max l2hosts, and l3hosts per family, per
+				 //  interface (0: unbounded)
+	int qdiscbypass;	 // send bypassing the qdisc layer
+	unsigned probepps;	 // active probe frames/s per interface (0: no limit)
+	unsigned probeburst;	 // ...sendable back-to-back
+	uintmax_t tcpmem;	 // TCP reassembly memory budget (0: disabled)
+	unsigned flowcap;	 // max flows tracked per interface (0: disabled)
+	const char *filter;	 // pcap-filter(7) expression applied to RX
+	int headers;		 // capture TCP only through its headers
+	const char *xdp;	 // devices to capture via AF_XDP, comma-delimited
+	unsigned reactor;	 // threads servicing all RX rings (0: one per ring)
 	omphalos_iface iface;
-	pcap_t *plogp;
-	pcap_dumper_t *plog;
+	plogconf plog;		 // --plog output (path is NULL if disabled)
 } omphalos_ctx;
 
 // The omphalos_ctx for a given thread can be accessed via this TSD.
@@ -1,6 +1,15 @@
+#include <glob.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
 #include <assert.h>
+#include <dirent.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <pcap/pcap.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -12,6 +21,9 @@
 #include <omphalos/irda.h>
 #include <omphalos/pcap.h>
 #include <omphalos/diag.h>
+#include <omphalos/plog.h>
+#include <omphalos/filter.h>
+#include <omphalos/savefile.h>
 #include <linux/if_ether.h>
 #include <omphalos/hwaddrs.h>
 #include <omphalos/ethernet.h>
@@ -20,17 +32,131 @@
 #include <omphalos/netaddrs.h>
 #include <omphalos/interface.h>
 
-static pcap_dumper_t *dumper;
-static pthread_mutex_t dumplock = PTHREAD_MUTEX_INITIALIZER;
-
+// With a single input file, or when replaying, files are dissected directly
+// into this interface. Otherwise, it's the shared interface into which each
+// file's discoveries are merged, in the order the files were provided.
 static interface pcap_file_interface;
 
+// A file's interfaces beyond its first: a pcapng file can describe any number
+// of them, and each becomes an interface of its own, named for the file and
+// its index within it. They're allocated as their descriptions are read.
+typedef struct pcap_links {
+	interface **ifaces;
+	unsigned count;
+} pcap_links;
+
+// ...and those of files dissected directly.
+static pcap_links pcap_file_links;
+
+// With --replay, files are dissected in order on the calling thread, each
+// frame held back until its capture time (relative to the first frame's),
+// scaled by the speed, has elapsed. Capture time running backwards (a later
+// file starting before an earlier one ended) restarts the schedule.
+typedef struct pcap_replay {
+	double speed;			// HUGE_VAL for unpaced
+	struct timespec wall0;		// CLOCK_MONOTONIC at which...
+	struct timeval cap0;		// ...this capture time was scheduled
+	struct timeval last;		// most recent capture time
+	double span;			// capture time covered, in seconds
+	int started;
+} pcap_replay;
+
+static pcap_replay pcap_replay_state;
+
+// Multiple files are each dissected into their own interface by a pool of
+// workers. The main thread merges finished files into pcap_file_interface in
+// order, so the result (and the sequence of UI callbacks) doesn't depend on
+// which worker finished first. Workers run at most 'window' files ahead of the
+// merge, bounding the unmerged host tables held in memory. Their interfaces
+// are isolated, so a name learned from a file is applied only to that file's
+// hosts (and carried along by the merge), whatever else is being dissected.
+typedef struct pcap_job {
+	interface iface;	// private to the file until it's merged
+	pcap_links links;	// ...as are any further pcapng interfaces
+	const char *fn;
+	int done;		// dissection is complete, with result r
+	int r;
+} pcap_job;
+
+typedef struct pcap_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pcap_job *jobs;
+	unsigned count;
+	unsigned next;		// next file to be claimed by a worker
+	unsigned merged;	// files merged into pcap_file_interface
+	unsigned window;	// files dissected ahead of the merge, at most
+	int failed;		// stop claiming files
+	omphalos_ctx ctx;	// for the workers, sans UI callbacks
+} pcap_pool;
+
 typedef struct pcap_marshal {
 	interface *i;
 	const omphalos_iface *octx;
 	analyzefxn handler;
+	pcap_handler fxn;		// per-frame entry point for the link type
+	struct bpf_program bp;		// --filter, when read natively
+	int filtered;			// ...if bp is valid
+	pcap_replay *replay;		// NULL unless replaying
 } pcap_marshal;
 
+// Hold the frame back until it's due. Frames which are already late are
+// dissected immediately; we don't skip to catch up.
+static void
+replay_pace(pcap_replay *pr,const struct timeval *ts){
+	struct timespec due,now;
+	struct timeval d;
+	double off;
+
+	if(!pr->started || timercmp(ts,&pr->last,<)){
+		clock_gettime(CLOCK_MONOTONIC,&pr->wall0);
+		pr->cap0 = pr->last = *ts;
+		pr->started = 1;
+		return;
+	}
+	timersub(ts,&pr->last,&d);
+	pr->span += d.tv_sec + d.tv_usec / 1000000.0;
+	pr->last = *ts;
+	if(pr->speed == HUGE_VAL){
+		return;
+	}
+	timersub(ts,&pr->cap0,&d);
+	off = (d.tv_sec + d.tv_usec / 1000000.0) / pr->speed;
+	due.tv_sec = pr->wall0.tv_sec + (time_t)off;
+	due.tv_nsec = pr->wall0.tv_nsec + (long)((off - (time_t)off) * 1000000000);
+	if(due.tv_nsec >= 1000000000){
+		++due.tv_sec;
+		due.tv_nsec -= 1000000000;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	if(now.tv_sec > due.tv_sec || (now.tv_sec == due.tv_sec && now.tv_nsec >= due.tv_nsec)){
+		return;
+	}
+	while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&due,NULL) == EINTR){
+		;
+	}
+}
+
+// Account for the frame, and determine the time at which it was seen: its
+// capture time when replaying, and otherwise the time at which it was read.
+static void
+count_pcap_frame(pcap_marshal *pm,const struct pcap_pkthdr *h,struct timeval *tv){
+	interface *iface = pm->i;
+
+	if(pm->replay){
+		replay_pace(pm->replay,&h->ts);
+		*tv = h->ts;
+	}else{
+		gettimeofday(tv,NULL);
+	}
+	rxshard_begin(iface->rxs);
+	++iface->rxs->frames;
+	iface->rxs->bytes += h->len;
+	timestat_inc(&iface->rxs->fps,tv,1);
+	timestat_inc(&iface->rxs->bps,tv,h->len);
+	rxshard_end(iface->rxs);
+}
+
 static int
 packet_sll_type(const omphalos_packet *packet){
 	// FIXME if we're the source, is a broadcast-targeted packet a
@@ -49,8 +175,6 @@ packet_sll_type(const omphalos_packet *packet){
 static void
 postprocess(pcap_marshal *pm,omphalos_packet *packet,interface *iface,
 			const struct pcap_pkthdr *h,const void *bytes){
-	struct pcap_pkthdr phdr;
-
 	if(packet->l2s){
 		l2srcpkt(packet->l2s);
 	}
@@ -63,17 +187,17 @@ postprocess(pcap_marshal *pm,omphalos_packet *packet,interface *iface,
 	if(packet->l3d){
 		l3_dstpkt(packet->l3d);
 	}
+	observe_flow(packet,h->len);
 	if(packet->noproto || packet->malformed){
 		struct pcap_ll pll;
 		hwaddrint hw;
 
 		memset(&pll,0,sizeof(pll));
-		memcpy(&phdr,h,sizeof(phdr));
 		if(packet->noproto){
-			++iface->noprotocol;
+			rxshard_inc(iface->rxs,&iface->rxs->noprotocol);
 		}
 		if(packet->malformed){
-			++iface->malformed;
+			rxshard_inc(iface->rxs,&iface->rxs->malformed);
 		}
 		pll.pkttype = packet_sll_type(packet);
 		pll.arphrd = htons(packet->i->arptype);
@@ -81,7 +205,7 @@ postprocess(pcap_marshal *pm,omphalos_packet *packet,interface *iface,
 		hw = packet->l2s ? get_hwaddr(packet->l2s) : 0;
 		memcpy(&pll.haddr,&hw,packet->i->addrlen > sizeof(pll.haddr) ? sizeof(pll.haddr) : packet->i->addrlen);
 		pll.ethproto = htons(packet->pcap_ethproto);
-		log_pcap_packet(&phdr,(void *)bytes,packet->i->l2hlen,&pll);
+		log_pcap_packet(iface->rxs,iface->name,h,bytes,packet->i->l2hlen,&pll);
 	}
 	if(pm->octx->packet_read){
 		pm->octx->packet_read(packet);
@@ -96,18 +220,23 @@ handle_pcap_direct(u_char *gi,const struct pcap_pkthdr *h,const u_char *bytes){
 	interface *iface = pm->i; // interface for the pcap file
 	struct pcap_pkthdr phdr;
 	omphalos_packet packet;
+	struct timeval tv;
 
-	++iface->frames;
+	count_pcap_frame(pm,h,&tv);
+	// Run what's due first, so that timers armed by this frame are
+	// scheduled from its time (the wheel begins at zero).
+	twheel_advance(&iface->timers,&h->ts);
 	//diagnostic("Frame %ju",iface->frames);
 	if(h->caplen != h->len){
-		++iface->truncated;
+		rxshard_inc(iface->rxs,&iface->rxs->truncated);
 		diagnostic("Partial capture (%u/%ub)",h->caplen,h->len);
 		return;
 	}
 	memset(&packet,0,sizeof(packet));
 	packet.i = iface;
+	packet.tv = tv;
 	pm->handler(&packet,bytes,h->len);
-	gettimeofday(&phdr.ts,NULL);
+	phdr.ts = tv;
 	phdr.len = h->len;
 	phdr.caplen = h->caplen;
 	postprocess(pm,&packet,iface,&phdr,bytes);
@@ -115,7 +244,6 @@ handle_pcap_direct(u_char *gi,const struct pcap_pkthdr *h,const u_char *bytes){
 
 static void
 handle_pcap_cooked(u_char *gi,const struct pcap_pkthdr *h,const u_char *bytes){
-	char bcast[8] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 	pcap_marshal *pm = (pcap_marshal *)gi;
 	interface *iface = pm->i; // interface for the pcap file
 	const struct pcapsll { // taken from pcap-linktype(7), "LINKTYPE_LINUX_SLL"
@@ -125,28 +253,30 @@ handle_pcap_cooked(u_char *gi,const struct pcap_pkthdr *h,const u_char *bytes){
 		char hwaddr[8];
 		uint16_t proto;
 	} *sll;
-	char addr[8];
 	omphalos_packet packet;
+	struct timeval tv;
 
-	++iface->frames;
+	count_pcap_frame(pm,h,&tv);
+	// Run what's due first, so that timers armed by this frame are
+	// scheduled from its time (the wheel begins at zero).
+	twheel_advance(&iface->timers,&h->ts);
 	// diagnostic("Frame %ju",iface->frames);
 	if(h->caplen != h->len || h->caplen < sizeof(*sll)){
 		diagnostic("Partial capture (%u/%ub)",h->caplen,h->len);
-		++iface->truncated;
+		rxshard_inc(iface->rxs,&iface->rxs->truncated);
 		return;
 	}
 	sll = (const struct pcapsll *)bytes;
 	if(h->len < sizeof(*sll) || ntohs(sll->hwlen) > sizeof(sll->hwaddr)){
-		++iface->malformed;
+		rxshard_inc(iface->rxs,&iface->rxs->malformed);
 		return;
 	}
 	memset(&packet,0,sizeof(packet));
 	packet.i = iface;
-	packet.i->addrlen = ntohs(sll->hwlen);
-	assert(packet.i->addrlen <= sizeof(addr));
-	memcpy(addr,sll->hwaddr,packet.i->addrlen);
-	packet.i->addr = addr;
-	packet.i->bcast = bcast;
+	packet.tv = tv;
+	// addr and bcast were sized for the largest sll_addr in setup_pcap_link()
+	iface->addrlen = ntohs(sll->hwlen);
+	memcpy(iface->addr,sll->hwaddr,iface->addrlen);
 	packet.l2s = lookup_l2host(iface,sll->hwaddr);
 	packet.l2d = packet.l2s;
 	packet.l3proto = ntohs(sll->proto);
@@ -161,99 +291,264 @@ handle_pcap_cooked(u_char *gi,const struct pcap_pkthdr *h,const u_char *bytes){
 			handle_ipv6_packet(&packet,bytes + sizeof(*sll),h->len - sizeof(*sll));
 			break;
 		}default:{
-			++iface->noprotocol;
+			rxshard_inc(iface->rxs,&iface->rxs->noprotocol);
 			break;
 		}
 	}
 	postprocess(pm,&packet,iface,h,bytes);
-	iface->addr = iface->bcast = NULL;
 }
 
-int handle_pcap_file(const omphalos_ctx *pctx){
-	pcap_handler fxn;
-	char ebuf[PCAP_ERRBUF_SIZE];
-	pcap_marshal pmarsh = {
-		.octx = &pctx->iface,
-		.i = &pcap_file_interface,
-	};
-	pcap_t *pcap;
+// (Re)initialize an interface standing in for pcap input.
+static int
+prep_pcap_iface(interface *i,const char *name){
+	const struct timeval zerotv = { .tv_sec = 0, .tv_usec = 0, };
 
-	free(pmarsh.i->name);
-	diagnostic("Processing pcap file %s",pctx->pcapfn);
-	memset(pmarsh.i,0,sizeof(*pmarsh.i));
-	pmarsh.i->fd4 = pmarsh.i->fd6udp = pmarsh.i->fd6icmp =
-		pmarsh.i->fd = pmarsh.i->rfd = -1;
-	pmarsh.i->flags = IFF_BROADCAST | IFF_UP | IFF_LOWER_UP;
-	// FIXME set up remainder of interface as best we can...
-	if((pmarsh.i->name = strdup(pctx->pcapfn)) == NULL){
+	free(i->name);
+	free_rxshards(i->rxs,i->rxshards);
+	cleanup_tcpstreams(i);
+	cleanup_ipfrags(i);
+	cleanup_flows(i);
+	twheel_destroy(&i->timers);
+	memset(i,0,sizeof(*i));
+	if(prep_rxshards(i,1)){
+		return -1;
+	}
+	// Timers run on capture time, advanced as each packet is read
+	if(twheel_init(&i->timers,IFACE_TIMER_USECS,&zerotv)){
 		return -1;
 	}
-	if((pcap = pcap_open_offline(pctx->pcapfn,ebuf)) == NULL){
-		diagnostic("Couldn't open pcap input %s (%s?)",pctx->pcapfn,ebuf);
+	i->fd4 = i->fd6udp = i->fd6icmp = i->fd = i->rfd = -1;
+	i->flags = IFF_BROADCAST | IFF_UP | IFF_LOWER_UP;
+	// FIXME set up remainder of interface as best we can...
+	if((i->name = strdup(name)) == NULL){
 		return -1;
 	}
-	fxn = NULL;
-	switch(pcap_datalink(pcap)){
+	return 0;
+}
+
+// Free everything a pcap interface holds, hosts included. It's not one of
+// the iface_by_idx() interfaces, so free_iface() can't be used.
+static void
+release_pcap_iface(interface *i){
+	cancel_probes(i);
+	cleanup_tcpstreams(i);
+	cleanup_ipfrags(i);
+	cleanup_flows(i);
+	twheel_destroy(&i->timers);
+	free_rxshards(i->rxs,i->rxshards);
+	i->rxs = NULL;
+	i->rxshards = 0;
+	cleanup_l3hosts(i);
+	cleanup_l2hosts(i);
+	free(i->name);
+	i->name = NULL;
+	free(i->addr);
+	i->addr = NULL;
+	free(i->bcast);
+	i->bcast = NULL;
+}
+
+// Allocate and prepare an interface for the file's idx'th link. It's isolated
+// if the file's first link is.
+static interface *
+add_pcap_link(pcap_links *links,const interface *first,const char *fn,unsigned idx){
+	char name[PATH_MAX + 16];
+	interface **tmp,*i;
+
+	if((tmp = realloc(links->ifaces,sizeof(*tmp) * (links->count + 1))) == NULL){
+		return NULL;
+	}
+	links->ifaces = tmp;
+	if((i = calloc(1,sizeof(*i))) == NULL){
+		return NULL;
+	}
+	snprintf(name,sizeof(name),"%s#%u",fn,idx);
+	if(prep_pcap_iface(i,name)){
+		release_pcap_iface(i);
+		free(i);
+		return NULL;
+	}
+	i->isolated = first->isolated;
+	links->ifaces[links->count++] = i;
+	return i;
+}
+
+static void
+release_pcap_links(pcap_links *links){
+	unsigned z;
+
+	for(z = 0 ; z < links->count ; ++z){
+		release_pcap_iface(links->ifaces[z]);
+		free(links->ifaces[z]);
+	}
+	free(links->ifaces);
+	links->ifaces = NULL;
+	links->count = 0;
+}
+
+// Prepare the marshal for frames of the link type, setting up the interface's
+// link-layer geometry (replacing that of any earlier file).
+static int
+setup_pcap_link(pcap_marshal *pm,int dlt){
+	free(pm->i->addr);
+	free(pm->i->bcast);
+	pm->i->addr = pm->i->bcast = NULL;
+	pm->i->addrlen = 0;
+	switch(dlt){
 		case DLT_EN10MB:{
-			fxn = handle_pcap_direct;
-			pmarsh.handler = handle_ethernet_packet;
-			pmarsh.i->addrlen = ETH_ALEN;
-			pmarsh.i->addr = malloc(pmarsh.i->addrlen);
-			pmarsh.i->bcast = malloc(pmarsh.i->addrlen);
-			pmarsh.i->l2hlen = ETH_HLEN;
-			memset(pmarsh.i->addr,0,pmarsh.i->addrlen);
-			memset(pmarsh.i->bcast,0xff,pmarsh.i->addrlen);
+			pm->fxn = handle_pcap_direct;
+			pm->handler = handle_ethernet_packet;
+			pm->i->addrlen = ETH_ALEN;
+			pm->i->addr = malloc(pm->i->addrlen);
+			pm->i->bcast = malloc(pm->i->addrlen);
+			pm->i->l2hlen = ETH_HLEN;
+			memset(pm->i->addr,0,pm->i->addrlen);
+			memset(pm->i->bcast,0xff,pm->i->addrlen);
 			break;
-		}case DLT_LINUX_SLL:{
-			fxn = handle_pcap_cooked;
+		}case DLT_LINUX_SLL:{ // addrlen is set from each frame
+			pm->fxn = handle_pcap_cooked;
+			pm->i->addrlen = 8;
+			pm->i->addr = malloc(pm->i->addrlen);
+			pm->i->bcast = malloc(pm->i->addrlen);
+			memset(pm->i->addr,0,pm->i->addrlen);
+			memset(pm->i->bcast,0xff,pm->i->addrlen);
 			break;
 		}case DLT_IEEE802_11_RADIO:{
-			pmarsh.handler = handle_radiotap_packet;
-			fxn = handle_pcap_direct;
-			pmarsh.i->addrlen = ETH_ALEN;
-			pmarsh.i->addr = malloc(pmarsh.i->addrlen);
-			pmarsh.i->bcast = malloc(pmarsh.i->addrlen);
-			pmarsh.i->l2hlen = ETH_HLEN;
-			memset(pmarsh.i->addr,0,pmarsh.i->addrlen);
-			memset(pmarsh.i->bcast,0xff,pmarsh.i->addrlen);
+			pm->handler = handle_radiotap_packet;
+			pm->fxn = handle_pcap_direct;
+			pm->i->addrlen = ETH_ALEN;
+			pm->i->addr = malloc(pm->i->addrlen);
+			pm->i->bcast = malloc(pm->i->addrlen);
+			pm->i->l2hlen = ETH_HLEN;
+			memset(pm->i->addr,0,pm->i->addrlen);
+			memset(pm->i->bcast,0xff,pm->i->addrlen);
 			break;
 		}case DLT_LINUX_IRDA:{
-			pmarsh.handler = handle_irda_packet;
-			fxn = handle_pcap_direct;
-			pmarsh.i->addrlen = 4;
-			pmarsh.i->addr = malloc(pmarsh.i->addrlen);
-			pmarsh.i->bcast = malloc(pmarsh.i->addrlen);
-			pmarsh.i->l2hlen = 15; // FIXME ???
-			memset(pmarsh.i->addr,0,pmarsh.i->addrlen);
-			memset(pmarsh.i->bcast,0xff,pmarsh.i->addrlen);
+			pm->handler = handle_irda_packet;
+			pm->fxn = handle_pcap_direct;
+			pm->i->addrlen = 4;
+			pm->i->addr = malloc(pm->i->addrlen);
+			pm->i->bcast = malloc(pm->i->addrlen);
+			pm->i->l2hlen = 15; // FIXME ???
+			memset(pm->i->addr,0,pm->i->addrlen);
+			memset(pm->i->bcast,0xff,pm->i->addrlen);
 			break;
 		}case DLT_C_HDLC:{
-			pmarsh.handler = handle_hdlc_packet;
-			fxn = handle_pcap_direct;
-			pmarsh.i->addrlen = 1;
-			pmarsh.i->addr = malloc(pmarsh.i->addrlen);
-			pmarsh.i->bcast = malloc(pmarsh.i->addrlen);
-			pmarsh.i->l2hlen = 4;
-			memset(pmarsh.i->addr,0,pmarsh.i->addrlen);
-			memset(pmarsh.i->bcast,0x8f,pmarsh.i->addrlen);
+			pm->handler = handle_hdlc_packet;
+			pm->fxn = handle_pcap_direct;
+			pm->i->addrlen = 1;
+			pm->i->addr = malloc(pm->i->addrlen);
+			pm->i->bcast = malloc(pm->i->addrlen);
+			pm->i->l2hlen = 4;
+			memset(pm->i->addr,0,pm->i->addrlen);
+			memset(pm->i->bcast,0x8f,pm->i->addrlen);
 			break;
 		}case DLT_PPP:
 		case DLT_PPP_SERIAL:{
-			pmarsh.handler = handle_ppp_packet;
-			fxn = handle_pcap_direct;
+			pm->handler = handle_ppp_packet;
+			pm->fxn = handle_pcap_direct;
 			// FIXME set up addr, bcast, l2hlen, etc
 			break;
 		}default:{
-			diagnostic("Unhandled datalink type: %d",pcap_datalink(pcap));
+			diagnostic("Unhandled datalink type: %d",dlt);
+			return -1;
+		}
+	}
+	if(pm->i->addrlen && (pm->i->addr == NULL || pm->i->bcast == NULL)){
+		return -1;
+	}
+	return 0;
+}
+
+// Walk a mapped savefile. Frames are handed to the link's handler in place.
+static int
+walk_savefile(const omphalos_ctx *pctx,savefile *sf,interface *i,
+			const char *fn,pcap_links *links){
+	pcap_marshal *pms = NULL,*pm;
+	unsigned pmcount = 0,z;
+	saverecord rec;
+	int r;
+
+	while((r = savefile_next(sf,&rec)) > 0){
+		while(rec.link >= pmcount){ // newly-described links
+			if((pm = realloc(pms,sizeof(*pms) * (pmcount + 1))) == NULL){
+				r = -1;
+				break;
+			}
+			pms = pm;
+			pm += pmcount;
+			memset(pm,0,sizeof(*pm));
+			pm->octx = &pctx->iface;
+			pm->replay = pctx->replay ? &pcap_replay_state : NULL;
+			if(pmcount == 0){
+				pm->i = i;
+			}else if((pm->i = add_pcap_link(links,i,fn,pmcount)) == NULL){
+				r = -1;
+				break;
+			}
+			++pmcount;
+			if(setup_pcap_link(pm,sf->links[pmcount - 1].dlt)){
+				if(!sf->ng){
+					r = -1;
+					break;
+				}
+				pm->fxn = NULL; // skip this pcapng interface's frames
+				continue;
+			}
+			if(pctx->filter){
+				if(filter_savefile(sf->links[pmcount - 1].dlt,pctx->filter,&pm->bp)){
+					r = -1;
+					break;
+				}
+				pm->filtered = 1;
+			}
+		}
+		if(r < 0){
 			break;
 		}
+		pm = &pms[rec.link];
+		if(pm->fxn == NULL){
+			continue;
+		}
+		if(pm->filtered && !pcap_offline_filter(&pm->bp,&rec.hdr,rec.data)){
+			continue;
+		}
+		pm->fxn((u_char *)pm,&rec.hdr,rec.data);
+	}
+	for(z = 0 ; z < pmcount ; ++z){
+		if(pms[z].filtered){
+			pcap_freecode(&pms[z].bp);
+		}
+	}
+	free(pms);
+	if(r < 0){
+		diagnostic("Error processing pcap file %s",fn);
+		return -1;
+	}
+	return 0;
+}
+
+// Files we can't map (pipes, say), or don't recognize, go through libpcap.
+static int
+loop_pcap_file(const omphalos_ctx *pctx,interface *i,const char *fn){
+	char ebuf[PCAP_ERRBUF_SIZE];
+	pcap_marshal pmarsh = {
+		.octx = &pctx->iface,
+		.i = i,
+		.replay = pctx->replay ? &pcap_replay_state : NULL,
+	};
+	pcap_t *pcap;
+
+	if((pcap = pcap_open_offline(fn,ebuf)) == NULL){
+		diagnostic("Couldn't open pcap input %s (%s?)",fn,ebuf);
+		return -1;
 	}
-	if(fxn == NULL){
+	if(setup_pcap_link(&pmarsh,pcap_datalink(pcap)) || filter_pcap(pcap,pctx->filter)){
 		pcap_close(pcap);
 		return -1;
 	}
-	if(pcap_loop(pcap,-1,fxn,(u_char *)&pmarsh)){
-		diagnostic("Error processing pcap file %s (%s?)",pctx->pcapfn,pcap_geterr(pcap));
+	if(pcap_loop(pcap,-1,pmarsh.fxn,(u_char *)&pmarsh)){
+		diagnostic("Error processing pcap file %s (%s?)",fn,pcap_geterr(pcap));
 		pcap_close(pcap);
 		return -1;
 	}
@@ -261,116 +556,421 @@ int handle_pcap_file(const omphalos_ctx *pctx){
 	return 0;
 }
 
-int print_pcap_stats(FILE *fp,interface *agg){
-	const interface *iface;
+// Dissect the file into the interface, and (for a pcapng file describing
+// several interfaces) into links.
+static int
+dissect_pcap_file(const omphalos_ctx *pctx,interface *i,const char *fn,pcap_links *links){
+	savefile sf;
+	int r;
 
-	iface = &pcap_file_interface;
-	if(iface->name){
-		if(print_iface_stats(fp,iface,agg,"file") < 0){
-			return -1;
-		}
+	diagnostic("Processing pcap file %s",fn);
+	if((r = savefile_open(&sf,fn)) < 0){
+		return -1;
+	}else if(r){
+		return loop_pcap_file(pctx,i,fn);
+	}
+	r = walk_savefile(pctx,&sf,i,fn,links);
+	savefile_close(&sf);
+	return r;
+}
+
+// The shared interface takes on the link geometry of the first file merged.
+// FIXME files of differing link types are merged under that geometry
+static int
+adopt_pcap_geometry(interface *dst,const interface *src){
+	dst->addrlen = src->addrlen ? src->addrlen : ETH_ALEN;
+	if(dst->addrlen > sizeof(hwaddrint)){
+		dst->addrlen = sizeof(hwaddrint);
+	}
+	dst->l2hlen = src->l2hlen;
+	dst->arptype = src->arptype;
+	if((dst->addr = malloc(dst->addrlen)) == NULL){
+		return -1;
+	}
+	if((dst->bcast = malloc(dst->addrlen)) == NULL){
+		free(dst->addr);
+		dst->addr = NULL;
+		return -1;
+	}
+	// A cooked capture's addr is that of its most recent sender
+	memset(dst->addr,0,dst->addrlen);
+	if(src->bcast){
+		memcpy(dst->bcast,src->bcast,dst->addrlen);
+	}else{
+		memset(dst->bcast,0xff,dst->addrlen);
 	}
 	return 0;
 }
 
-int init_pcap(const omphalos_ctx *pctx){
-	if(pctx->plog){
-		dumper = pctx->plog;
+// Merge a dissected file's statistics and hosts into the shared interface.
+static int
+merge_pcap_iface(interface *dst,const interface *src){
+	struct timeval tv;
+	ifstats st;
+
+	if(dst->addr == NULL && adopt_pcap_geometry(dst,src)){
+		return -1;
 	}
+	interface_stats(src,&st);
+	rxshard_begin(dst->rxs);
+	dst->rxs->frames += st.frames;
+	dst->rxs->malformed += st.malformed;
+	dst->rxs->truncated += st.truncated;
+	dst->rxs->truncated_recovered += st.truncated_recovered;
+	dst->rxs->noprotocol += st.noprotocol;
+	dst->rxs->bytes += st.bytes;
+	dst->rxs->drops += st.drops;
+	rxshard_end(dst->rxs);
+	gettimeofday(&tv,NULL);
+	merge_l2hosts(dst,src);
+	merge_l3hosts(&tv,dst,src);
+	merge_flows(dst,src);
 	return 0;
 }
 
-void cleanup_pcap(const omphalos_ctx *pctx){
-	// FIXME free_iface(&pcap_file_interface);
-	pthread_mutex_lock(&dumplock);
-	if(dumper){
-		pcap_dump_flush(dumper);
-		dumper = NULL;
+static void *
+pcap_worker(void *unsafe){
+	pcap_pool *pp = unsafe;
+	unsigned z;
+	int r;
+
+	pthread_mutex_lock(&pp->lock);
+	if(pthread_setspecific(omphalos_ctx_key,&pp->ctx)){
+		pp->failed = 1;
+		pthread_cond_broadcast(&pp->cond);
+		pthread_mutex_unlock(&pp->lock);
+		return "couldn't set TSD";
 	}
-	if(pctx->plogp){
-		pcap_close(pctx->plogp);
+	while(!pp->failed && pp->next < pp->count){
+		if(pp->next >= pp->merged + pp->window){
+			pthread_cond_wait(&pp->cond,&pp->lock);
+			continue;
+		}
+		z = pp->next++;
+		pthread_mutex_unlock(&pp->lock);
+		if((r = prep_pcap_iface(&pp->jobs[z].iface,pp->jobs[z].fn)) == 0){
+			// Other workers' hosts (and those being merged) mustn't
+			// be reachable from ours; see lookup_global_l3host().
+			pp->jobs[z].iface.isolated = 1;
+			r = dissect_pcap_file(&pp->ctx,&pp->jobs[z].iface,pp->jobs[z].fn,
+						&pp->jobs[z].links);
+		}
+		pthread_mutex_lock(&pp->lock);
+		pp->jobs[z].r = r;
+		pp->jobs[z].done = 1;
+		if(r){
+			pp->failed = 1;
+		}
+		pthread_cond_broadcast(&pp->cond);
 	}
-	pthread_mutex_unlock(&dumplock);
+	pthread_mutex_unlock(&pp->lock);
+	return NULL;
 }
 
-// Must convert the layer 2 header into a DLT_LINUX_SLL (sockaddr_ll) portable
-// pseudoheader. We copy the real header over to a temporary buffer, write our
-// new header, log from the new origin, then copy the real header back in.
-//
-// This requires an original header of at least 16 bytes. This is longer than
-// Ethernet and just about everything else, but thankfully we have tpacket_hdr
-// in the PACKET_RX_MMAP case. Otherwise, this won't work and we need fallback
-// to a payload copy.
-//
-// It is possible that we are using DLT_LINUX_SLL as a source. In that case,
-// pass 0 as l2len, and no transformation will take place.
-int log_pcap_packet(struct pcap_pkthdr *h,void *sp,size_t l2len,const struct pcap_ll *pll){
-	void *newframe;
-	void *rhdr;
+// Dissect the files on a pool of workers, merging each into the shared
+// interface in turn. Workers have no UI callbacks; the UI learns of hosts and
+// services as they're merged. Returns the number of workers used via *threads.
+static int
+dissect_pcap_files(const omphalos_ctx *pctx,unsigned *threads){
+	unsigned tcount,z;
+	char name[32];
+	pthread_t *tids;
+	pcap_pool pp;
+	int r,ret;
 
-	if(!dumper){
-		return 0;
+	if((*threads = pctx->pcapthreads) == 0){
+		long cpus;
+
+		if((cpus = sysconf(_SC_NPROCESSORS_ONLN)) <= 0){
+			cpus = 1;
+		}
+		*threads = cpus > PCAP_MAXTHREADS ? PCAP_MAXTHREADS : cpus;
 	}
-	assert(h->caplen >= l2len);
-	if(l2len >= sizeof(*pll)){ // copy pll over old headers
-		if((rhdr = Malloc(l2len)) == NULL){
-			return -1;
+	if(*threads > pctx->pcapcount){
+		*threads = pctx->pcapcount;
+	}
+	snprintf(name,sizeof(name),"%u pcap files",pctx->pcapcount);
+	if(prep_pcap_iface(&pcap_file_interface,name)){
+		return -1;
+	}
+	memset(&pp,0,sizeof(pp));
+	if((pp.jobs = calloc(pctx->pcapcount,sizeof(*pp.jobs))) == NULL){
+		return -1;
+	}
+	if((tids = malloc(sizeof(*tids) * *threads)) == NULL){
+		free(pp.jobs);
+		return -1;
+	}
+	for(z = 0 ; z < pctx->pcapcount ; ++z){
+		pp.jobs[z].fn = pctx->pcapfns[z];
+	}
+	pp.count = pctx->pcapcount;
+	pp.window = *threads * 2;
+	memcpy(&pp.ctx,pctx,sizeof(pp.ctx));
+	memset(&pp.ctx.iface,0,sizeof(pp.ctx.iface));
+	pp.ctx.iface.vdiagnostic = pctx->iface.vdiagnostic;
+	pp.ctx.hostcap = 0; // the cap is applied as files are merged
+	pthread_mutex_init(&pp.lock,NULL);
+	pthread_cond_init(&pp.cond,NULL);
+	for(tcount = 0 ; tcount < *threads ; ++tcount){
+		if( (r = pthread_create(&tids[tcount],NULL,pcap_worker,&pp)) ){
+			diagnostic("Couldn't launch pcap worker (%s?)",strerror(r));
+			break;
+		}
+	}
+	*threads = tcount;
+	ret = 0;
+	if(tcount == 0){
+		pp.failed = 1;
+		ret = -1;
+	}
+	for(z = 0 ; z < pp.count ; ++z){
+		pthread_mutex_lock(&pp.lock);
+		while(z < pp.next ? !pp.jobs[z].done : !pp.failed){
+			pthread_cond_wait(&pp.cond,&pp.lock);
 		}
-		memcpy(rhdr,sp,l2len); // preserve the true header
-		newframe = (char *)sp + (l2len - sizeof(*pll));
-		memcpy(newframe,pll,sizeof(*pll));
-		h->caplen -= (l2len - sizeof(*pll));
-		h->len -= (l2len - sizeof(*pll));
-	}else if(l2len){ // fall back to payload copy
-		uint32_t plen;
-
-		plen = h->caplen - l2len;
-		if((rhdr = Malloc(sizeof(*pll) + plen)) == NULL){
+		if(z >= pp.next){ // failed before it was claimed
+			pthread_mutex_unlock(&pp.lock);
+			break;
+		}
+		r = pp.jobs[z].r;
+		pthread_mutex_unlock(&pp.lock);
+		if(r == 0 && ret == 0){
+			unsigned l;
+
+			r = merge_pcap_iface(&pcap_file_interface,&pp.jobs[z].iface);
+			for(l = 0 ; r == 0 && l < pp.jobs[z].links.count ; ++l){
+				r = merge_pcap_iface(&pcap_file_interface,pp.jobs[z].links.ifaces[l]);
+			}
+		}
+		release_pcap_iface(&pp.jobs[z].iface);
+		release_pcap_links(&pp.jobs[z].links);
+		pthread_mutex_lock(&pp.lock);
+		++pp.merged;
+		if(r){
+			pp.failed = 1;
+			ret = -1;
+		}
+		pthread_cond_broadcast(&pp.cond);
+		pthread_mutex_unlock(&pp.lock);
+	}
+	for(z = 0 ; z < tcount ; ++z){
+		if( (r = pthread_join(tids[z],NULL)) ){
+			diagnostic("Couldn't join pcap worker (%s?)",strerror(r));
+		}
+	}
+	pthread_cond_destroy(&pp.cond);
+	pthread_mutex_destroy(&pp.lock);
+	free(tids);
+	free(pp.jobs);
+	return ret;
+}
+
+// Dissect the files in order on this thread, directly into the shared
+// interface. This is the path taken by a single file, and by any number of
+// files when replaying.
+static int
+dissect_pcap_serial(const omphalos_ctx *pctx){
+	char name[32];
+	unsigned z;
+
+	if(pctx->pcapcount > 1){
+		snprintf(name,sizeof(name),"%u pcap files",pctx->pcapcount);
+	}
+	if(prep_pcap_iface(&pcap_file_interface,pctx->pcapcount > 1 ? name : pctx->pcapfns[0])){
+		return -1;
+	}
+	memset(&pcap_replay_state,0,sizeof(pcap_replay_state));
+	pcap_replay_state.speed = pctx->replay;
+	// FIXME files of differing link types share the interface's geometry
+	for(z = 0 ; z < pctx->pcapcount ; ++z){
+		if(dissect_pcap_file(pctx,&pcap_file_interface,pctx->pcapfns[z],&pcap_file_links)){
 			return -1;
 		}
-		newframe = rhdr;
-		memcpy(newframe,pll,sizeof(*pll));
-		memcpy((char *)newframe + sizeof(*pll),(char *)sp + l2len,plen);
-		h->caplen = sizeof(*pll) + plen;
-		h->len = sizeof(*pll) + plen;
-		sp = NULL;
-	}else{ // DLT_LINUX_SLL source
-		newframe = sp;
-		rhdr = NULL;
-		sp = NULL;
-	}
-	if(pthread_mutex_lock(&dumplock)){
-		if(sp){
-			memcpy(sp,rhdr,l2len);
+	}
+	return 0;
+}
+
+int handle_pcap_file(const omphalos_ctx *pctx){
+	struct timespec t0,t1;
+	unsigned threads = 1,z;
+	double secs;
+	ifstats st;
+	int r;
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	if(pctx->pcapcount == 1 || pctx->replay){
+		r = dissect_pcap_serial(pctx);
+	}else{
+		r = dissect_pcap_files(pctx,&threads);
+	}
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1000000000.0;
+	if(secs <= 0){
+		secs = 1e-9;
+	}
+	interface_stats(&pcap_file_interface,&st);
+	for(z = 0 ; z < pcap_file_links.count ; ++z){ // unmerged pcapng links
+		ifstats lst;
+
+		interface_stats(pcap_file_links.ifaces[z],&lst);
+		st.frames += lst.frames;
+		st.bytes += lst.bytes;
+	}
+	diagnostic("Read %u file%s via %u thread%s in %.3fs: %ju frames (%.0f/s), %ju bytes (%.2f MB/s)",
+			pctx->pcapcount,pctx->pcapcount == 1 ? "" : "s",
+			threads,threads == 1 ? "" : "s",secs,
+			st.frames,st.frames / secs,st.bytes,st.bytes / secs / 1000000);
+	if(pctx->replay){
+		char speed[32];
+
+		if(pctx->replay == HUGE_VAL){
+			snprintf(speed,sizeof(speed),"max speed");
+		}else{
+			snprintf(speed,sizeof(speed),"%gx",pctx->replay);
 		}
-		free(rhdr);
+		diagnostic("Replayed %.3fs of capture time at %s (%.2fx achieved)",
+				pcap_replay_state.span,speed,pcap_replay_state.span / secs);
+	}
+	return r;
+}
+
+static int
+append_pcap_input(omphalos_ctx *pctx,const char *fn){
+	char **tmp,*dup;
+
+	if((dup = strdup(fn)) == NULL){
+		return -1;
+	}
+	if((tmp = realloc(pctx->pcapfns,sizeof(*tmp) * (pctx->pcapcount + 1))) == NULL){
+		free(dup);
+		return -1;
+	}
+	pctx->pcapfns = tmp;
+	pctx->pcapfns[pctx->pcapcount++] = dup;
+	return 0;
+}
+
+// Add the directory's regular files, save dotfiles, sorted by name.
+static int
+add_pcap_directory(omphalos_ctx *pctx,const char *dir){
+	unsigned added = 0;
+	struct dirent **ents;
+	int n,z,ret = 0;
+
+	if((n = scandir(dir,&ents,NULL,alphasort)) < 0){
+		fprintf(stderr,"Couldn't list %s (%s?)\n",dir,strerror(errno));
 		return -1;
 	}
-	pcap_dump((u_char *)dumper,h,newframe);
-	if(pthread_mutex_unlock(&dumplock)){
-		if(sp){
-			memcpy(sp,rhdr,l2len);
+	for(z = 0 ; z < n ; ++z){
+		size_t len = strlen(dir) + strlen(ents[z]->d_name) + 2;
+		struct stat st;
+		char *path;
+
+		if(ret == 0 && ents[z]->d_name[0] != '.'){
+			if((path = malloc(len)) == NULL){
+				ret = -1;
+			}else{
+				snprintf(path,len,"%s/%s",dir,ents[z]->d_name);
+				if(stat(path,&st) == 0 && S_ISREG(st.st_mode)){
+					ret = append_pcap_input(pctx,path);
+					++added;
+				}
+				free(path);
+			}
 		}
-		free(rhdr);
+		free(ents[z]);
+	}
+	free(ents);
+	if(ret == 0 && added == 0){
+		fprintf(stderr,"No files in %s\n",dir);
+		ret = -1;
+	}
+	return ret;
+}
+
+static int
+add_pcap_path(omphalos_ctx *pctx,const char *path){
+	struct stat st;
+
+	if(stat(path,&st) == 0 && S_ISDIR(st.st_mode)){
+		return add_pcap_directory(pctx,path);
+	}
+	return append_pcap_input(pctx,path); // errors are reported upon open
+}
+
+int add_pcap_input(omphalos_ctx *pctx,const char *spec){
+	glob_t g;
+	size_t z;
+	int r;
+
+	if(strpbrk(spec,"*?[") == NULL){
+		return add_pcap_path(pctx,spec);
+	}
+	if( (r = glob(spec,0,NULL,&g)) ){
+		fprintf(stderr,"%s %s\n",r == GLOB_NOMATCH ? "No files match" : "Couldn't expand",spec);
 		return -1;
 	}
-	if(sp){
-		memcpy(sp,rhdr,l2len);
+	for(z = 0 ; r == 0 && z < g.gl_pathc ; ++z){
+		r = add_pcap_path(pctx,g.gl_pathv[z]);
+	}
+	globfree(&g);
+	return r;
+}
+
+int print_pcap_stats(FILE *fp,ifstats *agg){
+	const interface *iface;
+	unsigned z;
+
+	iface = &pcap_file_interface;
+	if(iface->name){
+		if(print_iface_stats(fp,iface,agg,"file") < 0){
+			return -1;
+		}
+	}
+	for(z = 0 ; z < pcap_file_links.count ; ++z){
+		if(print_iface_stats(fp,pcap_file_links.ifaces[z],agg,"file") < 0){
+			return -1;
+		}
 	}
-	free(rhdr);
 	return 0;
 }
 
-pcap_dumper_t *init_pcap_write(pcap_t **p,const char *fn){
-	pcap_dumper_t *pd;
+int init_pcap(const omphalos_ctx *pctx){
+	(void)pctx;
+	return 0;
+}
 
-	if((*p = pcap_open_dead(DLT_LINUX_SLL,0)) == NULL){
-		return NULL;
+void cleanup_pcap(const omphalos_ctx *pctx){
+	unsigned z;
+
+	// FIXME free_iface(&pcap_file_interface);
+	release_pcap_links(&pcap_file_links);
+	for(z = 0 ; z < pctx->pcapcount ; ++z){
+		free(pctx->pcapfns[z]);
 	}
-	if((pd = pcap_dump_open(*p,fn)) == NULL){
-		pcap_close(*p);
-		*p = NULL;
-		return NULL;
+	free(pctx->pcapfns);
+	plog_stop();
+}
+
+// Must convert the layer 2 header into a DLT_LINUX_SLL (sockaddr_ll) portable
+// pseudoheader. The frame is queued for the --plog writer (see plog.h) with
+// our pseudoheader in place of its first l2len bytes; the frame itself is
+// left untouched. ifname names the interface in pcapng logs.
+//
+// It is possible that we are using DLT_LINUX_SLL as a source. In that case,
+// pass 0 as l2len, and no transformation will take place.
+int log_pcap_packet(rxshard *rs,const char *ifname,const struct pcap_pkthdr *h,
+			const void *frame,size_t l2len,const struct pcap_ll *pll){
+	struct pcap_pkthdr nh;
+
+	assert(h->caplen >= l2len);
+	if(l2len == 0){ // DLT_LINUX_SLL source
+		return plog_frame(rs,ifname,h,NULL,0,frame,h->caplen);
 	}
-	return pd;
+	nh.ts = h->ts;
+	nh.caplen = h->caplen - l2len + sizeof(*pll);
+	nh.len = h->len - l2len + sizeof(*pll);
+	return plog_frame(rs,ifname,&nh,pll,sizeof(*pll),(const char *)frame + l2len,
+				h->caplen - l2len);
 }
@@ -9,20 +9,26 @@ extern "C" {
 #include <stddef.h>
 #include <stdint.h>
 
+struct ifstats;
 struct interface;
 struct pcap_pkthdr;
+struct rxshard;
 struct omphalos_ctx;
 struct omphalos_iface;
 
-// Input from a PCAP file
+#define PCAP_MAXTHREADS 1024
+
+// Input from PCAP files. Each -f argument is added via add_pcap_input(): a
+// directory contributes its files, and a glob(7) pattern its matches, sorted
+// by name. Multiple files are dissected on a pool of threads, and merged into
+// a single interface in the order they were added. With --replay, they're
+// instead dissected in order on the calling thread, paced by capture time.
+int add_pcap_input(struct omphalos_ctx *,const char *);
 int init_pcap(const struct omphalos_ctx *);
 int handle_pcap_file(const struct omphalos_ctx *);
-int print_pcap_stats(FILE *fp,struct interface *);
+int print_pcap_stats(FILE *fp,struct ifstats *);
 void cleanup_pcap(const struct omphalos_ctx *);
 
-// Output to a PCAP savefile
-pcap_dumper_t *init_pcap_write(pcap_t **,const char *);
-
 struct pcap_ll { // see pcap-datalink(7), "DLT_LINUX_SSL"
 	uint16_t pkttype;		// Packet type, NBO
 					//  0 for unicast to us
@@ -37,7 +43,8 @@ struct pcap_ll { // see pcap-datalink(7), "DLT_LINUX_SSL"
 					//  1 for Novell 802.3, 4 for 802.2 LLC
 } __attribute__ ((packed));
 
-int log_pcap_packet(struct pcap_pkthdr *,void *,size_t,const struct pcap_ll *);
+int log_pcap_packet(struct rxshard *,const char *,const struct pcap_pkthdr *,
+			const void *,size_t,const struct pcap_ll *);
 
 #ifdef __cplusplus
 }
@@ -16,7 +16,7 @@ void handle_pim_packet(omphalos_packet *op,const void *frame,size_t len){
 
 	if(len < sizeof(*pim)){
 		diagnostic("%s malformed with %zu",__func__,len);
-		++op->i->malformed;
+		op->malformed = 1;
 		return;
 	}
 	// FIXME
@@ -0,0 +1,829 @@
+#include <time.h>
+#include <zlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <omphalos/diag.h>
+#include <omphalos/plog.h>
+#include <omphalos/stats.h>
+#include <omphalos/omphalos.h>
+
+#define PLOG_MAXFRAME (PLOG_QUEUE_BYTES / 4)
+#define PLOG_SNAPLEN (1u << 18u)	// libpcap's MAXIMUM_SNAPLEN
+#define PLOG_LINKTYPE 113		// DLT_LINUX_SLL
+#define PLOG_GZBUF (1u << 18u)
+#define PLOG_MAXSUFFIX 1000		// path.YYYYmmddHHMMSS-n
+
+#define PCAP_MAGIC_USEC		0xa1b2c3d4u
+#define PCAPNG_SHB		0x0a0d0d0au
+#define PCAPNG_IDB		1
+#define PCAPNG_EPB		6
+#define PCAPNG_BOM		0x1a2b3c4du
+#define PCAPNG_OPT_IFNAME	2
+#define PCAPNG_EPBLEN		32	// EPB, less data and options
+
+#define PAD4(x) (((x) + 3u) & ~3u)
+
+// Records are 8-byte aligned, and led by their aligned length and the length
+// of what follows (a savefile record header and the frame). A record which
+// wouldn't fit before the end of the ring is preceded by padding, a record
+// with nothing to write.
+typedef struct plogrec {
+	uint32_t rlen;
+	uint32_t wlen;
+} plogrec;
+
+// The savefile record header, as written to disk (or converted to an EPB).
+typedef struct plogsfhdr {
+	uint32_t sec,usec;
+	uint32_t caplen,len;
+} plogsfhdr;
+
+// head and frames are written only by the shard's thread, tail and done only
+// by the writer. They're kept on separate cachelines.
+typedef struct plogq {
+	uint64_t head;		// bytes ever queued, padding included
+	uint64_t frames;	// frames ever queued
+	uint64_t drops;		// frames dropped for want of space
+	uint64_t tail __attribute__ ((aligned (64)));	// bytes ever drained
+	uint64_t done;		// frames ever drained
+	int orphaned;		// shard freed; free the queue once drained
+	struct plogq *next;
+	unsigned char *buf;
+	char *name;		// interface name, for pcapng IDBs
+	unsigned ifid;		// writer's: IDB index within the log...
+	unsigned ifgen;		// ...valid while this matches plog_filegen
+} plogq;
+
+// The list of queues is protected by plog_lock. The writer takes a snapshot of
+// its head, and walks it unlocked: queues are only added at the head, and only
+// the writer unlinks them while it runs.
+static pthread_mutex_t plog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t plog_cond = PTHREAD_COND_INITIALIZER;
+static plogq *plog_queues;
+static int plog_running;	// accepting frames
+static int plog_stopping;	// writer ought finish up
+static int plog_kicked;		// writer has been signaled
+static int plog_live;		// writer thread exists
+static pthread_t plog_tid;
+static unsigned char *plog_batch;
+static size_t plog_batchlen;
+static int plog_failed;		// a write failed; diagnosed once
+// Counts of the writer, and those of freed queues
+static uintmax_t plog_written,plog_writes,plog_rotations,plog_reaped_drops;
+
+// The open log. Set up by plog_open(), and thereafter the writer's alone.
+static const plogconf *plog_conf;
+static int plog_fd = -1;
+static gzFile plog_gz;		// wrapping plog_fd, if compressing
+static int plog_unflushed;	// compressor holds data not yet written
+static uintmax_t plog_filebytes;// bytes (uncompressed) in this log
+static uintmax_t plog_filerecs;	// frames in this log
+static uint64_t plog_opened;	// plog_clock() at creation
+static unsigned plog_filegen;	// bumped with each log, invalidating ifids
+static char **plog_ifnames;	// this log's IDBs (pcapng)
+static unsigned plog_ifcount;
+static char **plog_rotated;	// names of retained rotations, oldest first
+static unsigned plog_rotcount;
+
+static uint64_t
+plog_clock(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static void
+plog_kick(void){
+	if(!__atomic_exchange_n(&plog_kicked,1,__ATOMIC_RELAXED)){
+		pthread_cond_signal(&plog_cond);
+	}
+}
+
+static plogq *
+create_plogq(const char *name){
+	plogq *q;
+
+	if((q = malloc(sizeof(*q))) == NULL){
+		return NULL;
+	}
+	memset(q,0,sizeof(*q));
+	if((q->name = strdup(name ? name : "")) == NULL){
+		free(q);
+		return NULL;
+	}
+	if((q->buf = malloc(PLOG_QUEUE_BYTES)) == NULL){
+		free(q->name);
+		free(q);
+		return NULL;
+	}
+	pthread_mutex_lock(&plog_lock);
+	if(!plog_running){
+		pthread_mutex_unlock(&plog_lock);
+		free(q->name);
+		free(q->buf);
+		free(q);
+		return NULL;
+	}
+	q->next = plog_queues;
+	plog_queues = q;
+	pthread_mutex_unlock(&plog_lock);
+	return q;
+}
+
+// plog_lock must be held.
+static void
+free_plogq(plogq *q){
+	plog_reaped_drops += __atomic_load_n(&q->drops,__ATOMIC_RELAXED);
+	free(q->name);
+	free(q->buf);
+	free(q);
+}
+
+int plog_frame(rxshard *rs,const char *name,const struct pcap_pkthdr *h,
+		const void *a,size_t alen,const void *b,size_t blen){
+	uint64_t head,tail;
+	uint32_t rlen,off;
+	unsigned char *dst;
+	plogsfhdr sfh;
+	plogrec rec;
+	plogq *q;
+
+	if(!__atomic_load_n(&plog_running,__ATOMIC_ACQUIRE)){
+		return 0;
+	}
+	if((q = rs->plogq) == NULL){
+		if((q = create_plogq(name)) == NULL){
+			rxshard_inc(rs,&rs->plogdrops);
+			return -1;
+		}
+		rs->plogq = q;
+	}
+	rec.wlen = sizeof(sfh) + alen + blen;
+	rec.rlen = (sizeof(rec) + rec.wlen + 7) & ~7u;
+	head = q->head;
+	off = head & (PLOG_QUEUE_BYTES - 1);
+	rlen = rec.rlen + (PLOG_QUEUE_BYTES - off < rec.rlen ? PLOG_QUEUE_BYTES - off : 0);
+	tail = __atomic_load_n(&q->tail,__ATOMIC_ACQUIRE);
+	if(rec.rlen > PLOG_MAXFRAME || PLOG_QUEUE_BYTES - (head - tail) < rlen){
+		__atomic_store_n(&q->drops,q->drops + 1,__ATOMIC_RELAXED);
+		rxshard_inc(rs,&rs->plogdrops);
+		plog_kick();
+		return -1;
+	}
+	if(rlen != rec.rlen){ // pad out to the end of the ring
+		plogrec pad = { .rlen = PLOG_QUEUE_BYTES - off, .wlen = 0, };
+
+		memcpy(q->buf + off,&pad,sizeof(pad));
+		head += pad.rlen;
+		off = 0;
+	}
+	sfh.sec = h->ts.tv_sec;
+	sfh.usec = h->ts.tv_usec;
+	sfh.caplen = h->caplen;
+	sfh.len = h->len;
+	dst = q->buf + off;
+	memcpy(dst,&rec,sizeof(rec));
+	memcpy(dst + sizeof(rec),&sfh,sizeof(sfh));
+	memcpy(dst + sizeof(rec) + sizeof(sfh),a,alen);
+	memcpy(dst + sizeof(rec) + sizeof(sfh) + alen,b,blen);
+	head += rec.rlen;
+	__atomic_store_n(&q->head,head,__ATOMIC_RELEASE);
+	__atomic_store_n(&q->frames,q->frames + 1,__ATOMIC_RELAXED);
+	if(head - tail > PLOG_QUEUE_BYTES / 2){
+		plog_kick();
+	}
+	return 0;
+}
+
+static int
+out_write(const void *buf,size_t len){
+	const unsigned char *b = buf;
+	size_t left = len;
+
+	if(plog_gz){
+		if(gzwrite(plog_gz,buf,len) != (int)len){
+			return -1;
+		}
+		plog_unflushed = 1;
+	}else{
+		if(plog_fd < 0){
+			errno = EBADF;
+			return -1;
+		}
+		while(left){
+			ssize_t r;
+
+			if((r = write(plog_fd,b,left)) < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				return -1;
+			}
+			b += r;
+			left -= r;
+		}
+	}
+	plog_filebytes += len;
+	return 0;
+}
+
+// Push anything held by the compressor out to the file, so that the log can
+// be read as it's written. gzip(1) handles the sync markers transparently.
+static void
+out_flush(void){
+	if(plog_gz && plog_unflushed){
+		gzflush(plog_gz,Z_SYNC_FLUSH);
+		plog_unflushed = 0;
+	}
+}
+
+static int
+out_close(void){
+	int ret = 0;
+
+	if(plog_gz){
+		ret = gzclose(plog_gz) == Z_OK ? 0 : -1;
+		plog_gz = NULL;
+	}else if(plog_fd >= 0){
+		ret = close(plog_fd);
+	}
+	plog_fd = -1;
+	return ret;
+}
+
+// The log's current size, as it counts against maxbytes: compressed, if
+// we're compressing (whatever's still in the compressor isn't counted).
+static uintmax_t
+out_size(void){
+	if(plog_gz){
+		return gzoffset(plog_gz);
+	}
+	return plog_filebytes;
+}
+
+static int
+write_file_header(void){
+	if(plog_conf->pcapng){
+		struct {
+			uint32_t btype,blen,bom;
+			uint16_t major,minor;
+			int64_t seclen;
+			uint32_t blen2;
+		} __attribute__ ((packed)) shb = {
+			.btype = PCAPNG_SHB,
+			.blen = sizeof(shb),
+			.bom = PCAPNG_BOM,
+			.major = 1,
+			.minor = 0,
+			.seclen = -1, // unknown
+			.blen2 = sizeof(shb),
+		};
+
+		return out_write(&shb,sizeof(shb));
+	}else{
+		struct {
+			uint32_t magic;
+			uint16_t major,minor;
+			int32_t thiszone;
+			uint32_t sigfigs,snaplen,linktype;
+		} hdr = {
+			.magic = PCAP_MAGIC_USEC,
+			.major = 2,
+			.minor = 4,
+			.thiszone = 0,
+			.sigfigs = 0,
+			.snaplen = PLOG_SNAPLEN,
+			.linktype = PLOG_LINKTYPE,
+		};
+
+		return out_write(&hdr,sizeof(hdr));
+	}
+}
+
+static void
+reset_ifnames(void){
+	while(plog_ifcount){
+		free(plog_ifnames[--plog_ifcount]);
+	}
+	free(plog_ifnames);
+	plog_ifnames = NULL;
+}
+
+// Open (O_TRUNC) or reopen (O_APPEND) the log at its path. A classic pcap
+// header is only written to an empty file. pcapng always gets a new section,
+// and thus new IDBs.
+static int
+open_log(int flags){
+	int fd;
+
+	if((fd = open(plog_conf->path,O_WRONLY | O_CREAT | O_CLOEXEC | flags,0644)) < 0){
+		return -1;
+	}
+	plog_fd = fd;
+	if(plog_conf->gzip){
+		if((plog_gz = gzdopen(fd,"wb")) == NULL){
+			close(fd);
+			plog_fd = -1;
+			errno = ENOMEM;
+			return -1;
+		}
+		gzbuffer(plog_gz,PLOG_GZBUF);
+	}
+	plog_filebytes = 0;
+	plog_filerecs = 0;
+	plog_unflushed = 0;
+	plog_opened = plog_clock();
+	reset_ifnames();
+	++plog_filegen;
+	if(plog_conf->pcapng || lseek(fd,0,SEEK_END) == 0){
+		if(write_file_header()){
+			int e = errno;
+
+			out_close();
+			errno = e;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// path.YYYYmmddHHMMSS (UTC), or with -n appended should that already exist.
+static char *
+rotated_name(void){
+	char stamp[32],*name;
+	struct tm tm;
+	unsigned n;
+	time_t t;
+	size_t l;
+
+	t = time(NULL);
+	if(gmtime_r(&t,&tm) == NULL || strftime(stamp,sizeof(stamp),"%Y%m%d%H%M%S",&tm) == 0){
+		return NULL;
+	}
+	l = strlen(plog_conf->path) + strlen(stamp) + 8;
+	if((name = malloc(l)) == NULL){
+		return NULL;
+	}
+	snprintf(name,l,"%s.%s",plog_conf->path,stamp);
+	for(n = 1 ; access(name,F_OK) == 0 ; ++n){
+		if(n == PLOG_MAXSUFFIX){
+			free(name);
+			errno = EEXIST;
+			return NULL;
+		}
+		snprintf(name,l,"%s.%s-%u",plog_conf->path,stamp,n);
+	}
+	return name;
+}
+
+// Remember a rotated log, unlinking the oldest should we have too many.
+static void
+retain_rotation(char *name){
+	if(plog_conf->keep == 0 || plog_rotated == NULL){
+		free(name);
+		return;
+	}
+	plog_rotated[plog_rotcount++] = name;
+	if(plog_rotcount > plog_conf->keep){
+		if(unlink(plog_rotated[0]) && errno != ENOENT){
+			diagnostic("Couldn't remove packet log %s (%s?)",plog_rotated[0],strerror(errno));
+		}
+		free(plog_rotated[0]);
+		--plog_rotcount;
+		memmove(plog_rotated,plog_rotated + 1,sizeof(*plog_rotated) * plog_rotcount);
+	}
+}
+
+static int
+rotation_due(uint64_t now){
+	if(plog_fd < 0 || plog_filerecs == 0){ // don't rotate out empty logs
+		return 0;
+	}
+	if(plog_conf->maxbytes && out_size() >= plog_conf->maxbytes){
+		return 1;
+	}
+	if(plog_conf->maxsecs && now - plog_opened >= plog_conf->maxsecs * 1000ull){
+		return 1;
+	}
+	return 0;
+}
+
+// Close the log, move it aside, and begin anew. Should the rename fail, we
+// carry on appending to the current log.
+static void
+rotate_log(void){
+	char *name;
+	int flags;
+
+	if(out_close()){
+		diagnostic("Couldn't close packet log %s (%s?)",plog_conf->path,strerror(errno));
+	}
+	flags = O_APPEND;
+	if((name = rotated_name()) == NULL){
+		diagnostic("Couldn't name rotated packet log (%s?)",strerror(errno));
+	}else if(rename(plog_conf->path,name)){
+		diagnostic("Couldn't rename %s to %s (%s?)",plog_conf->path,name,strerror(errno));
+		free(name);
+	}else{
+		__atomic_add_fetch(&plog_rotations,1,__ATOMIC_RELAXED);
+		retain_rotation(name);
+		flags = O_TRUNC;
+	}
+	if(open_log(flags)){
+		diagnostic("Couldn't open packet log %s (%s?)",plog_conf->path,strerror(errno));
+		plog_failed = 1; // further writes fail silently
+	}
+}
+
+static void
+write_batch(void){
+	if(plog_batchlen == 0){
+		return;
+	}
+	if(out_write(plog_batch,plog_batchlen)){
+		if(!plog_failed){
+			diagnostic("Couldn't write packet log (%s?)",strerror(errno));
+			plog_failed = 1;
+		}
+	}
+	__atomic_add_fetch(&plog_writes,1,__ATOMIC_RELAXED);
+	plog_batchlen = 0;
+}
+
+// Write out the batch if it hasn't room for need more bytes. Having something
+// to put in the next log, this is where an overlong log is rotated.
+static void
+batch_reserve(size_t need){
+	if(PLOG_BATCH_BYTES - plog_batchlen < need){
+		write_batch();
+		if(rotation_due(plog_clock())){
+			rotate_log();
+		}
+	}
+}
+
+static inline void
+batch_put(const void *src,size_t len){
+	memcpy(plog_batch + plog_batchlen,src,len);
+	plog_batchlen += len;
+}
+
+// Interface names longer than this are truncated in IDBs.
+#define PLOG_MAXIFNAME 1024
+
+static size_t
+idb_len(const plogq *q){
+	size_t nlen = strlen(q->name);
+
+	if(nlen > PLOG_MAXIFNAME){
+		nlen = PLOG_MAXIFNAME;
+	}
+	return 28 + PAD4(nlen);
+}
+
+// Find the queue's interface among this log's IDBs, adding one to the batch if
+// it's not there. Returns -1 on allocation failure.
+static int
+batch_idb(plogq *q){
+	static const unsigned char zeroes[4];
+	uint32_t blen,end = 0;
+	struct {
+		uint16_t code,len;
+	} opt;
+	char **tmp;
+	unsigned z;
+	size_t nlen;
+	struct {
+		uint32_t btype,blen;
+		uint16_t linktype,reserved;
+		uint32_t snaplen;
+	} idb;
+
+	for(z = 0 ; z < plog_ifcount ; ++z){
+		if(strcmp(plog_ifnames[z],q->name) == 0){
+			q->ifid = z;
+			q->ifgen = plog_filegen;
+			return 0;
+		}
+	}
+	if((tmp = realloc(plog_ifnames,sizeof(*tmp) * (plog_ifcount + 1))) == NULL){
+		return -1;
+	}
+	plog_ifnames = tmp;
+	if((tmp[plog_ifcount] = strdup(q->name)) == NULL){
+		return -1;
+	}
+	q->ifid = plog_ifcount++;
+	q->ifgen = plog_filegen;
+	if((nlen = strlen(q->name)) > PLOG_MAXIFNAME){
+		nlen = PLOG_MAXIFNAME;
+	}
+	blen = idb_len(q);
+	idb.btype = PCAPNG_IDB;
+	idb.blen = blen;
+	idb.linktype = PLOG_LINKTYPE;
+	idb.reserved = 0;
+	idb.snaplen = 0; // unlimited
+	opt.code = PCAPNG_OPT_IFNAME;
+	opt.len = nlen;
+	batch_put(&idb,sizeof(idb));
+	batch_put(&opt,sizeof(opt));
+	batch_put(q->name,nlen);
+	batch_put(zeroes,PAD4(nlen) - nlen);
+	batch_put(&end,sizeof(end)); // opt_endofopt
+	batch_put(&blen,sizeof(blen));
+	return 0;
+}
+
+// Convert a queued savefile record to an Enhanced Packet Block.
+static int
+batch_epb(plogq *q,const unsigned char *r,uint32_t wlen){
+	static const unsigned char zeroes[4];
+	struct {
+		uint32_t btype,blen,ifid;
+		uint32_t tshi,tslo;
+		uint32_t caplen,len;
+	} epb;
+	uint32_t caplen = wlen - sizeof(plogsfhdr);
+	plogsfhdr sfh;
+	uint64_t ts;
+
+	batch_reserve(PCAPNG_EPBLEN + PAD4(caplen) + idb_len(q));
+	if(q->ifgen != plog_filegen){
+		if(batch_idb(q)){
+			return -1;
+		}
+	}
+	memcpy(&sfh,r,sizeof(sfh));
+	ts = sfh.sec * 1000000ull + sfh.usec;
+	epb.btype = PCAPNG_EPB;
+	epb.blen = PCAPNG_EPBLEN + PAD4(caplen);
+	epb.ifid = q->ifid;
+	epb.tshi = ts >> 32u;
+	epb.tslo = ts & 0xffffffffu;
+	epb.caplen = sfh.caplen;
+	epb.len = sfh.len;
+	batch_put(&epb,sizeof(epb));
+	batch_put(r + sizeof(sfh),caplen);
+	batch_put(zeroes,PAD4(caplen) - caplen);
+	batch_put(&epb.blen,sizeof(epb.blen));
+	return 0;
+}
+
+// Move everything queued into the batch, writing as it fills.
+static unsigned
+drain_plogq(plogq *q){
+	uint64_t tail = q->tail,head;
+	unsigned n = 0,done = 0;
+
+	head = __atomic_load_n(&q->head,__ATOMIC_ACQUIRE);
+	while(tail != head){
+		const unsigned char *r = q->buf + (tail & (PLOG_QUEUE_BYTES - 1));
+		plogrec rec;
+
+		memcpy(&rec,r,sizeof(rec));
+		if(rec.wlen){
+			if(plog_conf->pcapng){
+				if(batch_epb(q,r + sizeof(rec),rec.wlen) == 0){
+					++plog_filerecs;
+					++n;
+				}
+			}else{
+				batch_reserve(rec.wlen);
+				batch_put(r + sizeof(rec),rec.wlen);
+				++plog_filerecs;
+				++n;
+			}
+			++done;
+		}
+		tail += rec.rlen;
+	}
+	__atomic_store_n(&q->tail,tail,__ATOMIC_RELEASE);
+	__atomic_store_n(&q->done,q->done + done,__ATOMIC_RELAXED);
+	return n;
+}
+
+static void *
+plog_writer(void *unsafe){
+	const omphalos_ctx *ctx = unsafe;
+	uint64_t lastflush;
+
+	if(pthread_setspecific(omphalos_ctx_key,ctx)){
+		return "couldn't set TSD";
+	}
+	lastflush = plog_clock();
+	for(;;){
+		plogq *q,**pq;
+		unsigned n = 0;
+		int stopping;
+		uint64_t now;
+
+		pthread_mutex_lock(&plog_lock);
+		stopping = plog_stopping;
+		for(pq = &plog_queues ; (q = *pq) ; ){
+			if(q->orphaned && q->tail == __atomic_load_n(&q->head,__ATOMIC_ACQUIRE)){
+				*pq = q->next;
+				free_plogq(q);
+			}else{
+				pq = &q->next;
+			}
+		}
+		q = plog_queues;
+		pthread_mutex_unlock(&plog_lock);
+		while(q){
+			n += drain_plogq(q);
+			q = q->next;
+		}
+		__atomic_add_fetch(&plog_written,n,__ATOMIC_RELAXED);
+		if(stopping){
+			write_batch();
+			out_flush();
+			break;
+		}
+		now = plog_clock();
+		if(plog_batchlen == 0 && !plog_unflushed){
+			lastflush = now;
+		}else if(now - lastflush >= PLOG_FLUSH_MSEC){
+			write_batch();
+			out_flush();
+			lastflush = now;
+		}
+		if(rotation_due(now)){
+			write_batch();
+			rotate_log();
+		}
+		if(n == 0){ // idle; wait to be kicked, or for the next flush
+			struct timespec ts;
+
+			clock_gettime(CLOCK_REALTIME,&ts);
+			ts.tv_nsec += (PLOG_FLUSH_MSEC / 4) * 1000000ull;
+			ts.tv_sec += ts.tv_nsec / 1000000000;
+			ts.tv_nsec %= 1000000000;
+			pthread_mutex_lock(&plog_lock);
+			if(!plog_stopping && !__atomic_load_n(&plog_kicked,__ATOMIC_RELAXED)){
+				pthread_cond_timedwait(&plog_cond,&plog_lock,&ts);
+			}
+			pthread_mutex_unlock(&plog_lock);
+		}
+		__atomic_store_n(&plog_kicked,0,__ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+int plog_open(const plogconf *conf){
+	plog_conf = conf;
+	if(conf->keep){
+		if((plog_rotated = malloc(sizeof(*plog_rotated) * (conf->keep + 1))) == NULL){
+			return -1;
+		}
+		plog_rotcount = 0;
+	}
+	if(open_log(O_TRUNC)){
+		int e = errno;
+
+		free(plog_rotated);
+		plog_rotated = NULL;
+		errno = e;
+		return -1;
+	}
+	return 0;
+}
+
+int plog_start(void){
+	int r;
+
+	if((plog_batch = malloc(PLOG_BATCH_BYTES)) == NULL){
+		return -1;
+	}
+	plog_batchlen = 0;
+	plog_stopping = 0;
+	__atomic_store_n(&plog_running,1,__ATOMIC_RELEASE);
+	if( (r = pthread_create(&plog_tid,NULL,plog_writer,(void *)get_octx())) ){
+		diagnostic("Couldn't launch packet log writer (%s?)",strerror(r));
+		__atomic_store_n(&plog_running,0,__ATOMIC_RELEASE);
+		free(plog_batch);
+		plog_batch = NULL;
+		return -1;
+	}
+	plog_live = 1;
+	return 0;
+}
+
+static void
+close_log(void){
+	if(plog_conf == NULL){
+		return;
+	}
+	if(out_close()){
+		diagnostic("Couldn't close packet log %s (%s?)",plog_conf->path,strerror(errno));
+	}
+	reset_ifnames();
+	while(plog_rotcount){
+		free(plog_rotated[--plog_rotcount]);
+	}
+	free(plog_rotated);
+	plog_rotated = NULL;
+}
+
+void plog_stop(void){
+	plogq *q,**pq;
+	int r;
+
+	if(!plog_live){
+		close_log();
+		return;
+	}
+	__atomic_store_n(&plog_running,0,__ATOMIC_RELEASE);
+	pthread_mutex_lock(&plog_lock);
+	plog_stopping = 1;
+	pthread_cond_signal(&plog_cond);
+	pthread_mutex_unlock(&plog_lock);
+	if( (r = pthread_join(plog_tid,NULL)) ){
+		diagnostic("Couldn't join packet log writer (%s?)",strerror(r));
+	}
+	pthread_mutex_lock(&plog_lock);
+	plog_live = 0;
+	for(pq = &plog_queues ; (q = *pq) ; ){ // shards still hold the others
+		if(q->orphaned){
+			*pq = q->next;
+			free_plogq(q);
+		}else{
+			pq = &q->next;
+		}
+	}
+	pthread_mutex_unlock(&plog_lock);
+	free(plog_batch);
+	plog_batch = NULL;
+	close_log();
+}
+
+void plog_release(rxshard *rs){
+	plogq *q,**pq;
+
+	if((q = rs->plogq) == NULL){
+		return;
+	}
+	rs->plogq = NULL;
+	pthread_mutex_lock(&plog_lock);
+	if(plog_live){ // the writer frees it once drained
+		q->orphaned = 1;
+	}else{
+		for(pq = &plog_queues ; *pq != q ; pq = &(*pq)->next){
+			;
+		}
+		*pq = q->next;
+		free_plogq(q);
+	}
+	pthread_mutex_unlock(&plog_lock);
+}
+
+void plog_stats(plogstats *ps){
+	const plogq *q;
+
+	memset(ps,0,sizeof(*ps));
+	pthread_mutex_lock(&plog_lock);
+	for(q = plog_queues ; q ; q = q->next){
+		uint64_t head = __atomic_load_n(&q->head,__ATOMIC_ACQUIRE);
+		uint64_t frames = __atomic_load_n(&q->frames,__ATOMIC_RELAXED);
+
+		ps->queued += frames - __atomic_load_n(&q->done,__ATOMIC_RELAXED);
+		ps->queuedbytes += head - __atomic_load_n(&q->tail,__ATOMIC_RELAXED);
+		ps->dropped += __atomic_load_n(&q->drops,__ATOMIC_RELAXED);
+		++ps->queues;
+	}
+	ps->dropped += plog_reaped_drops;
+	ps->written = __atomic_load_n(&plog_written,__ATOMIC_RELAXED);
+	ps->writes = __atomic_load_n(&plog_writes,__ATOMIC_RELAXED);
+	ps->rotations = __atomic_load_n(&plog_rotations,__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&plog_lock);
+}
+
+#define STAT(fp,st,x) if((st)->x) { if(fprintf((fp),"<"#x">%ju</"#x">",(uintmax_t)(st)->x) < 0){ return -1; } }
+int print_plog_stats(FILE *fp){
+	plogstats ps;
+
+	if(plog_conf == NULL){
+		return 0;
+	}
+	plog_stats(&ps);
+	if(fprintf(fp,"<plog>") < 0){
+		return -1;
+	}
+	STAT(fp,&ps,written);
+	STAT(fp,&ps,writes);
+	STAT(fp,&ps,rotations);
+	STAT(fp,&ps,dropped);
+	STAT(fp,&ps,queued);
+	STAT(fp,&ps,queuedbytes);
+	STAT(fp,&ps,queues);
+	if(fprintf(fp,"</plog>") < 0){
+		return -1;
+	}
+	return 0;
+}
+#undef STAT
@@ -0,0 +1,79 @@
+#ifndef OMPHALOS_PLOG
+#define OMPHALOS_PLOG
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+struct rxshard;
+
+// Asynchronous --plog output. Each RX shard logs into a queue of its own (a
+// single-producer, single-consumer byte ring, allocated upon the shard's first
+// log), so that logging never takes a lock nor waits on I/O. A writer thread
+// drains the queues, writing in large batches. Should a shard's queue fill,
+// its frames are dropped and counted (ifstats' plogdrops). Frames of distinct
+// shards are written in the order they're drained, not strictly by time.
+//
+// Formatting, compression and rotation all happen on the writer thread. The
+// log is written to the configured path. When it grows too large (checked as
+// batches are written) or too old, it's closed and renamed to
+// path.YYYYmmddHHMMSS (suffixed with -n should that exist), and a new log is
+// begun at path. Only the newest 'keep' of the files rotated out by this
+// process are retained.
+
+#define PLOG_QUEUE_BYTES	(1u << 20u)	// per RX shard
+#define PLOG_BATCH_BYTES	(1u << 20u)	// per write
+#define PLOG_FLUSH_MSEC		1000		// max delay of a partial batch
+
+typedef struct plogconf {
+	const char *path;	// NULL if not logging
+	int pcapng;		// pcapng, rather than classic pcap
+	int gzip;		// deflate with gzip framing
+	uintmax_t maxbytes;	// rotate once this much is written (0: never)
+	unsigned maxsecs;	// rotate once open this long (0: never)
+	unsigned keep;		// rotated logs to retain (0: all)
+} plogconf;
+
+typedef struct plogstats {
+	uintmax_t queued;	// frames awaiting the writer
+	uintmax_t queuedbytes;	// ...and the queue space they occupy
+	uintmax_t written;	// frames written
+	uintmax_t dropped;	// frames dropped on full queues
+	uintmax_t writes;	// batches written
+	uintmax_t rotations;	// logs rotated out
+	unsigned queues;	// shards with queues
+} plogstats;
+
+// Open the log, writing its file header. This ought be done before dropping
+// privileges; files created upon rotation are created with those remaining.
+// The configuration must remain valid until plog_stop().
+int plog_open(const plogconf *);
+
+// Launch the writer thread. Must be called with the omphalos_ctx TSD set.
+int plog_start(void);
+
+// Write out everything queued, stop the writer, and close the log. Frames
+// logged from here on are dropped without being counted.
+void plog_stop(void);
+
+// Queue a frame (the concatenation of the two buffers, of total length
+// h->caplen) from the RX shard's thread. The name is that of the shard's
+// interface. Returns -1 if it was dropped.
+int plog_frame(struct rxshard *,const char *,const struct pcap_pkthdr *,
+		const void *,size_t,const void *,size_t);
+
+// The shard is being freed. Anything it has queued is still written.
+void plog_release(struct rxshard *);
+
+void plog_stats(plogstats *);
+int print_plog_stats(FILE *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
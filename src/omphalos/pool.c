@@ -0,0 +1,67 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <omphalos/pool.h>
+#include <omphalos/util.h>
+
+// Each slab is prefixed with a link to the next slab, padded out to keep the
+// objects maximally aligned.
+typedef union slabhead {
+	void *next;
+	max_align_t align;
+} slabhead;
+
+static inline size_t
+pool_objsize(size_t s){
+	const size_t align = sizeof(max_align_t);
+
+	if(s < sizeof(void *)){
+		s = sizeof(void *);
+	}
+	return (s + align - 1) / align * align;
+}
+
+void *hostpool_get(hostpool *hp,size_t s){
+	void *ret;
+
+	s = pool_objsize(s);
+	if( (ret = hp->freelist) ){
+		hp->freelist = *(void **)ret;
+	}else{
+		if(hp->carveleft == 0){
+			slabhead *slab;
+
+			if((slab = Malloc(sizeof(*slab) + s * HOSTPOOL_SLABOBJS)) == NULL){
+				return NULL;
+			}
+			slab->next = hp->slabs;
+			hp->slabs = slab;
+			hp->carve = (char *)(slab + 1);
+			hp->carveleft = HOSTPOOL_SLABOBJS;
+		}
+		ret = hp->carve;
+		hp->carve += s;
+		--hp->carveleft;
+	}
+	++hp->used;
+	return ret;
+}
+
+void hostpool_put(hostpool *hp,void *obj){
+	*(void **)obj = hp->freelist;
+	hp->freelist = obj;
+	--hp->used;
+}
+
+void hostpool_destroy(hostpool *hp){
+	slabhead *slab;
+
+	while( (slab = hp->slabs) ){
+		hp->slabs = slab->next;
+		free(slab);
+	}
+	hp->freelist = NULL;
+	hp->carve = NULL;
+	hp->carveleft = 0;
+	hp->used = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef OMPHALOS_POOL
+#define OMPHALOS_POOL
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+// Slab-backed pool of fixed-size objects (l2hosts, l3hosts). Objects are
+// carved from slabs of HOSTPOOL_SLABOBJS, and returned objects are recycled
+// via a free list, so a pool whose population is capped occupies constant
+// space. Nothing is returned to the system until hostpool_destroy(). A
+// zero-initialized hostpool is valid and empty. The pool is unlocked; it
+// inherits the locking of its owner (generally the interface lock).
+typedef struct hostpool {
+	void *slabs;		// slab chain, linked through each slab's head
+	void *freelist;		// recycled objects, linked through their heads
+	char *carve;		// next uncarved object in the newest slab
+	unsigned carveleft;	// uncarved objects remaining in newest slab
+	unsigned used;		// objects currently handed out
+} hostpool;
+
+#define HOSTPOOL_SLABOBJS 256
+
+// All objects from a given pool must be of the same size.
+void *hostpool_get(hostpool *,size_t) __attribute__ ((nonnull (1)))
+	__attribute__ ((malloc));
+void hostpool_put(hostpool *,void *) __attribute__ ((nonnull (1,2)));
+
+// Frees all slabs, invalidating all objects taken from the pool.
+void hostpool_destroy(hostpool *) __attribute__ ((nonnull (1)));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
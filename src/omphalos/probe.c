@@ -0,0 +1,458 @@
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <omphalos/diag.h>
+#include <omphalos/probe.h>
+#include <omphalos/omphalos.h>
+#include <omphalos/interface.h>
+
+// Deferred probes per interface and class. Each class has its own queue
+// limit, so that a flood of one kind can't crowd out the others.
+#define PROBE_QUEUE_MAX 1024
+#define PROBE_ADDRLEN 16
+#define PROBE_TICKUSEC 1000	// probe wheel resolution
+
+typedef struct probe {
+	struct probe *next;
+	struct probe *hnext;		// in the interface's hash bucket
+	probeclass class;
+	probefxn fxn;
+	int fam;
+	unsigned char addr[PROBE_ADDRLEN];
+} probe;
+
+// Each class is limited to 1/share of the interface's rate.
+static const unsigned probeshares[PROBE_CLASSES] = {
+	1,	// PROBE_UNICAST
+	2,	// PROBE_MULTICAST
+	4,	// PROBE_BROADCAST
+};
+
+// Lock order is interface, then probe_lock. The probe thread drops
+// probe_lock before taking an interface's lock.
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_cond;
+static pthread_t probe_tid;
+static int probe_running,probe_stopping;
+static uintmax_t probe_interval;	// usec per frame at the interface rate
+static unsigned probe_burst;		// frames sendable back-to-back
+static interface *active;		// interfaces with deferred probes
+static interface *ready;		// interfaces whose timers have fired
+static twheel probe_wheel;		// on probe_clock() time
+
+static uintmax_t
+probe_clock(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void
+usec_to_tv(uintmax_t usec,struct timeval *tv){
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+}
+
+// Earliest time at which a frame of class c conforms to both buckets.
+static uintmax_t
+probe_eligible(const probesched *ps,probeclass c){
+	uintmax_t tol,t,ct;
+
+	tol = (probe_burst - 1) * probe_interval;
+	t = ps->tat > tol ? ps->tat - tol : 0;
+	tol *= probeshares[c];
+	ct = ps->ctat[c] > tol ? ps->ctat[c] - tol : 0;
+	return t > ct ? t : ct;
+}
+
+static void
+probe_charge(probesched *ps,probeclass c,uintmax_t now,unsigned cost){
+	if(ps->tat < now){
+		ps->tat = now;
+	}
+	ps->tat += cost * probe_interval;
+	if(ps->ctat[c] < now){
+		ps->ctat[c] = now;
+	}
+	ps->ctat[c] += cost * probe_interval * probeshares[c];
+	++ps->sent;
+}
+
+static inline uintmax_t
+tx_attempts(const interface *i){
+	return i->txframes + i->txpending + i->txerrors;
+}
+
+// A probe might emit several frames (or, via another interface, none on this
+// one). Charge what it actually put on the wire, but at least one frame.
+// Interface lock must be held, and probe_lock must not be.
+static int
+emit_probe(interface *i,probeclass c,probefxn fxn,int fam,const void *addr){
+	uintmax_t before = tx_attempts(i);
+	unsigned cost;
+	int r;
+
+	r = fxn(i,fam,addr);
+	if((cost = tx_attempts(i) - before) == 0){
+		cost = 1;
+	}
+	pthread_mutex_lock(&probe_lock);
+	probe_charge(&i->probes,c,probe_clock(),cost);
+	pthread_mutex_unlock(&probe_lock);
+	return r;
+}
+
+// FNV-1a over the probe's identity (PROBE_HASH_SIZE is a power of 2)
+static unsigned
+probe_hash(probeclass c,probefxn fxn,int fam,const unsigned char *addr){
+	uint32_t h = 2166136261u;
+	unsigned z;
+
+	h = (h ^ c) * 16777619u;
+	h = (h ^ (uint32_t)fam) * 16777619u;
+	h = (h ^ (uint32_t)((uintptr_t)fxn >> 4u)) * 16777619u;
+	for(z = 0 ; z < PROBE_ADDRLEN ; ++z){
+		h = (h ^ addr[z]) * 16777619u;
+	}
+	return h & (PROBE_HASH_SIZE - 1);
+}
+
+// Find the deferred probe bearing this identity. probe_lock must be held.
+static probe **
+find_probe(probesched *ps,probeclass c,probefxn fxn,int fam,const unsigned char *addr){
+	probe **pp;
+
+	for(pp = &ps->hash[probe_hash(c,fxn,fam,addr)] ; *pp ; pp = &(*pp)->hnext){
+		if((*pp)->class == c && (*pp)->fxn == fxn && (*pp)->fam == fam
+				&& memcmp((*pp)->addr,addr,PROBE_ADDRLEN) == 0){
+			break;
+		}
+	}
+	return pp;
+}
+
+// probe_lock must be held.
+static void
+deactivate_probes(interface *i){
+	interface **pi;
+
+	if(!i->probes.active){
+		return;
+	}
+	for(pi = &active ; *pi != i ; pi = &(*pi)->probes.next){
+		;
+	}
+	*pi = i->probes.next;
+	i->probes.next = NULL;
+	i->probes.active = 0;
+}
+
+// Find the deferred probe of the interface which can go soonest, returning
+// -1 if there are none. probe_lock must be held.
+static int
+next_class(const probesched *ps,probeclass *bc,uintmax_t *bt){
+	int found = -1;
+	unsigned c;
+
+	for(c = 0 ; c < PROBE_CLASSES ; ++c){
+		uintmax_t t;
+
+		if(ps->q[c] == NULL){
+			continue;
+		}
+		t = probe_eligible(ps,c);
+		if(found < 0 || t < *bt){
+			*bc = c;
+			*bt = t;
+			found = 0;
+		}
+	}
+	return found;
+}
+
+// The interface's soonest probe has come due. Hand it to the probe thread,
+// which can't service it from within the wheel: it holds probe_lock, and
+// must take the interface lock first. probe_lock must be held.
+static int
+probe_due(const struct timeval *tv __attribute__ ((unused)),
+		struct timeval *resched __attribute__ ((unused)),void *arg){
+	interface *i = arg;
+
+	if(!i->probes.ready){
+		i->probes.ready = 1;
+		i->probes.rnext = ready;
+		ready = i;
+	}
+	return 0;
+}
+
+// Arm the interface's timer for its soonest deferred probe, or disarm it if
+// there are none. probe_lock must be held.
+static void
+arm_probes(interface *i){
+	probesched *ps = &i->probes;
+	probeclass c = PROBE_UNICAST;
+	struct timeval tv;
+	uintmax_t t = 0;
+
+	if(next_class(ps,&c,&t)){
+		cancel_timer(&probe_wheel,&ps->timer);
+		return;
+	}
+	// A timer can fire anywhere within its tick; round up to the next, lest
+	// it fire before the probe conforms.
+	usec_to_tv(t + PROBE_TICKUSEC - 1,&tv);
+	schedule_timer(&probe_wheel,&ps->timer,&tv,probe_due,i);
+}
+
+// probe_lock must be held.
+static void
+unready_probes(interface *i){
+	interface **pi;
+
+	if(!i->probes.ready){
+		return;
+	}
+	for(pi = &ready ; *pi != i ; pi = &(*pi)->probes.rnext){
+		;
+	}
+	*pi = i->probes.rnext;
+	i->probes.rnext = NULL;
+	i->probes.ready = 0;
+}
+
+int schedule_probe(interface *i,probeclass c,probefxn fxn,int fam,const void *addr){
+	unsigned char key[PROBE_ADDRLEN];
+	probesched *ps = &i->probes;
+	size_t len;
+	probe **pp;
+	probe *p;
+
+	if(get_octx()->mode == OMPHALOS_MODE_SILENT){
+		return 0;
+	}
+	pthread_mutex_lock(&probe_lock);
+	if(!probe_running){
+		pthread_mutex_unlock(&probe_lock);
+		return fxn(i,fam,addr);
+	}
+	if(ps->q[c] == NULL && probe_eligible(ps,c) <= probe_clock()){
+		pthread_mutex_unlock(&probe_lock);
+		return emit_probe(i,c,fxn,fam,addr);
+	}
+	len = fam == AF_INET ? 4 : fam == AF_INET6 ? 16 : 0;
+	memset(key,0,sizeof(key));
+	if(addr && len){
+		memcpy(key,addr,len);
+	}
+	if(*(pp = find_probe(ps,c,fxn,fam,key))){
+		++ps->folded;
+		pthread_mutex_unlock(&probe_lock);
+		return 0;
+	}
+	if(ps->cqueued[c] >= PROBE_QUEUE_MAX || (p = malloc(sizeof(*p))) == NULL){
+		++ps->dropped;
+		pthread_mutex_unlock(&probe_lock);
+		return -1;
+	}
+	memset(p,0,sizeof(*p));
+	p->class = c;
+	p->fxn = fxn;
+	p->fam = fam;
+	memcpy(p->addr,key,sizeof(key));
+	*pp = p;
+	if(ps->q[c] == NULL){
+		ps->qtail[c] = &ps->q[c];
+	}
+	*ps->qtail[c] = p;
+	ps->qtail[c] = &p->next;
+	++ps->cqueued[c];
+	++ps->queued;
+	++ps->deferred;
+	if(!ps->active){
+		ps->active = 1;
+		ps->next = active;
+		active = i;
+	}
+	arm_probes(i);
+	pthread_cond_signal(&probe_cond);
+	pthread_mutex_unlock(&probe_lock);
+	return 0;
+}
+
+void cancel_probes(interface *i){
+	probesched *ps = &i->probes;
+	unsigned c;
+	probe *p;
+
+	pthread_mutex_lock(&probe_lock);
+	for(c = 0 ; c < PROBE_CLASSES ; ++c){
+		while( (p = ps->q[c]) ){
+			ps->q[c] = p->next;
+			free(p);
+		}
+		ps->qtail[c] = &ps->q[c];
+		ps->cqueued[c] = 0;
+	}
+	memset(ps->hash,0,sizeof(ps->hash));
+	ps->queued = 0;
+	++ps->gen;
+	cancel_timer(&probe_wheel,&ps->timer);
+	unready_probes(i);
+	deactivate_probes(i);
+	pthread_mutex_unlock(&probe_lock);
+}
+
+// Emit the interface's deferred probes which have come to conform, soonest
+// first, and rearm its timer for the remainder. probe_lock must be held, and is
+// dropped while taking the interface lock.
+static void
+service_probes(interface *i){
+	probesched *ps = &i->probes;
+	probeclass c = PROBE_UNICAST;
+	uintmax_t t = 0;
+	unsigned gen;
+	probe *p;
+
+	// Respect the lock order. The interface might be torn down while we
+	// hold neither lock, in which case its generation changes. It can't
+	// change while we hold the interface lock.
+	gen = ps->gen;
+	pthread_mutex_unlock(&probe_lock);
+	lock_interface(i);
+	pthread_mutex_lock(&probe_lock);
+	if(gen != ps->gen){
+		pthread_mutex_unlock(&probe_lock);
+		unlock_interface(i);
+		pthread_mutex_lock(&probe_lock);
+		return;
+	}
+	while(next_class(ps,&c,&t) == 0 && t <= probe_clock()){
+		p = ps->q[c];
+		if((ps->q[c] = p->next) == NULL){
+			ps->qtail[c] = &ps->q[c];
+		}
+		*find_probe(ps,c,p->fxn,p->fam,p->addr) = p->hnext;
+		--ps->cqueued[c];
+		if(--ps->queued == 0){
+			deactivate_probes(i);
+		}
+		pthread_mutex_unlock(&probe_lock);
+		emit_probe(i,c,p->fxn,p->fam,p->addr);
+		free(p);
+		pthread_mutex_lock(&probe_lock);
+	}
+	arm_probes(i);
+	pthread_mutex_unlock(&probe_lock);
+	unlock_interface(i);
+	pthread_mutex_lock(&probe_lock);
+}
+
+// Advance the wheel, service interfaces whose timers fired, and sleep until
+// the wheel next needs advancing (or a probe is queued).
+static void *
+probe_thread(void *unsafe){
+	const omphalos_ctx *ctx = unsafe;
+
+	if(pthread_setspecific(omphalos_ctx_key,ctx)){
+		return "couldn't set TSD";
+	}
+	pthread_mutex_lock(&probe_lock);
+	while(!probe_stopping){
+		struct timespec ts;
+		struct timeval tv;
+		uintmax_t now;
+		interface *i;
+		long usec;
+
+		now = probe_clock();
+		usec_to_tv(now,&tv);
+		twheel_advance(&probe_wheel,&tv);
+		if( (i = ready) ){
+			unready_probes(i);
+			service_probes(i);
+			continue;
+		}
+		if((usec = twheel_timeout(&probe_wheel,&tv)) < 0){
+			pthread_cond_wait(&probe_cond,&probe_lock);
+			continue;
+		}
+		now += usec;
+		ts.tv_sec = now / 1000000;
+		ts.tv_nsec = now % 1000000 * 1000;
+		pthread_cond_timedwait(&probe_cond,&probe_lock,&ts);
+	}
+	pthread_mutex_unlock(&probe_lock);
+	return NULL;
+}
+
+int init_probes(unsigned rate,unsigned burst){
+	pthread_condattr_t attr;
+	struct timeval tv;
+	int r;
+
+	if(rate == 0){
+		return 0;
+	}
+	probe_interval = 1000000 / rate;
+	probe_burst = burst ? burst : 1;
+	if(pthread_condattr_init(&attr)){
+		return -1;
+	}
+	if(pthread_condattr_setclock(&attr,CLOCK_MONOTONIC) ||
+			pthread_cond_init(&probe_cond,&attr)){
+		pthread_condattr_destroy(&attr);
+		return -1;
+	}
+	pthread_condattr_destroy(&attr);
+	usec_to_tv(probe_clock(),&tv);
+	if(twheel_init(&probe_wheel,PROBE_TICKUSEC,&tv)){
+		pthread_cond_destroy(&probe_cond);
+		return -1;
+	}
+	probe_stopping = 0;
+	if( (r = pthread_create(&probe_tid,NULL,probe_thread,(void *)get_octx())) ){
+		diagnostic("Couldn't launch probe thread (%s?)",strerror(r));
+		twheel_destroy(&probe_wheel);
+		pthread_cond_destroy(&probe_cond);
+		return -1;
+	}
+	pthread_mutex_lock(&probe_lock);
+	probe_running = 1;
+	pthread_mutex_unlock(&probe_lock);
+	return 0;
+}
+
+// Probes still queued are freed by cancel_probes() as interfaces go away.
+// Their timers are disarmed here, as the wheel goes away now.
+void stop_probes(void){
+	interface *i;
+	int r;
+
+	pthread_mutex_lock(&probe_lock);
+	if(!probe_running){
+		pthread_mutex_unlock(&probe_lock);
+		return;
+	}
+	probe_running = 0;
+	probe_stopping = 1;
+	pthread_cond_signal(&probe_cond);
+	pthread_mutex_unlock(&probe_lock);
+	if( (r = pthread_join(probe_tid,NULL)) ){
+		diagnostic("Couldn't join probe thread (%s?)",strerror(r));
+	}
+	pthread_mutex_lock(&probe_lock);
+	for(i = active ; i ; i = i->probes.next){
+		cancel_timer(&probe_wheel,&i->probes.timer);
+	}
+	while( (i = ready) ){
+		unready_probes(i);
+	}
+	twheel_destroy(&probe_wheel);
+	pthread_mutex_unlock(&probe_lock);
+	pthread_cond_destroy(&probe_cond);
+}
@@ -0,0 +1,78 @@
+#ifndef OMPHALOS_PROBE
+#define OMPHALOS_PROBE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <omphalos/timing.h>
+
+// Active probes (ARP, DNS PTR, mDNS, DHCP, SSDP, LLTD, broadcast pings) are
+// submitted to a scheduler, which holds each interface to a packets-per-
+// second ceiling. Each interface has a token bucket, and beneath it one bucket
+// per destination class. Broadcasts and multicasts are seen by every host on
+// the segment, and are allowed a smaller share of the interface's rate. Probes
+// which don't conform are queued per class, and emitted by the probe thread as
+// tokens become available. A probe identical to one already queued (same
+// class, function, family and address) is folded into it. Each interface with
+// deferred probes has a timer on the probe thread's timing wheel, armed for
+// the time at which its soonest probe conforms.
+//
+// Buckets are implemented via the Generic Cell Rate Algorithm (a token bucket
+// expressed as a "theoretical arrival time"), which needs no periodic refill.
+
+struct interface;
+
+typedef enum {
+	PROBE_UNICAST,
+	PROBE_MULTICAST,
+	PROBE_BROADCAST,
+	PROBE_CLASSES
+} probeclass;
+
+// Emits the probe. Called with the interface lock held, the address family,
+// and the address (copied if the probe was deferred; 16 bytes at most).
+typedef int (*probefxn)(struct interface *,int,const void *);
+
+struct probe;
+
+#define PROBE_HASH_SIZE 256	// buckets indexing deferred probes
+
+// Per-interface scheduler state, protected by the (global) probe lock.
+typedef struct probesched {
+	uintmax_t tat;				// interface bucket
+	uintmax_t ctat[PROBE_CLASSES];		// class buckets
+	struct probe *q[PROBE_CLASSES];		// deferred probes, FIFO
+	struct probe **qtail[PROBE_CLASSES];
+	unsigned cqueued[PROBE_CLASSES];	// deferred probes per class
+	struct probe *hash[PROBE_HASH_SIZE];	// deferred probes, by target
+	unsigned queued;			// total across classes
+	unsigned gen;				// bumped by cancel_probes()
+	twtimer timer;				// soonest deferred probe
+	struct interface *next;			// on the active list
+	struct interface *rnext;		// on the ready list
+	int active,ready;
+	uintmax_t sent,deferred,dropped;	// lifetime probe counts
+	uintmax_t folded;			// ...and duplicates suppressed
+} probesched;
+
+// Emit the probe now if the buckets allow, otherwise queue it. Interface lock
+// must be held. Returns the probe's result if emitted immediately, 0 if it was
+// queued (or already was, or we're silent), and -1 if the class's queue was
+// full.
+int schedule_probe(struct interface *,probeclass,probefxn,int,const void *);
+
+// Drop any probes queued for the interface. Interface lock must be held.
+void cancel_probes(struct interface *);
+
+// Start and stop the probe thread. Without it, probes are emitted immediately.
+// rate is in frames per second (0 disables limiting), burst in frames.
+int init_probes(unsigned,unsigned);
+void stop_probes(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
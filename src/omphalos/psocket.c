@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <stdio.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -8,8 +9,12 @@
 #include <sys/poll.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#ifdef HAVE_LINUX_IF_XDP_H
+#include <linux/if_xdp.h>
+#endif
 #include <net/if_arp.h>
 #include <omphalos/pci.h>
+#include <omphalos/xdp.h>
 #include <omphalos/pcap.h>
 #include <omphalos/diag.h>
 #include <omphalos/privs.h>
@@ -24,6 +29,29 @@
 #ifndef PACKET_TX_RING
 #define PACKET_TX_RING 13
 #endif
+#ifndef PACKET_LOSS
+#define PACKET_LOSS 14
+#endif
+#ifndef PACKET_QDISC_BYPASS
+#define PACKET_QDISC_BYPASS 20
+#endif
+
+// TPACKET_V3 geometry. Blocks are retired to userspace after the timeout even
+// if they're not full, so keep it well below the timestat sampling period.
+#define TPACKET3_BLOCK_SIZE (1u << 20)
+#define TPACKET3_RETIRE_MSEC 60
+
+// Frames of a batch have their first two cache lines prefetched: enough for
+// the L2 header and the start of L3 at any alignment of the former.
+#define RING_PREFETCH_STRIDE 64
+
+// RX ring budgets, per ring. With a known link speed, rings are sized to
+// absorb RX_RING_MSEC of line rate, within [RX_RING_MIN, RX_RING_MAX].
+// Otherwise, RX_RING_DEFAULT.
+#define RX_RING_MSEC 200
+#define RX_RING_MIN (4u << 20)
+#define RX_RING_DEFAULT (128u << 20)
+#define TX_RING_BYTES (1u << 20)
 
 // See packet(7) and Documentation/networking/packet_mmap.txt
 int packet_socket(unsigned protocol){
@@ -60,11 +88,30 @@ get_block_size(unsigned fsize,unsigned *bsize){
 	return 0;
 }
 
+size_t rx_ring_budget(unsigned mbps,unsigned rings){
+	uint64_t bytes;
+
+	if(mbps == 0){
+		bytes = RX_RING_DEFAULT;
+	}else{
+		bytes = (uint64_t)mbps * 1000000 / CHAR_BIT * RX_RING_MSEC / 1000;
+	}
+	if(rings > 1){
+		bytes /= rings;
+	}
+	if(bytes < RX_RING_MIN){
+		bytes = RX_RING_MIN;
+	}else if(bytes > RX_RING_MAX){
+		bytes = RX_RING_MAX;
+	}
+	return bytes;
+}
+
 // Returns 0 on failure, otherwise size of the ringbuffer. On a failure,
-// contents of treq are unspecified. blknum == 1024 for 4MiB rings.
+// contents of treq are unspecified. The ring is at most 'bytes' large.
 static size_t
-size_mmap_psocket(struct tpacket_req *treq,unsigned maxframe,unsigned blknum){
-	unsigned fperblk;
+size_mmap_psocket(struct tpacket_req *treq,unsigned maxframe,size_t bytes){
+	unsigned fperblk,bsize,z;
 
 	// Must be a multiple of TPACKET_ALIGNMENT, and the following must
 	// hold: TPACKET_HDRLEN <= tp_frame_size <= tp_block_size.
@@ -72,26 +119,59 @@ size_mmap_psocket(struct tpacket_req *treq,unsigned maxframe,unsigned blknum){
 	if(get_block_size(treq->tp_frame_size,&treq->tp_block_size) < 0){
 		return 0;
 	}
+	// Frames don't span blocks, so the remainder of each block is lost.
+	// A larger block might lose a smaller fraction of itself; take the
+	// tightest fit among the next few doublings.
+	for(z = 1, bsize = treq->tp_block_size << 1u ; z < 4 ; ++z, bsize <<= 1u){
+		if((uint64_t)(bsize % treq->tp_frame_size) * treq->tp_block_size <
+			(uint64_t)(treq->tp_block_size % treq->tp_frame_size) * bsize){
+			treq->tp_block_size = bsize;
+		}
+	}
 	fperblk = treq->tp_block_size / treq->tp_frame_size;
-	// Use the entire block, if there would otherwise be wasted space. This
-	// is useful to catch radiotap, small GRO etc without PACKET_COPY_THRESH.
-	treq->tp_frame_size = treq->tp_block_size / fperblk;
-	// Array of pointers to blocks, allocated via slab -- cannot be
-	// larger than largest slabbable allocation. FIXME do better
-	treq->tp_block_nr = blknum / (treq->tp_block_size / getpagesize());
+	// Spread whatever remains across the block's frames. This is useful to
+	// catch radiotap, small GRO etc without PACKET_COPY_THRESH.
+	treq->tp_frame_size = (treq->tp_block_size / fperblk) & ~(TPACKET_ALIGNMENT - 1);
+	treq->tp_block_nr = bytes / treq->tp_block_size;
+	if(treq->tp_block_nr == 0){
+		treq->tp_block_nr = 1;
+	}
 	// tp_frame_nr is derived from the other three parameters.
 	treq->tp_frame_nr = (treq->tp_block_size / treq->tp_frame_size)
 		* treq->tp_block_nr;
 	return treq->tp_block_nr * treq->tp_block_size;
 }
 
+// TPACKET_V3 packs variable-length frames into large blocks, which the kernel
+// hands over whole, either when full or upon the retire timeout. A block must
+// be able to hold at least one maximal frame. tp_frame_size and tp_frame_nr
+// are only used by the kernel for sanity checks in V3.
 static size_t
-mmap_psocket(int op,int idx,int fd,unsigned maxframe,void **map,
-			struct tpacket_req *treq,unsigned blknum){
-	size_t size;
+size_mmap_psocket3(struct tpacket_req3 *treq,unsigned maxframe,size_t bytes){
+	unsigned bsize;
 
+	if(get_block_size(TPACKET_ALIGN(TPACKET3_HDRLEN + maxframe),&bsize) < 0){
+		return 0;
+	}
+	treq->tp_block_size = bsize > TPACKET3_BLOCK_SIZE ? bsize : TPACKET3_BLOCK_SIZE;
+	treq->tp_block_nr = bytes / treq->tp_block_size;
+	if(treq->tp_block_nr == 0){
+		treq->tp_block_nr = 1;
+	}
+	treq->tp_frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + maxframe);
+	treq->tp_frame_nr = (treq->tp_block_size / treq->tp_frame_size)
+		* treq->tp_block_nr;
+	treq->tp_retire_blk_tov = TPACKET3_RETIRE_MSEC;
+	treq->tp_sizeof_priv = 0;
+	treq->tp_feature_req_word = 0;
+	return treq->tp_block_nr * treq->tp_block_size;
+}
+
+static size_t
+mmap_psocket(int op,int idx,int fd,void **map,const void *treq,
+				socklen_t treqlen,size_t size){
 	*map = MAP_FAILED;
-	if((size = size_mmap_psocket(treq,maxframe,blknum)) == 0){
+	if(size == 0){
 		return 0;
 	}
 	if(idx >= 0){
@@ -109,7 +189,7 @@ mmap_psocket(int op,int idx,int fd,unsigned maxframe,void **map,
 		return -1;
 	}
 	if(op){
-		if(setsockopt(fd,SOL_PACKET,op,treq,sizeof(*treq)) < 0){
+		if(setsockopt(fd,SOL_PACKET,op,treq,treqlen) < 0){
 			diagnostic("Couldn't set socket option (%s?)",strerror(errno));
 			return 0;
 		}
@@ -129,9 +209,37 @@ mmap_psocket(int op,int idx,int fd,unsigned maxframe,void **map,
 	return size;
 }
 
+// PACKET_LOSS must be set before the ring is created. Where PACKET_TX_RING
+// is unavailable, we map anonymous memory of the same geometry, and frames
+// are copied out with send() (see tx.c).
 size_t mmap_tx_psocket(int fd,int idx,unsigned maxframe,void **map,
-					struct tpacket_req *treq){
-	return mmap_psocket(0/*PACKET_TX_RING*/,idx,fd,maxframe,map,treq,256);
+				struct tpacket_req *treq,unsigned *txring){
+	int loss = 1;
+	size_t ret;
+
+	if(setsockopt(fd,SOL_PACKET,PACKET_LOSS,&loss,sizeof(loss)) == 0){
+		if( (ret = mmap_psocket(PACKET_TX_RING,idx,fd,map,treq,sizeof(*treq),
+					size_mmap_psocket(treq,maxframe,TX_RING_BYTES))) ){
+			*txring = 1;
+			return ret;
+		}
+	}else{
+		diagnostic("Couldn't set PACKET_LOSS (%s?)",strerror(errno));
+	}
+	diagnostic("No PACKET_TX_RING on fd %d, copying TX",fd);
+	*txring = 0;
+	return mmap_psocket(0,idx,fd,map,treq,sizeof(*treq),
+				size_mmap_psocket(treq,maxframe,TX_RING_BYTES));
+}
+
+int qdisc_bypass_psocket(int fd){
+	int bypass = 1;
+
+	if(setsockopt(fd,SOL_PACKET,PACKET_QDISC_BYPASS,&bypass,sizeof(bypass)) < 0){
+		diagnostic("Couldn't bypass qdisc on fd %d (%s?)",fd,strerror(errno));
+		return -1;
+	}
+	return 0;
 }
 
 int unmap_psocket(void *map,size_t size){
@@ -168,58 +276,94 @@ recover_truncated_packet(interface *iface,int fd,unsigned tlen){
 	return r;
 }
 
-// -1: error; don't call us anymore. 0: handled frame. 1: interrupted; we
-// return for a cancellation check, and the frameptr oughtn't be advanced. The
-// interface lock must be held upon entry.
-int handle_ring_packet(interface *iface,int fd,void *frame){
-	const struct omphalos_ctx *ctx = get_octx();
-	const omphalos_iface *octx = &ctx->iface;
-	struct tpacket_hdr *thdr = frame;
-	omphalos_packet packet;
-	int len;
+void idle_ring(omphalos_packet *packet,rxshard *rs){
+	const omphalos_iface *octx = &get_octx()->iface;
 
-	memset(&packet,0,sizeof(packet));
-	packet.i = iface;
-	while(thdr->tp_status == 0){
-		struct pollfd pfd[1];
-		int events,msec;
-
-		pfd[0].fd = fd;
-		pfd[0].revents = 0;
-		pfd[0].events = POLLIN | POLLRDNORM | POLLERR;
-		msec = IFACE_TIMESTAT_USECS / 1000;
-		pthread_mutex_unlock(&iface->lock);
-		events = poll(pfd,sizeof(pfd) / sizeof(*pfd),msec);
-		pthread_mutex_lock(&iface->lock);
-		if(events == 0){
-			gettimeofday(&packet.tv,NULL);
-			timestat_inc(&iface->fps,&packet.tv,0);
-			timestat_inc(&iface->bps,&packet.tv,0);
-			if(octx->packet_read){
-				octx->packet_read(&packet);
-			}
-			return 1;
-		}else if(events < 0){
-			if(errno != EINTR){
-				diagnostic("Error in poll() on %s (%s?)",
-						iface->name,strerror(errno));
-				return -1;
-			}
+	gettimeofday(&packet->tv,NULL);
+	rxshard_begin(rs);
+	timestat_inc(&rs->fps,&packet->tv,0);
+	timestat_inc(&rs->bps,&packet->tv,0);
+	rxshard_end(rs);
+	if(octx->packet_read){
+		octx->packet_read(packet);
+	}
+}
+
+// Wait for the kernel to hand us a frame (V1) or block (V3), updating the
+// timestats if none shows up within a sampling period. 0: events are ready,
+// recheck the status word. Otherwise, as handle_ring_batch(). The interface
+// lock must be held upon entry.
+static int
+wait_ring_packet(interface *iface,int fd,omphalos_packet *packet,rxshard *rs){
+	struct pollfd pfd[1];
+	struct timeval tv;
+	int events,msec;
+	long tmo;
+
+	pfd[0].fd = fd;
+	pfd[0].revents = 0;
+	pfd[0].events = POLLIN | POLLRDNORM | POLLERR;
+	msec = IFACE_TIMESTAT_USECS / 1000;
+	// Wake up in time for the timing wheel (see ring_packet_loop())
+	gettimeofday(&tv,NULL);
+	if((tmo = twheel_timeout(&iface->timers,&tv)) >= 0 && tmo < IFACE_TIMESTAT_USECS){
+		msec = (tmo + 999) / 1000;
+	}
+	pthread_mutex_unlock(&iface->lock);
+	events = poll(pfd,sizeof(pfd) / sizeof(*pfd),msec);
+	pthread_mutex_lock(&iface->lock);
+	if(events == 0){
+		if(msec < IFACE_TIMESTAT_USECS / 1000){
 			return 1;
-		}else if(pfd[0].revents & POLLERR){
-			// FIXME don't want to print this every time a device
-			// is removed from underneath us, but also don't want
-			// to race against notification...check to see if
-			// device is down here? FIXME
-			//diagnostic("Error polling psocket %d on %s",fd,i->name);
+		}
+		idle_ring(packet,rs);
+		return 1;
+	}else if(events < 0){
+		if(errno != EINTR){
+			diagnostic("Error in poll() on %s (%s?)",
+					iface->name,strerror(errno));
 			return -1;
 		}
+		return 1;
+	}else if(pfd[0].revents & POLLERR){
+		// FIXME don't want to print this every time a device
+		// is removed from underneath us, but also don't want
+		// to race against notification...check to see if
+		// device is down here? FIXME
+		//diagnostic("Error polling psocket %d on %s",fd,i->name);
+		return -1;
 	}
-	++iface->frames;
-	packet.tv.tv_sec = thdr->tp_sec;
-	packet.tv.tv_usec = thdr->tp_usec;
-	timestat_inc(&iface->fps,&packet.tv,1);
-	if(thdr->tp_status & TP_STATUS_LOSING){
+	return 0;
+}
+
+// A frame harvested from an RX ring, awaiting analysis. 'frame' points to the
+// tpacket header; the L2 header lies 'mac' bytes beyond (AF_XDP frames have
+// no header, and a 'mac' of 0). 'len' is set upon analysis.
+typedef struct ringslot {
+	void *frame;
+	struct timeval tv;
+	unsigned status,mac,snaplen,tplen;
+	unsigned len;		// length on the wire, as accounted
+} ringslot;
+
+// A batch's contributions to the stats shard, published in one update
+typedef struct ringtally {
+	uintmax_t frames,bytes,drops,truncated,recovered,malformed,noproto;
+} ringtally;
+
+// Analyze a single frame, independent of the TPACKET version in use. The
+// packet's timestamp ought already be set. The interface lock must be held.
+// Stats are accumulated into the batch's tally. Returns the frame's length.
+static unsigned
+handle_ring_frame(interface *iface,int fd,omphalos_packet *packet,
+			const ringslot *slot,ringtally *tally,rxshard *rs){
+	const struct omphalos_ctx *ctx = get_octx();
+	const omphalos_iface *octx = &ctx->iface;
+	unsigned drops = 0,caplen;
+	void *frame;
+	int len;
+
+	if(slot->status & TP_STATUS_LOSING){
 		struct tpacket_stats tstats;
 		socklen_t slen;
 
@@ -227,88 +371,265 @@ int handle_ring_packet(interface *iface,int fd,void *frame){
 		slen = sizeof(tstats);
 		if(getsockopt(fd,SOL_PACKET,PACKET_STATISTICS,&tstats,&slen)){
 			diagnostic("Error reading stats on %s (%s?)",iface->name,strerror(errno));
-		}else if(tstats.tp_drops){
-			iface->drops += tstats.tp_drops;
-			diagnostic("[%s] %u/%ju drops",iface->name,tstats.tp_drops,iface->drops);
+		}else if( (drops = tstats.tp_drops) ){
+			diagnostic("[%s] %u/%ju drops",iface->name,drops,
+					rs->drops + tally->drops + drops);
 		}
 	}
-	if((thdr->tp_status & TP_STATUS_COPY) || thdr->tp_snaplen != thdr->tp_len){
-		++iface->truncated;
-		if((len = recover_truncated_packet(iface,fd,thdr->tp_len)) <= 0){
+	frame = (char *)slot->frame + slot->mac;
+	if(!(slot->status & TP_STATUS_COPY) && slot->snaplen < slot->tplen && iface->rxsnap){
+		// Deliberately snapped by our filter; don't go back for the rest
+		packet->snapped = 1;
+		len = slot->snaplen;
+	}else if((slot->status & TP_STATUS_COPY) || slot->snaplen != slot->tplen){
+		++tally->truncated;
+		if((len = recover_truncated_packet(iface,fd,slot->tplen)) <= 0){
 			diagnostic("Partial capture on %s (%u/%ub)",
-				iface->name,thdr->tp_snaplen,thdr->tp_len);
-			frame = (char *)frame + thdr->tp_mac;
-			len = thdr->tp_snaplen;
+				iface->name,slot->snaplen,slot->tplen);
+			len = slot->snaplen;
 		}else{
 			frame = iface->truncbuf;
-			++iface->truncated_recovered;
-			len = thdr->tp_len;
+			++tally->recovered;
+			len = slot->tplen;
 		}
 	}else{
-		frame = (char *)frame + thdr->tp_mac;
-		len = thdr->tp_len;
+		len = slot->tplen;
 	}
-	timestat_inc(&iface->bps,&packet.tv,len);
-	iface->bytes += len;
-	iface->analyzer(&packet,frame,len);
-	thdr->tp_status = TP_STATUS_KERNEL; // return the frame
-	if(packet.l2s){
-		l2srcpkt(packet.l2s);
+	caplen = len;	// what we hold at 'frame'
+	iface->analyzer(packet,frame,len);
+	// Update hosts now, rather than in a pass of their own: a later frame of
+	// the batch might evict them (see lookup_l2host()).
+	if(packet->l2s){
+		l2srcpkt(packet->l2s);
 	}
-	if(packet.l2d){
-		l2dstpkt(packet.l2d);
+	if(packet->l2d){
+		l2dstpkt(packet->l2d);
 	}
-	if(packet.l3s){
-		l3_srcpkt(packet.l3s);
+	if(packet->l3s){
+		l3_srcpkt(packet->l3s);
 	}
-	if(packet.l3d){
-		l3_dstpkt(packet.l3d);
+	if(packet->l3d){
+		l3_dstpkt(packet->l3d);
 	}
-	if(packet.malformed || packet.noproto){
-		if(packet.malformed){
-			++iface->malformed;
-		}
-		if(packet.noproto){
-			++iface->noprotocol;
-		}
-		if(packet.pcap_ethproto){
+	if(packet->snapped){ // account for the frame as it was on the wire
+		len = slot->tplen;
+	}
+	observe_flow(packet,len);
+	++tally->frames;
+	tally->bytes += len;
+	tally->drops += drops;
+	tally->malformed += !!packet->malformed;
+	tally->noproto += !!packet->noproto;
+	if(packet->malformed || packet->noproto){
+		if(packet->pcap_ethproto){
 			struct pcap_pkthdr pcap;
-			size_t scribble = 0;
 			struct pcap_ll pll;
 
-			if(frame != iface->truncbuf){
-				scribble = thdr->tp_mac;
-				frame -= thdr->tp_mac;
-			}else{
-				scribble = 0;
-			}
-			pcap.caplen = pcap.len = len + scribble;
-			pcap.ts = packet.tv;
+			// Snapped frames are logged as snapped
+			pcap.caplen = caplen;
+			pcap.len = slot->tplen;
+			pcap.ts = packet->tv;
 			memset(&pll,0,sizeof(pll));
-			pll.arphrd = htons(packet.i->arptype);
-			pll.llen = htons(packet.i->addrlen);
-			if(packet.l2s){
-				hwaddrint hw = get_hwaddr(packet.l2s);
-				memcpy(&pll.haddr,&hw,packet.i->addrlen > sizeof(pll.haddr) ?
-						sizeof(pll.haddr) : packet.i->addrlen);
+			pll.arphrd = htons(packet->i->arptype);
+			pll.llen = htons(packet->i->addrlen);
+			if(packet->l2s){
+				hwaddrint hw = get_hwaddr(packet->l2s);
+				memcpy(&pll.haddr,&hw,packet->i->addrlen > sizeof(pll.haddr) ?
+						sizeof(pll.haddr) : packet->i->addrlen);
 				// FIXME handle other pkttypes
-				if(memcmp(&hw,packet.i->addr,packet.i->addrlen) == 0){
+				if(memcmp(&hw,packet->i->addr,packet->i->addrlen) == 0){
 					pll.pkttype = htons(4);
 				}
 			}
-			pll.ethproto = htons(packet.pcap_ethproto);
+			pll.ethproto = htons(packet->pcap_ethproto);
 			// 'frame' starts at the L2 header, *not* the tpacket_thdr
-			log_pcap_packet(&pcap,frame,packet.i->l2hlen + scribble,&pll);
-			if(scribble){
-				frame += thdr->tp_mac;
-			}
+			log_pcap_packet(rs,packet->i->name,&pcap,frame,packet->i->l2hlen,&pll);
 		}
 	}
 	if(octx->packet_read){
-		octx->packet_read(&packet);
+		octx->packet_read(packet);
+	}
+	return len;
+}
+
+// Analyze a batch of harvested frames, in order. Every frame's headers are
+// prefetched up front, so that their cache misses overlap one another (and
+// the dissection of earlier frames) rather than each stalling in turn. The
+// shard is then updated once for the whole batch. The interface lock must be
+// held.
+static void
+handle_ring_slots(interface *iface,int fd,ringslot *slots,unsigned n,rxshard *rs){
+	omphalos_packet packet;
+	ringtally tally;
+	unsigned z;
+
+	for(z = 0 ; z < n ; ++z){
+		const char *l2 = (const char *)slots[z].frame + slots[z].mac;
+
+		__builtin_prefetch(l2);
+		__builtin_prefetch(l2 + RING_PREFETCH_STRIDE);
+	}
+	memset(&tally,0,sizeof(tally));
+	for(z = 0 ; z < n ; ++z){
+		memset(&packet,0,sizeof(packet));
+		packet.i = iface;
+		packet.tv = slots[z].tv;
+		slots[z].len = handle_ring_frame(iface,fd,&packet,&slots[z],&tally,rs);
 	}
+	rxshard_begin(rs);
+	rs->frames += tally.frames;
+	rs->bytes += tally.bytes;
+	rs->drops += tally.drops;
+	rs->truncated += tally.truncated;
+	rs->truncated_recovered += tally.recovered;
+	rs->malformed += tally.malformed;
+	rs->noprotocol += tally.noproto;
+	for(z = 0 ; z < n ; ++z){
+		timestat_inc(&rs->fps,&slots[z].tv,1);
+		timestat_inc(&rs->bps,&slots[z].tv,slots[z].len);
+	}
+	rxshard_end(rs);
+}
+
+// -1: error; don't call us anymore. 0: handled frames. 1: interrupted; we
+// return for a cancellation check, and the frameptr oughtn't be advanced. The
+// interface lock must be held upon entry.
+int handle_ring_batch(interface *iface,int fd,void **cur,unsigned *idx,
+			const struct tpacket_req *treq,rxshard *rs){
+	struct tpacket_hdr *thdr = *cur;
+	ringslot slots[RING_BATCH];
+	omphalos_packet packet;
+	unsigned n,z,max;
+	int r;
+
+	memset(&packet,0,sizeof(packet));
+	packet.i = iface;
+	while(__atomic_load_n(&thdr->tp_status,__ATOMIC_ACQUIRE) == TP_STATUS_KERNEL){
+		if( (r = wait_ring_packet(iface,fd,&packet,rs)) ){
+			return r;
+		}
+	}
+	// Frames aren't returned until the batch is complete, so a batch mustn't
+	// wrap around a small ring onto its own (still ready) first frame.
+	max = treq->tp_frame_nr < RING_BATCH ? treq->tp_frame_nr : RING_BATCH;
+	n = 0;
+	do{
+		ringslot *s = &slots[n++];
+
+		s->frame = thdr;
+		s->tv.tv_sec = thdr->tp_sec;
+		s->tv.tv_usec = thdr->tp_usec;
+		s->status = thdr->tp_status;
+		s->mac = thdr->tp_mac;
+		s->snaplen = thdr->tp_snaplen;
+		s->tplen = thdr->tp_len;
+		thdr = (struct tpacket_hdr *)((char *)thdr + inclen(idx,treq));
+	}while(n < max &&
+		__atomic_load_n(&thdr->tp_status,__ATOMIC_ACQUIRE) != TP_STATUS_KERNEL);
+	handle_ring_slots(iface,fd,slots,n,rs);
+	for(z = 0 ; z < n ; ++z){ // return the frames
+		((struct tpacket_hdr *)slots[z].frame)->tp_status = TP_STATUS_KERNEL;
+	}
+	*cur = thdr;
+	return 0;
+}
+
+// As handle_ring_batch(), but for a TPACKET_V3 block. All frames within the
+// block are analyzed, RING_BATCH at a time, and the block is returned to the
+// kernel as a whole.
+int handle_ring_block(interface *iface,int fd,void *block,rxshard *rs){
+	struct tpacket_block_desc *bd = block;
+	ringslot slots[RING_BATCH];
+	struct tpacket3_hdr *thdr;
+	omphalos_packet packet;
+	unsigned z,n;
+	int r;
+
+	memset(&packet,0,sizeof(packet));
+	packet.i = iface;
+	while(!(bd->hdr.bh1.block_status & TP_STATUS_USER)){
+		if( (r = wait_ring_packet(iface,fd,&packet,rs)) ){
+			return r;
+		}
+	}
+	thdr = (struct tpacket3_hdr *)((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+	for(z = 0 ; z < bd->hdr.bh1.num_pkts ; z += n){
+		for(n = 0 ; n < RING_BATCH && z + n < bd->hdr.bh1.num_pkts ; ++n){
+			slots[n].frame = thdr;
+			slots[n].tv.tv_sec = thdr->tp_sec;
+			slots[n].tv.tv_usec = thdr->tp_nsec / 1000;
+			slots[n].status = thdr->tp_status;
+			slots[n].mac = thdr->tp_mac;
+			slots[n].snaplen = thdr->tp_snaplen;
+			slots[n].tplen = thdr->tp_len;
+			thdr = (struct tpacket3_hdr *)((char *)thdr + thdr->tp_next_offset);
+		}
+		handle_ring_slots(iface,fd,slots,n,rs);
+	}
+	bd->hdr.bh1.block_status = TP_STATUS_KERNEL; // return the block
+	return 0;
+}
+
+#ifdef HAVE_LINUX_IF_XDP_H
+// As handle_ring_block(), but for an AF_XDP socket's RX ring. Up to XSK_BATCH
+// ready frames are analyzed, and their UMEM frames returned to the fill ring.
+// AF_XDP provides no timestamps; we take one for the batch.
+int handle_xsk_batch(interface *iface,int fd,xsk *x,rxshard *rs){
+	const struct xdp_desc *descs = x->rx.descs;
+	uint64_t *fq = x->fill.descs;
+	ringslot slots[XSK_BATCH];
+	uint32_t cons,prod,fprod,n,z;
+	omphalos_packet packet;
+	struct timeval tv;
+	unsigned drops;
+	int r;
+
+	cons = *x->rx.consumer; // we're the only consumer
+	while((prod = __atomic_load_n(x->rx.producer,__ATOMIC_ACQUIRE)) == cons){
+		if( (drops = xsk_drops(fd,x)) ){
+			rxshard_begin(rs);
+			rs->drops += drops;
+			rxshard_end(rs);
+			diagnostic("[%s] %u/%ju drops",iface->name,drops,rs->drops);
+		}
+		memset(&packet,0,sizeof(packet));
+		packet.i = iface;
+		if( (r = wait_ring_packet(iface,fd,&packet,rs)) ){
+			return r;
+		}
+	}
+	if((n = prod - cons) > XSK_BATCH){
+		n = XSK_BATCH;
+	}
+	gettimeofday(&tv,NULL);
+	for(z = 0 ; z < n ; ++z){
+		const struct xdp_desc *d = &descs[(cons + z) & x->rx.mask];
+
+		slots[z].frame = (char *)x->umem + d->addr;
+		slots[z].tv = tv;
+		slots[z].status = 0;
+		slots[z].mac = 0;
+		slots[z].snaplen = slots[z].tplen = d->len;
+	}
+	handle_ring_slots(iface,fd,slots,n,rs);
+	fprod = *x->fill.producer;
+	for(z = 0 ; z < n ; ++z){
+		const struct xdp_desc *d = &descs[(cons + z) & x->rx.mask];
+
+		// The fill ring holds every frame, so there's always room
+		fq[(fprod + z) & x->fill.mask] = d->addr - d->addr % x->framesize;
+	}
+	__atomic_store_n(x->rx.consumer,cons + n,__ATOMIC_RELEASE);
+	__atomic_store_n(x->fill.producer,fprod + n,__ATOMIC_RELEASE);
 	return 0;
 }
+#else
+int handle_xsk_batch(interface *iface __attribute__ ((unused)),
+			int fd __attribute__ ((unused)),xsk *x __attribute__ ((unused)),
+			rxshard *rs __attribute__ ((unused))){
+	return -1;
+}
+#endif
 
 static int
 packet_multicast(int fd,int ifindex){
@@ -324,12 +645,78 @@ packet_multicast(int fd,int ifindex){
 	return 0;
 }
 
-size_t mmap_rx_psocket(int fd,int idx,unsigned maxframe,void **map,
-					struct tpacket_req *treq){
+// Join the bound packet socket to a PACKET_FANOUT group. All sockets in the
+// group must use the same mode. Defragmentation is requested for hash mode,
+// so that all fragments of a datagram are delivered to the same socket.
+int fanout_psocket(int fd,unsigned group,unsigned mode){
+	unsigned arg;
+
+	arg = (group & 0xffffu) | (mode << 16u);
+	if(mode == PACKET_FANOUT_HASH){
+		arg |= PACKET_FANOUT_FLAG_DEFRAG << 16u;
+	}
+	if(setsockopt(fd,SOL_PACKET,PACKET_FANOUT,&arg,sizeof(arg))){
+		diagnostic("Couldn't join fanout group %u on %d (%s?)",
+				group,fd,strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// Request TPACKET_V3 on the socket, returning non-zero if it's unavailable
+// (kernels prior to 3.2). Must precede PACKET_RX_RING.
+static int
+set_tpacket_version(int fd,int ver){
+	if(setsockopt(fd,SOL_PACKET,PACKET_VERSION,&ver,sizeof(ver))){
+		diagnostic("Couldn't set TPACKET version %d (%s?)",ver,strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// Set up and map an RX ring of the specified version, binding to idx if it's
+// non-negative. For TPACKET_V1, the geometry is returned in treq's prefix.
+static size_t
+map_rx_ring(int fd,int idx,unsigned maxframe,size_t bytes,void **map,
+			struct tpacket_req3 *treq,unsigned tpver){
+	struct tpacket_req treq1;
 	size_t ret;
+
+	if(tpver == TPACKET_V3){
+		return mmap_psocket(PACKET_RX_RING,idx,fd,map,treq,sizeof(*treq),
+				size_mmap_psocket3(treq,maxframe,bytes));
+	}
+	ret = mmap_psocket(PACKET_RX_RING,idx,fd,map,&treq1,sizeof(treq1),
+			size_mmap_psocket(&treq1,maxframe,bytes));
+	memset(treq,0,sizeof(*treq));
+	treq->tp_block_size = treq1.tp_block_size;
+	treq->tp_block_nr = treq1.tp_block_nr;
+	treq->tp_frame_size = treq1.tp_frame_size;
+	treq->tp_frame_nr = treq1.tp_frame_nr;
+	return ret;
+}
+
+size_t mmap_rx_psocket(int fd,int idx,unsigned maxframe,size_t bytes,void **map,
+			struct tpacket_req3 *treq,unsigned *tpver){
+	size_t ret = 0;
 	int thresh;
 
-	ret = mmap_psocket(PACKET_RX_RING,idx,fd,maxframe,map,treq,8192 * 4);
+	if(*tpver == TPACKET_V3){
+		if(set_tpacket_version(fd,TPACKET_V3) == 0){
+			ret = map_rx_ring(fd,idx,maxframe,bytes,map,treq,TPACKET_V3);
+			if(ret == 0){
+				set_tpacket_version(fd,TPACKET_V1);
+			}
+		}
+		if(ret == 0){
+			diagnostic("Falling back to TPACKET_V1 on idx %d",idx);
+			*tpver = TPACKET_V1;
+		}
+	}
+	if(*tpver != TPACKET_V3){
+		*tpver = TPACKET_V1;
+		ret = map_rx_ring(fd,idx,maxframe,bytes,map,treq,TPACKET_V1);
+	}
 	if(ret == 0){
 		return 0;
 	}
@@ -344,3 +731,29 @@ size_t mmap_rx_psocket(int fd,int idx,unsigned maxframe,void **map,
 	}
 	return ret;
 }
+
+// The kernel won't replace a ring in place, so we unmap and release the old
+// one, and set up the new one on the same socket. The socket remains bound,
+// in its fanout group, and registered with any epoll set. Frames arriving
+// while there's no ring are lost (the kernel purges them as the new ring is
+// installed), and aren't counted as drops.
+size_t resize_rx_psocket(int fd,unsigned maxframe,size_t bytes,void **map,
+			size_t size,struct tpacket_req3 *treq,unsigned tpver){
+	struct tpacket_req3 none;
+	size_t ret;
+
+	if(unmap_psocket(*map,size)){
+		return 0;
+	}
+	memset(&none,0,sizeof(none));
+	if(setsockopt(fd,SOL_PACKET,PACKET_RX_RING,&none,tpver == TPACKET_V3 ?
+				sizeof(none) : sizeof(struct tpacket_req))){
+		diagnostic("Couldn't release RX ring on %d (%s?)",fd,strerror(errno));
+		return 0;
+	}
+	if((ret = map_rx_ring(fd,-1,maxframe,bytes,map,treq,tpver)) == 0){
+		diagnostic("Couldn't grow RX ring on %d to %zub",fd,bytes);
+		ret = map_rx_ring(fd,-1,maxframe,size,map,treq,tpver);
+	}
+	return ret;
+}
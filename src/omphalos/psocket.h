@@ -7,18 +7,68 @@ extern "C" {
 
 #include <linux/if_packet.h>
 
+struct xsk;
+struct rxshard;
+struct omphalos_packet;
 struct interface;
 struct tpacket_req;
+struct tpacket_req3;
 
 // Open a packet socket. Requires superuser or network admin capabilities.
 int packet_socket(unsigned);
 
+// Largest RX ring we'll map. Rings which drop frames grow up to this size.
+#define RX_RING_MAX (1u << 30)
+
+// Bytes of RX ring wanted for each of 'rings' rings on a link of the given
+// speed in Mb/s (0 if unknown).
+size_t rx_ring_budget(unsigned,unsigned);
+
 // Returns the size of the map, or 0 if the operation fails (in this case,
-// map will be set to MAP_FAILED).
-size_t mmap_rx_psocket(int,int,unsigned,void **,struct tpacket_req *);
-size_t mmap_tx_psocket(int,int,unsigned,void **,struct tpacket_req *);
+// map will be set to MAP_FAILED). For RX, the ring is at most the specified
+// number of bytes, and the final argument is the requested TPACKET version
+// (TPACKET_V1 or TPACKET_V3), set to the version actually in use. TPACKET_V3
+// falls back to TPACKET_V1 on older kernels.
+size_t mmap_rx_psocket(int,int,unsigned,size_t,void **,struct tpacket_req3 *,unsigned *);
+// Replace the socket's RX ring (of the given size and TPACKET version) with
+// one of the specified number of bytes, falling back to the old size. Returns
+// the new size, or 0 if the socket was left without a ring. The old ring
+// ought have been drained.
+size_t resize_rx_psocket(int,unsigned,size_t,void **,size_t,struct tpacket_req3 *,
+				unsigned);
+// For TX, the final argument is set to 1 if a PACKET_TX_RING was mapped, or 0
+// if we fell back to an anonymous map (frames must then be copied out).
+size_t mmap_tx_psocket(int,int,unsigned,void **,struct tpacket_req *,unsigned *);
+
+// Have frames sent on this packet socket skip the traffic control layer
+// (PACKET_QDISC_BYPASS, Linux 3.14+). They'll not be shaped nor seen by
+// qdisc-attached taps, and are dropped rather than queued on full device
+// queues.
+int qdisc_bypass_psocket(int);
+
+// Join a bound packet socket to the PACKET_FANOUT group 'group', using the
+// PACKET_FANOUT_* distribution mode 'mode'.
+int fanout_psocket(int,unsigned,unsigned);
+
+// Maximum TPACKET_V1 frames harvested and analyzed as a batch
+#define RING_BATCH 64
+
+// Handle the ready TPACKET_V1 frames (up to RING_BATCH of them, waiting for
+// the first) beginning at the ring's frame *cur, of index *idx, advancing
+// both past them. Handle the next TPACKET_V3 block. Either way, count them
+// in the calling RX thread's stats shard.
+int handle_ring_batch(struct interface *,int,void **,unsigned *,
+			const struct tpacket_req *,struct rxshard *);
+int handle_ring_block(struct interface *,int,void *,struct rxshard *);
+
+// Sample zeroes into the shard's timestats, and hand the UI an empty packet
+// (bearing only its interface), as is done when a ring's been idle for a
+// sampling period. The interface lock must be held.
+void idle_ring(struct omphalos_packet *,struct rxshard *);
 
-int handle_ring_packet(struct interface *,int,void *);
+// Handle up to XSK_BATCH frames from an AF_XDP socket's RX ring.
+#define XSK_BATCH 64
+int handle_xsk_batch(struct interface *,int,struct xsk *,struct rxshard *);
 
 // map and size ought have been returned by mmap_*_psocket().
 int unmap_psocket(void *,size_t);
@@ -1,30 +1,71 @@
 #include <net/if_arp.h>
+#include <omphalos/tx.h>
 #include <omphalos/icmp.h>
 #include <omphalos/dhcp.h>
 #include <omphalos/mdns.h>
 #include <omphalos/lltd.h>
 #include <omphalos/ssdp.h>
+#include <omphalos/probe.h>
 #include <omphalos/queries.h>
 #include <omphalos/interface.h>
 
+// Adapt each emitter to probefxn, so that it can be deferred by schedule_probe().
+static int
+probe_lltd(interface *i,int family,const void *saddr){
+	return initiate_lltd(family,i,saddr);
+}
+
+static int
+probe_pings(interface *i,int family,const void *saddr){
+	if(family == AF_INET){
+		return tx_ipv4_bcast_pings(i,saddr);
+	}
+	return tx_ipv6_bcast_pings(i,saddr);
+}
+
+static int
+probe_dhcp(interface *i,int family,const void *saddr){
+	if(family == AF_INET){
+		return dhcp4_probe(i,saddr);
+	}
+	return dhcp6_probe(i,saddr);
+}
+
+static int
+probe_mdns_enumerate(interface *i,int family,const void *saddr){
+	return mdns_sd_enumerate(family,i,saddr);
+}
+
+static int
+probe_mdns_stdsd(interface *i,int family,const void *saddr){
+	return mdns_stdsd_probe(family,i,saddr);
+}
+
+static int
+probe_ssdp(interface *i,int family,const void *saddr){
+	return ssdp_msearch(family,i,saddr);
+}
+
 int query_network(int family,interface *i,const void *saddr){
 	int r = 0;
 
 	if(i->arptype != ARPHRD_LOOPBACK){
-		r |= initiate_lltd(family,i,saddr);
+		// Whatever the scheduler lets through now goes out with a
+		// single send() at the end
+		begin_tx_batch(i);
+		r |= schedule_probe(i,PROBE_BROADCAST,probe_lltd,family,saddr);
 		if(i->arptype != ARPHRD_NONE){
-			if(family == AF_INET){
-				r |= tx_ipv4_bcast_pings(i,saddr);
-				r |= dhcp4_probe(i,saddr);
-			}else if(family == AF_INET6){
-				r |= tx_ipv6_bcast_pings(i,saddr);
-				r |= dhcp6_probe(i,saddr);
+			if(family == AF_INET || family == AF_INET6){
+				r |= schedule_probe(i,family == AF_INET ? PROBE_BROADCAST : PROBE_MULTICAST,
+							probe_pings,family,saddr);
+				r |= schedule_probe(i,family == AF_INET ? PROBE_BROADCAST : PROBE_MULTICAST,
+							probe_dhcp,family,saddr);
 			}
 		}
-		r |= mdns_sd_enumerate(family,i,saddr);
-		r |= mdns_stdsd_probe(family,i,saddr);
-		r |= ssdp_msearch(family,i,saddr);
+		r |= schedule_probe(i,PROBE_MULTICAST,probe_mdns_enumerate,family,saddr);
+		r |= schedule_probe(i,PROBE_MULTICAST,probe_mdns_stdsd,family,saddr);
+		r |= schedule_probe(i,PROBE_MULTICAST,probe_ssdp,family,saddr);
+		r |= end_tx_batch(i);
 	}
 	return r;
 }
-
@@ -0,0 +1,316 @@
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <omphalos/diag.h>
+#include <omphalos/reactor.h>
+#include <omphalos/omphalos.h>
+
+#define REACTOR_EVENTS 32	// per epoll_wait()
+
+// Handles are the slot index plus one in the low 32 bits, and the slot's
+// generation in the high. Handle 0 is the shutdown eventfd.
+typedef struct rsource {
+	int fd;
+	reactorfxn service,tick;
+	void *arg;
+	uint32_t gen;		// bumped as the slot is freed
+	int live;		// registered, and not being removed
+	int busy;		// a thread is servicing or ticking it
+	int rearm;		// fired while being ticked; rearm when done
+	unsigned nextfree;	// index + 1 of the next free slot, or 0
+} rsource;
+
+// Sources are referenced by index, since the table moves as it grows.
+// Everything here is protected by reactor_lock, save the epoll set itself.
+static pthread_mutex_t reactor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reactor_cond = PTHREAD_COND_INITIALIZER;
+static rsource *sources;
+static unsigned srccount;	// slots in use or on the free list
+static unsigned srcalloc;
+static unsigned srcfree;	// index + 1 of the first free slot, or 0
+static int epfd = -1,evfd = -1;
+static pthread_t *tids;
+static unsigned tcount;
+static uint64_t nexttick;	// msec, CLOCK_MONOTONIC
+
+static uint64_t
+reactor_clock(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+// reactor_lock must be held.
+static rsource *
+lookup_source(uint64_t h){
+	uint32_t idx = (uint32_t)h;
+
+	if(idx == 0 || idx > srccount){
+		return NULL;
+	}
+	if(sources[idx - 1].gen != h >> 32u || !sources[idx - 1].live){
+		return NULL;
+	}
+	return &sources[idx - 1];
+}
+
+static int
+arm_source(int fd,uint64_t h,int op){
+	struct epoll_event ev;
+
+	memset(&ev,0,sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.u64 = h;
+	return epoll_ctl(epfd,op,fd,&ev);
+}
+
+// Mark the source no longer busy. reactor_lock must be held.
+static void
+release_source(uint64_t h){
+	rsource *s = &sources[(uint32_t)h - 1];
+
+	s->busy = 0;
+	if(!s->live){
+		pthread_cond_broadcast(&reactor_cond);
+	}else if(s->rearm){
+		s->rearm = 0;
+		arm_source(s->fd,h,EPOLL_CTL_MOD);
+	}
+}
+
+static void
+service_source(uint64_t h,unsigned events){
+	reactorfxn fxn;
+	rsource *s;
+	void *arg;
+	int r;
+
+	pthread_mutex_lock(&reactor_lock);
+	if((s = lookup_source(h)) == NULL){
+		pthread_mutex_unlock(&reactor_lock);
+		return;
+	}
+	if(s->busy){ // being ticked; it'll rearm us when done
+		s->rearm = 1;
+		pthread_mutex_unlock(&reactor_lock);
+		return;
+	}
+	s->busy = 1;
+	fxn = s->service;
+	arg = s->arg;
+	pthread_mutex_unlock(&reactor_lock);
+	r = fxn(arg,events);
+	pthread_mutex_lock(&reactor_lock);
+	sources[(uint32_t)h - 1].rearm = r >= 0;
+	release_source(h);
+	pthread_mutex_unlock(&reactor_lock);
+}
+
+// Tick each source which isn't otherwise busy, if a tick is due and no other
+// thread has claimed it.
+static void
+tick_sources(void){
+	uint64_t now = reactor_clock(),t;
+	unsigned z;
+
+	t = __atomic_load_n(&nexttick,__ATOMIC_RELAXED);
+	if(now < t || !__atomic_compare_exchange_n(&nexttick,&t,now + REACTOR_TICK_MSEC,
+					0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)){
+		return;
+	}
+	pthread_mutex_lock(&reactor_lock);
+	for(z = 0 ; z < srccount ; ++z){
+		rsource *s = &sources[z];
+		reactorfxn fxn;
+		uint64_t h;
+		void *arg;
+
+		if(!s->live || s->busy || s->tick == NULL){
+			continue;
+		}
+		s->busy = 1;
+		fxn = s->tick;
+		arg = s->arg;
+		h = ((uint64_t)s->gen << 32u) | (z + 1);
+		pthread_mutex_unlock(&reactor_lock);
+		fxn(arg,0);
+		pthread_mutex_lock(&reactor_lock);
+		release_source(h);
+	}
+	pthread_mutex_unlock(&reactor_lock);
+}
+
+static void *
+reactor_thread(void *unsafe){
+	const omphalos_ctx *ctx = unsafe;
+	struct epoll_event evs[REACTOR_EVENTS];
+
+	if(pthread_setspecific(omphalos_ctx_key,ctx)){
+		return "couldn't set TSD";
+	}
+	for(;;){
+		int n,z;
+
+		if((n = epoll_wait(epfd,evs,REACTOR_EVENTS,REACTOR_TICK_MSEC)) < 0){
+			if(errno != EINTR){
+				diagnostic("Error in epoll_wait() (%s?)",strerror(errno));
+				return "calamitous error";
+			}
+			continue;
+		}
+		for(z = 0 ; z < n ; ++z){
+			if(evs[z].data.u64 == 0){ // the eventfd never gets read
+				return NULL;
+			}
+			service_source(evs[z].data.u64,evs[z].events);
+		}
+		tick_sources();
+	}
+}
+
+uint64_t reactor_add(int fd,reactorfxn service,reactorfxn tick,void *arg){
+	unsigned idx;
+	rsource *s;
+	uint64_t h;
+
+	pthread_mutex_lock(&reactor_lock);
+	if(srcfree){
+		idx = srcfree - 1;
+		s = &sources[idx];
+		srcfree = s->nextfree;
+	}else{
+		if(srccount == srcalloc){
+			unsigned na = srcalloc ? srcalloc * 2 : 16;
+			rsource *tmp;
+
+			if((tmp = realloc(sources,sizeof(*sources) * na)) == NULL){
+				pthread_mutex_unlock(&reactor_lock);
+				return 0;
+			}
+			sources = tmp;
+			srcalloc = na;
+		}
+		idx = srccount++;
+		s = &sources[idx];
+		s->gen = 1;
+	}
+	s->fd = fd;
+	s->service = service;
+	s->tick = tick;
+	s->arg = arg;
+	s->busy = s->rearm = 0;
+	s->nextfree = 0;
+	s->live = 1;
+	h = ((uint64_t)s->gen << 32u) | (idx + 1);
+	if(arm_source(fd,h,EPOLL_CTL_ADD)){
+		diagnostic("Couldn't add %d to reactor (%s?)",fd,strerror(errno));
+		s->live = 0;
+		++s->gen;
+		s->nextfree = srcfree;
+		srcfree = idx + 1;
+		pthread_mutex_unlock(&reactor_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&reactor_lock);
+	return h;
+}
+
+void reactor_del(uint64_t h){
+	uint32_t idx = (uint32_t)h - 1;
+	rsource *s;
+
+	pthread_mutex_lock(&reactor_lock);
+	if((s = lookup_source(h)) == NULL){
+		pthread_mutex_unlock(&reactor_lock);
+		return;
+	}
+	s->live = 0;
+	if(epoll_ctl(epfd,EPOLL_CTL_DEL,s->fd,NULL)){
+		diagnostic("Couldn't remove %d from reactor (%s?)",s->fd,strerror(errno));
+	}
+	while(sources[idx].busy){
+		pthread_cond_wait(&reactor_cond,&reactor_lock);
+	}
+	s = &sources[idx];
+	++s->gen;
+	s->nextfree = srcfree;
+	srcfree = idx + 1;
+	pthread_mutex_unlock(&reactor_lock);
+}
+
+int init_reactor(unsigned threads){
+	const omphalos_ctx *ctx = get_octx();
+	struct epoll_event ev;
+	int r;
+
+	if(threads == 0 || threads > REACTOR_MAXTHREADS){
+		return -1;
+	}
+	if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+		diagnostic("Couldn't create epoll set (%s?)",strerror(errno));
+		return -1;
+	}
+	if((evfd = eventfd(0,EFD_CLOEXEC | EFD_NONBLOCK)) < 0){
+		diagnostic("Couldn't create eventfd (%s?)",strerror(errno));
+		close(epfd);
+		epfd = -1;
+		return -1;
+	}
+	memset(&ev,0,sizeof(ev));
+	ev.events = EPOLLIN; // level-triggered, so it wakes every thread
+	ev.data.u64 = 0;
+	if(epoll_ctl(epfd,EPOLL_CTL_ADD,evfd,&ev) ||
+			(tids = malloc(sizeof(*tids) * threads)) == NULL){
+		close(evfd);
+		close(epfd);
+		evfd = epfd = -1;
+		return -1;
+	}
+	nexttick = reactor_clock() + REACTOR_TICK_MSEC;
+	for(tcount = 0 ; tcount < threads ; ++tcount){
+		if( (r = pthread_create(&tids[tcount],NULL,reactor_thread,(void *)ctx)) ){
+			diagnostic("Couldn't launch reactor thread (%s?)",strerror(r));
+			break;
+		}
+	}
+	if(tcount == 0){
+		stop_reactor();
+		return -1;
+	}
+	diagnostic("Servicing RX via %u reactor thread%s",tcount,tcount == 1 ? "" : "s");
+	return 0;
+}
+
+// All sources ought have been removed by now.
+void stop_reactor(void){
+	uint64_t one = 1;
+	unsigned z;
+	int r;
+
+	if(evfd < 0){
+		return;
+	}
+	if(write(evfd,&one,sizeof(one)) != sizeof(one)){
+		diagnostic("Couldn't signal reactor (%s?)",strerror(errno));
+	}
+	for(z = 0 ; z < tcount ; ++z){
+		if( (r = pthread_join(tids[z],NULL)) ){
+			diagnostic("Couldn't join reactor thread (%s?)",strerror(r));
+		}
+	}
+	free(tids);
+	tids = NULL;
+	tcount = 0;
+	close(evfd);
+	close(epfd);
+	evfd = epfd = -1;
+	free(sources);
+	sources = NULL;
+	srccount = srcalloc = srcfree = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef OMPHALOS_REACTOR
+#define OMPHALOS_REACTOR
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// A small, fixed pool of threads servicing any number of event sources (RX
+// rings) through a single epoll set, so that thread count scales with
+// processors rather than interfaces. Sources are armed EPOLLONESHOT: at most
+// one thread services a source at a time, rearming it afterwards (if it's
+// still ready, it'll fire again immediately). Every REACTOR_TICK_MSEC, one
+// thread ticks each source, so that idle sources can do their housekeeping.
+// The pool is shut down through an eventfd, rather than signals.
+
+#define REACTOR_TICK_MSEC 10
+#define REACTOR_MAXTHREADS 1024
+
+// Called with the epoll events which fired (0 for ticks). A negative return
+// from a service callback leaves the source disarmed until it's removed.
+typedef int (*reactorfxn)(void *,unsigned);
+
+// Launch the pool with the specified number of threads.
+int init_reactor(unsigned);
+void stop_reactor(void);
+
+// Register a source readable via fd, returning a non-zero handle, or 0 on
+// failure. tick may be NULL.
+uint64_t reactor_add(int,reactorfxn,reactorfxn,void *);
+
+// Deregister the source, waiting for any thread servicing (or ticking) it.
+// The caller mustn't hold any lock the callbacks take.
+void reactor_del(uint64_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
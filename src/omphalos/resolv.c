@@ -128,8 +128,8 @@ void offer_nameserver(int nsfam,const void *nameserver){
 	}
 }
 
-int offer_resolution(int fam,const void *addr,const char *name,namelevel nlevel,
-				int nsfam,const void *nameserver){
+int offer_resolution(interface *i,int fam,const void *addr,const char *name,
+			namelevel nlevel,int nsfam,const void *nameserver){
 	wchar_t *wname;
 	size_t len;
 	int r;
@@ -140,15 +140,15 @@ int offer_resolution(int fam,const void *addr,const char *name,namelevel nlevel,
 	}
 	assert(mbsrtowcs(wname,&name,len,NULL) == len);
 	wname[len] = L'\0';
-	r = offer_wresolution(fam,addr,wname,nlevel,nsfam,nameserver);
+	r = offer_wresolution(i,fam,addr,wname,nlevel,nsfam,nameserver);
 	free(wname);
 	return r;
 }
 
-int offer_wresolution(int fam,const void *addr,const wchar_t *name,namelevel nlevel,
-				int nsfam __attribute__ ((unused)),
-				const void *nameserver __attribute__ ((unused))){
-	struct interface *i;
+int offer_wresolution(interface *i,int fam,const void *addr,const wchar_t *name,
+			namelevel nlevel,int nsfam __attribute__ ((unused)),
+			const void *nameserver __attribute__ ((unused))){
+	struct interface *owner;
 	struct l3host *l3;
 	struct l2host *l2;
 
@@ -156,13 +156,13 @@ int offer_wresolution(int fam,const void *addr,const wchar_t *name,namelevel nle
 	// if(nameserver){
 	// 	offer_nameserver(nsfam,nameserver);
 	// }
-	if((l3 = lookup_global_l3host(fam,addr)) == NULL){
+	if((l3 = lookup_global_l3host(i,fam,addr,&owner)) == NULL){
 		return 0;
 	}
-	// FIXME needs to lock the interface to touch l3 objs
-	l2 = l3_getlastl2(l3);
-	i = l2_getiface(l2);
-	wname_l3host_absolute(i,l2,l3,name,nlevel);
+	if( (l2 = l3_getlastl2(l3)) ){
+		wname_l3host_absolute(owner,l2,l3,name,nlevel);
+	}
+	release_global_l3host(i,owner);
 	/*{
 		char abuf[INET6_ADDRSTRLEN],rbuf[INET6_ADDRSTRLEN];
 
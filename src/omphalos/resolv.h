@@ -18,11 +18,13 @@ int queue_for_naming(struct interface *i,struct l3host *,dnstxfxn,
 				const char *,int,const void *)
 			__attribute__ ((nonnull (1,2,3,4)));
 
-int offer_wresolution(int,const void *,const wchar_t *,namelevel,
-		int,const void *) __attribute__ ((nonnull (2,3)));
+// Offer a name for the address, as learned from a response seen on the
+// interface (whose lock must be held).
+int offer_wresolution(struct interface *,int,const void *,const wchar_t *,
+		namelevel,int,const void *) __attribute__ ((nonnull (1,3,4)));
 
-int offer_resolution(int,const void *,const char *,namelevel,int,const void *)
-			__attribute__ ((nonnull (2,3)));
+int offer_resolution(struct interface *,int,const void *,const char *,namelevel,
+		int,const void *) __attribute__ ((nonnull (1,3,4)));
 
 void offer_nameserver(int,const void *);
 
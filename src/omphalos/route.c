@@ -1,10 +1,12 @@
 #include <assert.h>
 #include <stddef.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <omphalos/tx.h>
 #include <omphalos/arp.h>
 #include <omphalos/diag.h>
 #include <omphalos/util.h>
+#include <omphalos/lpm.h>
 #include <linux/version.h>
 #include <omphalos/route.h>
 #include <linux/rtnetlink.h>
@@ -12,10 +14,13 @@
 #include <omphalos/omphalos.h>
 #include <omphalos/interface.h>
 
-// FIXME need locking on all of this!!!
-
-// FIXME use a multibit trie rather than ultra-lame linked list yeargh
-// see varghese's 'networking algorithmics' sec 11.8
+// Routes are indexed by destination prefix in a multibit trie for each family,
+// and by gateway address in another (for is_router()). Updates come only from
+// the netlink thread, serialized by route_lock. Lookups take no locks; they're
+// bracketed by lpm_read_begin()/lpm_read_end(), so that replaced trie nodes
+// aren't freed beneath them (see lpm.h). Routes are never freed before
+// free_routes(), so lookups needn't worry about their reclamation.
+// FIXME we ought handle route deletion, deferring the free()
 typedef struct route {
 	interface *iface;
 	sa_family_t family;
@@ -24,18 +29,11 @@ typedef struct route {
 	struct route *next;
 } route;
 
-static route *ip_table4,*ip_table6;
+static route *ip_table4,*ip_table6;	// all routes, newest first
+static lpmtrie dst_trie4,dst_trie6;	// destination prefix -> first route
+static lpmtrie gw_trie4,gw_trie6;	// gateway address -> first route
 static pthread_mutex_t route_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// To do longest-match routing, we need to keep:
-//  (a) a partition of the address space, pointing to the longest match for
-//       each distinct section. each node stores 1 or more (in the case of
-//       equal-length multipath) routes, and a pointer to:
-//  (b) the next-longest match.
-//
-// A route may be pointed at by more than one node (the default routes will be
-// eventually pointed to by any and all nodes save their own), but does not
-// point to more than one node.
 static route *
 create_route(void){
 	route *r;
@@ -77,12 +75,34 @@ int handle_rtm_delroute(const struct nlmsghdr *nl){
 	return 0;
 }
 
+// route_lock must be held. The route must be fully initialized, as it becomes
+// visible to lookups. Where another route to the same prefix (or via the same
+// gateway) already exists, it continues to be preferred.
+static int
+link_route(route *r,route **table,lpmtrie *dsts,lpmtrie *gws,
+		const void *ad,const void *ag,size_t flen){
+	if(lpm_insert(dsts,ad,r->maskbits,r) == NULL){
+		return -1;
+	}
+	if(r->ssg.ss_family){
+		if(lpm_insert(gws,ag,flen * CHAR_BIT,r) == NULL){
+			if(lpm_find(dsts,ad,r->maskbits) == r){
+				lpm_remove(dsts,ad,r->maskbits);
+			}
+			return -1;
+		}
+	}
+	r->next = *table;
+	*table = r;
+	return 0;
+}
+
 int handle_rtm_newroute(const struct nlmsghdr *nl){
 	const struct rtmsg *rt = NLMSG_DATA(nl);
 	struct rtattr *ra;
 	void *as,*ad,*ag;
 	int rlen,oif;
-	route *r,**prev;
+	route *r,*lr;
 	size_t flen;
 
 	oif = -1;
@@ -263,21 +283,15 @@ int handle_rtm_newroute(const struct nlmsghdr *nl){
 		}
 		unlock_interface(r->iface);
 		pthread_mutex_lock(&route_lock);
-			prev = &ip_table4;
-			// Order most-specific (largest maskbits) to least-specific (0 maskbits)
-			while(*prev){
-				if(r->maskbits > (*prev)->maskbits){
-					break;
-				}
-				prev = &(*prev)->next;
+			if(link_route(r,&ip_table4,&dst_trie4,&gw_trie4,ad,ag,flen)){
+				pthread_mutex_unlock(&route_lock);
+				goto err;
 			}
-			r->next = *prev;
-			*prev = r;
+			// FIXME lookups might see a partially-copied source
 			if(r->sss.ss_family){
-				while( *(prev = &(*prev)->next) ){
-					assert((*prev)->maskbits < r->maskbits);
-					if(!((*prev)->sss.ss_family)){
-						memcpy(&(*prev)->sss,&r->sss,sizeof(r->sss));
+				for(lr = ip_table4 ; lr ; lr = lr->next){
+					if(lr->maskbits < r->maskbits && !lr->sss.ss_family){
+						memcpy(&lr->sss,&r->sss,sizeof(r->sss));
 					}
 				}
 			}
@@ -291,16 +305,10 @@ int handle_rtm_newroute(const struct nlmsghdr *nl){
 		}
 		unlock_interface(r->iface);
 		pthread_mutex_lock(&route_lock);
-			prev = &ip_table6;
-			// Order most-specific (largest maskbits) to least-specific (0 maskbits)
-			while(*prev){
-				if(r->maskbits > (*prev)->maskbits){
-					break;
-				}
-				prev = &(*prev)->next;
+			if(link_route(r,&ip_table6,&dst_trie6,&gw_trie6,ad,ag,flen)){
+				pthread_mutex_unlock(&route_lock);
+				goto err;
 			}
-			r->next = *prev;
-			*prev = r;
 			// FIXME set less-specific sources
 		pthread_mutex_unlock(&route_lock);
 	}
@@ -312,81 +320,48 @@ err:
 }
 
 int is_router(int fam,const void *addr){
-	size_t gwoffset,len;
-	route *rt;
+	unsigned epoch;
+	lpmtrie *t;
+	int ret;
 
-	// FIXME we will want an actual cross-interface routing table rather
-	// than iterating over all interfaces, eek
 	if(fam == AF_INET){
-		rt = ip_table4;
-		len = 4;
-		gwoffset = offsetof(struct sockaddr_in,sin_addr);
+		t = &gw_trie4;
 	}else if(fam == AF_INET6){
-		rt = ip_table6;
-		len = 16;
-		gwoffset = offsetof(struct sockaddr_in6,sin6_addr);
+		t = &gw_trie6;
 	}else if(fam == AF_BSSID){
 		return 0;
 	}else{
 		assert(0);
+		return 0;
 	}
-	pthread_mutex_lock(&route_lock);
-	while(rt){
-		if(memcmp((const char *)(&rt->ssg) + gwoffset,addr,len) == 0){
-			break;
-		}
-		rt = rt->next;
-	}
-	pthread_mutex_unlock(&route_lock);
-	return rt ? 1 : 0;
+	epoch = lpm_read_begin(t);
+	ret = lpm_lookup(t,addr) ? 1 : 0;
+	lpm_read_end(t,epoch);
+	return ret;
 }
 
 // Determine how to send a packet to a layer 3 address.
-// FIXME this whole function is just incredibly godawful
 int get_router(int fam,const void *addr,struct routepath *rp){
-	uint128_t maskaddr,gw;
 	size_t gwoffset,len;
-	route *rt;
+	const route *rt;
+	unsigned epoch;
+	lpmtrie *t;
+	uint128_t gw;
 
-	// FIXME we will want an actual cross-interface routing table rather
-	// than iterating over all interfaces, eek
 	if(fam == AF_INET){
-		rt = ip_table4;
+		t = &dst_trie4;
 		len = 4;
-		maskaddr[0] = *(const uint32_t *)addr;
 		gwoffset = offsetof(struct sockaddr_in,sin_addr);
 	}else if(fam == AF_INET6){
-		rt = ip_table6;
+		t = &dst_trie6;
 		len = 16;
-		memcpy(maskaddr,addr,len);
 		gwoffset = offsetof(struct sockaddr_in6,sin6_addr);
 	}else{
 		return -1;
 	}
-	pthread_mutex_lock(&route_lock);
-	while(rt){
-		uint128_t tmp = { 0, 0, 0, 0 }; // FIXME so lame
-		unsigned z;
-
-		// Construct a properly-masked version of maskaddr
-		for(z = 0 ; z < len / 4 ; ++z){
-			if(rt->maskbits > 32 * z){
-				if(rt->maskbits >= 32 * (z + 1)){
-					tmp[z] = maskaddr[z];
-				}else{
-					uint32_t mask = ~0U << (32 - (rt->maskbits % 32));
-
-					tmp[z] = htonl(ntohl(maskaddr[z]) & mask);
-				}
-			}else{
-				tmp[z] = 0;
-			}
-		}
-		if(memcmp((const char *)(&rt->ssd) + gwoffset,&tmp[0],len) == 0){
-			break;
-		}
-		rt = rt->next;
-	}
+	epoch = lpm_read_begin(t);
+	rt = lpm_lookup(t,addr);
+	lpm_read_end(t,epoch);
 	if(rt){
 		rp->i = rt->iface;
 		memcpy(rp->src,(const char *)(&rt->sss) + gwoffset,len);
@@ -394,12 +369,10 @@ int get_router(int fam,const void *addr,struct routepath *rp){
 		memcpy(gw,rt->ssg.ss_family ? (const char *)&rt->ssg + gwoffset : addr,len);
 		if( (rp->l3 = find_l3host(rp->i,fam,&gw)) ){
 			if( (rp->l2 = l3_getlastl2(rp->l3)) ){
-				pthread_mutex_unlock(&route_lock);
 				return 0;
 			}
 		}
 	}
-	pthread_mutex_unlock(&route_lock);
 	return -1;
 }
 
@@ -421,6 +394,10 @@ void free_routes(void){
 	route *rt;
 
 	Pthread_mutex_lock(&route_lock);
+	lpm_destroy(&gw_trie6);
+	lpm_destroy(&gw_trie4);
+	lpm_destroy(&dst_trie6);
+	lpm_destroy(&dst_trie4);
 	while( (rt = ip_table4) ){
 		ip_table4 = rt->next;
 		free_route(rt);
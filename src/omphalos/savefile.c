@@ -0,0 +1,335 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omphalos/diag.h>
+#include <omphalos/savefile.h>
+
+#define PCAP_MAGIC_USEC		0xa1b2c3d4u
+#define PCAP_MAGIC_NSEC		0xa1b23c4du
+#define PCAP_HDRLEN		24	// global header
+#define PCAP_RECLEN		16	// per-record header
+
+#define PCAPNG_SHB		0x0a0d0d0au	// palindromic in either order
+#define PCAPNG_IDB		1
+#define PCAPNG_PB		2	// obsolete Packet Block
+#define PCAPNG_SPB		3
+#define PCAPNG_EPB		6
+#define PCAPNG_BOM		0x1a2b3c4du
+#define PCAPNG_OPT_END		0
+#define PCAPNG_OPT_TSRESOL	9
+#define PCAPNG_OPT_TSOFFSET	14
+
+// Readahead is requested a window at a time, keeping two windows ahead of the
+// walk. Pages more than a window behind it are dropped, so that walking a
+// capture larger than memory doesn't evict everything else.
+#define SAVEFILE_WINDOW (16u << 20u)
+
+static inline uint16_t
+sf16(const savefile *sf,const unsigned char *p){
+	uint16_t v;
+
+	memcpy(&v,p,sizeof(v));
+	return sf->swapped ? __builtin_bswap16(v) : v;
+}
+
+static inline uint32_t
+sf32(const savefile *sf,const unsigned char *p){
+	uint32_t v;
+
+	memcpy(&v,p,sizeof(v));
+	return sf->swapped ? __builtin_bswap32(v) : v;
+}
+
+static inline uint64_t
+sf64(const savefile *sf,const unsigned char *p){
+	uint64_t v;
+
+	memcpy(&v,p,sizeof(v));
+	return sf->swapped ? __builtin_bswap64(v) : v;
+}
+
+static void
+savefile_advise(savefile *sf){
+	if(sf->advised < sf->len && sf->off + SAVEFILE_WINDOW > sf->advised){
+		size_t start = sf->advised & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+		size_t end = sf->off + 2 * SAVEFILE_WINDOW;
+
+		if(end > sf->len){
+			end = sf->len;
+		}
+		madvise(sf->map + start,end - start,MADV_WILLNEED);
+		sf->advised = end;
+	}
+	if(sf->off >= sf->released + 2 * SAVEFILE_WINDOW){
+		size_t end = (sf->off - SAVEFILE_WINDOW) & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+
+		madvise(sf->map + sf->released,end - sf->released,MADV_DONTNEED);
+		sf->released = end;
+	}
+}
+
+static int
+add_link(savefile *sf,int dlt,unsigned snaplen,uint64_t tsunits,int64_t tsoffset){
+	savelink *tmp;
+
+	if((tmp = realloc(sf->links,sizeof(*tmp) * (sf->linkcount + 1))) == NULL){
+		return -1;
+	}
+	sf->links = tmp;
+	tmp += sf->linkcount++;
+	tmp->dlt = dlt;
+	tmp->snaplen = snaplen;
+	tmp->tsunits = tsunits;
+	tmp->tsoffset = tsoffset;
+	return 0;
+}
+
+static void
+set_timestamp(struct pcap_pkthdr *h,const savelink *l,uint64_t ts){
+	h->ts.tv_sec = ts / l->tsunits + l->tsoffset;
+	h->ts.tv_usec = (unsigned __int128)(ts % l->tsunits) * 1000000 / l->tsunits;
+}
+
+// Interface Description Block. Of the options, only the timestamp resolution
+// and offset matter to us.
+static int
+pcapng_interface(savefile *sf,const unsigned char *b,uint32_t blen){
+	uint64_t tsunits = 1000000;
+	const unsigned char *o;
+	int64_t tsoffset = 0;
+
+	if(blen < 20){
+		return -1;
+	}
+	for(o = b + 16 ; o + 4 <= b + blen - 4 ; ){
+		uint16_t code = sf16(sf,o);
+		uint16_t olen = sf16(sf,o + 2);
+
+		if(code == PCAPNG_OPT_END || o + 4 + olen > b + blen - 4){
+			break;
+		}
+		if(code == PCAPNG_OPT_TSRESOL && olen >= 1){
+			unsigned v = o[4] & 0x7fu;
+
+			if(o[4] & 0x80u){
+				tsunits = v < 64 ? 1ull << v : 0;
+			}else{
+				for(tsunits = 1 ; v && tsunits <= UINT64_MAX / 10 ; --v){
+					tsunits *= 10;
+				}
+				if(v){
+					tsunits = 0;
+				}
+			}
+			if(tsunits == 0){
+				return -1;
+			}
+		}else if(code == PCAPNG_OPT_TSOFFSET && olen >= 8){
+			tsoffset = (int64_t)sf64(sf,o + 4);
+		}
+		o += 4 + ((olen + 3u) & ~3u);
+	}
+	return add_link(sf,sf16(sf,b + 8),sf32(sf,b + 12),tsunits,tsoffset);
+}
+
+int savefile_open(savefile *sf,const char *fn){
+	struct stat st;
+	uint32_t magic;
+	int fd;
+
+	memset(sf,0,sizeof(*sf));
+	if((fd = open(fn,O_RDONLY | O_CLOEXEC)) < 0){
+		diagnostic("Couldn't open pcap input %s (%s?)",fn,strerror(errno));
+		return -1;
+	}
+	// Pipes and the like are left to libpcap
+	if(fstat(fd,&st) || !S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(magic)){
+		close(fd);
+		return 1;
+	}
+	sf->len = st.st_size;
+	sf->map = mmap(NULL,sf->len,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(sf->map == MAP_FAILED){
+		sf->map = NULL;
+		return 1;
+	}
+	madvise(sf->map,sf->len,MADV_SEQUENTIAL);
+	memcpy(&magic,sf->map,sizeof(magic));
+	if(magic == PCAPNG_SHB){
+		sf->ng = 1;
+		return 0; // the SHB is read as any other block
+	}
+	if(magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC){
+		sf->swapped = 0;
+	}else if(magic == __builtin_bswap32(PCAP_MAGIC_USEC) ||
+			magic == __builtin_bswap32(PCAP_MAGIC_NSEC)){
+		sf->swapped = 1;
+		magic = __builtin_bswap32(magic);
+	}else{
+		savefile_close(sf);
+		return 1;
+	}
+	if(sf->len < PCAP_HDRLEN){
+		diagnostic("Truncated pcap header in %s",fn);
+		savefile_close(sf);
+		return -1;
+	}
+	// The upper bits of the link type hold FCS information
+	if(add_link(sf,sf32(sf,sf->map + 20) & 0xffffu,sf32(sf,sf->map + 16),
+			magic == PCAP_MAGIC_NSEC ? 1000000000 : 1000000,0)){
+		savefile_close(sf);
+		return -1;
+	}
+	sf->off = PCAP_HDRLEN;
+	return 0;
+}
+
+static int
+savefile_next_pcap(savefile *sf,saverecord *r){
+	const unsigned char *rec = sf->map + sf->off;
+	uint32_t caplen;
+
+	if(sf->len - sf->off < PCAP_RECLEN){
+		diagnostic("Truncated record header at offset %zu",sf->off);
+		return -1;
+	}
+	caplen = sf32(sf,rec + 8);
+	if(sf->len - sf->off - PCAP_RECLEN < caplen){
+		diagnostic("Truncated %ub record at offset %zu",caplen,sf->off);
+		return -1;
+	}
+	r->link = 0;
+	r->hdr.ts.tv_sec = sf32(sf,rec);
+	r->hdr.ts.tv_usec = sf32(sf,rec + 4);
+	if(sf->links[0].tsunits != 1000000){
+		r->hdr.ts.tv_usec /= 1000;
+	}
+	r->hdr.caplen = caplen;
+	r->hdr.len = sf32(sf,rec + 12);
+	r->data = sf->map + sf->off + PCAP_RECLEN;
+	sf->off += PCAP_RECLEN + caplen;
+	return 1;
+}
+
+static int
+savefile_next_pcapng(savefile *sf,saverecord *r){
+	for(;;){
+		const unsigned char *b = sf->map + sf->off;
+		uint32_t btype,blen,ifid;
+		uint64_t ts;
+
+		if(sf->off == sf->len){
+			return 0;
+		}
+		if(sf->len - sf->off < 12){
+			diagnostic("Truncated block at offset %zu",sf->off);
+			return -1;
+		}
+		memcpy(&btype,b,sizeof(btype));
+		if(btype == PCAPNG_SHB){ // a new section, in its own byte order
+			uint32_t bom;
+
+			if(sf->len - sf->off < 28){
+				diagnostic("Truncated section header at offset %zu",sf->off);
+				return -1;
+			}
+			memcpy(&bom,b + 8,sizeof(bom));
+			if(bom == PCAPNG_BOM){
+				sf->swapped = 0;
+			}else if(bom == __builtin_bswap32(PCAPNG_BOM)){
+				sf->swapped = 1;
+			}else{
+				diagnostic("Invalid byte-order magic at offset %zu",sf->off);
+				return -1;
+			}
+			blen = sf32(sf,b + 4);
+			if(blen < 28 || blen % 4 || blen > sf->len - sf->off){
+				diagnostic("Invalid section header at offset %zu",sf->off);
+				return -1;
+			}
+			sf->sectionbase = sf->linkcount;
+			sf->off += blen;
+			continue;
+		}
+		btype = sf32(sf,b);
+		blen = sf32(sf,b + 4);
+		if(blen < 12 || blen % 4 || blen > sf->len - sf->off){
+			diagnostic("Invalid %ub block at offset %zu",blen,sf->off);
+			return -1;
+		}
+		sf->off += blen;
+		switch(btype){
+			case PCAPNG_IDB:{
+				if(pcapng_interface(sf,b,blen)){
+					diagnostic("Invalid interface description at offset %zu",sf->off - blen);
+					return -1;
+				}
+				break;
+			}case PCAPNG_EPB: case PCAPNG_PB:{ // same layout, but for ifid
+				if(blen < 32){
+					diagnostic("Invalid packet block at offset %zu",sf->off - blen);
+					return -1;
+				}
+				ifid = btype == PCAPNG_EPB ? sf32(sf,b + 8) : sf16(sf,b + 8);
+				r->hdr.caplen = sf32(sf,b + 20);
+				r->hdr.len = sf32(sf,b + 24);
+				if(ifid >= sf->linkcount - sf->sectionbase || r->hdr.caplen > blen - 32){
+					diagnostic("Invalid packet block at offset %zu",sf->off - blen);
+					return -1;
+				}
+				r->link = sf->sectionbase + ifid;
+				ts = ((uint64_t)sf32(sf,b + 12) << 32u) | sf32(sf,b + 16);
+				set_timestamp(&r->hdr,&sf->links[r->link],ts);
+				r->data = b + 28;
+				return 1;
+			}case PCAPNG_SPB:{ // no timestamp; always the section's first link
+				const savelink *l;
+
+				if(blen < 16 || sf->linkcount == sf->sectionbase){
+					diagnostic("Invalid packet block at offset %zu",sf->off - blen);
+					return -1;
+				}
+				r->link = sf->sectionbase;
+				l = &sf->links[r->link];
+				r->hdr.len = sf32(sf,b + 8);
+				r->hdr.caplen = r->hdr.len;
+				if(l->snaplen && r->hdr.caplen > l->snaplen){
+					r->hdr.caplen = l->snaplen;
+				}
+				if(r->hdr.caplen > blen - 16){
+					r->hdr.caplen = blen - 16;
+				}
+				memset(&r->hdr.ts,0,sizeof(r->hdr.ts));
+				r->data = b + 12;
+				return 1;
+			}default: // statistics, name resolution, custom...
+				break;
+		}
+	}
+}
+
+int savefile_next(savefile *sf,saverecord *r){
+	savefile_advise(sf);
+	if(sf->ng){
+		return savefile_next_pcapng(sf,r);
+	}
+	if(sf->off == sf->len){
+		return 0;
+	}
+	return savefile_next_pcap(sf,r);
+}
+
+void savefile_close(savefile *sf){
+	if(sf->map){
+		munmap(sf->map,sf->len);
+		sf->map = NULL;
+	}
+	free(sf->links);
+	sf->links = NULL;
+	sf->linkcount = 0;
+}
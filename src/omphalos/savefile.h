@@ -0,0 +1,66 @@
+#ifndef OMPHALOS_SAVEFILE
+#define OMPHALOS_SAVEFILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pcap/pcap.h>
+
+// Native savefile reader. Classic pcap (microsecond or nanosecond, either
+// byte order) and pcapng files are mapped into memory, and their records
+// walked in place: frames are handed to the dissectors without being copied,
+// and without libpcap's per-record callback.
+//
+// Each pcapng Interface Description Block is a distinct link, numbered across
+// the file (a new section's interfaces follow those of earlier sections).
+// Classic pcap files have a single link, 0.
+
+// A link, as described by the file.
+typedef struct savelink {
+	int dlt;		// DLT_* (LINKTYPE_*) of its frames
+	unsigned snaplen;	// 0 if unlimited
+	uint64_t tsunits;	// timestamp units per second
+	int64_t tsoffset;	// seconds added to each timestamp
+} savelink;
+
+typedef struct savefile {
+	unsigned char *map;
+	size_t len;
+	size_t off;		// next record or block
+	size_t advised;		// readahead has been requested up to here
+	size_t released;	// pages before here have been dropped
+	int swapped;		// file's byte order is opposite ours
+	int ng;			// pcapng, rather than classic pcap
+	savelink *links;
+	unsigned linkcount;
+	unsigned sectionbase;	// first link of the current pcapng section
+} savefile;
+
+// A frame, pointing into the mapping.
+typedef struct saverecord {
+	struct pcap_pkthdr hdr;
+	const unsigned char *data;
+	unsigned link;
+} saverecord;
+
+// Map the file. Returns 0 on success, 1 if it's neither classic pcap nor
+// pcapng, or can't be mapped (libpcap might yet be able to read it), and -1
+// on error (with a diagnostic).
+int savefile_open(savefile *,const char *);
+
+// Advance to the next frame. Returns 1 with the record filled in, 0 at the
+// end of the file, and -1 if the file is corrupt or truncated (with a
+// diagnostic). Links are described in sf->links by the time their frames
+// are returned.
+int savefile_next(savefile *,saverecord *);
+
+void savefile_close(savefile *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
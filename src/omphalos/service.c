@@ -86,6 +86,14 @@ void observe_service(interface *i,struct l2host *l2,struct l3host *l3,
 	}
 }
 
+void observe_services(interface *i,struct l2host *l2,struct l3host *l3,
+			const l4srv *l4){
+	while(l4){
+		observe_service(i,l2,l3,l4->proto,l4->port,l4->srv,l4->srvver);
+		l4 = l4->next;
+	}
+}
+
 // Destroy a services structure.
 void free_services(l4srv *l){
 	l4srv *tmp;
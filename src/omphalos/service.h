@@ -21,6 +21,10 @@ struct interface;
 void observe_service(struct interface *,struct l2host *,struct l3host *,
 		unsigned,unsigned,const wchar_t *,const wchar_t *);
 
+// Observe each of a list of services, as taken from another l3host.
+void observe_services(struct interface *,struct l2host *,struct l3host *,
+		const struct l4srv *);
+
 // Call upon observing an l3 protocol, via an advertisement or (preferably) an
 // actual reply. Provide the protocol name.
 void observe_proto(struct interface *,struct l2host *,const wchar_t *);
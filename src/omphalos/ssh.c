@@ -0,0 +1,43 @@
+#include <string.h>
+#include <omphalos/ssh.h>
+#include <omphalos/diag.h>
+#include <omphalos/util.h>
+#include <omphalos/service.h>
+#include <omphalos/omphalos.h>
+#include <omphalos/interface.h>
+
+#define SSH_IDENT "SSH-"
+#define SSH_MAXIDENT 255	// including the CR LF
+
+// "SSH-protoversion-softwareversion SP comments CR LF". Servers may send
+// other lines first; we don't look past them.
+int handle_ssh_stream(omphalos_packet *op,const void *frame,size_t len){
+	const char *s = frame,*eol,*sw;
+	wchar_t ver[SSH_MAXIDENT + 1];
+	size_t swlen;
+
+	if(len > SSH_MAXIDENT){
+		len = SSH_MAXIDENT;
+	}
+	if(len < __builtin_strlen(SSH_IDENT) || memcmp(s,SSH_IDENT,__builtin_strlen(SSH_IDENT))){
+		return 0;
+	}
+	if((eol = memchr(s,'\n',len)) == NULL){
+		diagnostic("[%s] unterminated SSH identification",op->i->name);
+		op->malformed = 1;
+		return 0;
+	}
+	sw = s + __builtin_strlen(SSH_IDENT);
+	if((sw = memchr(sw,'-',eol - sw)) == NULL){
+		diagnostic("[%s] malformed SSH identification",op->i->name);
+		op->malformed = 1;
+		return 0;
+	}
+	++sw;
+	for(swlen = 0 ; sw + swlen < eol && sw[swlen] != ' ' && sw[swlen] != '\r' ; ++swlen){
+		;
+	}
+	btowcpy(ver,sizeof(ver) / sizeof(*ver),sw,swlen);
+	observe_service(op->i,op->l2s,op->l3s,op->l3proto,op->l4src,L"SSH",ver[0] ? ver : NULL);
+	return 1;
+}
@@ -0,0 +1,24 @@
+#ifndef OMPHALOS_SSH
+#define OMPHALOS_SSH
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+struct omphalos_packet;
+
+#define SSH_TCP_PORT 22
+
+// Handed the start of a server's stream, which ought be its identification
+// string (RFC 4253, 4.2). Observes SSH, with the software version, of the
+// sender. Returns 1 for a valid identification string, 0 otherwise.
+int handle_ssh_stream(struct omphalos_packet *,const void *,size_t)
+			__attribute__ ((nonnull (1,2)));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+#include <string.h>
+#include <stdlib.h>
+#include <omphalos/diag.h>
+#include <omphalos/plog.h>
+#include <omphalos/stats.h>
+
+// Each shard's timestats cover 'usec' * 'total' microseconds.
+rxshard *create_rxshards(unsigned count,unsigned usec,unsigned total){
+	rxshard *rs;
+	unsigned z;
+	int r;
+
+	if( (r = posix_memalign((void **)&rs,__alignof__(*rs),sizeof(*rs) * count)) ){
+		diagnostic("Couldn't allocate %u stats shards (%s?)",count,strerror(r));
+		return NULL;
+	}
+	memset(rs,0,sizeof(*rs) * count);
+	for(z = 0 ; z < count ; ++z){
+		if(timestat_prep(&rs[z].fps,usec,total)){
+			break;
+		}
+		if(timestat_prep(&rs[z].bps,usec,total)){
+			timestat_destroy(&rs[z].fps);
+			break;
+		}
+	}
+	if(z < count){
+		free_rxshards(rs,z);
+		return NULL;
+	}
+	return rs;
+}
+
+void free_rxshards(rxshard *rs,unsigned count){
+	unsigned z;
+
+	if(rs){
+		for(z = 0 ; z < count ; ++z){
+			plog_release(&rs[z]);
+			timestat_destroy(&rs[z].bps);
+			timestat_destroy(&rs[z].fps);
+		}
+		free(rs);
+	}
+}
+
+void rxshard_read(const rxshard *rs,ifstats *st){
+	unsigned seq;
+	rxshard c;
+
+	do{
+		while((seq = __atomic_load_n(&rs->seq,__ATOMIC_ACQUIRE)) & 1u){
+			;
+		}
+		c.frames = rs->frames;
+		c.malformed = rs->malformed;
+		c.truncated = rs->truncated;
+		c.truncated_recovered = rs->truncated_recovered;
+		c.noprotocol = rs->noprotocol;
+		c.bytes = rs->bytes;
+		c.drops = rs->drops;
+		c.plogdrops = rs->plogdrops;
+		c.fps.valtotal = timestat_val(&rs->fps);
+		c.bps.valtotal = timestat_val(&rs->bps);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}while(__atomic_load_n(&rs->seq,__ATOMIC_RELAXED) != seq);
+	st->frames += c.frames;
+	st->malformed += c.malformed;
+	st->truncated += c.truncated;
+	st->truncated_recovered += c.truncated_recovered;
+	st->noprotocol += c.noprotocol;
+	st->bytes += c.bytes;
+	st->drops += c.drops;
+	st->plogdrops += c.plogdrops;
+	st->fps += c.fps.valtotal;
+	st->bps += c.bps.valtotal;
+}
@@ -0,0 +1,72 @@
+#ifndef OMPHALOS_STATS
+#define OMPHALOS_STATS
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <omphalos/timing.h>
+
+// A point-in-time copy of an interface's statistics (see interface_stats()).
+typedef struct ifstats {
+	uintmax_t frames;		// Frames received on the interface
+	uintmax_t malformed;		// Packet had malformed L2 -- L4 headers
+	uintmax_t truncated;		// Packet didn't fit in ringbuffer frame
+	uintmax_t truncated_recovered;	// We were able to recvfrom() the packet
+	uintmax_t noprotocol;		// Packets without protocol handler
+	uintmax_t bytes;		// Total bytes sniffed
+	uintmax_t drops;		// PACKET_STATISTICS @ TP_STATUS_LOSING
+	uintmax_t txframes;		// Frames generated by omphalos
+	uintmax_t txbytes;		// Total bytes generated by omphalos
+	uintmax_t txaborts;		// TX frames handed out but aborted
+	uintmax_t txerrors;		// TX frames we failed to send
+	uintmax_t fps,bps;		// frames and bytes over the timestat domain
+	uintmax_t plogdrops;		// Frames --plog had no room to queue
+} ifstats;
+
+struct plogq;
+
+// Receive statistics for one RX thread. Each shard has a single writer, and
+// needn't be protected by the interface lock; readers use the sequence count
+// to take a consistent copy. Shards are cacheline-aligned so that RX threads
+// don't bounce one another's counters.
+typedef struct rxshard {
+	unsigned seq;			// odd while an update is in progress
+	uintmax_t frames,malformed,truncated,truncated_recovered;
+	uintmax_t noprotocol,bytes,drops,plogdrops;
+	timestat fps,bps;		// frames and bytes per second
+	struct plogq *plogq;		// --plog queue, allocated on first use
+} __attribute__ ((aligned (64))) rxshard;
+
+rxshard *create_rxshards(unsigned,unsigned,unsigned);
+void free_rxshards(rxshard *,unsigned);
+
+// Bracket each update to a shard. Keep these short: readers spin on them.
+static inline void
+rxshard_begin(rxshard *rs){
+	__atomic_store_n(&rs->seq,rs->seq + 1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+rxshard_end(rxshard *rs){
+	__atomic_store_n(&rs->seq,rs->seq + 1,__ATOMIC_RELEASE);
+}
+
+// Increment a single counter within the shard.
+static inline void
+rxshard_inc(rxshard *rs,uintmax_t *ctr){
+	rxshard_begin(rs);
+	++*ctr;
+	rxshard_end(rs);
+}
+
+// Add a consistent copy of the shard's statistics into the ifstats.
+void rxshard_read(const rxshard *,ifstats *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
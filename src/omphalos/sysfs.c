@@ -1,7 +1,14 @@
+#include <stdio.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <libsysfs.h>
 #include <omphalos/usb.h>
 #include <omphalos/pci.h>
+#include <omphalos/numa.h>
 #include <omphalos/sysfs.h>
 #include <omphalos/interface.h>
 
@@ -34,3 +41,98 @@ const char *lookup_bus(const char *dname,topdev_info *tinf){
 	}
 	return NULL;
 }
+
+// Read the first line of a sysfs or procfs attribute. Returns -1 on failure.
+static int
+read_attr(char *buf,size_t len,const char *fmt,...){
+	char path[PATH_MAX];
+	va_list va;
+	FILE *fp;
+	int r;
+
+	va_start(va,fmt);
+	r = vsnprintf(path,sizeof(path),fmt,va);
+	va_end(va);
+	if(r < 0 || (size_t)r >= sizeof(path)){
+		return -1;
+	}
+	if((fp = fopen(path,"r")) == NULL){
+		return -1;
+	}
+	if(fgets(buf,len,fp) == NULL){
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int
+irq_cpus(const char *irq,cpu_set_t *cs){
+	char buf[BUFSIZ];
+
+	if(read_attr(buf,sizeof(buf),"/proc/irq/%s/smp_affinity_list",irq)){
+		return -1;
+	}
+	return parse_cpulist(buf,cs);
+}
+
+// The union of the affinities of the device's MSI(-X) vectors, or of its
+// legacy IRQ. Drivers with per-queue vectors steer each queue separately.
+static void
+lookup_irq_cpus(const char *name,cpu_set_t *cs){
+	char path[PATH_MAX],buf[32];
+	struct dirent *d;
+	DIR *dir;
+
+	if((unsigned)snprintf(path,sizeof(path),"/sys/class/net/%s/device/msi_irqs",name) >= sizeof(path)){
+		return;
+	}
+	if( (dir = opendir(path)) ){
+		while( (d = readdir(dir)) ){
+			if(isdigit(d->d_name[0])){
+				irq_cpus(d->d_name,cs);
+			}
+		}
+		closedir(dir);
+	}
+	if(CPU_COUNT(cs) == 0){
+		if(read_attr(buf,sizeof(buf),"/sys/class/net/%s/device/irq",name) == 0
+				&& atoi(buf) > 0){
+			buf[strcspn(buf,"\n")] = '\0';
+			irq_cpus(buf,cs);
+		}
+	}
+}
+
+int lookup_placement(const char *name,int *node,cpu_set_t *cpus){
+	cpu_set_t nodecpus,both;
+	char buf[BUFSIZ];
+
+	*node = -1;
+	CPU_ZERO(cpus);
+	CPU_ZERO(&nodecpus);
+	if(read_attr(buf,sizeof(buf),"/sys/class/net/%s/device/numa_node",name) == 0){
+		*node = atoi(buf);
+	}
+	if(*node >= 0){
+		if(read_attr(buf,sizeof(buf),"/sys/devices/system/node/node%d/cpulist",*node) ||
+				parse_cpulist(buf,&nodecpus)){
+			CPU_ZERO(&nodecpus);
+		}
+	}
+	lookup_irq_cpus(name,cpus);
+	if(CPU_COUNT(cpus)){
+		// Without irqbalance, IRQs are often allowed everywhere
+		CPU_AND(&both,cpus,&nodecpus);
+		if(CPU_COUNT(&both)){
+			*cpus = both;
+		}
+		return 1;
+	}
+	if(CPU_COUNT(&nodecpus)){
+		*cpus = nodecpus;
+		return 0;
+	}
+	return -1;
+}
@@ -5,10 +5,20 @@
 extern "C" {
 #endif
 
+#include <sched.h>
+
 struct topdev_info;
 
 const char *lookup_bus(const char *,struct topdev_info *);
 
+// Determine where the named network device's RX work ought run. *node is set
+// to the device's NUMA node, or -1. cpus is set to those processors to which
+// the device's IRQs are steered, restricted to its node where that leaves any,
+// or else to the node's processors. Returns 1 if the processors were taken
+// from the IRQ affinity, 0 if from the node, and -1 if nothing is known (as
+// is the case for virtual devices), in which case cpus is empty.
+int lookup_placement(const char *,int *,cpu_set_t *);
+
 #ifdef __cplusplus
 }
 #endif
@@ -3,12 +3,11 @@
 #include <omphalos/diag.h>
 #include <omphalos/omphalos.h>
 #include <omphalos/interface.h>
-
-#define DNS_TCP_PORT 53
-#define MDNS_TC_PORT 5353
+#include <omphalos/tcpstream.h>
 
 void handle_tcp_packet(omphalos_packet *op,const void *frame,size_t len){
 	const struct tcphdr *tcp = frame;
+	size_t hlen;
 
 	if(len < sizeof(*tcp)){
 		diagnostic("%s malformed with %zu",__func__,len);
@@ -17,10 +16,11 @@ void handle_tcp_packet(omphalos_packet *op,const void *frame,size_t len){
 	}
 	op->l4src = tcp->source;
 	op->l4dst = tcp->dest;
-	if(len < tcp->doff){
+	hlen = tcp->doff * 4u;
+	if(hlen < sizeof(*tcp) || len < hlen){
 		diagnostic("%s options malformed with %zu",__func__,len);
 		op->malformed = 1;
 		return;
 	}
-	// FIXME need reassemble the TCP stream before analyzing it...
+	tcpstream_segment(op,tcp,(const char *)tcp + hlen,len - hlen);
 }
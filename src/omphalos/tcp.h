@@ -9,6 +9,8 @@ extern "C" {
 
 struct omphalos_packet;
 
+#define DNS_TCP_PORT 53
+
 void handle_tcp_packet(struct omphalos_packet *,const void *,size_t);
 
 #ifdef __cplusplus
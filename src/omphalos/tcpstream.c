@@ -0,0 +1,477 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <omphalos/util.h>
+#include <omphalos/timing.h>
+#include <omphalos/classify.h>
+#include <omphalos/omphalos.h>
+#include <omphalos/interface.h>
+#include <omphalos/tcpstream.h>
+
+typedef struct tcpdir {
+	uint32_t isn;		// sequence number of the first payload byte
+	uint16_t want;		// prefix wanted (0: unwanted, done or abandoned)
+	uint16_t have;		// contiguous bytes buffered from isn
+	uint16_t push;		// end of the furthest pushed segment (0: none)
+	uint16_t ext[TCPSTREAM_EXTENTS][2]; // [start, end) beyond have, sorted
+	unsigned extents;
+	unsigned synced;	// isn is known
+	unsigned bufclass;	// pool buf was drawn from
+	unsigned char *buf;	// want bytes, allocated with the first payload
+} tcpdir;
+
+// Endpoint 0 is the initiator (the SYN's sender), endpoint 1 the responder.
+// dir[n] is the data sent by endpoint n.
+typedef struct tcpflow {
+	struct tcpflow *next;	// hash chain
+	struct interface *i;	// owner, for the timer
+	twtimer timer;		// idle reaper
+	unsigned active;	// segments seen since the reaper last ran
+	unsigned l3proto;
+	uint128_t addr[2];
+	uint16_t port[2];	// network byte order
+	tcpdir dir[2];
+} tcpflow;
+
+static const unsigned bufsizes[TCPSTREAM_BUFCLASSES] = { 256, 1024, TCPSTREAM_MAXWANT, };
+
+static uintmax_t tcp_budget;
+static uintmax_t tcp_memused;	// all of these are updated atomically
+static uintmax_t tcp_flows;
+static uintmax_t tcp_active;
+static uintmax_t tcp_delivered;
+static uintmax_t tcp_bytes;
+static uintmax_t tcp_reaped;
+static uintmax_t tcp_memdrops;
+
+void init_tcpstreams(uintmax_t budget){
+	tcp_budget = budget;
+}
+
+static inline void
+stat_add(uintmax_t *stat,uintmax_t n){
+	__atomic_add_fetch(stat,n,__ATOMIC_RELAXED);
+}
+
+static inline void
+stat_sub(uintmax_t *stat,uintmax_t n){
+	__atomic_sub_fetch(stat,n,__ATOMIC_RELAXED);
+}
+
+// Charge n bytes against the budget, failing if it would be exceeded.
+static int
+mem_charge(size_t n){
+	uintmax_t used = __atomic_load_n(&tcp_memused,__ATOMIC_RELAXED);
+
+	do{
+		if(used + n > tcp_budget){
+			stat_add(&tcp_memdrops,1);
+			return -1;
+		}
+	}while(!__atomic_compare_exchange_n(&tcp_memused,&used,used + n,1,
+					__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+	return 0;
+}
+
+// Symmetric in its two endpoints, so that either direction finds the flow.
+static inline unsigned
+flow_hash(unsigned l3proto,const uint128_t a0,uint16_t p0,const uint128_t a1,uint16_t p1){
+	uint32_t h0 = p0,h1 = p1;
+	unsigned z;
+
+	for(z = 0 ; z < 4 ; ++z){
+		h0 = (h0 ^ a0[z]) * 0x9e3779b1u;
+		h1 = (h1 ^ a1[z]) * 0x9e3779b1u;
+	}
+	h0 ^= h1 ^ l3proto;
+	return h0 ^ (h0 >> 16u);
+}
+
+static inline unsigned
+flow_bucket(const tcpstreams *ts,const tcpflow *f){
+	return flow_hash(f->l3proto,f->addr[0],f->port[0],f->addr[1],f->port[1]) & (ts->size - 1);
+}
+
+// Returns the flow, and in *dir the endpoint which sent the segment.
+static tcpflow *
+lookup_flow(const tcpstreams *ts,const omphalos_packet *op,unsigned *dir){
+	tcpflow *f;
+
+	if(ts->count == 0){
+		return NULL;
+	}
+	f = ts->buckets[flow_hash(op->l3proto,op->l3saddr,op->l4src,op->l3daddr,op->l4dst) & (ts->size - 1)];
+	while(f){
+		if(f->l3proto == op->l3proto){
+			if(f->port[0] == op->l4src && f->port[1] == op->l4dst &&
+					equal128(f->addr[0],op->l3saddr) && equal128(f->addr[1],op->l3daddr)){
+				*dir = 0;
+				return f;
+			}
+			if(f->port[1] == op->l4src && f->port[0] == op->l4dst &&
+					equal128(f->addr[1],op->l3saddr) && equal128(f->addr[0],op->l3daddr)){
+				*dir = 1;
+				return f;
+			}
+		}
+		f = f->next;
+	}
+	return NULL;
+}
+
+// Double the table once it's as populated as it is wide.
+static int
+grow_table(tcpstreams *ts){
+	unsigned nsize = ts->size ? ts->size * 2 : 64,z;
+	tcpflow **nb;
+
+	if((nb = Malloc(sizeof(*nb) * nsize)) == NULL){
+		return -1;
+	}
+	memset(nb,0,sizeof(*nb) * nsize);
+	for(z = 0 ; z < ts->size ; ++z){
+		tcpflow *f;
+
+		while( (f = ts->buckets[z]) ){
+			unsigned b;
+
+			ts->buckets[z] = f->next;
+			b = flow_hash(f->l3proto,f->addr[0],f->port[0],f->addr[1],f->port[1]) & (nsize - 1);
+			f->next = nb[b];
+			nb[b] = f;
+		}
+	}
+	free(ts->buckets);
+	ts->buckets = nb;
+	ts->size = nsize;
+	return 0;
+}
+
+static void
+release_dir(tcpstreams *ts,tcpdir *d){
+	if(d->buf){
+		hostpool_put(&ts->bufpool[d->bufclass],d->buf);
+		stat_sub(&tcp_memused,bufsizes[d->bufclass]);
+		d->buf = NULL;
+	}
+	d->want = 0;
+}
+
+// Unlink and free the flow. Its timer must already be unscheduled.
+static void
+free_flow(tcpstreams *ts,tcpflow *f){
+	tcpflow **pf = &ts->buckets[flow_bucket(ts,f)];
+
+	while(*pf != f){
+		pf = &(*pf)->next;
+	}
+	*pf = f->next;
+	release_dir(ts,&f->dir[0]);
+	release_dir(ts,&f->dir[1]);
+	hostpool_put(&ts->flowpool,f);
+	stat_sub(&tcp_memused,sizeof(*f));
+	stat_sub(&tcp_active,1);
+	--ts->count;
+}
+
+static int
+reap_flow(const struct timeval *now,struct timeval *resched,void *arg){
+	tcpflow *f = arg;
+
+	if(f->active){
+		f->active = 0;
+		resched->tv_sec = now->tv_sec + TCPSTREAM_IDLE_SECS;
+		resched->tv_usec = now->tv_usec;
+		return 1;
+	}
+	stat_add(&tcp_reaped,1);
+	free_flow(&f->i->tcp,f);
+	return 0;
+}
+
+static void
+drop_flow(tcpstreams *ts,tcpflow *f){
+	cancel_timer(&f->i->timers,&f->timer);
+	free_flow(ts,f);
+}
+
+// A SYN of an untracked flow. Track it if some rule wants either direction.
+// The sender is the initiator, unless this is a SYN-ACK.
+static tcpflow *
+create_flow(interface *i,const omphalos_packet *op,int synack,unsigned *dir){
+	tcpstreams *ts = &i->tcp;
+	size_t want0,want1;
+	struct timeval tv;
+	uint16_t p0,p1;
+	tcpflow *f;
+
+	p0 = synack ? op->l4dst : op->l4src;
+	p1 = synack ? op->l4src : op->l4dst;
+	want0 = classify_stream_want(op->l3proto,p0,p1);
+	want1 = classify_stream_want(op->l3proto,p1,p0);
+	if(want0 == 0 && want1 == 0){
+		return NULL;
+	}
+	if(ts->count >= ts->size && grow_table(ts)){
+		return NULL;
+	}
+	if(mem_charge(sizeof(*f))){
+		return NULL;
+	}
+	if((f = hostpool_get(&ts->flowpool,sizeof(*f))) == NULL){
+		stat_sub(&tcp_memused,sizeof(*f));
+		return NULL;
+	}
+	memset(f,0,sizeof(*f));
+	f->i = i;
+	f->l3proto = op->l3proto;
+	if(synack){
+		memcpy(f->addr[0],op->l3daddr,sizeof(f->addr[0]));
+		memcpy(f->addr[1],op->l3saddr,sizeof(f->addr[1]));
+	}else{
+		memcpy(f->addr[0],op->l3saddr,sizeof(f->addr[0]));
+		memcpy(f->addr[1],op->l3daddr,sizeof(f->addr[1]));
+	}
+	f->port[0] = p0;
+	f->port[1] = p1;
+	f->dir[0].want = want0;
+	f->dir[1].want = want1;
+	f->next = ts->buckets[flow_bucket(ts,f)];
+	ts->buckets[flow_bucket(ts,f)] = f;
+	++ts->count;
+	stat_add(&tcp_flows,1);
+	stat_add(&tcp_active,1);
+	twheel_now(&i->timers,&tv);
+	tv.tv_sec += TCPSTREAM_IDLE_SECS;
+	schedule_timer(&i->timers,&f->timer,&tv,reap_flow,f);
+	*dir = synack;
+	return f;
+}
+
+// Hand the direction's prefix to the rules, and release its buffer. op is the
+// segment which completed it, and is thus from the same direction.
+static void
+deliver_dir(tcpstreams *ts,tcpdir *d,omphalos_packet *op){
+	if(d->have){
+		stat_add(&tcp_delivered,1);
+		stat_add(&tcp_bytes,d->have);
+		classify_l4(op,IPPROTO_TCP,d->buf,d->have);
+	}
+	release_dir(ts,d);
+}
+
+// Record [off, end) as buffered. Extents are kept sorted and disjoint; should
+// they all be in use, the data is dropped, to be had from a retransmission.
+static void
+add_extent(tcpdir *d,unsigned off,unsigned end){
+	unsigned z,e;
+
+	if(off <= d->have){
+		if(end > d->have){
+			d->have = end;
+		}
+	}else{
+		for(z = 0 ; z < d->extents && d->ext[z][1] < off ; ++z){
+			;
+		}
+		if(z < d->extents && d->ext[z][0] <= end){ // overlaps or abuts
+			if(off < d->ext[z][0]){
+				d->ext[z][0] = off;
+			}
+			if(end > d->ext[z][1]){
+				d->ext[z][1] = end;
+			}
+		}else if(d->extents < TCPSTREAM_EXTENTS){
+			memmove(d->ext + z + 1,d->ext + z,sizeof(*d->ext) * (d->extents - z));
+			d->ext[z][0] = off;
+			d->ext[z][1] = end;
+			++d->extents;
+		}else{
+			return;
+		}
+		// The extent might now reach its successors
+		while(z + 1 < d->extents && d->ext[z + 1][0] <= d->ext[z][1]){
+			if(d->ext[z + 1][1] > d->ext[z][1]){
+				d->ext[z][1] = d->ext[z + 1][1];
+			}
+			--d->extents;
+			memmove(d->ext + z + 1,d->ext + z + 2,sizeof(*d->ext) * (d->extents - z - 1));
+		}
+	}
+	// Absorb whatever extents the contiguous prefix now reaches
+	for(e = 0 ; e < d->extents && d->ext[e][0] <= d->have ; ++e){
+		if(d->ext[e][1] > d->have){
+			d->have = d->ext[e][1];
+		}
+	}
+	if(e){
+		d->extents -= e;
+		memmove(d->ext,d->ext + e,sizeof(*d->ext) * d->extents);
+	}
+}
+
+// Copy the segment into the direction's buffer, clipped to the prefix, noting
+// where it ends if it was pushed. Returns -1 if the direction had to be
+// abandoned.
+static int
+buffer_segment(tcpstreams *ts,tcpdir *d,uint32_t seq,const unsigned char *data,
+				size_t len,int push){
+	int32_t rel = (int32_t)(seq - d->isn);
+	unsigned off;
+
+	if(rel < 0){ // retransmission overlapping the start
+		if((size_t)-(int64_t)rel >= len){
+			return 0;
+		}
+		data += -(int64_t)rel;
+		len -= -(int64_t)rel;
+		rel = 0;
+	}
+	if((off = rel) >= d->want){
+		return 0;
+	}
+	if(len > d->want - off){
+		len = d->want - off;
+	}
+	if(d->buf == NULL){
+		unsigned c;
+
+		for(c = 0 ; bufsizes[c] < d->want ; ++c){
+			;
+		}
+		if(mem_charge(bufsizes[c])){
+			release_dir(ts,d);
+			return -1;
+		}
+		if((d->buf = hostpool_get(&ts->bufpool[c],bufsizes[c])) == NULL){
+			stat_sub(&tcp_memused,bufsizes[c]);
+			release_dir(ts,d);
+			return -1;
+		}
+		d->bufclass = c;
+	}
+	memcpy(d->buf + off,data,len);
+	add_extent(d,off,off + len);
+	if(push && off + len > d->push){
+		d->push = off + len;
+	}
+	return 0;
+}
+
+void tcpstream_segment(omphalos_packet *op,const struct tcphdr *tcp,
+			const void *payload,size_t len){
+	tcpstreams *ts = &op->i->tcp;
+	unsigned dirn;
+	tcpflow *f;
+	tcpdir *d;
+
+	if(tcp_budget == 0){ // reassembly is disabled; rules get segments
+		classify_l4(op,IPPROTO_TCP,payload,len);
+		return;
+	}
+	f = lookup_flow(ts,op,&dirn);
+	// A SYN with a different ISN is a new connection reusing the 5-tuple;
+	// anything buffered from the old one is stale.
+	if(f && tcp->syn && f->dir[dirn].synced && f->dir[dirn].isn != ntohl(tcp->seq) + 1){
+		drop_flow(ts,f);
+		f = NULL;
+	}
+	if(f == NULL){
+		if(!tcp->syn || tcp->rst){
+			return;
+		}
+		if((f = create_flow(op->i,op,tcp->ack,&dirn)) == NULL){
+			return;
+		}
+	}
+	f->active = 1;
+	if(tcp->rst){
+		drop_flow(ts,f);
+		return;
+	}
+	d = &f->dir[dirn];
+	if(tcp->syn){
+		d->isn = ntohl(tcp->seq) + 1;
+		d->synced = 1;
+		// A SYN-ACK acknowledges the initiator's ISN, should we have
+		// missed its SYN.
+		if(tcp->ack && !f->dir[!dirn].synced){
+			f->dir[!dirn].isn = ntohl(tcp->ack_seq);
+			f->dir[!dirn].synced = 1;
+		}
+		return; // FIXME data on SYNs (TCP Fast Open) is ignored
+	}
+	if(d->synced && d->want && len){
+		if(buffer_segment(ts,d,ntohl(tcp->seq),payload,len,tcp->psh || tcp->fin) == 0){
+			// Deliver once the prefix is complete, or once we've
+			// everything up through the furthest push.
+			if(d->have == d->want || (d->push && d->have >= d->push)){
+				deliver_dir(ts,d,op);
+			}
+		}
+	}
+	if(tcp->fin && d->want){
+		if(d->extents == 0){
+			deliver_dir(ts,d,op);
+		}else{ // FIXME the hole may yet be retransmitted
+			release_dir(ts,d);
+		}
+	}
+	if(f->dir[0].want == 0 && f->dir[1].want == 0){
+		drop_flow(ts,f);
+	}
+}
+
+void cleanup_tcpstreams(interface *i){
+	tcpstreams *ts = &i->tcp;
+	unsigned z;
+
+	for(z = 0 ; z < ts->size ; ++z){
+		while(ts->buckets[z]){
+			drop_flow(ts,ts->buckets[z]);
+		}
+	}
+	free(ts->buckets);
+	hostpool_destroy(&ts->flowpool);
+	for(z = 0 ; z < TCPSTREAM_BUFCLASSES ; ++z){
+		hostpool_destroy(&ts->bufpool[z]);
+	}
+	memset(ts,0,sizeof(*ts));
+}
+
+void tcpstream_stats(tcpstreamstats *ts){
+	ts->flows = __atomic_load_n(&tcp_flows,__ATOMIC_RELAXED);
+	ts->active = __atomic_load_n(&tcp_active,__ATOMIC_RELAXED);
+	ts->delivered = __atomic_load_n(&tcp_delivered,__ATOMIC_RELAXED);
+	ts->bytes = __atomic_load_n(&tcp_bytes,__ATOMIC_RELAXED);
+	ts->reaped = __atomic_load_n(&tcp_reaped,__ATOMIC_RELAXED);
+	ts->memdrops = __atomic_load_n(&tcp_memdrops,__ATOMIC_RELAXED);
+	ts->memused = __atomic_load_n(&tcp_memused,__ATOMIC_RELAXED);
+}
+
+#define STAT(fp,st,x) if((st)->x) { if(fprintf((fp),"<"#x">%ju</"#x">",(uintmax_t)(st)->x) < 0){ return -1; } }
+int print_tcpstream_stats(FILE *fp){
+	tcpstreamstats ts;
+
+	if(tcp_budget == 0){
+		return 0;
+	}
+	tcpstream_stats(&ts);
+	if(fprintf(fp,"<tcpstreams>") < 0){
+		return -1;
+	}
+	STAT(fp,&ts,flows);
+	STAT(fp,&ts,active);
+	STAT(fp,&ts,delivered);
+	STAT(fp,&ts,bytes);
+	STAT(fp,&ts,reaped);
+	STAT(fp,&ts,memdrops);
+	STAT(fp,&ts,memused);
+	if(fprintf(fp,"</tcpstreams>") < 0){
+		return -1;
+	}
+	return 0;
+}
+#undef STAT
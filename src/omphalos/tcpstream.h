@@ -0,0 +1,79 @@
+#ifndef OMPHALOS_TCPSTREAM
+#define OMPHALOS_TCPSTREAM
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <omphalos/pool.h>
+
+struct tcphdr;
+struct interface;
+struct omphalos_packet;
+
+// Bounded TCP reassembly for the stream dissectors. A TCP rule (see
+// classify.c) may ask for the first 'want' bytes of the direction it matches;
+// such rules are handed the reassembled prefix of the stream, rather than
+// individual segments. Flows are only tracked if seen from their SYN (or
+// SYN-ACK), and only if some rule wants one of their directions; all other
+// segments cost a lookup in an empty or small table, and nothing more.
+//
+// Segments are copied into the direction's buffer at their offset from the
+// initial sequence number, whatever order they arrive in; the extents of data
+// beyond the contiguous prefix are remembered until the hole is filled. Bytes
+// past 'want' are discarded. A direction is delivered once, when its prefix
+// is complete, or when everything up through its furthest PSH (or FIN) has
+// arrived. The flow is freed once no direction wants more, upon RST, or after
+// going idle.
+//
+// Flows and buffers come from per-interface pools, and are charged against a
+// process-wide budget. Flows which would exceed it aren't tracked, and
+// directions which would exceed it are abandoned; both are counted. Flow
+// tables are per interface, protected by the interface lock.
+
+#define TCPSTREAM_MAXWANT	4096	// largest prefix a rule may ask for
+#define TCPSTREAM_IDLE_SECS	60	// flows idle this long are reaped
+#define TCPSTREAM_EXTENTS	4	// out-of-order extents per direction
+#define TCPSTREAM_BUFCLASSES	3	// 256, 1024 and 4096 bytes
+
+struct tcpflow;
+
+typedef struct tcpstreams {
+	struct tcpflow **buckets;	// hash chains, indexed by 5-tuple
+	unsigned size,count;		// buckets, flows
+	hostpool flowpool;
+	hostpool bufpool[TCPSTREAM_BUFCLASSES];
+} tcpstreams;
+
+typedef struct tcpstreamstats {
+	uintmax_t flows;	// flows tracked
+	uintmax_t active;	// ...of which are currently tracked
+	uintmax_t delivered;	// stream prefixes handed to rules
+	uintmax_t bytes;	// ...and their total length
+	uintmax_t reaped;	// flows freed on idleness
+	uintmax_t memdrops;	// flows refused and directions abandoned
+	uintmax_t memused;	// bytes charged against the budget
+} tcpstreamstats;
+
+// Set the memory budget in bytes. 0 (the default) disables reassembly, in
+// which case rules are handed individual segments.
+void init_tcpstreams(uintmax_t);
+
+// Called from handle_tcp_packet() with the interface lock held, op's L3 and
+// L4 fields set, and the segment's payload.
+void tcpstream_segment(struct omphalos_packet *,const struct tcphdr *,
+			const void *,size_t);
+
+// Free all of an interface's flows. Must precede destruction of its wheel.
+void cleanup_tcpstreams(struct interface *);
+
+void tcpstream_stats(tcpstreamstats *);
+int print_tcpstream_stats(FILE *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
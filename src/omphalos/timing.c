@@ -19,12 +19,31 @@ ringinc(unsigned idx,unsigned move,unsigned s){
 	return (idx + move) % s;
 }
 
+// Zero the ring, with its first slot beginning at the time.
+static void
+restart_timestat(timestat *ts,const struct timeval *tv){
+	ts->firstidx = 0;
+	ts->valtotal = 0;
+	ts->firstsamp = *tv;
+	memset(ts->counts,0,sizeof(*ts->counts) * ts->total);
+}
+
 void timestat_inc(timestat *ts,const struct timeval *tv,unsigned val){
 	struct timeval diff;
-	unsigned long usec;
-	unsigned distance;
+	unsigned long usec,distance;
 
-	//assert(!timercmp(tv,&ts->firstsamp,<));
+	// Samples from before the ring's domain (replayed captures, or a clock
+	// which has been set back) restart the ring at their time. Those merely
+	// before the first sample are counted with it.
+	if(timercmp(tv,&ts->firstsamp,<)){
+		timersub(&ts->firstsamp,tv,&diff);
+		if(timerusec(&diff) >= (unsigned long)ts->usec * ts->total){
+			restart_timestat(ts,tv);
+		}
+		ts->counts[ts->firstidx] += val;
+		ts->valtotal += val;
+		return;
+	}
 	timersub(tv,&ts->firstsamp,&diff);
        	usec = timerusec(&diff);
 	// Get the number of samples between us and the first sample
@@ -38,8 +57,8 @@ void timestat_inc(timestat *ts,const struct timeval *tv,unsigned val){
 	// we always zero our own new slot. There's thus no need to track a
 	// last sample time; the first tracked sample time is sufficient.
 	if(distance >= ts->total){
+		unsigned long expired;
 		struct timeval adv;
-		unsigned expired;
 
 		// Some counts have expired (if the distance is greater than or
 		// equal to twice the total, all of them have expired). First,
@@ -73,10 +92,10 @@ void timestat_inc(timestat *ts,const struct timeval *tv,unsigned val){
 				}
 			}
 		}else{ // lose all; start over at head of ring, zero out all
-			ts->firstidx = 0;
-			distance = 0;
-			ts->valtotal = 0;
-			memset(ts->counts,0,sizeof(*ts->counts) * ts->total);
+			restart_timestat(ts,tv);
+			ts->counts[0] += val;
+			ts->valtotal += val;
+			return;
 		}
 		// Base the time off distance * ts->usec + firstsamp,
 		// normalizing time of the sample within the period.
@@ -92,3 +111,178 @@ void timestat_destroy(timestat *ts){
 	free(ts->counts);
 	memset(ts,0,sizeof(*ts));
 }
+
+#define TWHEEL_MASK (TWHEEL_SLOTS - 1)
+
+static inline uint64_t
+twheel_ticks(const twheel *w,const struct timeval *tv){
+	return ((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec) / w->tickusec;
+}
+
+int twheel_init(twheel *w,unsigned tickusec,const struct timeval *tv){
+	size_t s = sizeof(*w->slots) * TWHEEL_LEVELS * TWHEEL_SLOTS;
+
+	if((w->slots = malloc(s)) == NULL){
+		return -1;
+	}
+	memset(w->slots,0,s);
+	w->tickusec = tickusec ? tickusec : 1;
+	w->now = twheel_ticks(w,tv);
+	w->pending = 0;
+	return 0;
+}
+
+void twheel_destroy(twheel *w){
+	unsigned z;
+
+	if(w->slots){
+		for(z = 0 ; z < TWHEEL_LEVELS * TWHEEL_SLOTS ; ++z){
+			twtimer *t;
+
+			while( (t = w->slots[z]) ){
+				w->slots[z] = t->next;
+				t->next = NULL;
+				t->pprev = NULL;
+			}
+		}
+		free(w->slots);
+	}
+	memset(w,0,sizeof(*w));
+}
+
+// Hang the timer on the coarsest level whose span covers it.
+static void
+twheel_insert(twheel *w,twtimer *t){
+	twtimer **slot;
+	uint64_t delta;
+	unsigned lvl;
+
+	if(t->expires < w->now){
+		t->expires = w->now;
+	}
+	delta = t->expires - w->now;
+	for(lvl = 0 ; lvl + 1 < TWHEEL_LEVELS ; ++lvl){
+		if(delta >> (TWHEEL_BITS * (lvl + 1)) == 0){
+			break;
+		}
+	}
+	if(delta >> (TWHEEL_BITS * TWHEEL_LEVELS)){
+		t->expires = w->now + (1ull << (TWHEEL_BITS * TWHEEL_LEVELS)) - 1;
+	}
+	slot = &w->slots[lvl * TWHEEL_SLOTS +
+			((t->expires >> (TWHEEL_BITS * lvl)) & TWHEEL_MASK)];
+	if( (t->next = *slot) ){
+		t->next->pprev = &t->next;
+	}
+	t->pprev = slot;
+	*slot = t;
+}
+
+static inline void
+twheel_unlink(twtimer *t){
+	if( (*t->pprev = t->next) ){
+		t->next->pprev = t->pprev;
+	}
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+void schedule_timer(twheel *w,twtimer *t,const struct timeval *tv,timerfxn fxn,void *arg){
+	if(t->pprev){
+		twheel_unlink(t);
+	}else{
+		++w->pending;
+	}
+	t->expires = twheel_ticks(w,tv);
+	t->fxn = fxn;
+	t->arg = arg;
+	twheel_insert(w,t);
+}
+
+void cancel_timer(twheel *w,twtimer *t){
+	if(t->pprev){
+		twheel_unlink(t);
+		--w->pending;
+	}
+}
+
+// The level 0 wheel has come around. Redistribute the current slot of level
+// 1, and of each higher level whose lower neighbour has also come around.
+static void
+twheel_cascade(twheel *w){
+	unsigned lvl;
+
+	for(lvl = 1 ; lvl < TWHEEL_LEVELS ; ++lvl){
+		unsigned idx = (w->now >> (TWHEEL_BITS * lvl)) & TWHEEL_MASK;
+		twtimer **slot = &w->slots[lvl * TWHEEL_SLOTS + idx];
+		twtimer *t,*list;
+
+		list = *slot;
+		*slot = NULL;
+		while( (t = list) ){
+			list = t->next;
+			twheel_insert(w,t);
+		}
+		if(idx){
+			break;
+		}
+	}
+}
+
+unsigned twheel_advance(twheel *w,const struct timeval *tv){
+	uint64_t target = twheel_ticks(w,tv);
+	unsigned run = 0;
+
+	while(w->now <= target){
+		unsigned idx = w->now & TWHEEL_MASK;
+		twtimer *t,*work;
+
+		if(w->pending == 0){ // nothing to cascade; jump ahead
+			w->now = target + 1;
+			break;
+		}
+		if(idx == 0){
+			twheel_cascade(w);
+		}
+		// Detach the slot, so that timers run from it can reschedule
+		// or cancel one another.
+		if( (work = w->slots[idx]) ){
+			w->slots[idx] = NULL;
+			work->pprev = &work;
+		}
+		++w->now;
+		while( (t = work) ){
+			struct timeval resched;
+
+			twheel_unlink(t);
+			--w->pending;
+			++run;
+			if(t->fxn(tv,&resched,t->arg)){
+				schedule_timer(w,t,&resched,t->fxn,t->arg);
+			}
+		}
+	}
+	return run;
+}
+
+long twheel_timeout(const twheel *w,const struct timeval *tv){
+	uint64_t due,usec;
+	unsigned idx,z;
+
+	if(w->pending == 0){
+		return -1;
+	}
+	// Past the end of level 0, we'll need cascade regardless.
+	idx = w->now & TWHEEL_MASK;
+	for(z = 0 ; idx + z < TWHEEL_SLOTS ; ++z){
+		if(w->slots[idx + z]){
+			break;
+		}
+	}
+	// Tick now + z is due once it begins, not once it ends. Tick now is
+	// usually the one following that to which we were last advanced, and
+	// thus still (partly) in the future.
+	due = (w->now + z) * w->tickusec;
+	usec = (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+	return due > usec ? (long)(due - usec) : 0;
+}
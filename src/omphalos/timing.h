@@ -38,25 +38,73 @@ timerusec(const struct timeval *tv){
 	return tv->tv_sec * 1000000 + tv->tv_usec;
 }
 
-// We don't expect to have very many timers active for an interface (certainly
-// not as many as 10), so we use a trivial linked list implementation of our
-// timing wheel. Should this ever get serious (eg, TCP implementation), use the
-// methods of Varghese and Lauck.
+// Hierarchical timing wheels (Varghese and Lauck, "Hashed and Hierarchical
+// Timing Wheels", scheme 7). Each of TWHEEL_LEVELS wheels has TWHEEL_SLOTS
+// slots; a slot of level n spans TWHEEL_SLOTS^n ticks. Timers are hung on
+// the slot of the coarsest level they fit, and cascade down a level each time
+// the wheel beneath completes a revolution. Insertion and cancellation are
+// O(1); expiry is O(1) per timer, amortized over cascades. Timers further
+// out than the wheels' span (2^32 ticks) are clamped to it.
 //
-// Functions will be invoked from the interface thread's context. They block
-// progress of the interface thread. They are handed arbitrary opaque state and
-// the most recently-sampled timestamp. If a non-zero value is returned, the
-// value-result timestamp is taken to be a rescheduling time.
+// Wheels aren't locked; the owner must serialize access (interface wheels are
+// protected by the interface lock). Functions are invoked as the wheel is
+// advanced, with the sampled time. They are handed arbitrary opaque state. If
+// a non-zero value is returned, the value-result timestamp is taken to be a
+// rescheduling time. The timer is no longer scheduled when its function is
+// called, and may be freed or rescheduled by it.
+
+#define TWHEEL_BITS 8
+#define TWHEEL_SLOTS (1u << TWHEEL_BITS)
+#define TWHEEL_LEVELS 4
 
 typedef int (*timerfxn)(const struct timeval *,struct timeval *,void *);
 
-typedef struct twheel {
-	struct timeval sched;	// earliest (absolute) time it can fire
+// Embed these in the objects being timed. A zeroed twtimer is unscheduled.
+typedef struct twtimer {
+	struct twtimer *next,**pprev;	// pprev is NULL when unscheduled
+	uint64_t expires;		// absolute tick
 	timerfxn fxn;
-	struct twheel *next;
+	void *arg;
+} twtimer;
+
+typedef struct twheel {
+	uint64_t now;			// ticks up to here have been run
+	unsigned tickusec;		// resolution
+	unsigned pending;		// scheduled timers
+	twtimer **slots;		// TWHEEL_LEVELS * TWHEEL_SLOTS lists
 } twheel;
 
-int schedule_timer(twheel **,const struct timeval *,timerfxn,void *);
+int twheel_init(twheel *,unsigned,const struct timeval *);
+// Pending timers are dropped without being run.
+void twheel_destroy(twheel *);
+
+// (Re)schedule the timer to fire at or after the absolute time. Times already
+// past fire upon the next twheel_advance().
+void schedule_timer(twheel *,twtimer *,const struct timeval *,timerfxn,void *);
+void cancel_timer(twheel *,twtimer *);
+
+static inline int
+timer_scheduled(const twtimer *t){
+	return t->pprev != NULL;
+}
+
+// Run all timers due at or before the time. Returns the number run.
+unsigned twheel_advance(twheel *,const struct timeval *);
+
+// The time the wheel has been advanced to (at tick resolution). Timers armed
+// while dissecting ought be scheduled relative to this, as the wheel might be
+// running on capture time.
+static inline void
+twheel_now(const twheel *w,struct timeval *tv){
+	uint64_t usec = w->now * w->tickusec;
+
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+}
+
+// An upper bound on the microseconds from the time until the wheel next needs
+// advancing, suitable for a poll() timeout; -1 if no timers are pending.
+long twheel_timeout(const twheel *,const struct timeval *);
 
 #ifdef __cplusplus
 }
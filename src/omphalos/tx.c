@@ -83,12 +83,17 @@ void *get_tx_frame(interface *i,size_t *fsize){
 		diagnostic("Can't transmit on %s (fd %d)",i->name,i->fd);
 		return NULL;
 	}
+	// We've wrapped around onto frames not yet handed to the kernel
+	if(thdr->tp_status == TP_STATUS_SEND_REQUEST){
+		flush_tx_frames(i);
+	}
 	if(thdr->tp_status != TP_STATUS_AVAILABLE){
 		if(thdr->tp_status != TP_STATUS_WRONG_FORMAT){
 			pthread_mutex_unlock(&i->lock);
 			diagnostic("No available TX frames on %s",i->name);
 			return NULL;
 		}
+		++i->txerrors;
 		thdr->tp_status = TP_STATUS_AVAILABLE;
 	}
 	// Need indicate that this one is in use, but don't want to
@@ -96,13 +101,35 @@ void *get_tx_frame(interface *i,size_t *fsize){
 	thdr->tp_status = TP_STATUS_PREPARING;
 	// FIXME we ought be able to set this once for each packet, and be done
 	thdr->tp_net = thdr->tp_mac = TPACKET_ALIGN(sizeof(struct tpacket_hdr));
-	ret = i->curtxm;
+	ret = i->lasttxm = i->curtxm;
+	i->lasttxidx = i->txidx;
 	i->curtxm += inclen(&i->txidx,&i->ttpr);
 	pthread_mutex_unlock(&i->lock);
 	*fsize = i->ttpr.tp_frame_size;
 	return ret;
 }
 
+// The kernel walks the PACKET_TX_RING in order, stopping at the first frame
+// not marked TP_STATUS_SEND_REQUEST, so we mustn't leave holes in it. A frame
+// we won't be handing over is usually the one most recently acquired, and we
+// can simply back up over it. Otherwise, we give it to the kernel with a
+// length it'll refuse; PACKET_LOSS has malformed frames skipped and returned
+// to TP_STATUS_AVAILABLE.
+static void
+release_tx_frame(interface *i,struct tpacket_hdr *thdr){
+	if(thdr == i->lasttxm){
+		i->curtxm = thdr;
+		i->txidx = i->lasttxidx;
+		i->lasttxm = NULL;
+		thdr->tp_status = TP_STATUS_AVAILABLE;
+	}else if(i->txring){
+		thdr->tp_len = i->ttpr.tp_frame_size;
+		thdr->tp_status = TP_STATUS_SEND_REQUEST;
+	}else{
+		thdr->tp_status = TP_STATUS_AVAILABLE;
+	}
+}
+
 // Loopback devices don't play nicely with PF_PACKET sockets; transmitting on
 // them results in packets visible to device-level sniffers (tcpdump, wireshark,
 // ourselves) but never injected into the machine's IP stack. These results are
@@ -242,7 +269,9 @@ categorize_tx(const interface *i,const void *frame,int *self,int *out){
 }
 
 // Mark a frame as ready-to-send. Must have come from get_tx_frame() using this
-// same interface. Yes, we will see packets we generate on the RX ring.
+// same interface. Yes, we will see packets we generate on the RX ring. Frames
+// for the wire are handed over in place; unless a batch is open (see
+// begin_tx_batch()), they're flushed immediately.
 int send_tx_frame(interface *i,void *frame){
 	const omphalos_ctx *octx = get_octx();
 	struct tpacket_hdr *thdr = frame;
@@ -265,17 +294,24 @@ int send_tx_frame(interface *i,void *frame){
 			}
 			ret |= r < 0 ? -1 : 0;
 		}
-		if(out){
+		if(out && i->txring){
+			if(thdr == i->lasttxm){
+				i->lasttxm = NULL;
+			}
+			thdr->tp_status = TP_STATUS_SEND_REQUEST;
+			++i->txpending;
+			if(i->txbatch == 0){
+				ret |= flush_tx_frames(i);
+			}
+			return ret;
+		}else if(out){
 			uint32_t tplen = thdr->tp_len;
 			int r;
 
-			//thdr->tp_status = TP_STATUS_SEND_REQUEST;
-			//r = send(i->fd,NULL,0,0);
 			r = send(i->fd,(const char *)frame + thdr->tp_mac,tplen,0);
 			if(r == 0){
 				r = tplen;
 			}
-			//diagnostic("Transmitted %d on %s",ret,i->name);
 			if(r < 0){
 				diagnostic("Error out-TXing %u on %s (%s)",tplen,i->name,strerror(errno));
 				++i->txerrors;
@@ -285,7 +321,7 @@ int send_tx_frame(interface *i,void *frame){
 			}
 			ret |= r < 0 ? -1 : 0;
 		}
-		thdr->tp_status = TP_STATUS_AVAILABLE;
+		release_tx_frame(i,thdr);
 	}else{
 		abort_tx_frame(i,frame);
 		ret = 0;
@@ -298,8 +334,48 @@ void abort_tx_frame(interface *i,void *frame){
 	struct tpacket_hdr *thdr = frame;
 
 	++i->txaborts;
-	thdr->tp_status = TP_STATUS_AVAILABLE;
+	release_tx_frame(i,thdr);
 	if(octx->mode != OMPHALOS_MODE_SILENT){
 		diagnostic("Aborted TX %ju on %s",i->txaborts,i->name);
 	}
 }
+
+// Kick the kernel into transmitting every frame marked TP_STATUS_SEND_REQUEST.
+// With MSG_DONTWAIT, we needn't wait for the device: frames are returned to
+// TP_STATUS_AVAILABLE upon completion, and get_tx_frame() checks for this
+// before reusing them. On EAGAIN/ENOBUFS the frames remain marked, and go out
+// with the next flush.
+int flush_tx_frames(interface *i){
+	ssize_t r;
+	int ret = 0;
+
+	assert(pthread_mutex_lock(&i->lock) == 0);
+	if(i->txring){
+		if((r = sendto(i->fd,NULL,0,MSG_DONTWAIT,NULL,0)) < 0){
+			if(errno != EAGAIN && errno != ENOBUFS){
+				diagnostic("Error out-TXing %u on %s (%s)",i->txpending,i->name,strerror(errno));
+				i->txerrors += i->txpending;
+				i->txpending = 0;
+				ret = -1;
+			}
+		}else{
+			i->txbytes += r;
+			i->txframes += i->txpending;
+			i->txpending = 0;
+		}
+	}
+	pthread_mutex_unlock(&i->lock);
+	return ret;
+}
+
+void begin_tx_batch(interface *i){
+	++i->txbatch;
+}
+
+int end_tx_batch(interface *i){
+	assert(i->txbatch);
+	if(--i->txbatch == 0 && i->txpending){
+		return flush_tx_frames(i);
+	}
+	return 0;
+}
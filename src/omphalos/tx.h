@@ -19,6 +19,15 @@ int send_tx_frame(struct interface *,void *);
 // Release a frame for reuse without transmitting it. Interface lock must be held.
 void abort_tx_frame(struct interface *,void *);
 
+// Hand all sent frames to the kernel with a single nonblocking send().
+int flush_tx_frames(struct interface *);
+
+// Within a batch, send_tx_frame() only marks frames for transmission; they're
+// flushed together by the outermost end_tx_batch(). Batches nest. Interface
+// lock must be held throughout.
+void begin_tx_batch(struct interface *);
+int end_tx_batch(struct interface *);
+
 #ifdef __cplusplus
 }
 #endif
@@ -81,6 +81,20 @@ btowdup(const char *s){
 	return w;
 }
 
+// Widen up to len bytes of s into dst (of dlen wide characters, always
+// terminated), stopping short of the first nonprintable. Returns the number
+// of characters copied.
+static inline size_t
+btowcpy(wchar_t *dst,size_t dlen,const char *s,size_t len){
+	size_t z;
+
+	for(z = 0 ; z + 1 < dlen && z < len && s[z] >= ' ' && s[z] <= '~' ; ++z){
+		dst[z] = btowc(s[z]);
+	}
+	dst[z] = L'\0';
+	return z;
+}
+
 char *fgetl(char **,int *,FILE *) __attribute__ ((nonnull (1,2,3)))
 		__attribute__ ((warn_unused_result));
 
@@ -23,7 +23,7 @@ void handle_vrrp_packet(omphalos_packet *op,const void *frame,size_t len){
 
 	if(len < sizeof(*vrrp)){
 		diagnostic("%s malformed with %zu",__func__,len);
-		++op->i->malformed;
+		op->malformed = 1;
 		return;
 	}
 	// FIXME
@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <omphalos/xdp.h>
+#include <omphalos/diag.h>
+#include <omphalos/interface.h>
+
+#ifdef HAVE_LINUX_IF_XDP_H
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XSK_FRAMES 4096u	// per socket; also the fill and RX ring sizes
+
+// r2 <- ctx->rx_queue_index; return bpf_redirect_map(xskmap,r2,XDP_PASS).
+// Queues without a socket in the map fall through to the stack (5.3+).
+static int
+load_redirect_prog(int mapfd){
+	struct bpf_insn insns[] = {
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2,
+		  .src_reg = BPF_REG_1,
+		  .off = offsetof(struct xdp_md,rx_queue_index), },
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1,
+		  .src_reg = BPF_PSEUDO_MAP_FD, .imm = mapfd, },
+		{ .code = 0, }, // second half of the 64-bit immediate
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3,
+		  .imm = XDP_PASS, },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map, },
+		{ .code = BPF_JMP | BPF_EXIT, },
+	};
+	union bpf_attr attr;
+
+	memset(&attr,0,sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(*insns);
+	attr.license = (uintptr_t)"GPL";
+	return syscall(__NR_bpf,BPF_PROG_LOAD,&attr,sizeof(attr));
+}
+
+static int
+create_xskmap(unsigned entries){
+	union bpf_attr attr;
+
+	memset(&attr,0,sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = entries;
+	return syscall(__NR_bpf,BPF_MAP_CREATE,&attr,sizeof(attr));
+}
+
+static int
+link_xdp_prog(int progfd,int ifindex,unsigned flags){
+	union bpf_attr attr;
+
+	memset(&attr,0,sizeof(attr));
+	attr.link_create.prog_fd = progfd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = flags;
+	return syscall(__NR_bpf,BPF_LINK_CREATE,&attr,sizeof(attr));
+}
+
+static int
+xskmap_insert(int mapfd,uint32_t queue,uint32_t fd){
+	union bpf_attr attr;
+
+	memset(&attr,0,sizeof(attr));
+	attr.map_fd = mapfd;
+	attr.key = (uintptr_t)&queue;
+	attr.value = (uintptr_t)&fd;
+	return syscall(__NR_bpf,BPF_MAP_UPDATE_ELEM,&attr,sizeof(attr));
+}
+
+// Count the rx-* entries in the device's sysfs queues directory.
+static unsigned
+rx_queue_count(const char *name){
+	char path[PATH_MAX];
+	struct dirent *d;
+	unsigned ret = 0;
+	DIR *dir;
+
+	if((unsigned)snprintf(path,sizeof(path),"/sys/class/net/%s/queues",name) >= sizeof(path)){
+		return 0;
+	}
+	if((dir = opendir(path)) == NULL){
+		return 0;
+	}
+	while( (d = readdir(dir)) ){
+		if(strncmp(d->d_name,"rx-",3) == 0){
+			++ret;
+		}
+	}
+	closedir(dir);
+	return ret;
+}
+
+unsigned xdp_attach(interface *i,int idx){
+	xdpif *x;
+
+	if((x = malloc(sizeof(*x))) == NULL){
+		return 0;
+	}
+	memset(x,0,sizeof(*x));
+	if((x->queues = rx_queue_count(i->name)) == 0){
+		x->queues = 1;
+	}
+	if((x->mapfd = create_xskmap(x->queues)) < 0){
+		diagnostic("[%s] Couldn't create XSKMAP (%s?)",i->name,strerror(errno));
+		free(x);
+		return 0;
+	}
+	if((x->progfd = load_redirect_prog(x->mapfd)) < 0){
+		diagnostic("[%s] Couldn't load XDP program (%s?)",i->name,strerror(errno));
+		close(x->mapfd);
+		free(x);
+		return 0;
+	}
+	if((x->linkfd = link_xdp_prog(x->progfd,idx,XDP_FLAGS_DRV_MODE)) < 0){
+		x->skbmode = 1;
+		if((x->linkfd = link_xdp_prog(x->progfd,idx,XDP_FLAGS_SKB_MODE)) < 0){
+			diagnostic("[%s] Couldn't attach XDP program (%s?)",
+					i->name,strerror(errno));
+			close(x->progfd);
+			close(x->mapfd);
+			free(x);
+			return 0;
+		}
+	}
+	i->xdp = x;
+	return x->queues;
+}
+
+// Closing the link detaches the program.
+void xdp_detach(interface *i){
+	if(i->xdp){
+		close(i->xdp->linkfd);
+		close(i->xdp->progfd);
+		close(i->xdp->mapfd);
+		free(i->xdp);
+		i->xdp = NULL;
+	}
+}
+
+static int
+map_xskring(int fd,xskring *r,const struct xdp_ring_offset *off,
+		off_t pgoff,unsigned entries,size_t dsize){
+	r->maplen = off->desc + entries * dsize;
+	r->map = mmap(NULL,r->maplen,PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE,fd,pgoff);
+	if(r->map == MAP_FAILED){
+		diagnostic("Couldn't map %zub XDP ring (%s?)",r->maplen,strerror(errno));
+		r->map = NULL;
+		return -1;
+	}
+	r->producer = (uint32_t *)((char *)r->map + off->producer);
+	r->consumer = (uint32_t *)((char *)r->map + off->consumer);
+	r->descs = (char *)r->map + off->desc;
+	r->mask = entries - 1;
+	return 0;
+}
+
+static void
+unmap_xskring(xskring *r){
+	if(r->map){
+		munmap(r->map,r->maplen);
+		r->map = NULL;
+	}
+}
+
+void xsk_close(xsk *x){
+	if(x){
+		unmap_xskring(&x->rx);
+		unmap_xskring(&x->fill);
+		munmap(x->umem,x->umemlen);
+		free(x);
+	}
+}
+
+int xsk_open(interface *i,int idx,unsigned queue,xsk **xp){
+	unsigned entries = XSK_FRAMES,ccount = 64,z;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	struct xdp_umem_reg ur;
+	socklen_t olen;
+	uint64_t *fq;
+	int fd;
+	xsk *x;
+
+	if((x = malloc(sizeof(*x))) == NULL){
+		return -1;
+	}
+	memset(x,0,sizeof(*x));
+	// Frames are a power of two between 2KB and a page
+	x->framesize = i->mtu + i->l2hlen + XDP_PACKET_HEADROOM > 2048 ? 4096 : 2048;
+	x->umemlen = (size_t)x->framesize * XSK_FRAMES;
+	if((x->umem = mmap(NULL,x->umemlen,PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,-1,0)) == MAP_FAILED){
+		diagnostic("Couldn't map %zub UMEM (%s?)",x->umemlen,strerror(errno));
+		free(x);
+		return -1;
+	}
+	if((fd = socket(AF_XDP,SOCK_RAW,0)) < 0){
+		diagnostic("Couldn't open AF_XDP socket (%s?)",strerror(errno));
+		munmap(x->umem,x->umemlen);
+		free(x);
+		return -1;
+	}
+	memset(&ur,0,sizeof(ur));
+	ur.addr = (uintptr_t)x->umem;
+	ur.len = x->umemlen;
+	ur.chunk_size = x->framesize;
+	olen = sizeof(off);
+	if(setsockopt(fd,SOL_XDP,XDP_UMEM_REG,&ur,sizeof(ur)) ||
+			setsockopt(fd,SOL_XDP,XDP_UMEM_FILL_RING,&entries,sizeof(entries)) ||
+			setsockopt(fd,SOL_XDP,XDP_UMEM_COMPLETION_RING,&ccount,sizeof(ccount)) ||
+			setsockopt(fd,SOL_XDP,XDP_RX_RING,&entries,sizeof(entries)) ||
+			getsockopt(fd,SOL_XDP,XDP_MMAP_OFFSETS,&off,&olen)){
+		diagnostic("[%s] Couldn't set up AF_XDP rings (%s?)",i->name,strerror(errno));
+		goto err;
+	}
+	if(map_xskring(fd,&x->rx,&off.rx,XDP_PGOFF_RX_RING,entries,sizeof(struct xdp_desc)) ||
+			map_xskring(fd,&x->fill,&off.fr,XDP_UMEM_PGOFF_FILL_RING,entries,sizeof(uint64_t))){
+		goto err;
+	}
+	// Hand the kernel every frame
+	fq = x->fill.descs;
+	for(z = 0 ; z < XSK_FRAMES ; ++z){
+		fq[z] = (uint64_t)z * x->framesize;
+	}
+	__atomic_store_n(x->fill.producer,XSK_FRAMES,__ATOMIC_RELEASE);
+	// Without XDP_COPY or XDP_ZEROCOPY, zero-copy is tried first
+	memset(&sxdp,0,sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = idx;
+	sxdp.sxdp_queue_id = queue;
+	if(bind(fd,(struct sockaddr *)&sxdp,sizeof(sxdp))){
+		diagnostic("[%s] Couldn't bind AF_XDP to queue %u (%s?)",
+				i->name,queue,strerror(errno));
+		goto err;
+	}
+	if(xskmap_insert(i->xdp->mapfd,queue,fd)){
+		diagnostic("[%s] Couldn't add queue %u to XSKMAP (%s?)",
+				i->name,queue,strerror(errno));
+		goto err;
+	}
+	*xp = x;
+	return fd;
+
+err:
+	close(fd);
+	xsk_close(x);
+	return -1;
+}
+
+unsigned xsk_drops(int fd,xsk *x){
+	struct xdp_statistics xs;
+	socklen_t slen = sizeof(xs);
+	uintmax_t drops;
+	unsigned ret;
+
+	if(getsockopt(fd,SOL_XDP,XDP_STATISTICS,&xs,&slen)){
+		return 0;
+	}
+	drops = xs.rx_dropped + xs.rx_ring_full;
+	ret = drops - x->lastdrops;
+	x->lastdrops = drops;
+	return ret;
+}
+#else
+unsigned xdp_attach(interface *i,int idx __attribute__ ((unused))){
+	diagnostic("[%s] Built without AF_XDP support",i->name);
+	return 0;
+}
+
+void xdp_detach(interface *i __attribute__ ((unused))){
+}
+
+int xsk_open(interface *i __attribute__ ((unused)),int idx __attribute__ ((unused)),
+		unsigned queue __attribute__ ((unused)),xsk **xp __attribute__ ((unused))){
+	return -1;
+}
+
+void xsk_close(xsk *x __attribute__ ((unused))){
+}
+
+unsigned xsk_drops(int fd __attribute__ ((unused)),xsk *x __attribute__ ((unused))){
+	return 0;
+}
+#endif
+
+int xdp_requested(const char *list,const char *name){
+	size_t nlen = strlen(name);
+	const char *c;
+
+	if(list == NULL){
+		return 0;
+	}
+	for(c = list ; *c ; c += strcspn(c,",")){
+		if(*c == ','){
+			++c;
+		}
+		if(strncmp(c,name,nlen) == 0 && (c[nlen] == ',' || c[nlen] == '\0')){
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef OMPHALOS_XDP
+#define OMPHALOS_XDP
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+// AF_XDP capture. A minimal XDP program steers each of the device's RX queues
+// into an XSKMAP, where an AF_XDP socket per queue receives frames into its
+// UMEM. The program is attached in native mode where the driver supports it,
+// and generic (skb) mode otherwise; sockets bind zero-copy where possible, and
+// in copy mode otherwise (as on veth). Requires Linux 5.9 or later.
+//
+// Frames redirected to AF_XDP are not seen by the host's network stack, so
+// this is only suitable for dedicated capture devices.
+
+struct interface;
+
+// A single-producer, single-consumer ring shared with the kernel.
+typedef struct xskring {
+	uint32_t *producer;
+	uint32_t *consumer;
+	void *descs;
+	uint32_t mask;		// entries - 1
+	void *map;		// for munmap()
+	size_t maplen;
+} xskring;
+
+// One AF_XDP socket, bound to one RX queue.
+typedef struct xsk {
+	void *umem;		// frame memory
+	size_t umemlen;
+	unsigned framesize;
+	xskring rx,fill;
+	uintmax_t lastdrops;	// as of our last XDP_STATISTICS check
+} xsk;
+
+// Are descriptors waiting on the RX ring?
+static inline int
+xsk_rx_ready(const xsk *x){
+	return __atomic_load_n(x->rx.producer,__ATOMIC_ACQUIRE) != *x->rx.consumer;
+}
+
+// Per-interface XDP state (the program, map, and link).
+typedef struct xdpif {
+	int progfd,mapfd,linkfd;
+	unsigned queues;	// RX queues, each wanting an xsk
+	int skbmode;		// attached in generic mode
+} xdpif;
+
+// Is AF_XDP capture requested for this device, per --xdp?
+int xdp_requested(const char *,const char *);
+
+// Load and attach the redirection program. Returns the number of RX queues
+// on success, or 0 on failure (or if unsupported).
+unsigned xdp_attach(struct interface *,int);
+void xdp_detach(struct interface *);
+
+// Open an AF_XDP socket on RX queue 'queue', and enter it into the XSKMAP.
+// Returns the socket, and sets *x, or returns -1.
+int xsk_open(struct interface *,int,unsigned,xsk **);
+// Unmaps and frees the xsk, but doesn't close its socket.
+void xsk_close(xsk *);
+
+// Read XDP_STATISTICS, returning frames dropped since the last call.
+unsigned xsk_drops(int,xsk *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
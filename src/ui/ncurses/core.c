@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <omphalos/diag.h>
+#include <omphalos/numa.h>
 #include <ui/ncurses/core.h>
 #include <ui/ncurses/util.h>
 #include <ui/ncurses/color.h>
@@ -172,36 +173,78 @@ int new_display_panel(WINDOW *w,struct panel_state *ps,int rows,int cols,const w
 	return OK;
 }
 
-#define DETAILROWS 9
+#define IFACEROWS 10
+#define DETAILROWS (IFACEROWS + 1 + TOPFLOWS)
+
+// A heading, followed by the busiest flows of the last snapshot taken in
+// packet_cb_locked(), and blank rows for any we lack.
+static int
+flow_details(WINDOW *hw,const iface_state *is,int row,int rows,int scrcols){
+	const int w = scrcols - 2 - 25; // room left of the counters
+	const int col = START_COL;
+	int z;
+
+	assert(mvwprintw(hw,row,col,"%-*s %8s %8s %6s",w,"Busiest flows","sent","rcvd","frames") != ERR);
+	for(z = 1 ; z < rows ; ++z){
+		char a0[FLOW_NTOPLEN],a1[FLOW_NTOPLEN],proto[FLOW_PROTOSTRLEN];
+		char b0[U64STRLEN + 1],b1[U64STRLEN + 1],fb[U64STRLEN + 1];
+		char ends[FLOW_NTOPLEN * 2 + FLOW_PROTOSTRLEN + 8];
+		const flowrec *f;
+
+		if(is == NULL || (unsigned)z > is->topflowcount){
+			assert(mvwprintw(hw,row + z,col,"%-*s",scrcols - 2,"") != ERR);
+			continue;
+		}
+		f = &is->topflows[z - 1];
+		snprintf(ends,sizeof(ends),"%-5s %s <-> %s",flow_protostr(f,proto),
+				flow_ntop(f,0,a0),flow_ntop(f,1,a1));
+		assert(mvwprintw(hw,row + z,col,"%-*.*s %7sB %7sB %6s",w,w,ends,
+				bprefix(f->bytes[0],1,b0,sizeof(b0),1),
+				bprefix(f->bytes[1],1,b1,sizeof(b1),1),
+				prefix(f->frames[0] + f->frames[1],1,fb,sizeof(fb),1)) != ERR);
+	}
+	return OK;
+}
 
 static int
 iface_details(WINDOW *hw,const interface *i,int rows){
 	const int col = START_COL;
 	int scrcols,scrrows;
 	const int row = 1;
+	ifstats st;
 	int z;
 
+	interface_stats(i,&st);
 	assert(wattrset(hw,SUBDISPLAY_ATTR) == OK);
 	getmaxyx(hw,scrrows,scrcols);
 	assert(scrrows); // FIXME
-	if((z = rows) >= DETAILROWS){
-		z = DETAILROWS - 1;
+	z = rows;
+	if(z > DETAILROWS){
+		z = DETAILROWS;
+	}
+	// i->opaque isn't yet ours when called from interface_cb_locked() for
+	// a new interface; flow_details() handles a NULL state.
+	if(z > IFACEROWS){
+		assert(flow_details(hw,i->opaque,row + IFACEROWS,z - IFACEROWS,scrcols) != ERR);
+	}
+	if(z >= IFACEROWS){
+		z = IFACEROWS - 1;
 	}
 	switch(z){ // Intentional fallthroughs all the way to 0
-	case (DETAILROWS - 1):{
+	case (IFACEROWS - 1):{
 		assert(mvwprintw(hw,row + z,col,"drops: "U64FMT" truncs: "U64FMT" (%ju recov)%-*s",
-					i->drops,i->truncated,i->truncated_recovered,
+					st.drops,st.truncated,st.truncated_recovered,
 					scrcols - 2 - 72,"") != ERR);
 		--z;
-	}case 7:{
+	}case 8:{
 		assert(mvwprintw(hw,row + z,col,"mform: "U64FMT" noprot: "U64FMT,
-					i->malformed,i->noprotocol) != ERR);
+					st.malformed,st.noprotocol) != ERR);
 		--z;
-	}case 6:{
+	}case 7:{
 		assert(mvwprintw(hw,row + z,col,"Rbyte: "U64FMT" frames: "U64FMT,
-					i->bytes,i->frames) != ERR);
+					st.bytes,st.frames) != ERR);
 		--z;
-	}case 5:{
+	}case 6:{
 		char b[PREFIXSTRLEN];
 		char fb[PREFIXSTRLEN];
 		char buf[U64STRLEN];
@@ -212,11 +255,11 @@ iface_details(WINDOW *hw,const interface *i,int rows){
 					i->rtpr.tp_block_nr,
 					bprefix(i->rs,1,b,sizeof(b),1)) != ERR);
 		--z;
-	}case 4:{
+	}case 5:{
 		assert(mvwprintw(hw,row + z,col,"Tbyte: "U64FMT" frames: "U64FMT" aborts: %llu",
-					i->txbytes,i->txframes,i->txaborts) != ERR);
+					st.txbytes,st.txframes,st.txaborts) != ERR);
 		--z;
-	}case 3:{
+	}case 4:{
 		char b[PREFIXSTRLEN];
 		char fb[PREFIXSTRLEN];
 		char buf[U64STRLEN];
@@ -227,7 +270,7 @@ iface_details(WINDOW *hw,const interface *i,int rows){
 					bprefix(i->ttpr.tp_block_size,1,buf,sizeof(buf),1),i->ttpr.tp_block_nr,
 					bprefix(i->ts,1,b,sizeof(b),1)) != ERR);
 		--z;
-	}case 2:{
+	}case 3:{
 		assert(offload_details(hw,i,row + z,col,"TSO",TCP_SEG_OFFLOAD) != ERR);
 		assert(offload_details(hw,i,row + z,col + 5,"S/G",ETH_SCATTER_GATHER) != ERR);
 		assert(offload_details(hw,i,row + z,col + 10,"UFO",UDP_FRAG_OFFLOAD) != ERR);
@@ -240,6 +283,19 @@ iface_details(WINDOW *hw,const interface *i,int rows){
 		assert(offload_details(hw,i,row + z,col + 48,"RVln",RXVLAN_OFFLOAD) != ERR);
 		assert(mvwprintw(hw,row + z,col + 53," MTU: %-6d",i->mtu) != ERR);
 		--z;
+	}case 2:{
+		char cpus[BUFSIZ];
+
+		if(i->rxcpusirq < 0){
+			assert(mvwprintw(hw,row + z,col,"%-*s",scrcols - 2,
+						"NUMA: - RX CPUs: -") != ERR);
+		}else{
+			assert(mvwprintw(hw,row + z,col,"NUMA: %-3d RX CPUs: %s (%s)%-*s",
+						i->numanode,format_cpulist(&i->rxcpus,cpus,sizeof(cpus)),
+						i->rxcpusirq ? "IRQ affinity" : "node",
+						scrcols - 2 - 40,"") != ERR);
+		}
+		--z;
 	}case 1:{
 		assert(mvwprintw(hw,row + z,col,"%-*ls",scrcols - 2,i->topinfo.devname ?
 					i->topinfo.devname : L"Unknown device") != ERR);
@@ -712,6 +768,9 @@ int packet_cb_locked(const interface *i,omphalos_packet *op,struct panel_state *
 	}
 	is->lastprinted = op->tv;
 	if(rb == current_iface && ps->p){
+		// We hold the iface lock here, but the UI thread mustn't take
+		// it, so the panel always draws from this copy.
+		is->topflowcount = top_flows(i,is->topflows,TOPFLOWS);
 		iface_details(panel_window(ps->p),i,ps->ysize);
 	}
 	assert(redraw_iface_generic(rb) == OK);
@@ -943,6 +1002,47 @@ struct l3obj *host_callback_locked(const interface *i,struct l2host *l2,
 	return ret;
 }
 
+// The l4obj of any evicted service is freed along with its l3obj. l4srv
+// opaques are only consulted to decide whether a service is new, so we needn't
+// reset them.
+void evict_callback_locked(const interface *i,struct l2host *l2,
+					struct l3host *l3){
+	iface_state *is;
+	reelbox *rb;
+
+	if((is = i->opaque) == NULL){
+		return;
+	}
+	if(l3){
+		struct l3obj *l3o;
+
+		if((l3o = l3host_get_opaque(l3)) == NULL){
+			return;
+		}
+		remove_l3_from_iface(is,l3o);
+	}else{
+		struct l2obj *l2o;
+
+		if((l2o = l2host_get_opaque(l2)) == NULL){
+			return;
+		}
+		if( (rb = is->rb) && rb->selected == l2o){
+			if(l2obj_next(l2o)){
+				rb->selected = l2obj_next(l2o);
+			}else if( (rb->selected = l2obj_prev(l2o)) ){
+				rb->selline -= l2obj_lines(rb->selected);
+			}else{
+				rb->selline = -1;
+			}
+		}
+		remove_l2_from_iface(is,l2o);
+	}
+	if( (rb = is->rb) ){
+		resize_iface(rb);
+		redraw_iface_generic(rb);
+	}
+}
+
 // to be called only while ncurses lock is held
 int draw_main_window(WINDOW *w){
 	int rows,cols;
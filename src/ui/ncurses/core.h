@@ -87,6 +87,8 @@ struct l4obj *service_callback_locked(const struct interface *,struct l2host *,
 struct l3obj *host_callback_locked(const struct interface *,struct l2host *,
 					struct l3host *);
 struct l2obj *neighbor_callback_locked(const struct interface *,struct l2host *);
+void evict_callback_locked(const struct interface *,struct l2host *,
+					struct l3host *);
 void interface_removed_locked(iface_state *,struct panel_state **);
 void *interface_cb_locked(struct interface *,iface_state *,struct panel_state *);
 int packet_cb_locked(const struct interface *,struct omphalos_packet *,struct panel_state *);
@@ -80,6 +80,7 @@ iface_state *create_interface_state(interface *i){
 		ret->lastprinted.tv_sec = ret->lastprinted.tv_usec = 0;
 		ret->iface = i;
 		ret->expansion = EXPANSION_MAX;
+		ret->topflowcount = 0;
 	}
 	return ret;
 }
@@ -281,6 +282,51 @@ l4obj *add_service_to_iface(iface_state *is,struct l2obj *l2,struct l3obj *l3,
 	return l4;
 }
 
+void remove_l3_from_iface(iface_state *is,l3obj *l3){
+	l2obj *l2 = l3->l2;
+	l3obj **prev;
+
+	for(prev = &l2->l3objs ; *prev != l3 ; prev = &(*prev)->next){
+		assert(*prev);
+	}
+	*prev = l3->next;
+	if(l3->l4objs){
+		--is->srvs;
+	}
+	--is->hosts;
+	free_l3obj(l3);
+	l2->lines = node_lines(is->expansion,l2);
+}
+
+void remove_l2_from_iface(iface_state *is,l2obj *l2){
+	l3obj *l3;
+
+	// Any l3objs remaining belong to l3hosts which have since been seen
+	// via some other l2host. Detach them; they'll be recreated beneath
+	// their new l2obj by the next host event.
+	for(l3 = l2->l3objs ; l3 ; l3 = l3->next){
+		l3host_set_opaque(l3->l3,NULL);
+		if(l3->l4objs){
+			--is->srvs;
+		}
+		--is->hosts;
+	}
+	if(l2->prev){
+		l2->prev->next = l2->next;
+	}else{
+		is->l2objs = l2->next;
+	}
+	if(l2->next){
+		l2->next->prev = l2->prev;
+	}
+	if(l2->cat == RTN_LOCAL || l2->cat == RTN_UNICAST){
+		--is->nodes;
+	}else{
+		--is->vnodes;
+	}
+	free_l2obj(l2);
+}
+
 static void
 print_host_services(WINDOW *w,const interface *i,const l3obj *l,int *line,
 			int rows,int cols,wchar_t selectchar,int attrs,
@@ -729,20 +775,20 @@ print_iface_state(const interface *i,const iface_state *is,WINDOW *w,
 			int rows,int cols,unsigned topp,int active){
 	char buf[U64STRLEN + 1],buf2[U64STRLEN + 1];
 	unsigned long usecdomain;
+	ifstats st;
 
 	if(rows < 2 || topp > 1){
 		return;
 	}
+	interface_stats(i,&st);
 	assert(wattrset(w,A_BOLD | COLOR_PAIR(IFACE_COLOR)) != ERR);
-	// FIXME broken if bps domain ever != fps domain. need unite those
-	// into one FTD stat by letting it take an object...
 	// FIXME this leads to a "ramp-up" period where we approach steady state
-	usecdomain = i->bps.usec * i->bps.total;
+	usecdomain = IFACE_TIMESTAT_USECS * IFACE_TIMESTAT_SLOTS;
 	assert(mvwprintw(w,!topp,0,"%u node%s. Last %lus: %7sb/s (%sp)",
 		is->nodes,is->nodes == 1 ? "" : "s",
 		usecdomain / 1000000,
-		prefix(timestat_val(&i->bps) * CHAR_BIT * 1000000 * 100 / usecdomain,100,buf,sizeof(buf),0),
-		prefix(timestat_val(&i->fps),1,buf2,sizeof(buf2),1)) != ERR);
+		prefix(st.bps * CHAR_BIT * 1000000 * 100 / usecdomain,100,buf,sizeof(buf),0),
+		prefix(st.fps,1,buf2,sizeof(buf2),1)) != ERR);
 	mvwaddstr(w,1,cols - PREFIXSTRLEN * 2 - 1,"TotSrc  TotDst");
 	draw_right_vline(i,active,w);
 }
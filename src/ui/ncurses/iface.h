@@ -8,6 +8,7 @@ extern "C" {
 #include <sys/time.h>
 #include <ncursesw/panel.h>
 #include <ncursesw/ncurses.h>
+#include <omphalos/flow.h>
 
 struct l2obj;
 struct l3obj;
@@ -29,6 +30,8 @@ enum {
 
 #define EXPANSION_MAX EXPANSION_SERVICES
 
+#define TOPFLOWS 5	// busiest flows shown in the details panel
+
 // FIXME move this into iface.c
 // Bind one of these state structures to each interface in the callback,
 // and also associate an iface with them via *iface (for UI actions).
@@ -49,6 +52,8 @@ typedef struct iface_state {
 	struct iface_state *next,*prev;	// circular list; all ifaces are here
 	struct reelbox *rb;		// our reelbox (UI elements). if we're
 					// entirely offscreen, this is NULL.
+	flowrec topflows[TOPFLOWS];	// busiest flows, copied out while
+	unsigned topflowcount;		//  the iface lock was held
 } iface_state;
 
 int redraw_iface(const struct reelbox *,int);
@@ -65,6 +70,11 @@ struct l3obj *add_l3_to_iface(struct iface_state *,struct l2obj *,struct l3host
 struct l4obj *add_service_to_iface(struct iface_state *,struct l2obj *,
 				struct l3obj *,struct l4srv *,unsigned);
 
+// Drop UI state for evicted hosts. The caller must move any selection off of
+// an l2obj before removing it.
+void remove_l3_from_iface(struct iface_state *,struct l3obj *);
+void remove_l2_from_iface(struct iface_state *,struct l2obj *);
+
 // Call after changing the degree of collapse/expansion, and resizing, but
 // before redrawing.
 void recompute_selection(iface_state *,int,int,int);
@@ -541,9 +541,14 @@ err:
 	return NULL;
 }
 
+// Called with the interface lock held, so we mustn't stall capture behind a
+// redraw. If the UI is busy, skip this update; packet_cb_locked() only draws
+// every half second anyway, reading the stats snapshot.
 static void
 packet_callback(omphalos_packet *op){
-	pthread_mutex_lock(&bfl); // don't always want screen_update()
+	if(pthread_mutex_trylock(&bfl)){
+		return;
+	}
 	if(packet_cb_locked(op->i,op,&details)){
 		if(active){
 			assert(top_panel(active->p) != ERR);
@@ -619,6 +624,17 @@ neighbor_callback(const interface *i,struct l2host *l2){
 	return ret;
 }
 
+static void
+evict_callback(const interface *i,struct l2host *l2,struct l3host *l3){
+	pthread_mutex_lock(&bfl);
+	evict_callback_locked(i,l2,l3);
+	if(active){
+		assert(top_panel(active->p) != ERR);
+	}
+	screen_update();
+	pthread_mutex_unlock(&bfl);
+}
+
 static void
 interface_removed_callback(const interface *i __attribute__ ((unused)),void *unsafe){
 	lock_ncurses();
@@ -671,6 +687,7 @@ int main(int argc,char * const *argv){
 	pctx.iface.srv_event = service_callback;
 	pctx.iface.neigh_event = neighbor_callback;
 	pctx.iface.host_event = host_callback;
+	pctx.iface.evict_event = evict_callback;
 	pctx.iface.network_event = network_callback;
 	if(ncurses_setup() == NULL){
 		return EXIT_FAILURE;
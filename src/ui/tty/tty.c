@@ -15,7 +15,10 @@
 #include <sys/socket.h>
 #include <wireless.h>
 #include <omphalos/diag.h>
+#include <omphalos/plog.h>
+#include <omphalos/flow.h>
 #include <omphalos/pcap.h>
+#include <omphalos/numa.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <omphalos/service.h>
@@ -23,7 +26,9 @@
 #include <omphalos/netaddrs.h>
 #include <omphalos/wireless.h>
 #include <omphalos/omphalos.h>
+#include <omphalos/ipfrag.h>
 #include <omphalos/interface.h>
+#include <omphalos/tcpstream.h>
 
 static pthread_t *input_tid;
 static pthread_mutex_t promptlock = PTHREAD_MUTEX_INITIALIZER;
@@ -82,6 +87,18 @@ print_iface(FILE *fp,const interface *iface){
 			return -1;
 		}
 		n += nn;
+		if(iface->rxcpusirq >= 0){
+			char cpus[BUFSIZ];
+
+			nn = fprintf(fp,"\t   numa: node %d, RX on CPUs %s (%s)\n",
+					iface->numanode,
+					format_cpulist(&iface->rxcpus,cpus,sizeof(cpus)),
+					iface->rxcpusirq ? "IRQ affinity" : "node");
+			if(nn < 0){
+				return -1;
+			}
+			n += nn;
+		}
 	}
 	return n;
 }
@@ -89,7 +106,7 @@ print_iface(FILE *fp,const interface *iface){
 
 static int
 print_stats(FILE *fp){
-	interface total;
+	ifstats total;
 
 	memset(&total,0,sizeof(total));
 	if(fprintf(fp,"<stats>") < 0){
@@ -101,7 +118,19 @@ print_stats(FILE *fp){
 	if(print_pcap_stats(fp,&total) < 0){
 		return -1;
 	}
-	if(print_iface_stats(fp,&total,NULL,"total") < 0){
+	if(print_plog_stats(fp) < 0){
+		return -1;
+	}
+	if(print_ipfrag_stats(fp) < 0){
+		return -1;
+	}
+	if(print_tcpstream_stats(fp) < 0){
+		return -1;
+	}
+	if(print_flow_stats(fp) < 0){
+		return -1;
+	}
+	if(print_ifstats(fp,&total,NULL,"total") < 0){
 		return -1;
 	}
 	if(fprintf(fp,"</stats>") < 0){
@@ -189,6 +218,19 @@ print_service(const interface *iface,const struct l2host *l2,
 	return n;
 }
 
+static int
+print_flow(const interface *iface,const flowrec *f){
+	char a0[FLOW_NTOPLEN],a1[FLOW_NTOPLEN],proto[FLOW_PROTOSTRLEN];
+	int n;
+
+	n = printf("[%8s] flow %s %s -> %s (%ju frames %ju bytes) <- (%ju frames %ju bytes) %lds\n",
+			iface->name,flow_protostr(f,proto),flow_ntop(f,0,a0),
+			flow_ntop(f,1,a1),f->frames[0],f->bytes[0],f->frames[1],
+			f->bytes[1],(long)(f->last.tv_sec - f->first.tv_sec));
+	assert(n >= 0);
+	return n;
+}
+
 static int
 print_wireless_event(FILE *fp,const interface *i,unsigned cmd){
 	int n = 0;
@@ -284,6 +326,14 @@ service_event(const struct interface *i,struct l2host *l2,struct l3host *l3,
 	return NULL;
 }
 
+static void
+flow_event(const struct interface *i,const flowrec *f){
+	pthread_mutex_lock(&promptlock);
+	clear_for_output(stdout);
+	assert(print_flow(i,f) >= 0);
+	wake_input_thread();
+}
+
 static void *
 wireless_event(interface *i,unsigned cmd,void *unsafe __attribute__ ((unused))){
 	pthread_mutex_lock(&promptlock);
@@ -425,9 +475,10 @@ int main(int argc,char * const *argv){
 	pctx.iface.neigh_event = neigh_event;
 	pctx.iface.host_event = host_event;
 	pctx.iface.srv_event = service_event;
+	pctx.iface.flow_event = flow_event;
 	pctx.iface.wireless_event = wireless_event;
 	pctx.iface.packet_read = packet_cb;
-	if(!pctx.pcapfn){ // FIXME, ought be able to use UI with pcaps?
+	if(!pctx.pcapcount){ // FIXME, ought be able to use UI with pcaps?
 		input_tid = &tid;
 		if(init_tty_ui(input_tid)){
 			omphalos_cleanup(&pctx);
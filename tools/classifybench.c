@@ -0,0 +1,346 @@
+// Benchmark for UDP and TCP payload classification. Extracts the transport
+// tuples of the given captures' Ethernet frames (test/*.pcap by default), then
+// classifies them repeatedly: UDP via the well-known-port branch chain which
+// handle_udp_packet() used before classify.c, and both UDP and TCP via
+// classify_l4_rule(). No dissector is run. Each is timed both with its data
+// warm, and with the caches scrubbed every few packets, as the rest of the
+// packet path would do.
+#include <glob.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <pcap/pcap.h>
+#include <asm/byteorder.h>
+#include <linux/if_ether.h>
+#include <omphalos/udp.h>
+#include <omphalos/netbios.h>
+#include <omphalos/savefile.h>
+#include <omphalos/classify.h>
+#include <omphalos/omphalos.h>
+
+#define PASSES 200u
+#define COLD_PASSES 10u
+#define REPEATS 5u
+#define SCRUB_EVERY 8u			// packets between scrubs, when cold
+#define SCRUB_BYTES (4u << 20u)		// well past L2
+#define CACHELINE 64u
+
+typedef struct tuple {
+	omphalos_packet op;		// l3proto, l4src and l4dst set
+	int proto;			// IPPROTO_UDP or IPPROTO_TCP
+	const unsigned char *payload;
+	size_t len;
+} tuple;
+
+static savefile *sfs;
+static unsigned sfcount;
+static tuple *tuples;
+static unsigned tuplecount;
+static unsigned char *scrubbuf;
+static volatile unsigned sink;
+
+static void
+quiet_vdiagnostic(const char *fmt,va_list v){
+	(void)fmt;
+	(void)v;
+}
+
+// Ethernet, an optional 802.1Q tag, IPv4 or IPv6 (without extension headers),
+// then UDP or TCP. Anything else is skipped; this isn't the dissector. Fields
+// are read bytewise, the headers being unaligned.
+static int
+extract_tuple(const unsigned char *f,size_t len){
+	unsigned l3proto,proto;
+	size_t off = ETH_HLEN;
+	uint16_t sport,dport;
+	tuple *t;
+
+	if(len < off){
+		return 0;
+	}
+	l3proto = (f[off - 2] << 8u) | f[off - 1];
+	if(l3proto == ETH_P_8021Q){
+		if(len < off + 4){
+			return 0;
+		}
+		l3proto = (f[off + 2] << 8u) | f[off + 3];
+		off += 4;
+	}
+	if(l3proto == ETH_P_IP){
+		unsigned ihl;
+
+		if(len < off + 20 || (ihl = (f[off] & 0xfu) * 4u) < 20 || len < off + ihl){
+			return 0;
+		}
+		if(((f[off + 6] & 0x1fu) | f[off + 7]) != 0){ // not a first fragment
+			return 0;
+		}
+		proto = f[off + 9];
+		off += ihl;
+	}else if(l3proto == ETH_P_IPV6){
+		if(len < off + 40){
+			return 0;
+		}
+		proto = f[off + 6];
+		off += 40;
+	}else{
+		return 0;
+	}
+	if(proto == IPPROTO_UDP){
+		if(len < off + 8){
+			return 0;
+		}
+	}else if(proto == IPPROTO_TCP){
+		if(len < off + 20 || len < off + (f[off + 12] >> 4u) * 4u){
+			return 0;
+		}
+	}else{
+		return 0;
+	}
+	memcpy(&sport,f + off,sizeof(sport));
+	memcpy(&dport,f + off + 2,sizeof(dport));
+	off += proto == IPPROTO_UDP ? 8 : (f[off + 12] >> 4u) * 4u;
+	if((t = realloc(tuples,sizeof(*t) * (tuplecount + 1))) == NULL){
+		return -1;
+	}
+	tuples = t;
+	t += tuplecount++;
+	memset(t,0,sizeof(*t));
+	t->op.l3proto = l3proto;
+	t->op.l4src = sport;
+	t->op.l4dst = dport;
+	t->proto = proto;
+	t->payload = f + off;
+	t->len = len - off;
+	return 0;
+}
+
+// The savefiles stay mapped; tuples point into them.
+static int
+load_capture(const char *fn){
+	saverecord r;
+	savefile *sf;
+	int ret;
+
+	if((sf = realloc(sfs,sizeof(*sfs) * (sfcount + 1))) == NULL){
+		return -1;
+	}
+	sfs = sf;
+	sf += sfcount;
+	if(savefile_open(sf,fn)){
+		fprintf(stderr,"Couldn't read %s as a pcap or pcapng savefile\n",fn);
+		return -1;
+	}
+	++sfcount;
+	while((ret = savefile_next(sf,&r)) > 0){
+		if(sf->links[r.link].dlt != DLT_EN10MB){
+			continue;
+		}
+		if(extract_tuple(r.data,r.hdr.caplen)){
+			return -1;
+		}
+	}
+	return ret;
+}
+
+// handle_udp_packet()'s dispatch prior to the classifier, less the handlers.
+// Returns nonzero where it would have called one.
+static int
+branch_chain(const tuple *t){
+	const omphalos_packet *op = &t->op;
+
+	if(op->l4src == __constant_htons(MDNS_NATPMP1_UDP_PORT) &&
+			op->l4dst == __constant_htons(MDNS_NATPMP1_UDP_PORT)){
+		return 1;
+	}else if(op->l4src == __constant_htons(MDNS_NATPMP2_UDP_PORT) &&
+			op->l4dst == __constant_htons(MDNS_NATPMP2_UDP_PORT)){
+		return 2;
+	}
+	switch(op->l4src){
+		case __constant_htons(DNS_UDP_PORT):
+			return 3;
+		case __constant_htons(SSDP_UDP_PORT):
+			return 4;
+		case __constant_htons(MDNS_UDP_PORT):
+			if(op->l4dst == __constant_htons(MDNS_NATPMP1_UDP_PORT) ||
+					op->l4dst == __constant_htons(MDNS_NATPMP2_UDP_PORT)){
+				return 5;
+			}
+			return 6;
+		case __constant_htons(NETBIOS_NS_UDP_PORT):
+			return op->l4dst == __constant_htons(NETBIOS_NS_UDP_PORT) ? 7 : 0;
+		case __constant_htons(DHCP_UDP_PORT):
+			return op->l4dst == __constant_htons(BOOTP_UDP_PORT) ? 8 : 0;
+		case __constant_htons(DHCP6SRV_UDP_PORT):
+			return op->l4dst == __constant_htons(DHCP6CLI_UDP_PORT) ? 9 : 0;
+	}
+	return 0;
+}
+
+static int
+table_rule(const tuple *t){
+	return classify_l4_rule(&t->op,t->proto,t->payload,t->len) + 1;
+}
+
+static int
+no_rule(const tuple *t){
+	return t->proto == 0;
+}
+
+static void
+scrub(void){
+	unsigned z;
+
+	for(z = 0 ; z < SCRUB_BYTES ; z += CACHELINE){
+		++scrubbuf[z];
+	}
+}
+
+static double
+nsecs_between(const struct timespec *t0,const struct timespec *t1){
+	return (t1->tv_sec - t0->tv_sec) * 1000000000.0 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+// Returns ns per tuple of those given. When cold, the caches are scrubbed
+// between batches of SCRUB_EVERY tuples, and only the batches are timed.
+// *claimed is set to the number of tuples a rule claims.
+static double
+bench(int (*classify)(const tuple *),const tuple *tv,unsigned n,int cold,
+						unsigned *claimed){
+	struct timespec t0,t1;
+	unsigned p,z,c = 0;
+	double ns = 0;
+
+	for(p = 0 ; p < (cold ? COLD_PASSES : PASSES) ; ++p){
+		c = 0;
+		if(!cold){
+			clock_gettime(CLOCK_MONOTONIC,&t0);
+			for(z = 0 ; z < n ; ++z){
+				c += !!classify(&tv[z]);
+			}
+			clock_gettime(CLOCK_MONOTONIC,&t1);
+			ns += nsecs_between(&t0,&t1);
+			continue;
+		}
+		for(z = 0 ; z < n ; z += SCRUB_EVERY){
+			unsigned b;
+
+			scrub();
+			clock_gettime(CLOCK_MONOTONIC,&t0);
+			for(b = z ; b < n && b < z + SCRUB_EVERY ; ++b){
+				c += !!classify(&tv[b]);
+			}
+			clock_gettime(CLOCK_MONOTONIC,&t1);
+			ns += nsecs_between(&t0,&t1);
+		}
+	}
+	*claimed = c;
+	sink += c;
+	return ns / ((double)n * p);
+}
+
+// Times are net of an empty classifier's, which has the same call and clock
+// overheads. Each is the best of REPEATS runs, the machine being shared.
+static int
+report(const char *name,int (*classify)(const tuple *),int proto){
+	double warm = 0,cold = 0;
+	unsigned claimed,z,n;
+	tuple *tv;
+
+	if((tv = malloc(sizeof(*tv) * tuplecount)) == NULL){
+		return -1;
+	}
+	for(n = 0, z = 0 ; z < tuplecount ; ++z){
+		if(tuples[z].proto == proto){
+			tv[n++] = tuples[z];
+		}
+	}
+	if(n){
+		double w0 = 0,w1 = 0,c0 = 0,c1 = 0;
+		unsigned r;
+
+		for(r = 0 ; r < REPEATS ; ++r){
+			double t;
+
+			if((t = bench(classify,tv,n,0,&claimed)) < w1 || !r){
+				w1 = t;
+			}
+			if((t = bench(no_rule,tv,n,0,&z)) < w0 || !r){
+				w0 = t;
+			}
+			if((t = bench(classify,tv,n,1,&claimed)) < c1 || !r){
+				c1 = t;
+			}
+			if((t = bench(no_rule,tv,n,1,&z)) < c0 || !r){
+				c0 = t;
+			}
+		}
+		warm = w1 - w0;
+		cold = c1 - c0;
+		printf("%-14s %s: %6u tuples, %6u claimed, %6.2f ns warm, %6.2f ns cold\n",
+			name,proto == IPPROTO_TCP ? "tcp" : "udp",n,claimed,warm,cold);
+	}
+	free(tv);
+	return 0;
+}
+
+int main(int argc,char **argv){
+	omphalos_ctx ctx;
+	glob_t gl;
+	unsigned z;
+
+	memset(&gl,0,sizeof(gl));
+	if(argc > 1){
+		gl.gl_pathv = argv + 1;
+		gl.gl_pathc = argc - 1;
+	}else if(glob("../test/*.pcap",0,NULL,&gl)){
+		fprintf(stderr,"Couldn't find ../test/*.pcap\n");
+		return EXIT_FAILURE;
+	}
+	memset(&ctx,0,sizeof(ctx));
+	ctx.mode = OMPHALOS_MODE_SILENT;
+	ctx.iface.vdiagnostic = quiet_vdiagnostic;
+	if(pthread_key_create(&omphalos_ctx_key,NULL) ||
+			pthread_setspecific(omphalos_ctx_key,&ctx)){
+		fprintf(stderr,"Couldn't set up omphalos_ctx TSD\n");
+		return EXIT_FAILURE;
+	}
+	if(init_classifier()){
+		fprintf(stderr,"Couldn't compile classifier\n");
+		return EXIT_FAILURE;
+	}
+	for(z = 0 ; z < gl.gl_pathc ; ++z){
+		if(load_capture(gl.gl_pathv[z])){
+			return EXIT_FAILURE;
+		}
+	}
+	if(tuplecount == 0){
+		fprintf(stderr,"No UDP or TCP frames to classify\n");
+		return EXIT_FAILURE;
+	}
+	if((scrubbuf = calloc(1,SCRUB_BYTES)) == NULL){
+		return EXIT_FAILURE;
+	}
+	printf("%u tuples from %u captures, %u passes (%u cold)\n",tuplecount,sfcount,PASSES,COLD_PASSES);
+	if(report("branch chain",branch_chain,IPPROTO_UDP) ||
+			report("classify_l4",table_rule,IPPROTO_UDP) ||
+			report("classify_l4",table_rule,IPPROTO_TCP)){
+		return EXIT_FAILURE;
+	}
+	cleanup_classifier();
+	for(z = 0 ; z < sfcount ; ++z){
+		savefile_close(&sfs[z]);
+	}
+	if(argc <= 1){
+		globfree(&gl);
+	}
+	free(scrubbuf);
+	free(sfs);
+	free(tuples);
+	return EXIT_SUCCESS;
+}
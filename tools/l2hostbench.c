@@ -0,0 +1,97 @@
+// Microbenchmark for lookup_l2host(). Populates a dummy interface with n
+// distinct hardware addresses, then reports lookups/sec for random hits.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <omphalos/hwaddrs.h>
+#include <omphalos/omphalos.h>
+#include <omphalos/interface.h>
+
+#define LOOKUPS 10000000u
+
+static uint64_t
+xorshift(uint64_t *s){
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static double
+usecs_since(const struct timeval *t0){
+	struct timeval t1;
+
+	gettimeofday(&t1,NULL);
+	return (t1.tv_sec - t0->tv_sec) * 1000000.0 + (t1.tv_usec - t0->tv_usec);
+}
+
+static int
+bench(unsigned n){
+	unsigned char (*macs)[ETH_ALEN];
+	struct timeval t0;
+	uint64_t seed = 0x0123456789abcdefull;
+	unsigned char addr[ETH_ALEN];
+	interface i;
+	double us;
+	unsigned z;
+
+	memset(&i,0,sizeof(i));
+	i.arptype = ARPHRD_LOOPBACK; // skip OUI lookup
+	i.addrlen = ETH_ALEN;
+	i.addr = addr;
+	memset(addr,0,sizeof(addr));
+	if((macs = malloc(sizeof(*macs) * n)) == NULL){
+		return -1;
+	}
+	for(z = 0 ; z < n ; ++z){
+		// a shared OUI, as on a homogeneous data centre VLAN
+		macs[z][0] = 0x00; macs[z][1] = 0x25; macs[z][2] = 0x90;
+		macs[z][3] = z >> 16; macs[z][4] = z >> 8; macs[z][5] = z;
+	}
+	gettimeofday(&t0,NULL);
+	for(z = 0 ; z < n ; ++z){
+		if(lookup_l2host(&i,macs[z]) == NULL){
+			free(macs);
+			return -1;
+		}
+	}
+	us = usecs_since(&t0);
+	printf("%7u hosts: %12.0f inserts/s",n,n / us * 1000000.0);
+	gettimeofday(&t0,NULL);
+	for(z = 0 ; z < LOOKUPS ; ++z){
+		if(lookup_l2host(&i,macs[xorshift(&seed) % n]) == NULL){
+			free(macs);
+			return -1;
+		}
+	}
+	us = usecs_since(&t0);
+	printf(" %12.0f lookups/s\n",LOOKUPS / us * 1000000.0);
+	cleanup_l2hosts(&i);
+	free(macs);
+	return 0;
+}
+
+int main(void){
+	const unsigned counts[] = { 1000, 10000, 100000, };
+	omphalos_ctx ctx;
+	unsigned z;
+
+	memset(&ctx,0,sizeof(ctx));
+	if(pthread_key_create(&omphalos_ctx_key,NULL) ||
+			pthread_setspecific(omphalos_ctx_key,&ctx)){
+		fprintf(stderr,"Couldn't set up omphalos_ctx TSD\n");
+		return EXIT_FAILURE;
+	}
+	for(z = 0 ; z < sizeof(counts) / sizeof(*counts) ; ++z){
+		if(bench(counts[z])){
+			fprintf(stderr,"Error benchmarking %u hosts\n",counts[z]);
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,428 @@
+// Full-table fixture for the longest-prefix-match trie. Synthesizes a default-
+// free-zone-sized routing table (1M IPv4 prefixes, mostly /24s, and 220k IPv6
+// prefixes, mostly /48s within /32 allocations), and inserts each into two
+// tries, as route.c and interface.c each index every route. Reports heap
+// consumed (per mallinfo2(), thus including allocator overhead) and lookups/
+// sec. Every lookup is checked against sorted per-length tables of the
+// prefixes. Half the prefixes are then removed from one trie, while another
+// thread performs lock-free lookups against it (checking only that results
+// cover the key), and the lookups rechecked. Finally the remainder are
+// removed, after which the trie must hold no memory.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <omphalos/lpm.h>
+
+#define PREFIXES4 1000000u
+#define PREFIXES6 220000u
+#define ALLOCS6 40000u		// IPv6 /32 allocations
+#define LOOKUPS 10000000u
+#define CHECKS 1000000u
+
+// Relative frequencies of prefix lengths, roughly those of a current table
+typedef struct lenfreq {
+	unsigned len,weight;
+} lenfreq;
+
+static const lenfreq lens4[] = {
+	{ 24, 600, }, { 23, 100, }, { 22, 120, }, { 21, 50, }, { 20, 40, },
+	{ 19, 30, }, { 18, 15, }, { 17, 10, }, { 16, 15, }, { 15, 3, },
+	{ 14, 3, }, { 13, 3, }, { 12, 2, }, { 11, 1, }, { 10, 1, }, { 9, 1, },
+	{ 8, 1, }, { 25, 1, }, { 26, 1, }, { 27, 1, }, { 28, 1, }, { 29, 1, },
+	{ 30, 1, }, { 32, 1, }, { 0, 0, }
+};
+
+static const lenfreq lens6[] = {
+	{ 48, 450, }, { 32, 120, }, { 44, 110, }, { 40, 80, }, { 36, 40, },
+	{ 29, 30, }, { 47, 30, }, { 46, 30, }, { 45, 20, }, { 42, 20, },
+	{ 33, 10, }, { 34, 10, }, { 35, 10, }, { 38, 10, }, { 43, 10, },
+	{ 56, 10, }, { 64, 10, }, { 0, 0, }
+};
+
+typedef struct pfx {
+	unsigned char key[16];
+	unsigned len;
+	int dup;		// already present via an earlier prefix
+} pfx;
+
+typedef struct fixture {
+	const char *name;
+	unsigned keylen;	// bytes
+	unsigned n;
+	pfx *p;
+	pfx **bylen[LPM_MAXBITS + 1];	// live prefixes of each length, sorted
+	unsigned nbylen[LPM_MAXBITS + 1];
+} fixture;
+
+static uint64_t seed = 0x0123456789abcdefull;
+
+static uint64_t
+xorshift(uint64_t *s){
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+void diagnostic(const char *fmt,...){
+	va_list va;
+
+	va_start(va,fmt);
+	vfprintf(stderr,fmt,va);
+	va_end(va);
+	fputc('\n',stderr);
+}
+
+static double
+usecs_since(const struct timeval *t0){
+	struct timeval t1;
+
+	gettimeofday(&t1,NULL);
+	return (t1.tv_sec - t0->tv_sec) * 1000000.0 + (t1.tv_usec - t0->tv_usec);
+}
+
+static size_t
+heap_used(void){
+	struct mallinfo2 mi = mallinfo2();
+
+	return mi.uordblks + mi.hblkhd;
+}
+
+static unsigned
+random_len(const lenfreq *lf){
+	unsigned total = 0,r;
+	const lenfreq *l;
+
+	for(l = lf ; l->weight ; ++l){
+		total += l->weight;
+	}
+	r = xorshift(&seed) % total;
+	for(l = lf ; r >= l->weight ; ++l){
+		r -= l->weight;
+	}
+	return l->len;
+}
+
+static void
+mask_key(unsigned char *key,unsigned keylen,unsigned len){
+	unsigned z;
+
+	for(z = 0 ; z < keylen ; ++z){
+		if(len >= (z + 1) * 8){
+			continue;
+		}
+		key[z] &= len > z * 8 ? 0xffu << (8 - (len - z * 8)) : 0;
+	}
+}
+
+static void
+random_bytes(unsigned char *b,unsigned len){
+	while(len--){
+		*b++ = xorshift(&seed);
+	}
+}
+
+static void
+gen4(pfx *p){
+	random_bytes(p->key,4);
+	p->key[0] = 1 + xorshift(&seed) % 223;	// unicast
+	p->len = random_len(lens4);
+	mask_key(p->key,4,p->len);
+}
+
+static void
+gen6(pfx *p,const uint32_t *allocs){
+	uint32_t a = allocs[xorshift(&seed) % ALLOCS6];
+
+	random_bytes(p->key,16);
+	p->key[0] = a >> 24;
+	p->key[1] = a >> 16;
+	p->key[2] = a >> 8;
+	p->key[3] = a;
+	p->len = random_len(lens6);
+	mask_key(p->key,16,p->len);
+}
+
+static unsigned cmplen;
+
+static int
+pfxcmp(const void *va,const void *vb){
+	const pfx * const *a = va,* const *b = vb;
+
+	return memcmp((*a)->key,(*b)->key,cmplen);
+}
+
+// Index the prefixes present in the trie (those not removed) by length.
+static int
+index_fixture(fixture *f,const unsigned char *live){
+	unsigned z;
+
+	for(z = 0 ; z <= LPM_MAXBITS ; ++z){
+		f->nbylen[z] = 0;
+	}
+	for(z = 0 ; z < f->n ; ++z){
+		if(!f->p[z].dup && live[z]){
+			++f->nbylen[f->p[z].len];
+		}
+	}
+	for(z = 0 ; z <= LPM_MAXBITS ; ++z){
+		free(f->bylen[z]);
+		if((f->bylen[z] = malloc(sizeof(*f->bylen[z]) * (f->nbylen[z] + 1))) == NULL){
+			return -1;
+		}
+		f->nbylen[z] = 0;
+	}
+	for(z = 0 ; z < f->n ; ++z){
+		if(!f->p[z].dup && live[z]){
+			f->bylen[f->p[z].len][f->nbylen[f->p[z].len]++] = &f->p[z];
+		}
+	}
+	cmplen = f->keylen;
+	for(z = 0 ; z <= LPM_MAXBITS ; ++z){
+		qsort(f->bylen[z],f->nbylen[z],sizeof(*f->bylen[z]),pfxcmp);
+	}
+	return 0;
+}
+
+// The longest live prefix covering the key, by exhaustive search of lengths
+static const pfx *
+naive_lookup(const fixture *f,const unsigned char *key){
+	unsigned len = f->keylen * 8 + 1;
+	pfx q,*qp = &q,**r;
+
+	cmplen = f->keylen;
+	while(len--){
+		memcpy(q.key,key,f->keylen);
+		mask_key(q.key,f->keylen,len);
+		if( (r = bsearch(&qp,f->bylen[len],f->nbylen[len],sizeof(*r),pfxcmp)) ){
+			return *r;
+		}
+	}
+	return NULL;
+}
+
+// A key within a random prefix, so that lookups reach its depth
+static void
+random_key(const fixture *f,unsigned char *key){
+	const pfx *p = &f->p[xorshift(&seed) % f->n];
+	unsigned char host[16];
+	unsigned z;
+
+	random_bytes(host,f->keylen);
+	memcpy(key,host,f->keylen);
+	mask_key(key,f->keylen,p->len);
+	for(z = 0 ; z < f->keylen ; ++z){
+		key[z] = p->key[z] | (host[z] & ~key[z]);
+	}
+}
+
+static int
+check(const fixture *f,const lpmtrie *t){
+	unsigned char key[16];
+	uintmax_t bad = 0;
+	unsigned z;
+
+	for(z = 0 ; z < CHECKS ; ++z){
+		random_key(f,key);
+		if(lpm_lookup(t,key) != naive_lookup(f,key)){
+			++bad;
+		}
+	}
+	if(bad){
+		fprintf(stderr,"%s: %ju/%u lookups wrong\n",f->name,bad,CHECKS);
+		return -1;
+	}
+	return 0;
+}
+
+typedef struct reader {
+	const fixture *f;
+	lpmtrie *t;
+	const unsigned char *keys;
+	int stop;
+	uintmax_t lookups,bad;
+} reader;
+
+static int
+covers(const fixture *f,const pfx *p,const unsigned char *key){
+	unsigned char masked[16];
+
+	memcpy(masked,key,f->keylen);
+	mask_key(masked,f->keylen,p->len);
+	return !memcmp(masked,p->key,f->keylen);
+}
+
+// Lock-free lookups racing the writer. Nodes they're traversing mustn't be
+// freed beneath them, and any result must cover the key.
+static void *
+reader_thread(void *vr){
+	reader *r = vr;
+	unsigned z = 0;
+
+	while(!__atomic_load_n(&r->stop,__ATOMIC_RELAXED)){
+		const unsigned char *key = r->keys + (size_t)z * r->f->keylen;
+		unsigned epoch;
+		const pfx *p;
+
+		epoch = lpm_read_begin(r->t);
+		p = lpm_lookup(r->t,key);
+		lpm_read_end(r->t,epoch);
+		if(p && !covers(r->f,p,key)){
+			++r->bad;
+		}
+		++r->lookups;
+		z = (z + 1) % LOOKUPS;
+	}
+	return NULL;
+}
+
+static int
+bench(fixture *f){
+	unsigned char *keys,*live;
+	size_t h0,h1;
+	struct timeval t0;
+	uintmax_t hits;
+	lpmtrie ta,tb;
+	pthread_t tid;
+	unsigned z;
+	reader rd;
+	double us;
+
+	memset(&ta,0,sizeof(ta));
+	memset(&tb,0,sizeof(tb));
+	if((live = malloc(f->n)) == NULL){
+		return -1;
+	}
+	memset(live,1,f->n);
+	h0 = heap_used();
+	gettimeofday(&t0,NULL);
+	for(z = 0 ; z < f->n ; ++z){
+		pfx *p = &f->p[z];
+
+		if(lpm_insert(&ta,p->key,p->len,p) != p){
+			p->dup = 1;
+			continue;
+		}
+		if(lpm_insert(&tb,p->key,p->len,p) != p){
+			fprintf(stderr,"%s: tries disagree\n",f->name);
+			return -1;
+		}
+	}
+	us = usecs_since(&t0);
+	lpm_synchronize(&ta);
+	lpm_synchronize(&tb);
+	h1 = heap_used();
+	printf("%s: %u prefixes: %12.0f inserts/s\n",f->name,f->n,f->n * 2 / us * 1000000.0);
+	printf("%s: %zu bytes per trie, %zu bytes of heap for both (%.1f per prefix)\n",
+			f->name,ta.bytes,h1 - h0,(double)(h1 - h0) / f->n / 2);
+	if(index_fixture(f,live) || check(f,&ta) || check(f,&tb)){
+		return -1;
+	}
+	if((keys = malloc((size_t)f->keylen * LOOKUPS)) == NULL){
+		return -1;
+	}
+	for(z = 0 ; z < LOOKUPS ; ++z){
+		random_key(f,keys + (size_t)z * f->keylen);
+	}
+	hits = 0;
+	gettimeofday(&t0,NULL);
+	for(z = 0 ; z < LOOKUPS ; ++z){
+		hits += lpm_lookup(&ta,keys + (size_t)z * f->keylen) != NULL;
+	}
+	us = usecs_since(&t0);
+	printf("%s: %12.0f lookups/s (%ju hits)\n",f->name,LOOKUPS / us * 1000000.0,hits);
+	// Remove every other prefix from one trie, racing a reader, and
+	// recheck it
+	memset(&rd,0,sizeof(rd));
+	rd.f = f;
+	rd.t = &tb;
+	rd.keys = keys;
+	if(pthread_create(&tid,NULL,reader_thread,&rd)){
+		return -1;
+	}
+	for(z = 0 ; z < f->n ; z += 2){
+		if(!f->p[z].dup){
+			if(lpm_remove(&tb,f->p[z].key,f->p[z].len) != &f->p[z]){
+				fprintf(stderr,"%s: couldn't remove prefix %u\n",f->name,z);
+				return -1;
+			}
+		}
+		live[z] = 0;
+	}
+	__atomic_store_n(&rd.stop,1,__ATOMIC_RELAXED);
+	pthread_join(tid,NULL);
+	free(keys);
+	if(rd.bad){
+		fprintf(stderr,"%s: %ju/%ju concurrent lookups wrong\n",f->name,rd.bad,rd.lookups);
+		return -1;
+	}
+	lpm_synchronize(&tb);
+	printf("%s: %zu bytes per trie after removing half (%ju concurrent lookups)\n",
+			f->name,tb.bytes,rd.lookups);
+	if(index_fixture(f,live) || check(f,&tb)){
+		return -1;
+	}
+	for(z = 1 ; z < f->n ; z += 2){
+		if(!f->p[z].dup){
+			lpm_remove(&tb,f->p[z].key,f->p[z].len);
+		}
+	}
+	lpm_synchronize(&tb);
+	if(tb.bytes || tb.root){
+		fprintf(stderr,"%s: %zu bytes left after removing all\n",f->name,tb.bytes);
+		return -1;
+	}
+	lpm_destroy(&ta);
+	lpm_destroy(&tb);
+	free(live);
+	return 0;
+}
+
+int main(void){
+	fixture f4 = { .name = "IPv4", .keylen = 4, .n = PREFIXES4, };
+	fixture f6 = { .name = "IPv6", .keylen = 16, .n = PREFIXES6, };
+	uint32_t *allocs;
+	unsigned z;
+
+	if((f4.p = malloc(sizeof(*f4.p) * f4.n)) == NULL ||
+			(f6.p = malloc(sizeof(*f6.p) * f6.n)) == NULL ||
+			(allocs = malloc(sizeof(*allocs) * ALLOCS6)) == NULL){
+		return EXIT_FAILURE;
+	}
+	memset(f4.p,0,sizeof(*f4.p) * f4.n);
+	memset(f6.p,0,sizeof(*f6.p) * f6.n);
+	memset(f4.bylen,0,sizeof(f4.bylen));
+	memset(f6.bylen,0,sizeof(f6.bylen));
+	for(z = 0 ; z < f4.n ; ++z){
+		gen4(&f4.p[z]);
+	}
+	// Allocations cluster within a few RIR blocks
+	for(z = 0 ; z < ALLOCS6 ; ++z){
+		static const uint16_t rirs[] = { 0x2001, 0x2400, 0x2600, 0x2800, 0x2a00, 0x2c00, };
+		uint16_t hi = rirs[xorshift(&seed) % (sizeof(rirs) / sizeof(*rirs))];
+
+		if(hi != 0x2001){
+			hi += xorshift(&seed) % 16;
+		}
+		allocs[z] = ((uint32_t)hi << 16) | (xorshift(&seed) & 0xffffu);
+	}
+	for(z = 0 ; z < f6.n ; ++z){
+		gen6(&f6.p[z],allocs);
+	}
+	if(bench(&f4) || bench(&f6)){
+		return EXIT_FAILURE;
+	}
+	for(z = 0 ; z <= LPM_MAXBITS ; ++z){
+		free(f4.bylen[z]);
+		free(f6.bylen[z]);
+	}
+	free(allocs);
+	free(f4.p);
+	free(f6.p);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,199 @@
+// Benchmark for TCP dissection, with and without stream reassembly. Loads the
+// Ethernet frames of the given captures (test/HTTP.pcap and friends by
+// default) into memory, then dissects them repeatedly on a dummy interface,
+// reporting frames/s and what reassembly delivered.
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <net/if_arp.h>
+#include <pcap/pcap.h>
+#include <omphalos/savefile.h>
+#include <omphalos/ethernet.h>
+#include <omphalos/classify.h>
+#include <omphalos/omphalos.h>
+#include <omphalos/interface.h>
+#include <omphalos/tcpstream.h>
+
+#define PASSES 2000u
+
+typedef struct frame {
+	struct timeval ts;
+	const unsigned char *data;
+	size_t len;
+} frame;
+
+static const char *defaultfns[] = {
+	"../test/HTTP.pcap",
+	"../test/SSHv2.pcap",
+	"../test/TCP_SACK.pcap",
+	"../test/lots-of-dns-bugs.pcap",
+	NULL
+};
+
+static savefile *sfs;
+static unsigned sfcount;
+static frame *frames;
+static unsigned framecount;
+
+// Malformed frames in the captures would otherwise swamp the results
+static void
+quiet_vdiagnostic(const char *fmt,va_list v){
+	(void)fmt;
+	(void)v;
+}
+
+static double
+usecs_since(const struct timeval *t0){
+	struct timeval t1;
+
+	gettimeofday(&t1,NULL);
+	return (t1.tv_sec - t0->tv_sec) * 1000000.0 + (t1.tv_usec - t0->tv_usec);
+}
+
+// The savefiles stay mapped; frames point into them.
+static int
+load_capture(const char *fn){
+	saverecord r;
+	savefile *sf;
+	int ret;
+
+	if((sf = realloc(sfs,sizeof(*sfs) * (sfcount + 1))) == NULL){
+		return -1;
+	}
+	sfs = sf;
+	sf += sfcount;
+	if(savefile_open(sf,fn)){
+		fprintf(stderr,"Couldn't read %s as a pcap or pcapng savefile\n",fn);
+		return -1;
+	}
+	++sfcount;
+	while((ret = savefile_next(sf,&r)) > 0){
+		frame *tmp;
+
+		if(sf->links[r.link].dlt != DLT_EN10MB || r.hdr.caplen != r.hdr.len){
+			continue;
+		}
+		if((tmp = realloc(frames,sizeof(*tmp) * (framecount + 1))) == NULL){
+			return -1;
+		}
+		frames = tmp;
+		tmp += framecount++;
+		tmp->ts = r.hdr.ts;
+		tmp->data = r.data;
+		tmp->len = r.hdr.caplen;
+	}
+	return ret;
+}
+
+// Each pass is shifted past the last, plus an idle period, so that flows of
+// one pass are reaped before their 5-tuples recur.
+static int
+bench(uintmax_t budget){
+	const struct timeval zerotv = { .tv_sec = 0, .tv_usec = 0, };
+	unsigned char addr[ETH_ALEN];
+	tcpstreamstats ts0,ts1;
+	struct timeval t0;
+	time_t first,last,span,shift;
+	interface i;
+	unsigned p,z;
+	double us;
+
+	memset(&i,0,sizeof(i));
+	i.arptype = ARPHRD_LOOPBACK; // skip OUI lookup
+	i.addrlen = ETH_ALEN;
+	i.addr = addr;
+	i.name = "bench";
+	memset(addr,0,sizeof(addr));
+	if(twheel_init(&i.timers,IFACE_TIMER_USECS,&zerotv)){
+		return -1;
+	}
+	init_tcpstreams(budget);
+	tcpstream_stats(&ts0);
+	first = last = frames[0].ts.tv_sec;
+	for(z = 1 ; z < framecount ; ++z){
+		if(frames[z].ts.tv_sec < first){
+			first = frames[z].ts.tv_sec;
+		}else if(frames[z].ts.tv_sec > last){
+			last = frames[z].ts.tv_sec;
+		}
+	}
+	span = last - first;
+	gettimeofday(&t0,NULL);
+	for(p = 0 ; p < PASSES ; ++p){
+		shift = p * (span + 2 * TCPSTREAM_IDLE_SECS);
+		for(z = 0 ; z < framecount ; ++z){
+			omphalos_packet packet;
+			struct timeval tv;
+
+			tv = frames[z].ts;
+			tv.tv_sec += shift;
+			twheel_advance(&i.timers,&tv);
+			memset(&packet,0,sizeof(packet));
+			packet.i = &i;
+			packet.tv = tv;
+			handle_ethernet_packet(&packet,frames[z].data,frames[z].len);
+		}
+	}
+	us = usecs_since(&t0);
+	tcpstream_stats(&ts1);
+	printf("tcpmem %10ju: %12.0f frames/s, %ju flows, %ju delivered (%ju bytes), %ju refused\n",
+		budget,(double)framecount * PASSES / us * 1000000.0,
+		ts1.flows - ts0.flows,ts1.delivered - ts0.delivered,
+		ts1.bytes - ts0.bytes,ts1.memdrops - ts0.memdrops);
+	cleanup_tcpstreams(&i);
+	twheel_destroy(&i.timers);
+	cleanup_l3hosts(&i);
+	cleanup_l2hosts(&i);
+	return 0;
+}
+
+int main(int argc,char **argv){
+	// Disabled, ample, and too small to hold a flow's buffers
+	const uintmax_t budgets[] = { 0, 64u << 20u, 512, };
+	const char * const *fns = defaultfns;
+	omphalos_ctx ctx;
+	unsigned z;
+
+	if(argc > 1){
+		fns = (const char * const *)argv + 1;
+	}
+	memset(&ctx,0,sizeof(ctx));
+	ctx.mode = OMPHALOS_MODE_SILENT;
+	ctx.iface.vdiagnostic = quiet_vdiagnostic;
+	if(pthread_key_create(&omphalos_ctx_key,NULL) ||
+			pthread_setspecific(omphalos_ctx_key,&ctx)){
+		fprintf(stderr,"Couldn't set up omphalos_ctx TSD\n");
+		return EXIT_FAILURE;
+	}
+	if(init_classifier()){
+		fprintf(stderr,"Couldn't compile classifier\n");
+		return EXIT_FAILURE;
+	}
+	for(z = 0 ; fns[z] ; ++z){
+		if(load_capture(fns[z])){
+			return EXIT_FAILURE;
+		}
+	}
+	if(framecount == 0){
+		fprintf(stderr,"No Ethernet frames to dissect\n");
+		return EXIT_FAILURE;
+	}
+	printf("%u frames from %u captures, %u passes\n",framecount,sfcount,PASSES);
+	for(z = 0 ; z < sizeof(budgets) / sizeof(*budgets) ; ++z){
+		if(bench(budgets[z])){
+			fprintf(stderr,"Error benchmarking budget %ju\n",budgets[z]);
+			return EXIT_FAILURE;
+		}
+	}
+	cleanup_classifier();
+	for(z = 0 ; z < sfcount ; ++z){
+		savefile_close(&sfs[z]);
+	}
+	free(sfs);
+	free(frames);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+// Microbenchmark for the hierarchical timing wheel. Keeps 100k timers
+// outstanding on a simulated clock, continually rescheduling random timers
+// (as naming backoff and host aging do) while advancing the wheel, and
+// reports reschedules/sec and expiries/sec. Each expiry is checked against
+// its deadline; timers must fire during the tick in which they come due.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <omphalos/timing.h>
+
+#define TIMERS 100000u
+#define CHURN 20000000u		// reschedules
+#define CHURN_PER_TICK 100u	// reschedules between advances
+#define TICKUSEC 1000u
+#define HORIZON 60000000ull	// usec; deadlines are uniform over [1ms, 60s)
+
+typedef struct bt {
+	twtimer t;
+	uint64_t due;		// usec
+} bt;
+
+static twheel wheel;
+static uint64_t seed = 0x0123456789abcdefull;
+static uintmax_t fired,early,late;
+
+static uint64_t
+xorshift(uint64_t *s){
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static double
+usecs_since(const struct timeval *t0){
+	struct timeval t1;
+
+	gettimeofday(&t1,NULL);
+	return (t1.tv_sec - t0->tv_sec) * 1000000.0 + (t1.tv_usec - t0->tv_usec);
+}
+
+static void
+usec_to_tv(uint64_t usec,struct timeval *tv){
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+}
+
+static uint64_t
+random_due(uint64_t now){
+	return now + TICKUSEC + xorshift(&seed) % (HORIZON - TICKUSEC);
+}
+
+// Verify the deadline, then rearm, keeping the population constant.
+static int
+expire(const struct timeval *tv,struct timeval *resched,void *arg){
+	uint64_t now = (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+	bt *b = arg;
+
+	++fired;
+	if(now < b->due / TICKUSEC * TICKUSEC){
+		++early;
+	}else if(now / TICKUSEC > b->due / TICKUSEC){
+		++late;
+	}
+	b->due = random_due(now);
+	usec_to_tv(b->due,resched);
+	return 1;
+}
+
+int main(void){
+	struct timeval t0,tv;
+	uint64_t now = 1000000000ull;
+	uintmax_t run = 0;
+	unsigned z;
+	double us;
+	bt *bts;
+
+	if((bts = malloc(sizeof(*bts) * TIMERS)) == NULL){
+		return EXIT_FAILURE;
+	}
+	memset(bts,0,sizeof(*bts) * TIMERS);
+	usec_to_tv(now,&tv);
+	if(twheel_init(&wheel,TICKUSEC,&tv)){
+		fprintf(stderr,"Couldn't initialize timing wheel\n");
+		return EXIT_FAILURE;
+	}
+	gettimeofday(&t0,NULL);
+	for(z = 0 ; z < TIMERS ; ++z){
+		bts[z].due = random_due(now);
+		usec_to_tv(bts[z].due,&tv);
+		schedule_timer(&wheel,&bts[z].t,&tv,expire,&bts[z]);
+	}
+	us = usecs_since(&t0);
+	printf("%u timers: %12.0f inserts/s\n",TIMERS,TIMERS / us * 1000000.0);
+	gettimeofday(&t0,NULL);
+	for(z = 0 ; z < CHURN ; ++z){
+		bt *b = &bts[xorshift(&seed) % TIMERS];
+
+		if(z % CHURN_PER_TICK == 0){
+			now += TICKUSEC;
+			usec_to_tv(now,&tv);
+			run += twheel_advance(&wheel,&tv);
+		}
+		b->due = random_due(now);
+		usec_to_tv(b->due,&tv);
+		schedule_timer(&wheel,&b->t,&tv,expire,b);
+	}
+	us = usecs_since(&t0);
+	printf("%u timers: %12.0f reschedules/s over %.0fs simulated, %ju expired\n",
+			TIMERS,CHURN / us * 1000000.0,
+			(double)CHURN / CHURN_PER_TICK * TICKUSEC / 1000000,run);
+	// Let everything expire (at least once), without further churn
+	gettimeofday(&t0,NULL);
+	fired = 0;
+	for(z = 0 ; z < HORIZON / TICKUSEC ; ++z){
+		now += TICKUSEC;
+		usec_to_tv(now,&tv);
+		twheel_advance(&wheel,&tv);
+	}
+	us = usecs_since(&t0);
+	printf("%u timers: %12.0f expiries/s (%ju in %.0fs simulated)\n",TIMERS,
+			fired / us * 1000000.0,fired,HORIZON / 1000000.0);
+	if(wheel.pending != TIMERS){
+		fprintf(stderr,"%u timers pending, expected %u\n",wheel.pending,TIMERS);
+		return EXIT_FAILURE;
+	}
+	twheel_destroy(&wheel);
+	free(bts);
+	if(early || late){
+		fprintf(stderr,"%ju early, %ju late expiries\n",early,late);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}